@@ -6,6 +6,11 @@
 #ifndef LOADER_PARAMS_H
 #define LOADER_PARAMS_H
 
+///
+/// Boot arguments buffer size, including the terminating NUL.
+///
+#define LOADER_CMDLINE_SIZE 256
+
 typedef struct {
   ///
   /// Virtual pointer to self.
@@ -62,6 +67,11 @@ typedef struct {
   EFI_PHYSICAL_ADDRESS     StringTableStart;
   EFI_PHYSICAL_ADDRESS     StringTableEnd;
 
+  ///
+  /// Boot arguments: whitespace separated name=value pairs, NUL-terminated.
+  ///
+  CHAR8                    CommandLine[LOADER_CMDLINE_SIZE];
+
 } LOADER_PARAMS;
 
 #endif // LOADER_PARAMS_H
@@ -272,15 +272,17 @@ AcpiFindRsdp (
 }
 
 /**
-  Obtain kernel file protocol.
+  Obtain file protocol for a file on the loader's own volume.
 
-  @param[out] FileProtocol  Instance of file protocol holding the kernel.
+  @param[in]  Path          Path to the file.
+  @param[out] FileProtocol  Instance of file protocol holding the file.
 
   @retval EFI_SUCCESS on success.
 **/
 STATIC
 EFI_STATUS
-GetKernelFile (
+GetBootFile (
+  IN   CHAR16             *Path,
   OUT  EFI_FILE_PROTOCOL  **FileProtocol
   )
 {
@@ -353,14 +355,15 @@ GetKernelFile (
   //
   // LAB 1: Your code here
 
-  // чтение файла ядра, находящегося по пути KERNEL_PATH
+  // чтение файла, находящегося по пути Path (ядро - KERNEL_PATH)
   // атрибуты здесь не имеют значения. Результат сохраняем в указатель на
-  // файл ядра.
-  Status = CurrentDriveRoot->Open(CurrentDriveRoot, &KernelFile, KERNEL_PATH,
+  // файл.
+  Status = CurrentDriveRoot->Open(CurrentDriveRoot, &KernelFile, Path,
                                   EFI_FILE_MODE_READ, 0);
 
   if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_ERROR, "JOS: Cannot access own file system - %r\n", Status));
+    DEBUG ((DEBUG_INFO, "JOS: Cannot open %s - %r\n", Path, Status));
+    CurrentDriveRoot->Close(CurrentDriveRoot);
     return Status;
   }
 
@@ -375,6 +378,58 @@ GetKernelFile (
   return EFI_SUCCESS;
 }
 
+/**
+  Obtain kernel file protocol.
+
+  @param[out] FileProtocol  Instance of file protocol holding the kernel.
+
+  @retval EFI_SUCCESS on success.
+**/
+STATIC
+EFI_STATUS
+GetKernelFile (
+  OUT  EFI_FILE_PROTOCOL  **FileProtocol
+  )
+{
+  return GetBootFile (KERNEL_PATH, FileProtocol);
+}
+
+/**
+  Read kernel boot arguments from BOOTARGS_PATH into loader parameters.
+  The file is optional, without it the kernel gets empty arguments.
+
+  @param[in,out] LoaderParams  Loader parameters.
+**/
+STATIC
+VOID
+LoadBootArgs (
+  IN OUT LOADER_PARAMS  *LoaderParams
+  )
+{
+  EFI_STATUS         Status;
+  EFI_FILE_PROTOCOL  *ArgsFile;
+  UINTN              ReadSize;
+
+  ASSERT (LoaderParams != NULL);
+
+  Status = GetBootFile (BOOTARGS_PATH, &ArgsFile);
+  if (EFI_ERROR (Status)) {
+    return;
+  }
+
+  ReadSize = sizeof (LoaderParams->CommandLine) - 1;
+  Status = ArgsFile->Read (ArgsFile, &ReadSize, LoaderParams->CommandLine);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "JOS: Failed to read boot arguments - %r\n", Status));
+    ReadSize = 0;
+  }
+
+  LoaderParams->CommandLine[ReadSize] = '\0';
+  ArgsFile->Close (ArgsFile);
+
+  DEBUG ((DEBUG_INFO, "JOS: Boot arguments: %a\n", LoaderParams->CommandLine));
+}
+
 /**
   Read file data at offset of specified size.
 
@@ -1078,6 +1133,8 @@ UefiMain (
     return Status;
   }
 
+  LoadBootArgs (LoaderParams);
+
   DEBUG ((
     DEBUG_INFO,
     "JOS: CR0 - %Lx CR3 - %Lx\n",
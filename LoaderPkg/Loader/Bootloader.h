@@ -29,6 +29,11 @@
 ///
 #define KERNEL_PATH L"\\EFI\\BOOT\\kernel"
 
+///
+/// Optional file with kernel boot arguments.
+///
+#define BOOTARGS_PATH L"\\EFI\\BOOT\\bootargs"
+
 /**
   Generate architecture-specific kernel call gate data.
 
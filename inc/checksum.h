@@ -0,0 +1,27 @@
+#ifndef JOS_INC_CHECKSUM_H
+#define JOS_INC_CHECKSUM_H
+
+#include <inc/types.h>
+
+/* Internet checksum (RFC 1071) engine, shared by the kernel and user space.
+ *
+ * csum_accumulate() adds 16-bit words of a buffer to a 64-bit accumulator
+ * in native byte order, without folding carries on every step.
+ * The ones' complement sum does not depend on byte order, so the caller
+ * folds the accumulator with csum_fold() once and swaps the result
+ * to network order if needed. A buffer may be split into several calls,
+ * all pieces but the last must have even length. */
+
+uint64_t csum_accumulate(const void *data, size_t len, uint64_t acc);
+
+/* Fold accumulator into 16 bits with end-around carry */
+static inline uint16_t
+csum_fold(uint64_t acc) {
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    acc = (acc & 0xFFFF) + (acc >> 16);
+    acc = (acc & 0xFFFF) + (acc >> 16);
+    return (uint16_t)acc;
+}
+
+#endif /* !JOS_INC_CHECKSUM_H */
@@ -45,6 +45,7 @@ enum EnvType {
     ENV_TYPE_KERNEL,
     ENV_TYPE_USER,
     ENV_TYPE_FS, /* File system server */
+    ENV_TYPE_NS, /* Network server */
 };
 
 struct List {
@@ -92,6 +93,8 @@ struct Env {
     envid_t env_ipc_from;    /* envid of the sender */
     int env_ipc_perm;        /* Perm of page mapping received */
 
+    bool env_irq_waiting;    /* Env is blocked until device interrupt */
+
     bool need_work_concurent;
 };
 
@@ -33,6 +33,8 @@ enum {
     E_UNS_ICMP_TYPE = 23, /* Unsupported icmp message type */
     E_INV_ICMP_CODE = 24, /* Invalid icmp message code */
     E_INV_SENDER    = 25,
+    E_WOULD_BLOCK   = 26, /* Nothing received yet */
+    E_ADDR_IN_USE   = 27, /* Port is already bound */
     MAXERROR
 };
 
@@ -27,6 +27,11 @@ struct FdFile {
     int id;
 };
 
+struct FdSock {
+    int sockid;
+    int type; /* SOCK_STREAM or SOCK_DGRAM */
+};
+
 struct Fd {
     int fd_dev_id;
     off_t fd_offset;
@@ -34,6 +39,8 @@ struct Fd {
     union {
         /* File server files */
         struct FdFile fd_file;
+        /* Network server sockets */
+        struct FdSock fd_sock;
     };
 };
 
@@ -54,5 +61,6 @@ int dev_lookup(int devid, struct Dev **dev_store);
 extern struct Dev devfile;
 extern struct Dev devcons;
 extern struct Dev devpipe;
+extern struct Dev devsock;
 
 #endif /* not JOS_INC_FD_H */
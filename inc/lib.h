@@ -20,6 +20,7 @@
 #include <inc/trap.h>
 #include <inc/fs.h>
 #include <inc/fd.h>
+#include <inc/ns.h>
 #include <inc/args.h>
 
 #ifdef SANITIZE_USER_SHADOW_BASE
@@ -101,6 +102,8 @@ int vsys_gettime(void);
 
 void sys_monitor(void);
 void sys_ethernet_loop(void);
+int sys_net_call(int op, void *ipc);
+int sys_net_wait(int sockid, int op);
 
 /* This must be inlined. Exercise for reader: why? */
 static inline envid_t __attribute__((always_inline))
@@ -160,6 +163,13 @@ int opencons(void);
 int pipe(int pipefds[2]);
 int pipeisclosed(int pipefd);
 
+/* sockets.c */
+int socket(int type);
+int bind(int s, const struct sockaddr_in *addr);
+int listen(int s, int backlog);
+int accept(int s, struct sockaddr_in *addr);
+int connect(int s, const struct sockaddr_in *addr);
+
 /* wait.c */
 void wait(envid_t env);
 
@@ -0,0 +1,103 @@
+/* Network server interface: requests of user sockets (lib/sockets.c)
+ * served by the network server (net/serv.c) through the TCP/UDP stack
+ * of the kernel (kern/socket.c). */
+
+#ifndef JOS_INC_NS_H
+#define JOS_INC_NS_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+/* Socket types */
+#define SOCK_STREAM 1 /* TCP */
+#define SOCK_DGRAM  2 /* UDP */
+
+/* Address of a socket, both fields in host byte order.
+ * ip 0 in bind means the address of the machine. */
+struct sockaddr_in {
+    uint32_t sin_addr;
+    uint16_t sin_port;
+};
+
+/* Definitions for requests from clients to the network server */
+enum {
+    NSREQ_SOCKET = 1,
+    NSREQ_BIND,
+    NSREQ_LISTEN,
+    /* Accept returns a Nsret_accept on the request page */
+    NSREQ_ACCEPT,
+    NSREQ_CONNECT,
+    /* Recv returns a Nsret_recv on the request page */
+    NSREQ_RECV,
+    NSREQ_SEND,
+    NSREQ_CLOSE,
+    /* Requests of the network server itself, never taken from clients.
+     * The HTTP server of the kernel reads its files through them:
+     * Http_miss returns a Nsret_http_miss with the path of a file it
+     * needs, or -E_WOULD_BLOCK, and Http_fill hands a part of it back. */
+    NSREQ_HTTP_MISS,
+    NSREQ_HTTP_FILL
+};
+
+#define NSBUFSIZE (PAGE_SIZE - 32)
+#define NS_PATH_MAX 128
+#define NSFILLSIZE (PAGE_SIZE - NS_PATH_MAX - 32)
+
+union Nsipc {
+    struct Nsreq_socket {
+        int req_type;
+    } socket;
+    struct Nsreq_bind {
+        int req_sockid;
+        struct sockaddr_in req_addr;
+    } bind;
+    struct Nsreq_listen {
+        int req_sockid;
+        int req_backlog;
+    } listen;
+    struct Nsreq_accept {
+        int req_sockid;
+    } accept;
+    struct Nsret_accept {
+        struct sockaddr_in ret_addr;
+    } acceptRet;
+    struct Nsreq_connect {
+        int req_sockid;
+        struct sockaddr_in req_addr;
+    } connect;
+    struct Nsreq_recv {
+        int req_sockid;
+        size_t req_n;
+    } recv;
+    struct Nsret_recv {
+        struct sockaddr_in ret_addr;
+        char ret_buf[NSBUFSIZE];
+    } recvRet;
+    struct Nsreq_send {
+        int req_sockid;
+        size_t req_n;
+        /* datagram destination, port 0 - the connected peer */
+        struct sockaddr_in req_addr;
+        char req_buf[NSBUFSIZE];
+    } send;
+    struct Nsreq_close {
+        int req_sockid;
+    } close;
+    struct Nsret_http_miss {
+        char ret_path[NS_PATH_MAX];
+    } httpMiss;
+    struct Nsreq_http_fill {
+        char req_path[NS_PATH_MAX];
+        /* < 0 - the file cannot be read, e.g. -E_NOT_FOUND */
+        int req_status;
+        size_t req_size;
+        size_t req_offset;
+        size_t req_n;
+        char req_buf[NSFILLSIZE];
+    } httpFill;
+
+    /* Ensure Nsipc is one page */
+    char _pad[PAGE_SIZE];
+};
+
+#endif /* !JOS_INC_NS_H */
@@ -22,6 +22,8 @@ enum {
     SYS_gettime,
     SYS_monitor,
     SYS_ethernet_loop,
+    SYS_net_call,
+    SYS_net_wait,
     NSYSCALLS
 };
 
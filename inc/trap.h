@@ -37,6 +37,9 @@
 #define IRQ_SERIAL   4
 #define IRQ_SPURIOUS 7
 #define IRQ_CLOCK    8
+#define IRQ_PCI_A    9  /* Lines firmware routes PCI INTx to */
+#define IRQ_PCI_B    10
+#define IRQ_PCI_C    11
 #define IRQ_IDE      14
 #define IRQ_ERROR    19
 
@@ -14,6 +14,7 @@ typedef int32_t INT32;
 typedef int64_t INT64;
 
 typedef uintptr_t UINTN;
+typedef char CHAR8;
 typedef uint16_t CHAR16;
 typedef void VOID;
 
@@ -97,6 +98,8 @@ int efi_call_in_32bit_mode(uint32_t func,
                            size_t stack_contents_size, /* 16-byte multiple */
                            uint32_t *efi_status);
 
+long uefi_boot_arg(const char *name, long def);
+
 /* Attribute values */
 
 /* uncached */
@@ -4,23 +4,111 @@
 #include <kern/eth.h>
 #include <inc/error.h>
 #include <kern/inet.h>
+#include <kern/slab.h>
+#include <kern/timer.h>
 #include <kern/traceopt.h>
 
 static struct arp_cache_table arp_table[ARP_TABLE_MAX_SIZE];
+// Entries in use by IP address
+static struct arp_cache_table *arp_hash[ARP_HASH_SIZE];
+
+// IP frame waiting for the MAC address of its destination
+struct arp_pending {
+    struct arp_pending *next;
+    struct tx_csum csum;
+    bool has_csum;
+    struct pbuf *pb;    // the IP frame, the Ethernet header goes in front of it
+};
+
+static struct slab_cache arp_pending_cache;
+
+static const uint8_t broadcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 
 /**
- * Перебирает ARP-таблицу в поисках следующего элемента.
+ * Номер корзины для адреса (multiplicative hashing, Кнут)
  */
-uint8_t *
-get_mac_by_ip(uint32_t ip) {
-    struct arp_cache_table *entry;
+static uint32_t
+arp_hash_fn(uint32_t ip) {
+    return (ip * 2654435761u) >> 24 & (ARP_HASH_SIZE - 1);
+}
+
+static struct arp_cache_table *
+arp_find(uint32_t ip) {
+    struct arp_cache_table *entry = arp_hash[arp_hash_fn(ip)];
+    while (entry && entry->source_ip != ip) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+/**
+ * Освобождает запись вместе с кадрами, которые ждали её разрешения
+ */
+static void
+arp_free(struct arp_cache_table *entry) {
+    struct arp_cache_table **link = &arp_hash[arp_hash_fn(entry->source_ip)];
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    while (entry->pending_head) {
+        struct arp_pending *p = entry->pending_head;
+        entry->pending_head = p->next;
+        pbuf_release(p->pb);
+        slab_free(&arp_pending_cache, p);
+    }
+    entry->pending_tail = NULL;
+    entry->nr_pending = 0;
+    entry->state = FREE_STATE;
+}
+
+/**
+ * Заводит запись для адреса. Если свободных нет,
+ * вытесняется динамическая запись, которая дольше всех не обновлялась.
+ */
+static struct arp_cache_table *
+arp_alloc(uint32_t ip) {
+    struct arp_cache_table *entry = NULL;
     for (int i = 0; i < ARP_TABLE_MAX_SIZE; i++) {
-        entry = &arp_table[i];
-        if (entry->source_ip == ip) {
-            return entry->source_mac;
+        struct arp_cache_table *e = &arp_table[i];
+        if (e->state == FREE_STATE) {
+            entry = e;
+            break;
+        }
+        if (e->state == DYNAMIC_STATE && (!entry || e->updated < entry->updated)) {
+            entry = e;
         }
     }
-    return NULL;
+    if (!entry) return NULL;
+    if (entry->state != FREE_STATE) arp_free(entry);
+
+    uint32_t bucket = arp_hash_fn(ip);
+    entry->source_ip = ip;
+    entry->retries = 0;
+    entry->hash_next = arp_hash[bucket];
+    arp_hash[bucket] = entry;
+    return entry;
+}
+
+/**
+ * Ищет MAC-адрес в ARP-таблице. NULL - адрес не разрешён
+ * или запись устарела и должна быть подтверждена заново.
+ */
+const uint8_t *
+get_mac_by_ip(uint32_t ip) {
+    if (ip == JHTONL(BROADCAST_IP)) {
+        return broadcast_mac;
+    }
+
+    struct arp_cache_table *entry = arp_find(ip);
+    if (!entry || entry->state == INCOMPLETE_STATE) {
+        return NULL;
+    }
+    if (entry->state == DYNAMIC_STATE && hpet_msec() - entry->updated > ARP_ENTRY_TTL) {
+        return NULL;
+    }
+    return entry->source_mac;
 }
 
 /**
@@ -29,85 +117,202 @@ get_mac_by_ip(uint32_t ip) {
 */
 void
 initialize_arp_table() {
-    struct arp_cache_table *entry;
-    entry = &arp_table[ARP_TABLE_MAX_SIZE - 1]; // it shall be just default MAC
+    slab_init(&arp_pending_cache, "arp_pending", sizeof(struct arp_pending));
+    memset(arp_hash, 0, sizeof(arp_hash));
+    for (int i = 0; i < ARP_TABLE_MAX_SIZE; i++) {
+        arp_table[i].state = FREE_STATE;
+    }
 
-    entry->source_ip = JHTONL(HOST_IP);
+    struct arp_cache_table *entry = arp_alloc(JHTONL(HOST_IP));
     // aa:aa:aa:aa:aa:aa - mac address of br0 interface
     uint8_t mac[6] = {0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa};
     memcpy(entry->source_mac, mac, 6);
     entry->state = STATIC_STATE;
+}
+
+/**
+ * Забывает выученный адрес ip (в порядке байт сети), если он есть в таблице
+ */
+void
+arp_forget(uint32_t ip) {
+    struct arp_cache_table *entry = arp_find(ip);
+    if (entry && entry->state == DYNAMIC_STATE) {
+        arp_free(entry);
+    }
+}
 
-    // подготавливаем все остальные записи
-    for (int i = 1; i < ARP_TABLE_MAX_SIZE; i++) {
-        entry = &arp_table[i];
-        entry->state = FREE_STATE;
+/**
+ * Отправляет кадры, дождавшиеся MAC-адреса своего получателя
+ */
+static void
+arp_flush(struct arp_cache_table *entry) {
+    while (entry->pending_head) {
+        struct arp_pending *p = entry->pending_head;
+        entry->pending_head = p->next;
+
+        struct eth_hdr ethernet_header = {};
+        ethernet_header.eth_type = JHTONS(ETH_TYPE_IP);
+        struct tx_seg seg = {p->pb->data, p->pb->len, p->pb};
+        // the NIC keeps its own reference until the frame is sent
+        if (eth_sendv(&ethernet_header, &seg, 1, p->has_csum ? &p->csum : NULL) < 0) {
+            cprintf("Error sending queued frame\n");
+        }
+        pbuf_release(p->pb);
+        slab_free(&arp_pending_cache, p);
     }
+    entry->pending_tail = NULL;
+    entry->nr_pending = 0;
 }
 
 /**
- * Обновляет ARP-таблицу по событию получения нового ARP-запроса (от нового абонента)
+ * Обновляет ARP-таблицу по событию получения ARP-пакета. Новая запись
+ * заводится только для того, кто обращается к нам (RFC 826), известная -
+ * обновляется, и ждавшие её кадры уходят.
  */
 int
 update_arp_table(struct arp_hdr *arp_header) {
-    int i;
-    struct arp_cache_table *entry;
-
-    for (i = 0; i < ARP_TABLE_MAX_SIZE; i++) {
-        entry = &arp_table[i];
-        // если запись свободна, то запоминаем в неё нового абонента
-        if (entry->state == FREE_STATE) {
-            entry->source_ip = arp_header->source_ip;
-            memcpy(entry->source_mac, arp_header->source_mac, 6);
-            entry->state = DYNAMIC_STATE;
+    struct arp_cache_table *entry = arp_find(arp_header->source_ip);
+    if (!entry) {
+        if (arp_header->target_ip != MY_IP) {
             return 0;
         }
-
-        if (entry->source_ip == arp_header->source_ip) {
-            if (entry->state == DYNAMIC_STATE) {
-                memcpy(entry->source_mac, arp_header->source_mac, 6);
-            }
-            break;
+        if (!(entry = arp_alloc(arp_header->source_ip))) {
+            return -1;
         }
     }
+    if (entry->state == STATIC_STATE) {
+        return 0;
+    }
 
+    memcpy(entry->source_mac, arp_header->source_mac, 6);
+    entry->state = DYNAMIC_STATE;
+    entry->updated = hpet_msec();
+    entry->retries = 0;
+    arp_flush(entry);
     return 0;
 }
 
 /**
- * Отсылает ARP-запрос, когда необходимо
+ * Отсылает широковещательный ARP-запрос MAC-адреса для ip
  */
 int
-arp_request(struct ip_pkt *reply_packet) {
+arp_request(uint32_t ip) {
     if (trace_packet_processing) cprintf("Sending ARP-request\n");
 
     struct eth_hdr ethernet_header;
-    struct arp_hdr arp_request;
+    struct arp_hdr arp_request = {};
 
-    uint8_t *jos_mac = get_mac_by_ip(MY_IP);
-
-    memcpy(ethernet_header.eth_source_mac, jos_mac, 6);
-    memset(ethernet_header.eth_destination_mac, 0, 6);
+    memcpy(ethernet_header.eth_destination_mac, broadcast_mac, 6);
     ethernet_header.eth_type = JHTONS(ETH_TYPE_ARP);
 
-    memcpy(arp_request.source_mac, jos_mac, 6);
-
-    arp_request.source_ip = reply_packet->hdr.ip_source_address;
-    // broadcast address must be here:
-    arp_request.target_ip = JHTONL(BROADCAST_IP);
-    arp_request.protocol_type = JNTOHS(ARP_IPV4);
-    arp_request.hardware_type = JNTOHS(ARP_ETHERNET);
-    arp_request.opcode = JNTOHS(ARP_REQUEST);
+    memcpy(arp_request.source_mac, get_my_mac(), 6);
+    arp_request.source_ip = JHTONL(MY_IP);
+    arp_request.target_ip = ip;
+    arp_request.hardware_address_length = 6;
+    arp_request.protocol_address_length = 4;
+    arp_request.protocol_type = JHTONS(ARP_IPV4);
+    arp_request.hardware_type = JHTONS(ARP_ETHERNET);
+    arp_request.opcode = JHTONS(ARP_REQUEST);
 
     int status = eth_send(&ethernet_header, &arp_request, sizeof(struct arp_hdr));
 
     if (status < 0) {
-        cprintf("Error attempting arp response.");
+        cprintf("Error attempting arp request.");
         return -1;
     }
     return 0;
 }
 
+/**
+ * Ставит IP-кадр в очередь до ответа на ARP-запрос о его получателе.
+ * Запрос уходит, если ещё не отправлен. Кадр копируется в буфер пула:
+ * куски принадлежат вызывающему. Кадры TSO не ставятся - отправитель
+ * повторит их посегментно.
+ */
+int
+arp_queue(uint32_t ip, const struct tx_seg *segs, int nsegs, const struct tx_csum *csum) {
+    size_t len = 0;
+    for (int i = 0; i < nsegs; i++) {
+        len += segs[i].len;
+    }
+    if (len > ETH_MAX_PACKET_SIZE || (csum && (csum->flags & E1000_TX_TSO))) {
+        return -E_NO_MEM;
+    }
+
+    struct arp_cache_table *entry = arp_find(ip);
+    if (!entry && !(entry = arp_alloc(ip))) {
+        cprintf("ARP table already filled !\n");
+        return -E_NO_MEM;
+    }
+    if (entry->state != INCOMPLETE_STATE) {
+        // new or stale entry, one request at a time
+        entry->state = INCOMPLETE_STATE;
+        entry->updated = hpet_msec();
+        entry->retries = 0;
+        arp_request(ip);
+    }
+
+    struct pbuf *pb = pbuf_alloc(len);
+    if (!pb) {
+        return -E_NO_MEM;
+    }
+
+    struct arp_pending *p;
+    if (entry->nr_pending == ARP_PENDING_MAX) {
+        // the oldest frame gives way
+        p = entry->pending_head;
+        entry->pending_head = p->next;
+        entry->nr_pending--;
+        if (!entry->pending_head) entry->pending_tail = NULL;
+        pbuf_release(p->pb);
+    } else if (!(p = slab_alloc(&arp_pending_cache))) {
+        pbuf_release(pb);
+        return -E_NO_MEM;
+    }
+
+    p->next = NULL;
+    p->has_csum = csum != NULL;
+    if (csum) p->csum = *csum;
+    p->pb = pb;
+    size_t off = 0;
+    for (int i = 0; i < nsegs; i++) {
+        memcpy(pb->data + off, segs[i].addr, segs[i].len);
+        off += segs[i].len;
+    }
+
+    if (entry->pending_tail) {
+        entry->pending_tail->next = p;
+    } else {
+        entry->pending_head = p;
+    }
+    entry->pending_tail = p;
+    entry->nr_pending++;
+    return 0;
+}
+
+/**
+ * Вызывается на каждый тик таймера: повторяет запросы о неразрешённых
+ * адресах, после ARP_RETRIES_MAX попыток их кадры выбрасываются
+ */
+void
+arp_timer(void) {
+    uint64_t now = hpet_msec();
+
+    for (int i = 0; i < ARP_TABLE_MAX_SIZE; i++) {
+        struct arp_cache_table *entry = &arp_table[i];
+        if (entry->state != INCOMPLETE_STATE || now - entry->updated < ARP_RETRY_MS) {
+            continue;
+        }
+        if (++entry->retries >= ARP_RETRIES_MAX) {
+            if (trace_packet_processing) cprintf("ARP resolution failed\n");
+            arp_free(entry);
+            continue;
+        }
+        entry->updated = now;
+        arp_request(entry->source_ip);
+    }
+}
+
 /**
  * Отвечаем на ARP-запрос, посылаем ARP-reply (ответ)
  */
@@ -174,3 +379,86 @@ arp_resolve(void *data) {
 
     return arp_reply(arp_header);
 }
+
+#define ARP_TEST_IP(n) JHTONL(IP(172, 16, 9, n))
+
+/**
+ * Самопроверка кэша: очередь кадров неразрешённого адреса и её предел,
+ * отправка кадров по ответу, устаревание записи, отказ после повторов
+ * запроса и вытеснение дольше всех не обновлявшейся записи.
+ * Использует адреса 172.16.9.0/24 и забывает их. Возвращает число ошибок.
+ */
+int
+arp_selftest(void) {
+    static uint8_t frame[64];
+    static const uint8_t mac[6] = {0x02, 0x00, 0x00, 0x00, 0x09, 0x01};
+    struct tx_seg seg = {frame, sizeof(frame), NULL};
+    struct arp_hdr reply = {.target_ip = MY_IP};
+    uint32_t ip = ARP_TEST_IP(1);
+    int errors = 0;
+
+    // frames wait for the reply, the oldest gives way to a new one
+    for (int i = 0; i <= ARP_PENDING_MAX; i++) {
+        frame[0] = i;
+        if (arp_queue(ip, &seg, 1, NULL) < 0) errors++;
+    }
+    struct arp_cache_table *entry = arp_find(ip);
+    if (!entry) {
+        cprintf("arp: no entry for a queued frame\n");
+        return errors + 1;
+    }
+    if (entry->state != INCOMPLETE_STATE || get_mac_by_ip(ip) ||
+        entry->nr_pending != ARP_PENDING_MAX || entry->pending_head->pb->data[0] != 1) {
+        cprintf("arp: frames of an unresolved address are not queued\n");
+        errors++;
+    }
+
+    // the reply sends them
+    reply.source_ip = ip;
+    memcpy(reply.source_mac, mac, 6);
+    update_arp_table(&reply);
+    const uint8_t *found = get_mac_by_ip(ip);
+    if (!found || memcmp(found, mac, 6) || entry->nr_pending || entry->pending_head) {
+        cprintf("arp: the reply does not resolve the address\n");
+        errors++;
+    }
+
+    entry->updated = hpet_msec() - ARP_ENTRY_TTL - 1;
+    if (get_mac_by_ip(ip)) {
+        cprintf("arp: stale entry is used\n");
+        errors++;
+    }
+
+    // an address that never answers is given up
+    arp_forget(ip);
+    arp_queue(ip, &seg, 1, NULL);
+    for (int i = 0; i < ARP_RETRIES_MAX && (entry = arp_find(ip)); i++) {
+        entry->updated = hpet_msec() - ARP_RETRY_MS;
+        arp_timer();
+    }
+    if (arp_find(ip)) {
+        cprintf("arp: unresolved address is kept after %d requests\n", ARP_RETRIES_MAX);
+        errors++;
+        arp_free(arp_find(ip));
+    }
+
+    // a full table gives up the entry updated least recently
+    for (int i = 0; i < ARP_TABLE_MAX_SIZE; i++) {
+        reply.source_ip = ARP_TEST_IP(i + 1);
+        update_arp_table(&reply);
+        if (!i && (entry = arp_find(reply.source_ip))) entry->updated = 0;
+    }
+    if (arp_find(ARP_TEST_IP(1)) || !get_mac_by_ip(ARP_TEST_IP(ARP_TABLE_MAX_SIZE))) {
+        cprintf("arp: wrong entry evicted from a full table\n");
+        errors++;
+    }
+    if (!get_mac_by_ip(JHTONL(HOST_IP))) {
+        cprintf("arp: static entry evicted\n");
+        errors++;
+    }
+    for (int i = 0; i < ARP_TABLE_MAX_SIZE; i++) {
+        arp_forget(ARP_TEST_IP(i + 1));
+    }
+
+    return errors;
+}
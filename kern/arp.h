@@ -3,6 +3,7 @@
 
 #include <inc/types.h>
 #include <kern/ip.h>
+#include <kern/e1000.h>
 
 #define ARP_ETHERNET 0x0001
 #define ARP_IPV4     0x0800
@@ -10,6 +11,11 @@
 #define ARP_REPLY    0x0002
 
 #define ARP_TABLE_MAX_SIZE 32
+#define ARP_HASH_SIZE 64        // Buckets of the neighbor cache, power of 2
+#define ARP_ENTRY_TTL 60000     // ms, then the entry is confirmed again
+#define ARP_RETRY_MS 1000       // between requests for an unresolved address
+#define ARP_RETRIES_MAX 3       // then its queued frames are dropped
+#define ARP_PENDING_MAX 8       // frames queued per unresolved address
 
 struct arp_hdr {
     uint16_t hardware_type;
@@ -23,21 +29,36 @@ struct arp_hdr {
     uint32_t target_ip;
 } __attribute__((packed));
 
+struct arp_pending;
+
+// Neighbor cache entry, found by IP through arp_hash
 struct arp_cache_table {
-    uint32_t source_ip;
+    uint32_t source_ip;         // network byte order
     uint8_t source_mac[6];
     unsigned int state;
+    uint64_t updated;           // ms, last reply or request
+    unsigned int retries;       // requests without a reply
+    // frames waiting for the reply, oldest first
+    struct arp_pending *pending_head;
+    struct arp_pending *pending_tail;
+    unsigned int nr_pending;
+    struct arp_cache_table *hash_next;
 };
 
 #define FREE_STATE 0
 #define STATIC_STATE 1
 #define DYNAMIC_STATE 2
+#define INCOMPLETE_STATE 3  // request sent, frames are queued
 
 int arp_resolve(void *data);
 int arp_reply(struct arp_hdr *arp_header);
-uint8_t *get_mac_by_ip(uint32_t ip);
+const uint8_t *get_mac_by_ip(uint32_t ip);
 void initialize_arp_table();
 
-int arp_request(struct ip_pkt *reply_packet);
+int arp_request(uint32_t ip);
+int arp_queue(uint32_t ip, const struct tx_seg *segs, int nsegs, const struct tx_csum *csum);
+void arp_timer(void);
+void arp_forget(uint32_t ip);
+int arp_selftest(void);
 
 #endif
@@ -1,20 +1,68 @@
 #include <kern/e1000.h>
+#include <kern/netif.h>
 #include <kern/pci.h>
 #include <kern/pmap.h>
 #include <kern/timer.h>
+#include <kern/picirq.h>
+#include <kern/env.h>
 #include <inc/types.h>
 #include <inc/string.h>
 #include <inc/error.h>
+#include <inc/assert.h>
 #include <kern/traceopt.h>
+#include <inc/uefi.h>
+#include <inc/trap.h>
+
+bool net_trace_packets = 0;
+bool net_trace_processing = 0;
 
 // Base mmio address
 volatile uint32_t *phy_mmio_addr;
 #define E1000_REG(offset) (phy_mmio_addr[offset >> 2])
 
-struct tx_desc tx_desc_table[E1000_NU_DESC] __attribute__((aligned (PAGE_SIZE)));
-struct rx_desc rx_desc_table[E1000_NU_DESC] __attribute__((aligned (PAGE_SIZE)));
-char tx_buf[E1000_NU_DESC][E1000_BUFFER_SIZE] __attribute__((aligned (PAGE_SIZE)));
-char rx_buf[E1000_NU_DESC][E1000_BUFFER_SIZE] __attribute__((aligned (PAGE_SIZE)));
+// Ring depth and buffer size chosen at attach time
+static uint32_t e1000_nu_desc;
+static uint32_t e1000_buf_size;
+
+struct tx_desc *tx_desc_table;
+struct rx_desc *rx_desc_table;
+static physaddr_t tx_desc_pa, rx_desc_pa;
+// RX DMA buffer of each descriptor
+static uint8_t **rx_buf;
+
+// Copies of pieces that are not pool buffers, nobody keeps them until DMA
+static uint8_t **tx_bounce;
+static physaddr_t *tx_bounce_pa;
+// Pool buffer the descriptor points to, released when the frame is sent
+static struct pbuf **tx_pbuf;
+// Last descriptor of the frame starting at given descriptor
+static uint16_t *tx_eop;
+// Oldest descriptor not reclaimed, next one to fill and tail the NIC knows
+static uint32_t tx_clean, tx_tail, tx_doorbell;
+// Doorbell is held back while a burst is open
+static int tx_batch;
+// Checksum offload the NIC is set up for by the last context descriptor
+static struct tx_csum tx_ctx;
+// Checksum offload capabilities, E1000_CAP_CSUM_*
+static uint32_t e1000_caps;
+
+// Software queue in front of the ring, used while the ring is full
+struct tx_queued {
+    uint16_t len;
+    uint8_t *data;
+    struct tx_csum csum;
+};
+static struct tx_queued txq[E1000_TXQ_LEN];
+static uint8_t *txq_data;
+static uint32_t txq_head, txq_len;
+
+// Next RX descriptor to hand out and descriptors lent to the stack
+static uint32_t rx_next;
+static bool *rx_held;
+
+// PCI INTx line of the card and environment sleeping until RX interrupt
+static uint8_t e1000_irq;
+static envid_t rx_waiter;
 
 static void
 dump_tx_desc(uint32_t tx_idx) {
@@ -55,13 +103,13 @@ is_time_over(uint64_t *a, uint64_t *b, double *timeout) {
 static void
 e1000_transmit_init() {
     // Set TX Base Address Low
-    E1000_REG(E1000_TDBAL) = (uint32_t)PADDR(tx_desc_table);
+    E1000_REG(E1000_TDBAL) = (uint32_t)tx_desc_pa;
 
     // Set TX Base Address High
-    E1000_REG(E1000_TDBAH) = 0;
+    E1000_REG(E1000_TDBAH) = (uint32_t)(tx_desc_pa >> 32);
 
     // Set TX Length
-    E1000_REG(E1000_TDLEN) = sizeof(tx_desc_table);
+    E1000_REG(E1000_TDLEN) = e1000_nu_desc * sizeof(struct tx_desc);
 
     // Set TX Head
     E1000_REG(E1000_TDH) = 0;
@@ -79,14 +127,15 @@ e1000_transmit_init() {
     E1000_REG(E1000_TIPG) = 0x60200a;
 
     // Set TX Descriptors
-    for (int i = 0; i < E1000_NU_DESC; i++) {
+    for (int i = 0; i < e1000_nu_desc; i++) {
         // Set TX status as Descriptor Done
         tx_desc_table[i].status |= E1000_TXD_STAT_DD;
-        // Set TX buffer address
-        tx_desc_table[i].buf_addr = PADDR(tx_buf[i]);
-        // Set TX cmd
-        tx_desc_table[i].cmd = E1000_TXD_CMD_RS | E1000_TXD_CMD_EOP;
+        // Buffer address and cmd are filled per frame by e1000_transmit
+        tx_desc_table[i].buf_addr = 0;
+        tx_desc_table[i].cmd = 0;
     }
+    tx_clean = tx_tail = tx_doorbell = 0;
+    memset(&tx_ctx, 0, sizeof(tx_ctx));
 
     if (trace_packets) dump_tx_desc(0);
 }
@@ -97,34 +146,138 @@ e1000_transmit_init() {
 static void
 e1000_receive_init() {
     // Set RX Base Address Low
-    E1000_REG(E1000_RDBAL) = PADDR(rx_desc_table);
+    E1000_REG(E1000_RDBAL) = (uint32_t)rx_desc_pa;
 
     // Set RX Base Address High
-    E1000_REG(E1000_RDBAH) = 0;
+    E1000_REG(E1000_RDBAH) = (uint32_t)(rx_desc_pa >> 32);
 
     // Set RX Length
-    E1000_REG(E1000_RDLEN) = sizeof(rx_desc_table);
+    E1000_REG(E1000_RDLEN) = e1000_nu_desc * sizeof(struct rx_desc);
 
     // Set RX Head
     E1000_REG(E1000_RDH) = 0;
 
     // Set RX Tail
-    E1000_REG(E1000_RDT) = E1000_NU_DESC - 1;
+    E1000_REG(E1000_RDT) = e1000_nu_desc - 1;
+
+    // Set RX Control Register, frames longer than 1522 need LPE
+    uint32_t rctl = E1000_RCTL_EN | E1000_RCTL_BAM | E1000_RCTL_CRC;
+    switch (e1000_buf_size) {
+    case 4096: rctl |= E1000_RCTL_SZ_4096 | E1000_RCTL_BSEX | E1000_RCTL_LPE; break;
+    case 8192: rctl |= E1000_RCTL_SZ_8192 | E1000_RCTL_BSEX | E1000_RCTL_LPE; break;
+    case 16384: rctl |= E1000_RCTL_SZ_16384 | E1000_RCTL_BSEX | E1000_RCTL_LPE; break;
+    default: rctl |= E1000_RCTL_SZ_2048; break;
+    }
+    E1000_REG(E1000_RCTL) = rctl;
 
-    // Set RX Control Register
-    E1000_REG(E1000_RCTL) = E1000_RCTL_EN | E1000_RCTL_BAM | E1000_RCTL_CRC;
+    // Let the NIC verify IPv4 and TCP/UDP checksums, results land in descriptors
+    E1000_REG(E1000_RXCSUM) = (e1000_caps & E1000_CAP_CSUM_RX) ? E1000_RXCSUM_IPOFL | E1000_RXCSUM_TUOFL : 0;
 
-    // Set RX Descriptors
-    for (int i = 0; i < E1000_NU_DESC; i++) {
+    // RX buffer addresses are set once by e1000_alloc_rings()
+    for (int i = 0; i < e1000_nu_desc; i++) {
         // Clear RX status Descriptor Done
         rx_desc_table[i].status &= ~E1000_RXD_STAT_DD;
-        // Set RX buffer address
-        rx_desc_table[i].buf_addr = PADDR(rx_buf[i]);
     }
 
     if (trace_packets) dump_rx_desc(0);
 }
 
+/**
+ * Выделяет n DMA-буферов по size байт кусками не больше наибольшего
+ * класса страниц, чтобы каждый буфер был непрерывен физически.
+ */
+static int
+e1000_alloc_buffers(uint32_t n, uint32_t size, uint8_t **va, physaddr_t *pa) {
+    uint32_t per_chunk = CLASS_SIZE(MAX_ALLOCATION_CLASS) / size;
+
+    for (uint32_t i = 0; i < n; i += per_chunk) {
+        uint32_t count = MIN(per_chunk, n - i);
+        physaddr_t chunk_pa;
+        uint8_t *chunk = kzalloc_dma_region(count * size, &chunk_pa);
+        if (!chunk) return -E_NO_MEM;
+
+        for (uint32_t j = 0; j < count; j++) {
+            va[i + j] = chunk + j * size;
+            if (pa) pa[i + j] = chunk_pa + j * size;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Выбирает глубину колец и размер буферов по аргументам загрузки
+ * e1000.ring (от E1000_NU_DESC_MIN до 4096, кратно 8, чтобы длина кольца
+ * была кратна 128 байтам) и e1000.rxbuf (2048, 4096, 8192 или 16384)
+ * и выделяет под них память. Кольца и буферы карта читает по DMA,
+ * поэтому они выделяются сразу и непрерывными кусками.
+ */
+static int
+e1000_alloc_rings(void) {
+    long ndesc = uefi_boot_arg("e1000.ring", E1000_NU_DESC_DEFAULT);
+    if (ndesc < E1000_NU_DESC_MIN || ndesc > E1000_NU_DESC_MAX || ndesc % 8) {
+        cprintf("E1000: bad e1000.ring=%ld, using %d\n", ndesc, E1000_NU_DESC_DEFAULT);
+        ndesc = E1000_NU_DESC_DEFAULT;
+    }
+
+    long bufsize = uefi_boot_arg("e1000.rxbuf", E1000_BUFFER_SIZE_DEFAULT);
+    if (bufsize != 2048 && bufsize != 4096 && bufsize != 8192 && bufsize != 16384) {
+        cprintf("E1000: bad e1000.rxbuf=%ld, using %d\n", bufsize, E1000_BUFFER_SIZE_DEFAULT);
+        bufsize = E1000_BUFFER_SIZE_DEFAULT;
+    }
+
+    e1000_nu_desc = ndesc;
+    e1000_buf_size = bufsize;
+
+    tx_desc_table = kzalloc_dma_region(ndesc * sizeof(struct tx_desc), &tx_desc_pa);
+    rx_desc_table = kzalloc_dma_region(ndesc * sizeof(struct rx_desc), &rx_desc_pa);
+    if (!tx_desc_table || !rx_desc_table) return -E_NO_MEM;
+
+    // Bookkeeping is touched only by the CPU, lazily allocated memory is fine
+    rx_buf = kzalloc_region(ndesc * sizeof(*rx_buf));
+    rx_held = kzalloc_region(ndesc * sizeof(*rx_held));
+    tx_bounce = kzalloc_region(ndesc * sizeof(*tx_bounce));
+    tx_bounce_pa = kzalloc_region(ndesc * sizeof(*tx_bounce_pa));
+    tx_eop = kzalloc_region(ndesc * sizeof(*tx_eop));
+    tx_pbuf = kzalloc_region(ndesc * sizeof(*tx_pbuf));
+    txq_data = kzalloc_region(E1000_TXQ_LEN * bufsize);
+    for (int i = 0; i < E1000_TXQ_LEN; i++) {
+        txq[i].data = txq_data + i * bufsize;
+    }
+
+    physaddr_t *rx_buf_pa = kzalloc_region(ndesc * sizeof(*rx_buf_pa));
+    int res = e1000_alloc_buffers(ndesc, bufsize, rx_buf, rx_buf_pa);
+    if (res < 0) return res;
+    for (int i = 0; i < ndesc; i++) {
+        rx_desc_table[i].buf_addr = rx_buf_pa[i];
+    }
+
+    res = e1000_alloc_buffers(ndesc, bufsize, tx_bounce, tx_bounce_pa);
+    if (res < 0) return res;
+
+    cprintf("E1000: %u descriptors per ring, %u byte buffers\n", e1000_nu_desc, e1000_buf_size);
+    return 0;
+}
+
+/**
+ * Настраивает прерывания E1000: RXT0 (пришёл кадр), RXDMT0 (кольцо почти
+ * исчерпано), RXO (переполнение) и TXDW (кадр отправлен),
+ * и размаскирует линию в 8259A.
+ */
+static void
+e1000_interrupt_init() {
+    // Mask everything and drop causes left pending by firmware
+    E1000_REG(E1000_IMC) = 0xFFFFFFFF;
+    (void)E1000_REG(E1000_ICR);
+
+    // Raise RXT0 as soon as a frame is written back
+    E1000_REG(E1000_RDTR) = 0;
+
+    // Set Interrupt Mask
+    E1000_REG(E1000_IMS) = E1000_ICR_RX | E1000_ICR_TXDW;
+
+    pic_irq_unmask(e1000_irq);
+}
+
 /**
  * Функция сопоставления pci-устройства и e1000.
  * Нужна для мапинга регистров устройства (сетевой карты) в память ядра.
@@ -151,65 +304,351 @@ e1000_attach(struct pci_func *pciFunction) {
     // Set Multicast Table Array
     E1000_REG(E1000_MTA) = 0;
 
+    // Checksum offload can be turned off with e1000.csum=0,
+    // TCP segmentation offload (needs checksum offload) with e1000.tso=0
+    e1000_caps = uefi_boot_arg("e1000.csum", 1) ?
+                 E1000_CAP_CSUM_TX_IP | E1000_CAP_CSUM_TX_L4 | E1000_CAP_CSUM_RX : 0;
+    if ((e1000_caps & E1000_CAP_CSUM_TX_L4) && uefi_boot_arg("e1000.tso", 1)) {
+        e1000_caps |= E1000_CAP_TSO;
+    }
+
+    // trap_dispatch() hands only these lines to e1000_intr()
+    e1000_irq = pciFunction->irq_line;
+    if (e1000_irq != IRQ_PCI_A && e1000_irq != IRQ_PCI_B && e1000_irq != IRQ_PCI_C) {
+        cprintf("E1000: unsupported irq line %u\n", e1000_irq);
+        return 0;
+    }
+
+    if (e1000_alloc_rings() < 0) {
+        cprintf("E1000: out of memory for rings\n");
+        return 0;
+    }
+
     e1000_transmit_init();
     e1000_receive_init();
 
+    e1000_interrupt_init();
+
     cprintf("E1000 status: %08x\n", E1000_REG(E1000_DEVICE_STATUS));
 
     return 1;
 }
 
 /**
- * Помещаем в очередь отправки e1000 пакет размером len
- * Если очередь отправки полна - возвращаем отрицательное число
+ * Кусок нельзя отдать карте по его адресу: карта заберёт его по DMA
+ * уже после возврата из e1000_transmit(), а владельца у куска нет.
+ * Стек ядра, кольцо приёма (ответ ICMP собирается прямо в буфере
+ * приёма, который сразу возвращается карте), программная очередь
+ * и статические буферы успеют измениться. Отдаются напрямую только
+ * буферы пула: они живут, пока карта держит ссылку на них.
+ */
+static bool
+e1000_tx_volatile(const struct tx_seg *seg) {
+    return !seg->pb;
+}
+
+/**
+ * Число свободных дескрипторов отправки. Один всегда остаётся пустым,
+ * чтобы отличать полное кольцо от пустого.
+ */
+static uint32_t
+e1000_tx_free(void) {
+    return e1000_nu_desc - 1 - (tx_tail - tx_clean + e1000_nu_desc) % e1000_nu_desc;
+}
+
+/**
+ * Забирает у карты дескрипторы всех отправленных кадров разом.
+ * RS выставлен только на последнем дескрипторе кадра, поэтому
+ * достаточно смотреть на его DD. Возвращает число освобождённых дескрипторов.
+ */
+static uint32_t
+e1000_tx_reclaim(void) {
+    uint32_t reclaimed = 0;
+
+    while (tx_clean != tx_tail) {
+        uint32_t eop = tx_eop[tx_clean];
+        if (!(tx_desc_table[eop].status & E1000_TXD_STAT_DD)) {
+            break;
+        }
+        reclaimed += (eop - tx_clean + e1000_nu_desc) % e1000_nu_desc + 1;
+        for (uint32_t idx = tx_clean;; idx = (idx + 1) % e1000_nu_desc) {
+            if (tx_pbuf[idx]) {
+                pbuf_release(tx_pbuf[idx]);
+                tx_pbuf[idx] = NULL;
+            }
+            if (idx == eop) break;
+        }
+        tx_clean = (eop + 1) % e1000_nu_desc;
+    }
+    return reclaimed;
+}
+
+/**
+ * Сообщает карте о новых дескрипторах одной записью в TDT.
+ */
+static void
+e1000_tx_doorbell(void) {
+    if (tx_doorbell == tx_tail) return;
+
+    // Point to next TX Descriptor
+    E1000_REG(E1000_TDT) = tx_tail;
+    tx_doorbell = tx_tail;
+}
+
+/**
+ * Нужен ли кадру с такими check-суммами новый контекстный дескриптор.
+ * Карта помнит последний контекст, поэтому подряд идущие кадры одного
+ * вида (например, TCP-сегменты) обходятся без него.
+ */
+static bool
+e1000_tx_need_ctx(const struct tx_csum *csum) {
+    return csum && csum->flags && ((csum->flags & E1000_TX_TSO) || memcmp(csum, &tx_ctx, sizeof(tx_ctx)));
+}
+
+/**
+ * Кладёт в кольцо контекстный дескриптор: откуда и докуда карта считает
+ * check-суммы IP и TCP/UDP и куда их записывает. Для TSO в нём же
+ * длина нагрузки paylen, длина заголовков и mss.
+ */
+static void
+e1000_tx_post_ctx(const struct tx_csum *csum, uint32_t paylen) {
+    struct tx_ctx_desc *ctx = (struct tx_ctx_desc *)&tx_desc_table[tx_tail];
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->ipcss = csum->ipcss;
+    ctx->ipcso = csum->ipcso;
+    ctx->ipcse = csum->tucss - 1;
+    ctx->tucss = csum->tucss;
+    ctx->tucso = csum->tucso;
+    ctx->tucse = 0;
+    ctx->tucmd = E1000_TXD_CMD_DEXT | E1000_TXD_TUCMD_IP;
+    if (csum->flags & E1000_TX_TSO) {
+        ctx->tucmd |= E1000_TXD_TUCMD_TCP | E1000_TXD_TUCMD_TSE;
+        ctx->paylen = paylen & 0xFFFF;
+        ctx->dtyp = (paylen >> 16) & 0xF;
+        ctx->hdrlen = csum->hdrlen;
+        ctx->mss = csum->mss;
+    }
+
+    tx_ctx = *csum;
+    tx_pbuf[tx_tail] = NULL;
+    tx_tail = (tx_tail + 1) % e1000_nu_desc;
+}
+
+/**
+ * Раскладывает кадр по дескрипторам кольца, не трогая TDT.
+ * Подряд идущие куски без буфера пула копируются в bounce-буфер одного
+ * дескриптора, куски буферов пула отдаются карте прямо оттуда, где лежат.
+ * Если карта должна вставить check-суммы, перед кадром идёт контекстный
+ * дескриптор, а дескрипторы данных становятся расширенными.
+ * Вызывающий проверил, что свободных дескрипторов не меньше nsegs + 1.
+ */
+static void
+e1000_tx_post(const struct tx_seg *segs, int nsegs, const struct tx_csum *csum) {
+    uint32_t first = tx_tail;
+
+    if (e1000_tx_need_ctx(csum)) {
+        uint32_t total = 0;
+        for (int i = 0; i < nsegs; i++) {
+            total += segs[i].len;
+        }
+        e1000_tx_post_ctx(csum, total - csum->hdrlen);
+    }
+
+    uint32_t idx = tx_tail;
+    uint32_t last = tx_tail;
+    bool offload = csum && csum->flags;
+
+    for (int i = 0; i < nsegs;) {
+        // Skip empty pieces, zero length descriptors are not allowed
+        if (!segs[i].len) {
+            i++;
+            continue;
+        }
+
+        tx_pbuf[idx] = NULL;
+        if (e1000_tx_volatile(&segs[i])) {
+            uint16_t len = 0;
+            // a bounce buffer holds e1000_buf_size bytes, more than a TSO frame has
+            for (; i < nsegs && (!segs[i].len || (e1000_tx_volatile(&segs[i]) &&
+                                                  len + segs[i].len <= e1000_buf_size)); i++) {
+                memcpy(tx_bounce[idx] + len, segs[i].addr, segs[i].len);
+                len += segs[i].len;
+            }
+            tx_desc_table[idx].buf_addr = tx_bounce_pa[idx];
+            tx_desc_table[idx].length = len;
+        } else {
+            tx_desc_table[idx].buf_addr = pbuf_paddr(segs[i].pb, segs[i].addr);
+            tx_desc_table[idx].length = segs[i].len;
+            tx_pbuf[idx] = segs[i].pb;
+            pbuf_ref(segs[i].pb);
+            i++;
+        }
+        tx_desc_table[idx].cmd = 0;
+        tx_desc_table[idx].cso = 0;
+        tx_desc_table[idx].css = 0;
+
+        // Extended data descriptor: type in cso, checksum options in css
+        if (offload) {
+            tx_desc_table[idx].cmd = E1000_TXD_CMD_DEXT;
+            tx_desc_table[idx].cso = E1000_TXD_DTYP_D;
+            if (csum->flags & E1000_TX_CSUM_IP) tx_desc_table[idx].css |= E1000_TXD_POPTS_IXSM;
+            if (csum->flags & E1000_TX_CSUM_L4) tx_desc_table[idx].css |= E1000_TXD_POPTS_TXSM;
+            if (csum->flags & E1000_TX_TSO) tx_desc_table[idx].cmd |= E1000_TXD_CMD_TSE;
+        }
+
+        // Clear TX status Descriptor Done
+        tx_desc_table[idx].status = 0;
+
+        if (trace_packets) dump_tx_desc(idx);
+
+        last = idx;
+        idx = (idx + 1) % e1000_nu_desc;
+    }
+
+    // End of packet and status report only on the last piece
+    tx_desc_table[last].cmd |= E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS;
+    tx_eop[first] = last;
+    tx_tail = idx;
+}
+
+/**
+ * Переносит кадры из программной очереди в освободившиеся дескрипторы.
+ */
+static void
+e1000_txq_drain(void) {
+    while (txq_len) {
+        struct tx_queued *queued = &txq[txq_head];
+        uint32_t need = 1 + e1000_tx_need_ctx(&queued->csum);
+        if (e1000_tx_free() < need) {
+            e1000_tx_reclaim();
+            if (e1000_tx_free() < need) break;
+        }
+
+        struct tx_seg seg = {queued->data, queued->len, NULL};
+        e1000_tx_post(&seg, 1, &queued->csum);
+
+        txq_head = (txq_head + 1) % E1000_TXQ_LEN;
+        txq_len--;
+    }
+}
+
+/**
+ * Помещаем в очередь отправки e1000 кадр, собранный из nsegs кусков.
+ * Каждый кусок занимает свой дескриптор, EOP выставляется только на последнем,
+ * так что заголовки и данные отправляются оттуда, где уже лежат.
+ * csum (может быть NULL) говорит, какие check-суммы досчитает карта.
+ * Отправленные дескрипторы забираются пачкой, когда свободных остаётся мало.
+ * Если кольцо полно, кадр встаёт в программную очередь; если полна и она -
+ * возвращаем отрицательное число.
+ * Кадр TSO (E1000_TX_TSO) длиной до E1000_TSO_MAX_LEN карта сама режет
+ * на сегменты; в программную очередь он не помещается, поэтому при полном
+ * кольце возвращается -E_NO_MEM.
  */
 int
-e1000_transmit(const char* buf, uint16_t len) {
-    // Trunk packet length
-    len = len > E1000_BUFFER_SIZE ? E1000_BUFFER_SIZE : len;
+e1000_transmit(const struct tx_seg *segs, int nsegs, const struct tx_csum *csum) {
+    bool tso = csum && (csum->flags & E1000_TX_TSO);
+    uint32_t total = 0, longest = 0;
+    for (int i = 0; i < nsegs; i++) {
+        total += segs[i].len;
+        longest = MAX(longest, (uint32_t)segs[i].len);
+    }
+    if (!e1000_nu_desc) return -E_INVAL;
+    // every piece of a TSO frame must fit a bounce buffer
+    if (!total || nsegs > (tso ? e1000_tso_max_segs() : E1000_TX_MAX_SEGS) ||
+        total > (tso ? E1000_TSO_MAX_LEN : e1000_buf_size) || (tso && longest > e1000_buf_size)) {
+        cprintf("\nE1000 bad frame: %d segments, %u bytes\n", nsegs, total);
+        return -E_INVAL;
+    }
 
-    // Tail TX Descriptor Index
-    uint32_t tail_tx = E1000_REG(E1000_TDT);
+    // Frames queued earlier go first to keep order
+    if (txq_len) {
+        e1000_txq_drain();
+    }
+    if (e1000_tx_free() < E1000_TX_RECLAIM_THRESH(e1000_nu_desc)) {
+        e1000_tx_reclaim();
+    }
 
-    // Check status of tail TX Descriptor
-    if (!(tx_desc_table[tail_tx].status & E1000_TXD_STAT_DD)) {
-        cprintf("\nE1000 transmit queue is full\n");
-        return -1;
+    if (csum && (csum->flags & ~e1000_caps & (E1000_TX_CSUM_IP | E1000_TX_CSUM_L4 | E1000_TX_TSO))) {
+        cprintf("\nE1000 checksum offload is off\n");
+        return -E_INVAL;
     }
 
-    // Move data to buffer
-    memmove(tx_buf[tail_tx], buf, len);
+    if (tso && (txq_len || e1000_tx_free() < nsegs + 1)) {
+        e1000_tx_reclaim();
+        if (txq_len || e1000_tx_free() < nsegs + 1) {
+            e1000_tx_doorbell();
+            return -E_NO_MEM;
+        }
+    }
 
-    // Set packet length
-    tx_desc_table[tail_tx].length = len;
+    if (txq_len || e1000_tx_free() < nsegs + e1000_tx_need_ctx(csum)) {
+        // Let the NIC work on what is posted while we wait
+        e1000_tx_doorbell();
 
-    // Clear TX status Descriptor Done
-    tx_desc_table[tail_tx].status &= ~E1000_TXD_STAT_DD;
+        if (txq_len == E1000_TXQ_LEN) {
+            cprintf("\nE1000 transmit queue is full\n");
+            return -E_NO_MEM;
+        }
 
-    if (trace_packets) dump_tx_desc(tail_tx);
+        struct tx_queued *queued = &txq[(txq_head + txq_len) % E1000_TXQ_LEN];
+        queued->len = 0;
+        if (csum) {
+            queued->csum = *csum;
+        } else {
+            memset(&queued->csum, 0, sizeof(queued->csum));
+        }
+        for (int i = 0; i < nsegs; i++) {
+            memcpy(queued->data + queued->len, segs[i].addr, segs[i].len);
+            queued->len += segs[i].len;
+        }
+        txq_len++;
+        return 0;
+    }
 
-    // Point to next TX Descriptor
-    E1000_REG(E1000_TDT) = (tail_tx + 1) % E1000_NU_DESC;
+    e1000_tx_post(segs, nsegs, csum);
 
+    if (!tx_batch) {
+        e1000_tx_doorbell();
+    }
     return 0;
 }
 
 /**
- * Ожидаем освобождение слота под пакет в какой-либо очереди отправки на сетевой карте.
- * Если место есть, возвращаем индекс очереди, что освободилась.
+ * Открывает пачку отправок: TDT не пишется до e1000_tx_batch_end().
+ */
+void
+e1000_tx_batch_begin(void) {
+    tx_batch++;
+}
+
+/**
+ * Закрывает пачку и одной записью в TDT отдаёт карте все её кадры.
+ */
+void
+e1000_tx_batch_end(void) {
+    assert(tx_batch > 0);
+    if (--tx_batch) return;
+
+    e1000_txq_drain();
+    e1000_tx_doorbell();
+}
+
+/**
+ * Ожидаем освобождение места под кадр в кольце отправки на сетевой карте.
+ * Если место есть, возвращаем 0.
  */
 int
 e1000_timeout_transmit(double timeout) {
     uint64_t tsc0 = read_tsc(), tsc1 = 0;
     do {
-        // Tail TX Descriptor Index
-        uint32_t tail_tx = E1000_REG(E1000_TDT);
-        tail_tx = (tail_tx + 1) % E1000_NU_DESC;
+        e1000_tx_reclaim();
+        e1000_txq_drain();
 
-        // Check status of tail TX Descriptor
-        if (rx_desc_table[tail_tx].status & E1000_TXD_STAT_DD) {
+        if (!txq_len && e1000_tx_free() >= E1000_TX_MAX_SEGS + 1) {
             return 0;
         }
+        e1000_tx_doorbell();
     } while (!is_time_over(&tsc0, &tsc1, &timeout));
 
     // if (trace_packets) cprintf("transmit TIMEOUT! (%d ms)\n", (uint32_t)(timeout * 1000));
@@ -222,11 +661,8 @@ e1000_timeout_transmit(double timeout) {
 void
 e1000_listen(void) {
     while (1) {
-        uint32_t tail_rx = E1000_REG(E1000_RDT);
-        tail_rx = (tail_rx + 1) % E1000_NU_DESC;
-
-        // Check status of tail RX Descriptor
-        if (rx_desc_table[tail_rx].status & E1000_RXD_STAT_DD) {
+        // Check status of next RX Descriptor
+        if (rx_desc_table[rx_next].status & E1000_RXD_STAT_DD) {
             break;
         }
     }
@@ -241,11 +677,8 @@ e1000_timeout_listen(double timeout) {
     uint64_t tsc0 = read_tsc(), tsc1 = 0;
 
     do {
-        uint32_t tail_rx = E1000_REG(E1000_RDT);
-        tail_rx = (tail_rx + 1) % E1000_NU_DESC;
-
-        // Check status of tail RX Descriptor
-        if (rx_desc_table[tail_rx].status & E1000_RXD_STAT_DD) {
+        // Check status of next RX Descriptor
+        if (rx_desc_table[rx_next].status & E1000_RXD_STAT_DD) {
             return 0;
         }
     } while (!is_time_over(&tsc0, &tsc1, &timeout));
@@ -255,38 +688,188 @@ e1000_timeout_listen(double timeout) {
 }
 
 /**
- * Читаем из входящей очереди и записываем последний прочитанный элемент
- * в память, на которую указывает указатель buffer.
+ * Возвращает дескриптор владельцу-карте. Хвост RDT сдвигается только
+ * по непрерывной цепочке освобождённых дескрипторов, поэтому стек может
+ * отпускать пакеты в любом порядке.
  */
-int
-e1000_receive(char *buffer) {
-    // Tail RX Descriptor Index
+static void
+e1000_rx_release(struct pbuf *pb) {
+    uint32_t idx = pb->cookie;
+    assert(idx < e1000_nu_desc && rx_held[idx]);
+
+    rx_desc_table[idx].status = 0;
+    rx_held[idx] = false;
+
     uint32_t tail_rx = E1000_REG(E1000_RDT);
-    tail_rx = (tail_rx + 1) % E1000_NU_DESC;
+    uint32_t next = (tail_rx + 1) % e1000_nu_desc;
+    while (next != rx_next && !rx_held[next]) {
+        tail_rx = next;
+        next = (next + 1) % e1000_nu_desc;
+    }
 
-    if (trace_packets) dump_rx_desc(tail_rx);
+    // Point to last RX Descriptor given back
+    E1000_REG(E1000_RDT) = tail_rx;
+}
 
-    // Check status of tail RX Descriptor
-    if (!(rx_desc_table[tail_rx].status & E1000_RXD_STAT_DD)) {
-        cprintf("\nE1000 receive queue is empty\n");
+/**
+ * Отдаёт стеку очередной пришедший кадр прямо в DMA-буфере карты, без
+ * копирования. Дескриптор остаётся занятым до вызова pbuf_release().
+ * Возвращает длину кадра или 0, если очередь пуста.
+ */
+int
+e1000_receive_pbuf(struct pbuf *pb) {
+    uint32_t idx = rx_next;
+
+    if (!e1000_nu_desc) return 0;
+    if (trace_packets) dump_rx_desc(idx);
+
+    // Check status of next RX Descriptor
+    if (!(rx_desc_table[idx].status & E1000_RXD_STAT_DD)) {
         return 0;
     }
-    if (!(rx_desc_table[tail_rx].status & E1000_RXD_STAT_EOP)){
+    rx_next = (idx + 1) % e1000_nu_desc;
+
+    if (!(rx_desc_table[idx].status & E1000_RXD_STAT_EOP)) {
         cprintf("\nE1000 receive status is not EOP\n");
+        rx_held[idx] = true;
+        pb->cookie = idx;
+        e1000_rx_release(pb);
         return 0;
     }
 
-    // Clear RX status Descriptor Done
-    rx_desc_table[tail_rx].status &= ~E1000_RXD_STAT_DD;
+    pb->csum = 0;
+    if ((e1000_caps & E1000_CAP_CSUM_RX) && !(rx_desc_table[idx].status & E1000_RXD_STAT_IXSM)) {
+        if ((rx_desc_table[idx].status & E1000_RXD_STAT_IPCS) &&
+            !(rx_desc_table[idx].errors & E1000_RXD_ERR_IPE)) {
+            pb->csum |= PBUF_CSUM_IP;
+        }
+        if ((rx_desc_table[idx].status & E1000_RXD_STAT_TCPCS) &&
+            !(rx_desc_table[idx].errors & E1000_RXD_ERR_TCPE)) {
+            pb->csum |= PBUF_CSUM_L4;
+        }
+    }
 
-    // Get packet length
-    int len = (int)rx_desc_table[tail_rx].length;
+    rx_held[idx] = true;
+    pb->ref = 0;
+    pb->data = rx_buf[idx];
+    pb->len = rx_desc_table[idx].length;
+    pb->free = e1000_rx_release;
+    pb->cookie = idx;
 
-    // Get data from buffer
-    memmove(buffer, rx_buf[tail_rx], len);
+    return pb->len;
+}
 
-    // Point to next RX Descriptor
-    E1000_REG(E1000_RDT) = tail_rx;
+/**
+ * Читаем из входящей очереди и записываем последний прочитанный элемент
+ * в память, на которую указывает указатель buffer (не больше size байт).
+ */
+int
+e1000_receive(char *buffer, size_t size) {
+    struct pbuf pb = {};
+
+    int len = e1000_receive_pbuf(&pb);
+    if (len <= 0) {
+        cprintf("\nE1000 receive queue is empty\n");
+        return 0;
+    }
+
+    // Get data from buffer, tail of a longer frame is dropped
+    len = MIN((size_t)len, size);
+    memmove(buffer, pb.data, len);
+    pbuf_release(&pb);
 
     return len;
-}
\ No newline at end of file
+}
+
+/**
+ * Какие check-суммы карта считает сама (E1000_CAP_CSUM_*).
+ * Стек по ним решает, считать ли check-суммы программно.
+ */
+uint32_t
+e1000_csum_caps(void) {
+    return e1000_caps;
+}
+
+/**
+ * Сколько кусков может быть в кадре TSO, 0 если TSO выключено.
+ * Кадру нужно столько же дескрипторов и ещё контекстный, так что
+ * он занимает не больше половины кольца.
+ */
+int
+e1000_tso_max_segs(void) {
+    if (!(e1000_caps & E1000_CAP_TSO)) return 0;
+    return MIN(E1000_TSO_MAX_SEGS, (int)e1000_nu_desc / 2 - 1);
+}
+
+/**
+ * Есть ли во входящей очереди хотя бы один готовый пакет.
+ */
+bool
+e1000_rx_ready(void) {
+    return e1000_nu_desc && rx_desc_table[rx_next].status & E1000_RXD_STAT_DD;
+}
+
+/**
+ * Усыпляет текущее окружение до прерывания о приёме пакета.
+ * После вызова процессор нужно отдать через sched_yield().
+ */
+void
+e1000_wait_receive(void) {
+    assert(curenv);
+
+    // Frame could land while previous ones were being processed
+    if (e1000_rx_ready()) return;
+
+    rx_waiter = curenv->env_id;
+    curenv->env_irq_waiting = true;
+    curenv->env_status = ENV_NOT_RUNNABLE;
+}
+
+/**
+ * Забывает окружение, спящее до прерывания о приёме, если оно уничтожается.
+ */
+void
+e1000_env_free(envid_t envid) {
+    if (rx_waiter == envid) rx_waiter = 0;
+}
+
+/**
+ * Обработчик прерывания E1000. Линия INTx может быть разделяемой,
+ * поэтому по ICR проверяем, что прерывание действительно наше.
+ */
+void
+e1000_intr(void) {
+    if (!phy_mmio_addr) return;
+
+    // Reading ICR acknowledges all pending causes
+    uint32_t icr = E1000_REG(E1000_ICR);
+    if (!(icr & (E1000_ICR_RX | E1000_ICR_TXDW))) return;
+
+    if (trace_packets) cprintf("E1000 interrupt: ICR %08x\n", icr);
+
+    if (icr & E1000_ICR_TXDW) {
+        // Frames went out: reclaim their descriptors and push the backlog
+        e1000_tx_reclaim();
+        if (txq_len && !tx_batch) {
+            e1000_txq_drain();
+            e1000_tx_doorbell();
+        }
+    }
+
+    if (!(icr & E1000_ICR_RX)) return;
+
+    struct Env *env;
+    if (rx_waiter && !envid2env(rx_waiter, &env, 0) && env->env_irq_waiting) {
+        env->env_irq_waiting = false;
+        env->env_status = ENV_RUNNABLE;
+    }
+    rx_waiter = 0;
+}
+
+const struct netif_ops e1000_netif = {
+        .name = "e1000",
+        .transmit = e1000_transmit,
+        .receive = e1000_receive_pbuf,
+        .rx_ready = e1000_rx_ready,
+        .csum_caps = e1000_csum_caps,
+};
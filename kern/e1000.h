@@ -2,13 +2,16 @@
 #define JOS_KERN_E1000_H
 
 #include <inc/mmu.h>
+#include <inc/env.h>
 #include <kern/pci.h>
+#include <kern/pbuf.h>
 
-#define E1000_NU_DESC     64      // Number of descriptors (RX or TX)
-#define E1000_BUFFER_SIZE 1518    // Same as ethernet packet size
-
-#define trace_packets 1
-#define trace_packet_processing 1
+// Ring depth (RX and TX) and buffer size are set at attach time
+// by boot arguments e1000.ring and e1000.rxbuf
+#define E1000_NU_DESC_DEFAULT 64    // Number of descriptors (RX or TX)
+#define E1000_NU_DESC_MIN     16    // Room for a frame of E1000_TX_MAX_SEGS pieces
+#define E1000_NU_DESC_MAX     4096  // Hardware limit
+#define E1000_BUFFER_SIZE_DEFAULT 2048  // Fits ethernet packet, 2048/4096/8192/16384
 
 // TX Descriptor
 struct tx_desc {
@@ -21,6 +24,62 @@ struct tx_desc {
     uint16_t special;
 };
 
+// TX Context Descriptor, sets up checksum offload for the data
+// descriptors that follow it
+struct tx_ctx_desc {
+    uint8_t ipcss;      // IP checksum start
+    uint8_t ipcso;      // IP checksum offset
+    uint16_t ipcse;     // IP checksum end (inclusive)
+    uint8_t tucss;      // TCP/UDP checksum start
+    uint8_t tucso;      // TCP/UDP checksum offset
+    uint16_t tucse;     // TCP/UDP checksum end (inclusive), 0 - end of packet
+    uint16_t paylen;    // TSO payload length (bits 15:0)
+    uint8_t dtyp;       // PAYLEN bits 19:16 and descriptor type
+    uint8_t tucmd;      // Command
+    uint8_t status;
+    uint8_t hdrlen;     // TSO header length
+    uint16_t mss;       // TSO maximum segment size
+};
+
+// Checksums the NIC should insert into a frame, offsets from frame start
+struct tx_csum {
+    uint8_t flags;      // E1000_TX_CSUM_*
+    uint8_t ipcss;      // IP header start
+    uint8_t ipcso;      // IP checksum field
+    uint8_t tucss;      // TCP/UDP header start, IP header ends right before it
+    uint8_t tucso;      // TCP/UDP checksum field, pseudo header sum is already there
+    uint8_t hdrlen;     // TSO: bytes of headers repeated in every segment
+    uint16_t mss;       // TSO: TCP payload of every segment but the last
+};
+
+#define E1000_TX_CSUM_IP 0x01   // Insert IPv4 header checksum
+#define E1000_TX_CSUM_L4 0x02   // Insert TCP/UDP checksum
+#define E1000_TX_TSO     0x08   // Cut TCP payload into mss sized segments, needs both checksums;
+                                // pseudo header sum in the frame leaves out the length
+
+// Interface checksum capabilities, see e1000_csum_caps()
+#define E1000_CAP_CSUM_TX_IP 0x01   // NIC fills IPv4 header checksum
+#define E1000_CAP_CSUM_TX_L4 0x02   // NIC fills TCP/UDP checksum
+#define E1000_CAP_CSUM_RX    0x04   // NIC verifies received checksums
+#define E1000_CAP_TSO        0x08   // NIC does TCP segmentation
+
+// Piece of a frame, the NIC gathers all pieces into one packet.
+// A piece of a pool buffer (pb) is taken by DMA from where it lies,
+// the NIC holds a reference to the buffer until the frame is sent.
+// Other pieces are copied before e1000_transmit returns, so data that
+// should go without a copy is built in a pool buffer.
+struct tx_seg {
+    const void *addr;
+    uint16_t len;
+    struct pbuf *pb;
+};
+
+#define E1000_TX_MAX_SEGS 8   // Max pieces (and descriptors) per frame
+#define E1000_TX_RECLAIM_THRESH(ndesc) ((ndesc) / 4) // Reclaim TX ring below it
+#define E1000_TXQ_LEN     32    // Frames queued while TX ring is full
+#define E1000_TSO_MAX_SEGS 48   // Max pieces of a TSO frame, also bounded by ring depth
+#define E1000_TSO_MAX_LEN 65536 // TSO frame, Ethernet header included
+
 // RX Descriptor
 struct rx_desc {
     uint64_t buf_addr;
@@ -38,6 +97,20 @@ struct rx_desc {
 #define E1000_RAL           0x05400 // Receive Address Low - RW Array
 #define E1000_RAH           0x05404 // Receive Address High - RW Array
 
+// Interrupt Registers
+#define E1000_ICR  0x000C0  // Interrupt Cause Read - R/clr
+#define E1000_ITR  0x000C4  // Interrupt Throttling Rate - RW
+#define E1000_IMS  0x000D0  // Interrupt Mask Set - RW
+#define E1000_IMC  0x000D8  // Interrupt Mask Clear - WO
+
+// Interrupt Cause bits (same layout for ICR, IMS and IMC)
+#define E1000_ICR_TXDW   0x00000001 // Transmit desc written back
+#define E1000_ICR_LSC    0x00000004 // Link Status Change
+#define E1000_ICR_RXDMT0 0x00000010 // RX desc min. threshold reached
+#define E1000_ICR_RXO    0x00000040 // RX overrun
+#define E1000_ICR_RXT0   0x00000080 // RX timer intr (ring 0)
+#define E1000_ICR_RX     (E1000_ICR_RXT0 | E1000_ICR_RXDMT0 | E1000_ICR_RXO)
+
 // TX Descriptor Registers
 #define E1000_TIPG  0x00410 // Inter-packet Gap - RW
 #define E1000_TDBAL 0x03800 // Base Address Low - RW
@@ -56,6 +129,14 @@ struct rx_desc {
 #define E1000_TXD_STAT_DD 0x00000001    // Descriptor Done
 #define E1000_TXD_CMD_RS  0x08          // Report Status
 #define E1000_TXD_CMD_EOP 0x01          // End of Packet
+#define E1000_TXD_CMD_DEXT 0x20         // Descriptor extension (non-legacy)
+#define E1000_TXD_CMD_TSE 0x04          // TCP segmentation enable
+#define E1000_TXD_DTYP_D  0x10          // Data descriptor (in cso byte)
+#define E1000_TXD_POPTS_IXSM 0x01       // Insert IP checksum (in css byte)
+#define E1000_TXD_POPTS_TXSM 0x02       // Insert TCP/UDP checksum (in css byte)
+#define E1000_TXD_TUCMD_IP 0x02         // Context: packet is IPv4
+#define E1000_TXD_TUCMD_TCP 0x01        // Context: packet is TCP
+#define E1000_TXD_TUCMD_TSE 0x04        // Context: TCP segmentation
 
 // Rx Descriptor Registers
 #define E1000_RDBAL 0x02800 // Base Address Low - RW
@@ -63,25 +144,54 @@ struct rx_desc {
 #define E1000_RDLEN 0x02808 // Length - RW
 #define E1000_RDH   0x02810 // Head - RW
 #define E1000_RDT   0x02818 // Tail - RW
+#define E1000_RDTR  0x02820 // Delay Timer - RW
 #define E1000_MTA   0x5200  // Multicast Table Array - RW Array
+#define E1000_RXCSUM 0x05000 // RX Checksum Control - RW
+
+// Receive Checksum Control
+#define E1000_RXCSUM_IPOFL 0x00000100   // IPv4 checksum offload
+#define E1000_RXCSUM_TUOFL 0x00000200   // TCP/UDP checksum offload
 
 // Receive Control
 #define E1000_RCTL_EN  0x00000002   // Enable RX
+#define E1000_RCTL_LPE 0x00000020   // Long Packet Enable
 #define E1000_RCTL_BAM 0x00008000   // Broadcast Enable
+#define E1000_RCTL_BSEX 0x02000000  // Buffer Size Extension (BSIZE * 16)
 #define E1000_RCTL_CRC 0x04000000   // Strip Ethernet CRC
 
+// Receive buffer size, BSIZE field
+#define E1000_RCTL_SZ_2048  0x00000000  // BSEX = 0
+#define E1000_RCTL_SZ_16384 0x00010000  // BSEX = 1
+#define E1000_RCTL_SZ_8192  0x00020000  // BSEX = 1
+#define E1000_RCTL_SZ_4096  0x00030000  // BSEX = 1
+
 // RX Descriptor bit definitions
 #define E1000_RXD_STAT_DD  0x01 // Descriptor Done
 #define E1000_RXD_STAT_EOP 0x02 // End of Packet
+#define E1000_RXD_STAT_IXSM 0x04 // Ignore checksum indication
+#define E1000_RXD_STAT_TCPCS 0x20 // TCP/UDP checksum calculated
+#define E1000_RXD_STAT_IPCS 0x40 // IP checksum calculated
+#define E1000_RXD_ERR_TCPE  0x20 // TCP/UDP checksum error
+#define E1000_RXD_ERR_IPE   0x40 // IP checksum error
 
 int e1000_attach(struct pci_func *pcif);
 
-int e1000_transmit(const char *buf, uint16_t len);
+int e1000_transmit(const struct tx_seg *segs, int nsegs, const struct tx_csum *csum);
+int e1000_tso_max_segs(void);
 int e1000_timeout_transmit(double timeout);
+void e1000_tx_batch_begin(void);
+void e1000_tx_batch_end(void);
 
 void e1000_listen(void);
 int e1000_timeout_listen(double timeout);
 
-int e1000_receive(char *buf);
+int e1000_receive(char *buf, size_t size);
+int e1000_receive_pbuf(struct pbuf *pb);
+
+bool e1000_rx_ready(void);
+uint32_t e1000_csum_caps(void);
+void e1000_wait_receive(void);
+void e1000_env_free(envid_t envid);
+void e1000_intr(void);
 
 #endif // JOS_KERN_E1000_H
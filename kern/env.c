@@ -8,6 +8,7 @@
 #include <inc/elf.h>
 #include <inc/vsyscall.h>
 
+#include <kern/e1000.h>
 #include <kern/env.h>
 #include <kern/kdebug.h>
 #include <kern/macro.h>
@@ -225,6 +226,9 @@ env_alloc(struct Env **newenv_store, envid_t parent_id, enum EnvType type) {
     /* Also clear the IPC receiving flag. */
     env->env_ipc_recving = 0;
 
+    /* Not waiting for any device either. */
+    env->env_irq_waiting = 0;
+
     /* Commit the allocation */
     env_free_list = env->env_link;
     *newenv_store = env;
@@ -583,6 +587,11 @@ env_free(struct Env *env) {
     release_address_space(&env->address_space);
 #endif
 
+    /* A dead environment no longer waits for an interrupt,
+     * otherwise sched_halt() would keep counting it */
+    env->env_irq_waiting = 0;
+    e1000_env_free(env->env_id);
+
     /* Return the environment to the free list */
     env->env_status = ENV_FREE;
     env->env_link = env_free_list;
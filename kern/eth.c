@@ -1,90 +1,232 @@
 #include <kern/e1000.h>
 #include <kern/eth.h>
+#include <kern/netif.h>
 #include <inc/string.h>
 #include <kern/inet.h>
 #include <inc/error.h>
 #include <inc/assert.h>
 #include <kern/arp.h>
 #include <kern/ip.h>
+#include <kern/tcp.h>
 #include <kern/traceopt.h>
 
 // 10:00:00:11:11:11
 static const uint8_t qemu_mac[6] = {0x10, 0x00, 0x00, 0x11, 0x11, 0x11};
 
+struct net_drop_stats net_drops;
+
+// Interfaces frames are taken from, in this order
+static const struct netif_ops *const netifs[] = {&e1000_netif, &loopback_netif};
+
 const uint8_t *
 get_my_mac(void) {
     return qemu_mac;
 }
 
+/**
+ * Интерфейс, через который уходят кадры на адрес ip: свои адреса
+ * (127.0.0.0/8 и MY_IP) замыкаются на себя, остальное идёт в сеть.
+ */
+const struct netif_ops *
+netif_route(uint32_t ip) {
+    return IP_IS_LOOPBACK(ip) || ip == MY_IP ? &loopback_netif : &e1000_netif;
+}
+
+/**
+ * Какие check-суммы досчитает интерфейс на пути к ip (E1000_CAP_*)
+ */
+uint32_t
+netif_csum_caps(uint32_t ip) {
+    return netif_route(ip)->csum_caps();
+}
+
+bool
+netif_rx_ready(void) {
+    for (size_t i = 0; i < sizeof(netifs) / sizeof(*netifs); i++) {
+        if (netifs[i]->rx_ready()) return true;
+    }
+    return false;
+}
+
 /**
  * @brief
- * Функция, которая упаковывает в один пакет слои: уровень Ethernet, уровень IP
+ * Функция, которая упаковывает в один пакет слои: уровень Ethernet, уровень IP.
+ * Кадр не собирается в промежуточном буфере: заголовок Ethernet и куски
+ * верхних уровней отдаются карте как есть, она соберёт их сама (scatter-gather).
  *
  * @param hdr указатель на фрейм Ethernet
- * @param data указатель на фрейм IP ИЛИ ARP
- * @param len число байт фрейма IP или ARP
+ * @param segs куски фрейма IP ИЛИ ARP, первым идёт заголовок
+ * @param nsegs число кусков
+ * @param csum check-суммы, которые досчитает карта (смещения от начала
+ *             фрейма IP), или NULL; с E1000_TX_TSO фрейм может быть
+ *             больше MTU, карта сама нарежет его на сегменты
  * 
  * @return возвращает статус отправки. Если статус отрицатен - отправка неудачна,
  *         так как очередь на сетевой карте уже заполнена.
  */
 int
-eth_send(struct eth_hdr *hdr, void *data, size_t len) {
+eth_sendv(struct eth_hdr *hdr, const struct tx_seg *segs, int nsegs, const struct tx_csum *csum) {
     if (trace_packet_processing) cprintf("Sending Ethernet packet\n");
-    assert(len <= ETH_MAX_PACKET_SIZE - sizeof(struct eth_hdr));
+    bool tso = csum && (csum->flags & E1000_TX_TSO);
+    assert(nsegs > 0 && nsegs < (tso ? E1000_TSO_MAX_SEGS : E1000_TX_MAX_SEGS));
 
-    char buf[ETH_MAX_PACKET_SIZE + 1];
+    struct tx_seg v[E1000_TSO_MAX_SEGS];
+    size_t len = 0;
+    for (int i = 0; i < nsegs; i++) {
+        v[i + 1] = segs[i];
+        len += segs[i].len;
+    }
+    assert(len <= (tso ? E1000_TSO_MAX_LEN : ETH_MAX_PACKET_SIZE) - sizeof(struct eth_hdr));
 
+    const struct netif_ops *netif = &e1000_netif;
     if (hdr->eth_type == JHTONS(ETH_TYPE_IP)) {
-        struct ip_hdr *ip_header = &((struct ip_pkt *)data)->hdr;
-        uint8_t *dmac = get_mac_by_ip(ip_header->ip_destination_address);
+        const struct ip_hdr *ip_header = segs[0].addr;
+        netif = netif_route(JNTOHL(ip_header->ip_destination_address));
+        const uint8_t *dmac = netif == &loopback_netif ? get_my_mac() :
+                                                         get_mac_by_ip(ip_header->ip_destination_address);
         if (dmac == NULL) {
-            memset(hdr->eth_destination_mac, 0, 6);
-        } else {
-            memcpy(hdr->eth_destination_mac, get_mac_by_ip(ip_header->ip_destination_address), 6);
+            // frame waits for the ARP reply of its destination
+            return arp_queue(ip_header->ip_destination_address, segs, nsegs, csum);
         }
+        memcpy(hdr->eth_destination_mac, dmac, 6);
     }
     hdr->eth_type = htons(hdr->eth_type);
-    memcpy((void *)buf, (void *)hdr, sizeof(struct eth_hdr));
-    memcpy((void *)buf + sizeof(struct eth_hdr), data, len);
     memcpy((void *)hdr->eth_source_mac, get_my_mac(), sizeof(hdr->eth_source_mac));
 
-    // len - data length
-    return e1000_transmit(buf, len + sizeof(struct eth_hdr));
+    v[0].addr = hdr;
+    v[0].len = sizeof(struct eth_hdr);
+    v[0].pb = NULL;
+
+    // header goes into the headroom of a pool buffer, the frame stays one piece
+    struct tx_seg *frame = v;
+    if (pbuf_headroom(segs[0].pb, segs[0].addr) >= sizeof(struct eth_hdr)) {
+        uint8_t *room = (uint8_t *)segs[0].addr - sizeof(struct eth_hdr);
+        memcpy(room, hdr, sizeof(struct eth_hdr));
+        frame = &v[1];
+        frame->addr = room;
+        frame->len += sizeof(struct eth_hdr);
+    }
+
+    // NIC counts offsets from the start of the frame
+    struct tx_csum frame_csum;
+    if (csum) {
+        frame_csum = *csum;
+        frame_csum.ipcss += sizeof(struct eth_hdr);
+        frame_csum.ipcso += sizeof(struct eth_hdr);
+        frame_csum.tucss += sizeof(struct eth_hdr);
+        frame_csum.tucso += sizeof(struct eth_hdr);
+        if (tso) frame_csum.hdrlen += sizeof(struct eth_hdr);
+    }
+    return netif->transmit(frame, nsegs + 1 - (frame - v), csum ? &frame_csum : NULL);
+}
+
+/**
+ * @brief
+ * Отправка кадра, нагрузка которого лежит одним куском.
+ *
+ * @param hdr указатель на фрейм Ethernet
+ * @param data указатель на фрейм IP ИЛИ ARP
+ * @param len число байт фрейма IP или ARP
+ */
+int
+eth_send(struct eth_hdr *hdr, void *data, size_t len) {
+    struct tx_seg seg = {data, len};
+    return eth_sendv(hdr, &seg, 1, NULL);
 }
 
 /**
  * @brief
  * Функция, возвращающая определяющая тип входящих данных, по принадлежности к протоколу,
- * и запускающая процесс обработки данных. 
- * 
- * @param data указатель на заготовку для фрейма IP или ARP
- * 
+ * и запускающая процесс обработки данных. Кадр не копируется: заголовки разбираются
+ * прямо в буфере pb, который остаётся у вызывающего.
+ *
+ * @param pb принятый кадр Ethernet
+ *
  * @return возвращает количество байт прочитанного фрейма arp или ip, если обработка прошла успешно,
  *         иначе возвращает отрицательный результат.
  */
 int
-eth_recieve(void *data) {
-    char buf[ETH_MAX_PACKET_SIZE + 1];
-    struct eth_hdr hdr = {};
+eth_deliver(struct pbuf *pb) {
+    if (trace_packet_processing) cprintf("Processing Ethernet packet\n");
+    if (trace_packets) {
+        cprintf("received packet: ");
+        for (size_t i = 0; i < pb->len; i++) {
+            cprintf("%x ", pb->data[i]);
+        }
+        cprintf("\n");
+    }
+
+    struct eth_hdr *hdr = pbuf_pull(pb, sizeof(struct eth_hdr));
+    if (!hdr) {
+        net_drops.eth++;
+        return -E_BAD_ETH_TYPE;
+    }
+    // ip or arp frame - payload, handlers parse it in place
+    uint16_t type = JNTOHS(hdr->eth_type);
+    if (type == ETH_TYPE_IP) {
+        // IP and the protocols above count their own drops
+        return ip_recv((struct ip_pkt *)pb->data, pb->len, pb->csum) >= 0 ? (int)pb->len : -E_BAD_ETH_TYPE;
+    }
+    if (type == ETH_TYPE_ARP) {
+        if (arp_resolve(pb->data) >= 0) return pb->len;
+        net_drops.arp++;
+    } else {
+        net_drops.eth++;
+    }
+    return -E_BAD_ETH_TYPE;
+}
+
+/**
+ * Берёт кадр из очереди интерфейса netif и обрабатывает его
+ */
+static int
+eth_input(const struct netif_ops *netif) {
+    struct pbuf pb = {};
     // достаём очередной пакет из очереди
-    int size = e1000_receive(buf);
+    int size = netif->receive(&pb);
     if (size <= 0) {
         return size;
     }
 
-    if (trace_packet_processing) cprintf("Processing Ethernet packet\n");
-
-    // ethernet frame filling
-    memcpy((void *)&hdr, (void *)buf, sizeof(struct eth_hdr));
-    hdr.eth_type = JNTOHS(hdr.eth_type);
-    // ip or arp frame filling - payload
-    memcpy(data, (void *)buf + sizeof(struct eth_hdr), size);
+    int res = eth_deliver(&pb);
+    // handlers keep no references to the frame, recycle the descriptor
+    pbuf_release(&pb);
+    return res;
+}
 
-    if ((hdr.eth_type == ETH_TYPE_IP && ip_recv(data) >= 0)    ||
-        (hdr.eth_type == ETH_TYPE_ARP && arp_resolve(data) >= 0))
-    {
-        return size;
-    } else {
-        return -E_BAD_ETH_TYPE;
+/**
+ * Обрабатывает кадр первого интерфейса, у которого он есть
+ */
+int
+eth_recieve(void) {
+    for (size_t i = 0; i < sizeof(netifs) / sizeof(*netifs); i++) {
+        if (netifs[i]->rx_ready()) return eth_input(netifs[i]);
     }
+    return 0;
+}
+
+/**
+ * Обрабатывает кадры, которые стек отправил сам себе. Вызывается там,
+ * где стек не занят другим пакетом: после запроса сетевого сервера и
+ * по таймеру, когда цикл приёма спит в ожидании карты.
+ */
+void
+eth_poll(void) {
+    if (!loopback_netif.rx_ready()) return;
+
+    e1000_tx_batch_begin();
+    do {
+        while (loopback_netif.rx_ready()) {
+            eth_input(&loopback_netif);
+        }
+        tcp_flush_acks();
+    } while (loopback_netif.rx_ready());
+    e1000_tx_batch_end();
+}
+
+void
+net_print_drops(void) {
+    cprintf("received and dropped: eth %lu, arp %lu, ip %lu, icmp %lu, udp %lu, tcp %lu\n",
+            (unsigned long)net_drops.eth, (unsigned long)net_drops.arp, (unsigned long)net_drops.ip,
+            (unsigned long)net_drops.icmp, (unsigned long)net_drops.udp, (unsigned long)net_drops.tcp);
 }
@@ -10,9 +10,27 @@ struct eth_hdr {
     uint16_t eth_type;
 } __attribute__((packed));
 
+struct pbuf;
+
+// Received packets each layer refused, for the monitor
+struct net_drop_stats {
+    uint64_t eth;
+    uint64_t arp;
+    uint64_t ip;
+    uint64_t icmp;
+    uint64_t udp;
+    uint64_t tcp;
+};
+
+extern struct net_drop_stats net_drops;
+
 const uint8_t *get_my_mac(void);
 int eth_send(struct eth_hdr* hdr, void* data, size_t len);
-int eth_recieve(void* data);
+int eth_sendv(struct eth_hdr* hdr, const struct tx_seg* segs, int nsegs, const struct tx_csum* csum);
+int eth_recieve(void);
+int eth_deliver(struct pbuf *pb);
+void eth_poll(void);
+void net_print_drops(void);
 
 #define ETH_MAX_PACKET_SIZE 1500
 #define ETH_HEADER_LEN sizeof(struct eth_hdr)
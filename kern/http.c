@@ -1,53 +1,187 @@
 #include <inc/stdio.h>
 #include <inc/string.h>
+#include <inc/error.h>
+#include <inc/time.h>
+#include <inc/vsyscall.h>
+#include <kern/env.h>
 #include <kern/tcp.h>
+#include <kern/tcp_cc.h>
+#include <kern/netif.h>
 #include <kern/http.h>
+#include <kern/pbuf.h>
+#include <kern/slab.h>
+#include <kern/timer.h>
 #include <kern/traceopt.h>
+#include <kern/vsyscall.h>
+#include <stdatomic.h>
 
-static const char *OK_page = "<!DOCTYPE html>\n<html><body><h1>Hello from JOS!</h1></body></html>";
+/* Files are read by a helper of the network server (net/serv.c): a
+ * request for a file not in the cache puts it on the miss queue, the
+ * helper takes the path with NSREQ_HTTP_MISS and brings the file back
+ * in parts with NSREQ_HTTP_FILL. Connections wait on the object and
+ * get their reply once the last part arrives. While the queue is empty
+ * the helper sleeps in the kernel and is woken by the next miss. */
+
+static struct http_object http_cache[HTTP_CACHE_NUM];
+static struct http_object *http_hash[HTTP_HASH_SIZE];
+static struct http_object *http_lru_head;
+static struct http_object *http_lru_tail;
+static struct http_object *http_miss_head;
+static struct http_object *http_miss_tail;
+// helper sleeping in http_miss() until a file is missed
+static envid_t http_helper;
+
+static struct http_stats http_stats;
+static struct slab_cache http_parser_cache;
+
+/* Response headers are put together from pieces rendered at compile
+ * time, their lengths included: the status line, the Date line with the
+ * date of the current second, Content-Type and Content-Length with the
+ * digits of the length. */
+
+struct http_tmpl {
+    const char *str;
+    uint8_t len;
+};
+
+#define HTTP_TMPL(s) {s, sizeof(s) - 1}
+
+// End of the response header for each HTTP_CONN_*
+static const struct http_tmpl http_conn_end[] = {
+        [HTTP_CONN_KEEP] = HTTP_TMPL("\r\n"),
+        [HTTP_CONN_KEEP_ALIVE] = HTTP_TMPL("Connection: keep-alive\r\n\r\n"),
+        [HTTP_CONN_CLOSE] = HTTP_TMPL("Connection: close\r\n\r\n"),
+};
+
+#define HTTP_STATUS(code, reason) {code, #code " " reason, HTTP_TMPL(HTTP_VER " " #code " " reason "\r\n")}
+
+static const struct http_status {
+    uint16_t code;
+    const char *message;
+    struct http_tmpl line;
+} http_statuses[] = {
+        HTTP_STATUS(200, "OK"),
+        HTTP_STATUS(400, "Bad Request"),
+        HTTP_STATUS(404, "Not Found"),
+        HTTP_STATUS(405, "Method Not Allowed"),
+        HTTP_STATUS(413, "Payload Too Large"),
+        HTTP_STATUS(414, "URI Too Long"),
+        HTTP_STATUS(431, "Request Header Fields Too Large"),
+        HTTP_STATUS(500, "Internal Server Error"),
+        HTTP_STATUS(501, "Not Implemented"),
+        HTTP_STATUS(503, "Service Unavailable"),
+        HTTP_STATUS(505, "HTTP Version Not Supported"),
+        // the last one stands for codes not in the table
+        HTTP_STATUS(520, "Unknown Error"),
+};
+
+#define HTTP_TYPE(ext, type) {ext, type, HTTP_TMPL("Content-Type: " type "\r\n")}
+
+// HTTP_TYPE_HTML is the first, files of unknown types take the last one
+static const struct {
+    const char *ext;
+    const char *type;
+    struct http_tmpl line;
+} http_types[] = {
+        HTTP_TYPE(".html", "text/html"),
+        HTTP_TYPE(".htm", "text/html"),
+        HTTP_TYPE(".txt", "text/plain"),
+        HTTP_TYPE(".css", "text/css"),
+        HTTP_TYPE(".js", "application/javascript"),
+        HTTP_TYPE(".png", "image/png"),
+        HTTP_TYPE(".jpg", "image/jpeg"),
+        HTTP_TYPE(".gif", "image/gif"),
+        HTTP_TYPE(".ico", "image/x-icon"),
+        HTTP_TYPE(NULL, "application/octet-stream"),
+};
+
+#define HTTP_TYPE_TEXT 2
+#define HTTP_TYPE_NUM (int)(sizeof(http_types) / sizeof(*http_types))
+
+static const char http_date_name[] = "Date: ";
+static const char http_length_name[] = "Content-Length: ";
+
+// Date of the current second, redone when the second changes
+static char http_date[HTTP_DATE_LEN + 1];
+static uint64_t http_date_time = ~0ULL;
+
+static const struct http_status *
+http_status(int code) {
+    size_t i = 0;
+    while (i < sizeof(http_statuses) / sizeof(*http_statuses) - 1 && http_statuses[i].code != code) {
+        i++;
+    }
+    return &http_statuses[i];
+}
 
 /**
- * Функция-парсер HTTP-запроса 
+ * Обновляет http_date по часам, которые обработчик таймера кладёт в vsys
  */
-int
-http_parse(char *data, size_t length, char *reply, size_t *reply_len) {
-    if (trace_packet_processing) cprintf("Parsing HTTP request\n");
-
-    struct HTTP_hdr hdr = {};
-    char *word_start = data;
-    size_t word_len = 0;
-    for (int i = 0; i <= length; i++) {
-        if (data[i] == ' ' || data[i] == '\n' || i == length) {
-            word_len = data + i - word_start;
-            if (!hdr.method.start) {
-                if (strncmp(word_start, HTTP_METHOD, strlen(HTTP_METHOD))) {
-                    cprintf("Only %s requests are supported!\n", HTTP_METHOD);
-                    return http_reply(400, NULL, reply, reply_len);
-                }
-                hdr.method.start = word_start;
-                hdr.method.length = word_len;
-            } else if (!hdr.URI.start) {
-                hdr.URI.start = word_start;
-                hdr.URI.length = word_len;
-            } else if (!hdr.HTTP_version.start) {
-                // По этой причине мы можем отправлять только пакеты по HTTP/1, используя TCP
-                if (strncmp(word_start, HTTP_VER, strlen(HTTP_VER)) && strncmp(word_start, HTTP_VER_COMPATIBLE, strlen(HTTP_VER_COMPATIBLE))) {
-                    cprintf("Only %s and %s are supported!\n", HTTP_VER, HTTP_VER_COMPATIBLE);
-                    return http_reply(505, NULL, reply, reply_len);
-                }
-                hdr.HTTP_version.start = word_start;
-                hdr.HTTP_version.length = word_len;
-                break;
-            }
-            word_start += word_len + 1;
-        }
-    }
-    if (!hdr.HTTP_version.start) {
-        cprintf("HTTP header incomplete!\n");
-        return http_reply(400, NULL, reply, reply_len);
+static void
+http_date_update(void) {
+    static const char days[][4] = {"Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed"};
+    static const char months[][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                     "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    uint64_t now = atomic_load_explicit(&vsys[VSYS_gettime], memory_order_relaxed);
+    if (now == http_date_time) {
+        return;
     }
-    // подготавливает ответ. А TCP его отправит
-    return http_reply(200, OK_page, reply, reply_len);
+
+    struct tm tm;
+    mktime((int)now, &tm);
+    // 1 January 1970 was a Thursday
+    snprintf(http_date, sizeof(http_date), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+             days[now / DAY % 7], tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900,
+             tm.tm_hour, tm.tm_min, tm.tm_sec);
+    http_date_time = now;
+}
+
+/**
+ * Собирает в buf (HTTP_HDR_MAX байт) заголовок ответа с кодом code на
+ * тело длины length и типа type без окончания: его выбирает http_conn_end
+ * для каждого ответа. Возвращает длину заголовка.
+ */
+size_t
+http_render_hdr(int code, int type, size_t length, char *buf) {
+    const struct http_status *status = http_status(code);
+    const struct http_tmpl *type_line = &http_types[type].line;
+    char digits[20];
+    size_t n = sizeof(digits);
+
+    do {
+        digits[--n] = '0' + length % 10;
+        length /= 10;
+    } while (length);
+    http_date_update();
+
+    char *p = buf;
+    memcpy(p, status->line.str, status->line.len);
+    p += status->line.len;
+    memcpy(p, http_date_name, sizeof(http_date_name) - 1);
+    p += sizeof(http_date_name) - 1;
+    memcpy(p, http_date, HTTP_DATE_LEN);
+    p += HTTP_DATE_LEN;
+    memcpy(p, "\r\n", 2);
+    p += 2;
+    memcpy(p, type_line->str, type_line->len);
+    p += type_line->len;
+    memcpy(p, http_length_name, sizeof(http_length_name) - 1);
+    p += sizeof(http_length_name) - 1;
+    memcpy(p, digits + n, sizeof(digits) - n);
+    p += sizeof(digits) - n;
+    memcpy(p, "\r\n", 2);
+    return p + 2 - buf;
+}
+
+/**
+ * То же через snprintf, образец для сравнения в мониторе
+ */
+size_t
+http_render_hdr_ref(int code, int type, size_t length, char *buf) {
+    http_date_update();
+    int n = snprintf(buf, HTTP_HDR_MAX, "%s %s\r\nDate: %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n",
+                     HTTP_VER, http_status(code)->message, http_date, http_types[type].type, length);
+    return MIN((size_t)n, HTTP_HDR_MAX - 1);
 }
 
 /**
@@ -58,56 +192,840 @@ int
 http_reply(int code, const char *page, char *reply, size_t *reply_len) {
     if (trace_packet_processing) cprintf("Creating HTTP reply\n");
 
-    static const char *messages[600] = {};
-    if (!messages[200]) { // first init
-        messages[200] = "200 OK";
-        messages[400] = "400 Bad Request";
-        messages[404] = "404 Not Found";
-        messages[505] = "505 HTTP Version Not Supported";
-        messages[520] = "520 Unknown Error";
-    }
-    if (code < 100 || code >= 600 || !messages[code]) {
-        code = 520;
-    }
-
-    char *cur_pos = reply;
-    memcpy(cur_pos, HTTP_VER, strlen(HTTP_VER));
-    cur_pos += strlen(HTTP_VER);
-    *cur_pos = ' ';
-    cur_pos++;
-    memcpy(cur_pos, messages[code], strlen(messages[code]));
-    cur_pos += strlen(messages[code]);
-
-    char type_field[] = "\nContent-Type: text/html\n";
-    memcpy(cur_pos, type_field, sizeof(type_field) - 1);
-    cur_pos += sizeof(type_field) - 1;
-
-    if (page) {
-        char length_field[] = "Content-Length: ";
-        memcpy(cur_pos, length_field, sizeof(length_field) - 1);
-        cur_pos += sizeof(length_field) - 1;
-
-        size_t page_len = page ? strlen(page) : 0;
-        char page_len_text[10] = {};
-        int page_len_text_start = 9;
-        for (page_len_text_start = 9; page_len_text_start >= 0 && page_len > 0; page_len_text_start--) {
-            page_len_text[page_len_text_start] = page_len % 10 + '0';
-            page_len /= 10;
+    size_t page_len = page ? strlen(page) : 0;
+    size_t len = http_render_hdr(code, HTTP_TYPE_HTML, page_len, reply);
+    memcpy(reply + len, http_conn_end[HTTP_CONN_CLOSE].str, http_conn_end[HTTP_CONN_CLOSE].len);
+    len += http_conn_end[HTTP_CONN_CLOSE].len;
+    memcpy(reply + len, page, page_len);
+    reply[len + page_len] = '\0';
+    *reply_len = len + page_len;
+    return 0;
+}
+
+/**
+ * Тип содержимого по расширению файла. Файлы без расширения
+ * (motd, lorem) считаются текстом.
+ */
+static int
+http_content_type(const char *path) {
+    const char *ext = NULL;
+    for (; *path; path++) {
+        if (*path == '/') ext = NULL;
+        if (*path == '.') ext = path;
+    }
+    if (!ext) {
+        return HTTP_TYPE_TEXT;
+    }
+    int i = 0;
+    while (i < HTTP_TYPE_NUM - 1 && strcmp(ext, http_types[i].ext)) {
+        i++;
+    }
+    return i;
+}
+
+/**
+ * Путь файла по URI: без строки запроса, каталог - его HTTP_INDEX.
+ * Возвращает 0 или код ответа с ошибкой.
+ */
+static int
+http_uri_path(const struct str_part *uri, char *path) {
+    size_t len = 0;
+    while (len < uri->length && uri->start[len] != '?') {
+        len++;
+    }
+    if (!len || uri->start[0] != '/') {
+        return 400;
+    }
+    size_t index_len = uri->start[len - 1] == '/' ? strlen(HTTP_INDEX) : 0;
+    if (len + index_len >= HTTP_PATH_MAX) {
+        return 414;
+    }
+    memcpy(path, uri->start, len);
+    memcpy(path + len, HTTP_INDEX, index_len);
+    path[len + index_len] = '\0';
+
+    // the file server has no notion of a root to escape, still refuse to walk up
+    for (const char *p = path; (p = strchr(p, '/')); p++) {
+        if (p[1] == '.' && p[2] == '.' && (p[3] == '/' || !p[3])) return 400;
+    }
+    return 0;
+}
+
+/**
+ * Номер корзины для пути (FNV-1a)
+ */
+static uint32_t
+http_hash_fn(const char *path) {
+    uint32_t hash = 2166136261u;
+    for (; *path; path++) {
+        hash = (hash ^ (uint8_t)*path) * 16777619u;
+    }
+    return hash & (HTTP_HASH_SIZE - 1);
+}
+
+static struct http_object *
+http_lookup(const char *path) {
+    struct http_object *obj = http_hash[http_hash_fn(path)];
+    while (obj && strcmp(obj->path, path)) {
+        obj = obj->hash_next;
+    }
+    return obj;
+}
+
+static void
+http_lru_unlink(struct http_object *obj) {
+    if (obj->lru_prev) {
+        obj->lru_prev->lru_next = obj->lru_next;
+    } else {
+        http_lru_head = obj->lru_next;
+    }
+    if (obj->lru_next) {
+        obj->lru_next->lru_prev = obj->lru_prev;
+    } else {
+        http_lru_tail = obj->lru_prev;
+    }
+    obj->lru_prev = obj->lru_next = NULL;
+}
+
+static void
+http_lru_push(struct http_object *obj) {
+    obj->lru_prev = NULL;
+    obj->lru_next = http_lru_head;
+    if (http_lru_head) {
+        http_lru_head->lru_prev = obj;
+    } else {
+        http_lru_tail = obj;
+    }
+    http_lru_head = obj;
+}
+
+/**
+ * Освобождает объект вместе с телом. Ждущих его соединений нет.
+ */
+static void
+http_obj_free(struct http_object *obj) {
+    struct http_object **link = &http_hash[http_hash_fn(obj->path)];
+    while (*link != obj) {
+        link = &(*link)->hash_next;
+    }
+    *link = obj->hash_next;
+
+    if (!obj->requested) {
+        // still on the miss queue
+        struct http_object *prev = NULL;
+        for (link = &http_miss_head; *link != obj; link = &(*link)->miss_next) {
+            prev = *link;
         }
-        page_len_text_start++;
-        memcpy(cur_pos, page_len_text + page_len_text_start, 10 - page_len_text_start);
-        cur_pos += (10 - page_len_text_start);
-
-        *cur_pos = '\n'; cur_pos++;
-        *cur_pos = '\n'; cur_pos++;
-        memcpy(cur_pos, page, strlen(page));
-        cur_pos += strlen(page);
+        *link = obj->miss_next;
+        if (http_miss_tail == obj) http_miss_tail = prev;
+    }
+    if (obj->ready) {
+        http_lru_unlink(obj);
+        http_stats.cached_bytes -= obj->size;
+        http_stats.nr_cached--;
+    }
+    while (obj->body) {
+        struct pbuf *pb = obj->body;
+        obj->body = pb->next;
+        pbuf_release(pb);
+    }
+    obj->used = false;
+}
+
+/**
+ * Заводит объект для пути и ставит его в очередь к помощнику. Если
+ * свободных нет, вытесняется тот, к которому дольше всех не обращались.
+ */
+static struct http_object *
+http_obj_alloc(const char *path) {
+    struct http_object *obj = NULL;
+    for (int i = 0; i < HTTP_CACHE_NUM; i++) {
+        if (!http_cache[i].used) {
+            obj = &http_cache[i];
+            break;
+        }
+    }
+    if (!obj) {
+        // objects being read are not on the LRU list
+        if (!(obj = http_lru_tail)) return NULL;
+        http_obj_free(obj);
+        http_stats.evictions++;
+    }
+
+    memset(obj, 0, sizeof(*obj));
+    obj->used = true;
+    strcpy(obj->path, path);
+
+    uint32_t bucket = http_hash_fn(path);
+    obj->hash_next = http_hash[bucket];
+    http_hash[bucket] = obj;
+
+    if (http_miss_tail) {
+        http_miss_tail->miss_next = obj;
     } else {
-        char length_field[] = "\nContent-Length: 0";
-        memcpy(cur_pos, length_field, sizeof(length_field) - 1);
-        cur_pos += sizeof(length_field) - 1;
+        http_miss_head = obj;
+    }
+    http_miss_tail = obj;
+
+    struct Env *env;
+    if (http_helper && !envid2env(http_helper, &env, 0) && env->env_status == ENV_NOT_RUNNABLE) {
+        env->env_status = ENV_RUNNABLE;
+    }
+    http_helper = 0;
+    return obj;
+}
+
+/**
+ * Ставит в очередь отправки следующие куски тела ответа, пока в ней
+ * остаётся место (TCP_SNDBUF_MAX), и отправляет её. Остальное ждёт,
+ * пока ACK освободят очередь: http_serve() зовётся на каждый сегмент.
+ * После последнего куска с HTTP_CONN_CLOSE уходит FIN.
+ */
+static int
+http_push(struct tcp_virtual_channel *vc) {
+    struct pbuf *pb;
+    int rc = 0;
+
+    while (!rc && (pb = vc->http_body) && pb->len <= tcp_sndbuf_space(vc)) {
+        vc->http_body = pb->next;
+        rc = tcp_queue(vc, pb->data, pb->len, vc->http_body ? 0 : TH_PSH);
+        pbuf_release(pb);
+    }
+    tcp_push(vc);
+    if (rc < 0 || vc->http_body) {
+        return rc;
+    }
+    return vc->http_conn == HTTP_CONN_CLOSE ? tcp_close(vc) : 0;
+}
+
+/**
+ * Отправляет ответ: заголовок hdr и его окончание по conn сразу,
+ * тело body - из буферов пула объекта по мере того, как освобождается
+ * очередь отправки, так что файл в несколько мегабайт не занимает пул
+ * целиком. Соединение держит ссылки на ещё не отправленные куски,
+ * объект тем временем может быть вытеснен.
+ */
+static int
+http_send(struct tcp_virtual_channel *vc, const char *hdr, size_t hdr_len,
+          struct pbuf *body, int conn) {
+    const struct http_tmpl *end = &http_conn_end[conn];
+
+    int rc = tcp_queue(vc, hdr, hdr_len, 0);
+    if (!rc) {
+        rc = tcp_queue(vc, end->str, end->len, body ? 0 : TH_PSH);
+    }
+    if (rc < 0) {
+        return rc;
+    }
+
+    for (struct pbuf *pb = body; pb; pb = pb->next) {
+        pbuf_ref(pb);
+    }
+    vc->http_body = body;
+    vc->http_conn = conn;
+    return http_push(vc);
+}
+
+/**
+ * Ответ без тела. После ошибки в самом запросе соединение закрывается:
+ * неясно, где в потоке начинается следующий.
+ */
+static int
+http_send_status(struct tcp_virtual_channel *vc, int code, int conn) {
+    static const char allow[] = "Allow: GET, HEAD\r\n";
+    char hdr[HTTP_HDR_MAX];
+
+    size_t hdr_len = http_render_hdr(code, HTTP_TYPE_HTML, 0, hdr);
+    if (code == 405 && hdr_len + sizeof(allow) <= sizeof(hdr)) {
+        memcpy(hdr + hdr_len, allow, sizeof(allow) - 1);
+        hdr_len += sizeof(allow) - 1;
+    }
+    return http_send(vc, hdr, hdr_len, NULL, conn);
+}
+
+/**
+ * Ответ файлом, на HEAD - только его заголовок. Заголовок собран один
+ * раз, в нём лишь обновляется дата.
+ */
+static int
+http_send_object(struct tcp_virtual_channel *vc, struct http_object *obj, int conn) {
+    http_date_update();
+    if (obj->hdr_time != http_date_time) {
+        memcpy(obj->hdr + obj->hdr_date, http_date, HTTP_DATE_LEN);
+        obj->hdr_time = http_date_time;
+    }
+    return http_send(vc, obj->hdr, obj->hdr_len, vc->http_head ? NULL : obj->body, conn);
+}
+
+/**
+ * Отвечает ждущим объект соединениям: code 200 - самим файлом, иначе
+ * ошибкой. Возвращает список этих соединений, чтобы после того, как
+ * объект будет сохранён или забыт, обслужить их следующие запросы.
+ * Соединение, ответ которому не встал в очередь, обрывается и в список
+ * не попадает.
+ */
+static struct tcp_virtual_channel *
+http_obj_reply(struct http_object *obj, int code) {
+    struct tcp_virtual_channel *vc = obj->waiters, *next, *served = NULL;
+    obj->waiters = NULL;
+
+    for (; vc; vc = next) {
+        next = vc->http_next;
+        vc->http_wait = NULL;
+        int rc = code == 200 ? http_send_object(vc, obj, vc->http_conn) :
+                               http_send_status(vc, code, code == 404 ? vc->http_conn : HTTP_CONN_CLOSE);
+        if (rc < 0) {
+            // a cut reply must not pass for a whole one
+            tcp_abort(vc);
+            continue;
+        }
+        vc->http_next = served;
+        served = vc;
+    }
+    return served;
+}
+
+/**
+ * Обслуживает запросы, которые ждали в конвейере за отвеченным.
+ * Соединение, которому не удалось ответить, http_serve() обрывает.
+ */
+static void
+http_resume(struct tcp_virtual_channel *waiters) {
+    struct tcp_virtual_channel *vc, *next;
+
+    // a connection may wait for another object or be freed after this, next is taken first
+    for (vc = waiters; vc; vc = next) {
+        next = vc->http_next;
+        http_serve(vc);
+    }
+}
+
+/**
+ * Отвечает ждущим соединениям ошибкой и забывает объект
+ */
+static void
+http_obj_fail(struct http_object *obj, int code) {
+    if (code == 404) {
+        http_stats.not_found++;
+    } else {
+        http_stats.errors++;
+    }
+    struct tcp_virtual_channel *waiters = http_obj_reply(obj, code);
+    http_obj_free(obj);
+    http_resume(waiters);
+}
+
+/**
+ * Файл прочитан: заголовок собирается один раз, ждущие получают ответ,
+ * объект остаётся в кэше, если вытеснением старых для него найдётся место.
+ */
+static void
+http_obj_complete(struct http_object *obj) {
+    obj->hdr_len = http_render_hdr(200, http_content_type(obj->path), obj->size, obj->hdr);
+    obj->hdr_date = http_status(200)->line.len + sizeof(http_date_name) - 1;
+    obj->hdr_time = http_date_time;
+    struct tcp_virtual_channel *waiters = http_obj_reply(obj, 200);
+
+    if (obj->size > HTTP_CACHE_BUDGET) {
+        http_obj_free(obj);
+    } else {
+        while (http_stats.cached_bytes + obj->size > HTTP_CACHE_BUDGET) {
+            http_obj_free(http_lru_tail);
+            http_stats.evictions++;
+        }
+        obj->ready = true;
+        http_lru_push(obj);
+        http_stats.cached_bytes += obj->size;
+        http_stats.nr_cached++;
+    }
+    http_resume(waiters);
+}
+
+/**
+ * Есть ли среди значений заголовка через запятую token (без учёта регистра)
+ */
+static bool
+http_has_token(const struct str_part *value, const char *token) {
+    size_t token_len = strlen(token);
+    const char *p = value->start, *end = value->start + value->length;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char *start = p;
+        while (p < end && *p != ',' && *p != ' ' && *p != '\t') p++;
+        if ((size_t)(p - start) == token_len && !http_strncasecmp(start, token, token_len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Что ответ на запрос делает с соединением (RFC 7230, 6.3): HTTP/1.1
+ * держит его, пока клиент не попросит закрыть, HTTP/1.0 - только по просьбе.
+ */
+static int
+http_conn_mode(const struct http_parser *p) {
+    static const struct str_part none;
+    const struct str_part *connection = http_parser_header(p, "Connection");
+    if (!connection) {
+        connection = &none;
+    }
+
+    if (http_has_token(connection, "close")) {
+        return HTTP_CONN_CLOSE;
+    }
+    if (!strncmp(p->version.start, HTTP_VER_COMPATIBLE, strlen(HTTP_VER_COMPATIBLE))) {
+        return http_has_token(connection, "keep-alive") ? HTTP_CONN_KEEP_ALIVE : HTTP_CONN_CLOSE;
+    }
+    return HTTP_CONN_KEEP;
+}
+
+/**
+ * Обрабатывает один разобранный запрос соединения vc: файл из кэша
+ * уходит сразу, иначе соединение ждёт, пока помощник сетевого сервера
+ * его прочитает. Тело запроса к этому моменту уже пропущено, так что
+ * после отказа соединение остаётся годным для следующих.
+ */
+static int
+http_serve_request(struct tcp_virtual_channel *vc, const struct http_parser *p) {
+    char path[HTTP_PATH_MAX];
+
+    http_stats.requests++;
+    int conn = http_conn_mode(p);
+    vc->http_head = p->method.length == 4 && !strncmp(p->method.start, "HEAD", 4);
+    if (!vc->http_head && (p->method.length != 3 || strncmp(p->method.start, "GET", 3))) {
+        return http_send_status(vc, 405, conn);
+    }
+    int code = http_uri_path(&p->uri, path);
+    if (code) {
+        return http_send_status(vc, code, conn);
+    }
+
+    struct http_object *obj = http_lookup(path);
+    if (obj && obj->ready) {
+        http_stats.hits++;
+        http_lru_unlink(obj);
+        http_lru_push(obj);
+        return http_send_object(vc, obj, conn);
+    }
+
+    http_stats.misses++;
+    if (!obj && !(obj = http_obj_alloc(path))) {
+        // every object is being read
+        return http_send_status(vc, 503, HTTP_CONN_CLOSE);
+    }
+    vc->http_wait = obj;
+    vc->http_wait_ms = hpet_msec();
+    vc->http_conn = conn;
+    vc->http_next = obj->waiters;
+    obj->waiters = vc;
+    return 0;
+}
+
+/**
+ * Разбирает то, что пришло в приёмный буфер соединения, и по порядку
+ * обслуживает полные запросы (HTTP pipelining). Запрос, ждущий файла,
+ * задерживает следующие за ним, так что ответы идут в порядке запросов.
+ * Следующие запросы ждут в приёмном буфере и тогда, когда очередь
+ * отправки дошла до TCP_SNDBUF_MAX: их обслужит ACK, который её освободит.
+ * Соединение закрывается по просьбе клиента, после неверного запроса
+ * или после ответов на всё, что клиент прислал до FIN. Если ответ не
+ * встал в очередь отправки, соединение обрывается и освобождается.
+ */
+int
+http_serve(struct tcp_virtual_channel *vc) {
+    size_t off = 0;
+    int rc = 0;
+
+    // the rest of the previous reply goes first
+    if (vc->http_body) {
+        rc = http_push(vc);
+    }
+    while (!rc && off < vc->data_len && !vc->http_wait && !vc->http_body && !vc->user_closed &&
+           tcp_sndbuf_space(vc)) {
+        struct http_parser *p = vc->http;
+        if (!p) {
+            if (!(p = vc->http = slab_alloc(&http_parser_cache))) {
+                off = vc->data_len;
+                rc = http_send_status(vc, 503, HTTP_CONN_CLOSE);
+                break;
+            }
+            http_parser_init(p);
+        }
+
+        struct str_part body;
+        off += http_parser_feed(p, (char *)vc->buffer + off, vc->data_len - off, &body);
+        // no handler takes a body, it is only skipped
+        http_stats.body_bytes += body.length;
+
+        if (p->state == HTTP_PS_ERROR) {
+            // where the next request starts is unknown
+            http_stats.bad_requests++;
+            off = vc->data_len;
+            rc = http_send_status(vc, p->error, HTTP_CONN_CLOSE);
+        } else if (p->state == HTTP_PS_DONE) {
+            rc = http_serve_request(vc, p);
+            http_parser_init(p);
+        }
     }
-    *cur_pos = '\0';
-    *reply_len = cur_pos - reply;
+    memmove(vc->buffer, vc->buffer + off, vc->data_len - off);
+    vc->data_len -= off;
+
+    if (!rc && vc->rcv_fin && !vc->data_len && !vc->http_wait && !vc->http_body && !vc->user_closed) {
+        rc = tcp_close(vc);
+    }
+    if (rc < 0) {
+        tcp_abort(vc);
+    }
+    return rc;
+}
+
+/**
+ * Соединение перестаёт ждать файл, объект дочитывается в кэш без него
+ */
+static void
+http_unwait(struct tcp_virtual_channel *vc) {
+    if (vc->http_wait) {
+        struct tcp_virtual_channel **link = &vc->http_wait->waiters;
+        while (*link != vc) {
+            link = &(*link)->http_next;
+        }
+        *link = vc->http_next;
+        vc->http_wait = NULL;
+    }
+}
+
+/**
+ * Файл не пришёл за TCP_HTTP_WAIT_MS: запрос получает 503, соединение
+ * закрывается, ведь ответы на следующие запросы должны идти после него.
+ */
+void
+http_timeout(struct tcp_virtual_channel *vc) {
+    http_unwait(vc);
+    http_stats.errors++;
+    if (http_send_status(vc, 503, HTTP_CONN_CLOSE) < 0) {
+        tcp_abort(vc);
+    }
+}
+
+/**
+ * Соединение освобождается: оно перестаёт ждать файл (объект дочитывается
+ * в кэш), разбор запроса и неотправленная часть ответа бросаются.
+ */
+void
+http_release(struct tcp_virtual_channel *vc) {
+    while (vc->http_body) {
+        struct pbuf *pb = vc->http_body;
+        vc->http_body = pb->next;
+        pbuf_release(pb);
+    }
+    http_unwait(vc);
+    if (vc->http) {
+        slab_free(&http_parser_cache, vc->http);
+        vc->http = NULL;
+    }
+}
+
+/**
+ * Отдаёт помощнику путь следующего файла, который надо прочитать.
+ * Если очередь пуста, помощник засыпает до промаха в http_obj_alloc()
+ * и, проснувшись с -E_WOULD_BLOCK, спрашивает снова.
+ */
+int
+http_miss(union Nsipc *ipc) {
+    struct http_object *obj = http_miss_head;
+    if (!obj) {
+        if (curenv) {
+            http_helper = curenv->env_id;
+            curenv->env_status = ENV_NOT_RUNNABLE;
+        }
+        return -E_WOULD_BLOCK;
+    }
+
+    http_miss_head = obj->miss_next;
+    if (!http_miss_head) http_miss_tail = NULL;
+    obj->miss_next = NULL;
+    obj->requested = true;
+    strcpy(ipc->httpMiss.ret_path, obj->path);
     return 0;
 }
+
+/**
+ * Принимает от помощника очередную часть файла или ошибку его чтения.
+ * Части идут по порядку, первая сообщает размер файла.
+ */
+int
+http_fill(union Nsipc *ipc) {
+    struct Nsreq_http_fill *req = &ipc->httpFill;
+    req->req_path[HTTP_PATH_MAX - 1] = '\0';
+
+    struct http_object *obj = http_lookup(req->req_path);
+    if (!obj || !obj->requested || obj->ready) {
+        return -E_NOT_FOUND;
+    }
+    if (req->req_status < 0) {
+        http_obj_fail(obj, req->req_status == -E_NOT_FOUND ? 404 : 500);
+        return 0;
+    }
+
+    if (!obj->filled) {
+        obj->size = req->req_size;
+    }
+    if (obj->size > HTTP_OBJECT_MAX || req->req_offset != obj->filled ||
+        req->req_n > NSFILLSIZE || req->req_n > obj->size - obj->filled) {
+        http_obj_fail(obj, 500);
+        return -E_INVAL;
+    }
+
+    for (size_t done = 0; done < req->req_n;) {
+        struct pbuf *pb = obj->body_tail;
+        if (!pb || pb->len == PBUF_DATA_LEN) {
+            if (!(pb = pbuf_alloc(0))) {
+                http_obj_fail(obj, 500);
+                return -E_NO_MEM;
+            }
+            if (obj->body_tail) {
+                obj->body_tail->next = pb;
+            } else {
+                obj->body = pb;
+            }
+            obj->body_tail = pb;
+        }
+        size_t n = MIN(req->req_n - done, PBUF_DATA_LEN - pb->len);
+        memcpy(pb->data + pb->len, req->req_buf + done, n);
+        pb->len += n;
+        done += n;
+    }
+    obj->filled += req->req_n;
+
+    if (obj->filled == obj->size) {
+        http_obj_complete(obj);
+    }
+    return 0;
+}
+
+void
+http_init(void) {
+    slab_init(&http_parser_cache, "http_parser", sizeof(struct http_parser));
+}
+
+void
+http_print_stats(void) {
+    cprintf("HTTP: %lu requests, %lu hits, %lu misses, %lu evictions, %lu not found, %lu errors\n",
+            (unsigned long)http_stats.requests, (unsigned long)http_stats.hits,
+            (unsigned long)http_stats.misses, (unsigned long)http_stats.evictions,
+            (unsigned long)http_stats.not_found, (unsigned long)http_stats.errors);
+    cprintf("HTTP requests: %lu bad, %lu body bytes skipped\n",
+            (unsigned long)http_stats.bad_requests, (unsigned long)http_stats.body_bytes);
+    cprintf("HTTP cache: %u files, %lu of %lu bytes\n", http_stats.nr_cached,
+            (unsigned long)http_stats.cached_bytes, (unsigned long)HTTP_CACHE_BUDGET);
+    for (struct http_object *obj = http_lru_head; obj; obj = obj->lru_next) {
+        cprintf("  %s %lu\n", obj->path, (unsigned long)obj->size);
+    }
+}
+
+#define HTTP_TEST_PATH "/nettest.txt"
+#define HTTP_TEST_MISSING "/nettest-missing.txt"
+#define HTTP_TEST_BODY "0123456789"
+
+/**
+ * Запросы req приходят в приёмный буфер соединения
+ */
+static void
+http_test_request(struct tcp_virtual_channel *vc, const char *req) {
+    size_t len = strlen(req);
+    memcpy(vc->buffer + vc->data_len, req, len);
+    vc->data_len += len;
+    http_serve(vc);
+}
+
+/**
+ * Помощник сетевого сервера: берёт промах, он должен быть по path,
+ * и отдаёт файл body двумя частями, а если body нет - ошибку E_NOT_FOUND
+ */
+static int
+http_test_fill(const char *path, const char *body) {
+    static union Nsipc ipc;
+    struct Nsreq_http_fill *fill = &ipc.httpFill;
+
+    if (http_miss(&ipc) < 0 || strcmp(ipc.httpMiss.ret_path, path)) {
+        cprintf("http: no miss for %s\n", path);
+        return -1;
+    }
+    strcpy(fill->req_path, path);
+    if (!body) {
+        fill->req_status = -E_NOT_FOUND;
+        return http_fill(&ipc);
+    }
+    fill->req_status = 0;
+    fill->req_size = strlen(body);
+    for (fill->req_offset = 0; fill->req_offset < fill->req_size; fill->req_offset += fill->req_n) {
+        fill->req_n = fill->req_offset ? fill->req_size - fill->req_offset : fill->req_size / 2;
+        memcpy(fill->req_buf, body + fill->req_offset, fill->req_n);
+        int rc = http_fill(&ipc);
+        if (rc < 0) return rc;
+    }
+    return 0;
+}
+
+/**
+ * Всё, что соединение поставило в очередь отправки, строкой в buf
+ */
+static size_t
+http_test_sent(struct tcp_virtual_channel *vc, char *buf, size_t size) {
+    size_t len = 0;
+    for (struct tcp_snd_seg *seg = vc->snd_head; seg; seg = seg->next) {
+        size_t n = MIN((size_t)seg->data_len, size - 1 - len);
+        memcpy(buf + len, seg->pb->data, n);
+        len += n;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/**
+ * Первое вхождение s в buf после from, NULL - его нет
+ */
+static const char *
+http_test_find(const char *buf, const char *from, const char *s) {
+    size_t len = strlen(s);
+    for (const char *p = from ? from : buf; *p; p++) {
+        if (!strncmp(p, s, len)) return p;
+    }
+    return NULL;
+}
+
+/**
+ * Соединение HTTP-сервера ядра для самопроверки
+ */
+static struct tcp_virtual_channel *
+http_test_vc(void) {
+    struct tcp_virtual_channel *vc = tcp_test_vc(&tcp_cc_newreno);
+    if (vc) vc->user = false;
+    return vc;
+}
+
+/**
+ * Кэш файлов: промах ждёт помощника, его ответ собирается из частей
+ * файла, повторный запрос берёт файл из кэша без помощника, а файла,
+ * которого нет, в кэше не остаётся
+ */
+static int
+http_test_cache(void) {
+    static char sent[1024];
+    int errors = 0;
+
+    struct tcp_virtual_channel *vc = http_test_vc();
+    if (!vc) return 1;
+    http_test_request(vc, "GET " HTTP_TEST_PATH " HTTP/1.1\r\n\r\n");
+    if (!vc->http_wait || vc->snd_head) {
+        cprintf("http: missed file does not wait for the helper\n");
+        errors++;
+    }
+    errors += http_test_fill(HTTP_TEST_PATH, HTTP_TEST_BODY) < 0;
+    http_test_sent(vc, sent, sizeof(sent));
+    const char *end = http_test_find(sent, NULL, "\r\n\r\n");
+    if (vc->http_wait || strncmp(sent, HTTP_VER " 200 OK\r\n", 17) ||
+        !http_test_find(sent, NULL, "Content-Length: 10\r\n") ||
+        !end || strcmp(end + 4, HTTP_TEST_BODY)) {
+        cprintf("http: wrong reply to a missed file: %s\n", sent);
+        errors++;
+    }
+    tcp_abort(vc);
+
+    struct http_object *obj = http_lookup(HTTP_TEST_PATH);
+    if (!obj || !obj->ready) {
+        cprintf("http: file is not cached\n");
+        return errors + 1;
+    }
+
+    // the second time it comes from the cache
+    uint64_t hits = http_stats.hits, misses = http_stats.misses;
+    if (!(vc = http_test_vc())) return errors + 1;
+    http_test_request(vc, "GET " HTTP_TEST_PATH " HTTP/1.1\r\n\r\n");
+    http_test_sent(vc, sent, sizeof(sent));
+    end = http_test_find(sent, NULL, "\r\n\r\n");
+    if (http_stats.hits != hits + 1 || http_stats.misses != misses || vc->http_wait ||
+        !end || strcmp(end + 4, HTTP_TEST_BODY)) {
+        cprintf("http: cached file is not served\n");
+        errors++;
+    }
+    tcp_abort(vc);
+
+    if (!(vc = http_test_vc())) return errors + 1;
+    http_test_request(vc, "GET " HTTP_TEST_MISSING " HTTP/1.1\r\n\r\n");
+    errors += http_test_fill(HTTP_TEST_MISSING, NULL) < 0;
+    http_test_sent(vc, sent, sizeof(sent));
+    if (strncmp(sent, HTTP_VER " 404 Not Found\r\n", 24) || http_lookup(HTTP_TEST_MISSING)) {
+        cprintf("http: wrong reply to a missing file: %s\n", sent);
+        errors++;
+    }
+    tcp_abort(vc);
+
+    http_obj_free(obj);
+    return errors;
+}
+
+/**
+ * Конвейер запросов: запрос, ждущий файла, задерживает следующие за ним
+ * в приёмном буфере, ответы идут в порядке запросов, на HEAD - без тела,
+ * а после ответа на запрос с Connection: close соединение закрывается
+ */
+static int
+http_test_pipeline(void) {
+    static char sent[2048];
+    int errors = 0;
+
+    struct tcp_virtual_channel *vc = http_test_vc();
+    if (!vc) return 1;
+    http_test_request(vc, "GET " HTTP_TEST_PATH " HTTP/1.1\r\n\r\n"
+                          "HEAD " HTTP_TEST_PATH " HTTP/1.1\r\n\r\n"
+                          "GET " HTTP_TEST_MISSING " HTTP/1.1\r\nConnection: close\r\n\r\n");
+    if (!vc->http_wait || vc->snd_head || !vc->data_len) {
+        cprintf("http: pipelined requests do not wait for the first one\n");
+        errors++;
+    }
+    errors += http_test_fill(HTTP_TEST_PATH, HTTP_TEST_BODY) < 0;
+    if (!vc->http_wait || vc->data_len) {
+        cprintf("http: third request does not wait for its file\n");
+        errors++;
+    }
+    errors += http_test_fill(HTTP_TEST_MISSING, NULL) < 0;
+    http_test_sent(vc, sent, sizeof(sent));
+
+    // GET with the body, HEAD without it, then 404
+    const char *get_end = http_test_find(sent, NULL, "\r\n\r\n");
+    const char *head = get_end ? http_test_find(sent, get_end, HTTP_VER " 200 OK\r\n") : NULL;
+    const char *head_end = head ? http_test_find(sent, head, "\r\n\r\n") : NULL;
+    if (strncmp(sent, HTTP_VER " 200 OK\r\n", 17) || !get_end ||
+        strncmp(get_end + 4, HTTP_TEST_BODY, strlen(HTTP_TEST_BODY)) ||
+        head != get_end + 4 + strlen(HTTP_TEST_BODY) || !head_end ||
+        strncmp(head_end + 4, HTTP_VER " 404 Not Found\r\n", 24)) {
+        cprintf("http: wrong pipelined replies: %s\n", sent);
+        errors++;
+    }
+    if (!vc->user_closed) {
+        cprintf("http: connection is not closed on request\n");
+        errors++;
+    }
+    tcp_abort(vc);
+
+    struct http_object *obj = http_lookup(HTTP_TEST_PATH);
+    if (obj) http_obj_free(obj);
+    return errors;
+}
+
+/**
+ * Самопроверка HTTP-сервера ядра на соединениях без рукопожатия: запросы
+ * кладутся в приёмный буфер, помощник сетевого сервера подменяется,
+ * ответы читаются из очереди отправки. Возвращает число ошибок.
+ */
+int
+http_selftest(void) {
+    int errors = http_test_cache();
+    errors += http_test_pipeline();
+    // nobody is there to take the replies
+    loopback_flush();
+    return errors;
+}
@@ -1,19 +1,134 @@
 #ifndef JOS_KERN_HTTP_H
 #define JOS_KERN_HTTP_H
 
+#include <inc/types.h>
+#include <inc/ns.h>
+
 struct str_part {
     char *start;
     size_t length;
 };
 
-struct HTTP_hdr {
-    struct str_part method, URI, HTTP_version;
+#define HTTP_HEAD_MAX 2048        // request line and headers
+#define HTTP_HEADERS_MAX 24       // header lines of a request
+#define HTTP_BODY_MAX (16 * 1024 * 1024) // request body, it is not kept
+
+struct http_header {
+    struct str_part name, value;
+};
+
+// Parser states, a request is taken byte by byte as segments arrive
+enum http_parse_state {
+    HTTP_PS_METHOD,
+    HTTP_PS_URI,
+    HTTP_PS_VERSION,
+    HTTP_PS_LINE_START,     // of a header line or the empty one ending the head
+    HTTP_PS_NAME,
+    HTTP_PS_VALUE_START,
+    HTTP_PS_VALUE,
+    HTTP_PS_BODY,           // Content-Length bytes
+    HTTP_PS_CHUNK_SIZE,
+    HTTP_PS_CHUNK_EXT,
+    HTTP_PS_CHUNK_DATA,
+    HTTP_PS_CHUNK_END,      // line end after the chunk data
+    HTTP_PS_TRAILER_START,
+    HTTP_PS_TRAILER,
+    HTTP_PS_DONE,           // whole request is parsed
+    HTTP_PS_ERROR
+};
+
+// Resumable parser of one request: the head is copied into it, parts of
+// the body are only pointed at and then dropped by the caller
+struct http_parser {
+    enum http_parse_state state;
+    uint16_t error;             // response code of a rejected request
+    uint16_t head_len;
+    char head[HTTP_HEAD_MAX];
+    struct str_part method, uri, version;   // point into head
+    struct http_header headers[HTTP_HEADERS_MAX];
+    uint8_t nr_headers;
+    bool chunked;
+    uint8_t chunk_digits;       // of the chunk size line so far
+    uint64_t body_len;          // Content-Length or chunks so far
+    uint64_t body_left;         // of the body or the current chunk
+};
+
+// What the reply does to the connection
+#define HTTP_CONN_KEEP 0        // HTTP/1.1 stays open by default
+#define HTTP_CONN_KEEP_ALIVE 1  // HTTP/1.0 asked to keep it, the reply says so
+#define HTTP_CONN_CLOSE 2       // closed after the reply
+
+struct pbuf;
+struct tcp_virtual_channel;
+
+#define HTTP_PATH_MAX NS_PATH_MAX   // file path of a URI, with the final NUL
+#define HTTP_HDR_MAX 192            // pre-rendered response header, without the end
+#define HTTP_CACHE_NUM 64           // cached and requested files
+#define HTTP_HASH_SIZE 64           // buckets of paths, power of 2
+#define HTTP_CACHE_BUDGET (1024 * 1024)     // bytes of bodies kept in the cache
+#define HTTP_OBJECT_MAX (4 * 1024 * 1024)   // larger files are not served
+#define HTTP_INDEX "index.html"     // served for a URI naming a directory
+#define HTTP_DATE_LEN 29            // "Sun, 06 Nov 1994 08:49:37 GMT" (RFC 7231, 7.1.1.1)
+#define HTTP_TYPE_HTML 0            // content type of generated pages
+
+// File of the file server with its response header rendered once.
+// Ready objects stay in LRU order while their bodies fit HTTP_CACHE_BUDGET,
+// the others are being read by the helper of the network server.
+struct http_object {
+    char path[HTTP_PATH_MAX];
+    bool used;
+    bool ready;                 // body is complete, header is rendered
+    bool requested;             // path was handed to the helper
+    size_t size;                // body bytes
+    size_t filled;              // of them read so far
+    char hdr[HTTP_HDR_MAX];     // connection header and the empty line follow it
+    uint16_t hdr_len;
+    uint16_t hdr_date;          // offset of the date in hdr
+    uint64_t hdr_time;          // s, when that date was put there
+    // body in pool buffers linked through next
+    struct pbuf *body;
+    struct pbuf *body_tail;
+    // connections waiting for the file, linked through http_next
+    struct tcp_virtual_channel *waiters;
+    struct http_object *hash_next;
+    // ready objects, most recently used first
+    struct http_object *lru_prev;
+    struct http_object *lru_next;
+    // objects the helper has not taken yet
+    struct http_object *miss_next;
 };
 
-int http_parse(char *data, size_t length, char *reply, size_t *reply_len);
+// Counters for the monitor
+struct http_stats {
+    uint64_t requests;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t not_found;
+    uint64_t errors;
+    uint64_t bad_requests;
+    uint64_t body_bytes;      // of requests, skipped
+    size_t cached_bytes;
+    uint32_t nr_cached;
+};
+
+void http_parser_init(struct http_parser *p);
+size_t http_parser_feed(struct http_parser *p, const char *data, size_t length, struct str_part *body);
+const struct str_part *http_parser_header(const struct http_parser *p, const char *name);
+int http_strncasecmp(const char *a, const char *b, size_t n);
+
+void http_init(void);
+size_t http_render_hdr(int code, int type, size_t length, char *buf);
+size_t http_render_hdr_ref(int code, int type, size_t length, char *buf);
 int http_reply(int code, const char *page, char *reply, size_t *reply_len);
+int http_serve(struct tcp_virtual_channel *vc);
+void http_release(struct tcp_virtual_channel *vc);
+void http_timeout(struct tcp_virtual_channel *vc);
+int http_miss(union Nsipc *ipc);
+int http_fill(union Nsipc *ipc);
+void http_print_stats(void);
+int http_selftest(void);
 
-#define HTTP_METHOD "GET"
 #define HTTP_VER "HTTP/1.1"
 #define HTTP_VER_COMPATIBLE "HTTP/1.0"
 
@@ -0,0 +1,318 @@
+#include <inc/string.h>
+#include <kern/http.h>
+
+/* Incremental parser of HTTP/1.x requests (RFC 7230, 3). Bytes are
+ * taken as segments bring them, the state is kept between the calls,
+ * so a request may be split anywhere. The request line and the headers
+ * are copied into the parser within HTTP_HEAD_MAX, the body is not:
+ * http_parser_feed() points at each part of it and the caller lets it go.
+ * A bare LF ends a line as well as CRLF. */
+
+static void
+http_parser_fail(struct http_parser *p, uint16_t code) {
+    p->state = HTTP_PS_ERROR;
+    p->error = code;
+}
+
+/**
+ * Символ токена: метода или имени заголовка (RFC 7230, 3.2.6)
+ */
+static bool
+http_is_tchar(char c) {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+        return true;
+    }
+    return c && strchr("!#$%&'*+-.^_`|~", c);
+}
+
+static int
+http_hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Дописывает c к части заголовка part. Если заголовок не помещается,
+ * запрос отвергается с кодом code.
+ */
+static bool
+http_head_put(struct http_parser *p, struct str_part *part, char c, uint16_t code) {
+    if (p->head_len == HTTP_HEAD_MAX) {
+        http_parser_fail(p, code);
+        return false;
+    }
+    if (!part->start) {
+        part->start = p->head + p->head_len;
+    }
+    p->head[p->head_len++] = c;
+    part->length++;
+    return true;
+}
+
+int
+http_strncasecmp(const char *a, const char *b, size_t n) {
+    for (; n; n--, a++, b++) {
+        char ca = *a >= 'A' && *a <= 'Z' ? *a - 'A' + 'a' : *a;
+        char cb = *b >= 'A' && *b <= 'Z' ? *b - 'A' + 'a' : *b;
+        if (ca != cb) return (unsigned char)ca - (unsigned char)cb;
+    }
+    return 0;
+}
+
+/**
+ * Значение заголовка name (без учёта регистра) или NULL
+ */
+const struct str_part *
+http_parser_header(const struct http_parser *p, const char *name) {
+    size_t len = strlen(name);
+    for (int i = 0; i < p->nr_headers; i++) {
+        const struct http_header *h = &p->headers[i];
+        if (h->name.length == len && !http_strncasecmp(h->name.start, name, len)) {
+            return &h->value;
+        }
+    }
+    return NULL;
+}
+
+void
+http_parser_init(struct http_parser *p) {
+    p->state = HTTP_PS_METHOD;
+    p->error = 0;
+    p->head_len = 0;
+    memset(&p->method, 0, sizeof(p->method));
+    memset(&p->uri, 0, sizeof(p->uri));
+    memset(&p->version, 0, sizeof(p->version));
+    p->nr_headers = 0;
+    p->chunked = false;
+    p->chunk_digits = 0;
+    p->body_len = 0;
+    p->body_left = 0;
+}
+
+/**
+ * Заголовок прочитан: длина тела по Content-Length или
+ * Transfer-Encoding: chunked (RFC 7230, 3.3.3)
+ */
+static void
+http_head_done(struct http_parser *p) {
+    const struct str_part *te = http_parser_header(p, "Transfer-Encoding");
+    const struct str_part *cl = http_parser_header(p, "Content-Length");
+
+    if (te) {
+        // both at once is how requests are smuggled past proxies
+        if (cl) {
+            http_parser_fail(p, 400);
+        } else if (te->length != 7 || http_strncasecmp(te->start, "chunked", 7)) {
+            http_parser_fail(p, 501);
+        } else {
+            p->chunked = true;
+            p->state = HTTP_PS_CHUNK_SIZE;
+        }
+        return;
+    }
+
+    uint64_t len = 0;
+    if (cl) {
+        if (!cl->length) {
+            http_parser_fail(p, 400);
+            return;
+        }
+        for (size_t i = 0; i < cl->length; i++) {
+            if (cl->start[i] < '0' || cl->start[i] > '9') {
+                http_parser_fail(p, 400);
+                return;
+            }
+            len = len * 10 + cl->start[i] - '0';
+            if (len > HTTP_BODY_MAX) {
+                http_parser_fail(p, 413);
+                return;
+            }
+        }
+    }
+    p->body_len = p->body_left = len;
+    p->state = len ? HTTP_PS_BODY : HTTP_PS_DONE;
+}
+
+/**
+ * Конец строки с размером куска: за ним данные куска или,
+ * после последнего (нулевого), трейлер
+ */
+static void
+http_chunk_size_done(struct http_parser *p) {
+    if (!p->chunk_digits) {
+        http_parser_fail(p, 400);
+        return;
+    }
+    p->chunk_digits = 0;
+    p->state = p->body_left ? HTTP_PS_CHUNK_DATA : HTTP_PS_TRAILER_START;
+}
+
+/**
+ * Один байт заголовка запроса или служебных строк chunked-тела
+ */
+static void
+http_parser_step(struct http_parser *p, char c) {
+    struct http_header *h = p->nr_headers ? &p->headers[p->nr_headers - 1] : NULL;
+
+    switch (p->state) {
+    case HTTP_PS_METHOD:
+        if (c == ' ' && p->method.length) {
+            p->state = HTTP_PS_URI;
+        } else if ((c == '\r' || c == '\n') && !p->method.length) {
+            // empty lines before a request are ignored (RFC 7230, 3.5)
+        } else if (!http_is_tchar(c)) {
+            http_parser_fail(p, 400);
+        } else {
+            http_head_put(p, &p->method, c, 501);
+        }
+        break;
+    case HTTP_PS_URI:
+        if (c == ' ' && p->uri.length) {
+            p->state = HTTP_PS_VERSION;
+        } else if ((unsigned char)c <= ' ' || c == 0x7F) {
+            http_parser_fail(p, 400);
+        } else {
+            http_head_put(p, &p->uri, c, 414);
+        }
+        break;
+    case HTTP_PS_VERSION:
+        if (c == '\n') {
+            if (p->version.length != 8 || strncmp(p->version.start, "HTTP/1.", 7)) {
+                http_parser_fail(p, p->version.length >= 5 && !strncmp(p->version.start, "HTTP/", 5) ? 505 : 400);
+            } else if (strncmp(p->version.start, HTTP_VER, 8) && strncmp(p->version.start, HTTP_VER_COMPATIBLE, 8)) {
+                http_parser_fail(p, 505);
+            } else {
+                p->state = HTTP_PS_LINE_START;
+            }
+        } else if (c != '\r') {
+            http_head_put(p, &p->version, c, 400);
+        }
+        break;
+    case HTTP_PS_LINE_START:
+        if (c == '\n') {
+            http_head_done(p);
+            break;
+        }
+        if (c == '\r') {
+            break;
+        }
+        // obsolete line folding is not accepted (RFC 7230, 3.2.4)
+        if (c == ' ' || c == '\t' || p->nr_headers == HTTP_HEADERS_MAX) {
+            http_parser_fail(p, c == ' ' || c == '\t' ? 400 : 431);
+            break;
+        }
+        h = &p->headers[p->nr_headers++];
+        memset(h, 0, sizeof(*h));
+        p->state = HTTP_PS_NAME;
+        /* fallthrough */
+    case HTTP_PS_NAME:
+        if (c == ':' && h->name.length) {
+            p->state = HTTP_PS_VALUE_START;
+        } else if (!http_is_tchar(c)) {
+            http_parser_fail(p, 400);
+        } else {
+            http_head_put(p, &h->name, c, 431);
+        }
+        break;
+    case HTTP_PS_VALUE_START:
+        if (c == '\n') {
+            p->state = HTTP_PS_LINE_START;
+            break;
+        }
+        if (c == ' ' || c == '\t' || c == '\r') {
+            break;
+        }
+        p->state = HTTP_PS_VALUE;
+        /* fallthrough */
+    case HTTP_PS_VALUE:
+        if (c == '\n') {
+            // trailing whitespace and CR are not part of the value
+            while (h->value.length && (h->value.start[h->value.length - 1] == ' ' ||
+                                       h->value.start[h->value.length - 1] == '\t' ||
+                                       h->value.start[h->value.length - 1] == '\r')) {
+                h->value.length--;
+            }
+            p->state = HTTP_PS_LINE_START;
+        } else {
+            http_head_put(p, &h->value, c, 431);
+        }
+        break;
+    case HTTP_PS_CHUNK_SIZE: {
+        int digit = http_hex_digit(c);
+        if (digit >= 0) {
+            p->body_left = p->body_left * 16 + digit;
+            p->chunk_digits++;
+            if (p->body_len + p->body_left > HTTP_BODY_MAX) {
+                http_parser_fail(p, 413);
+            }
+        } else if (c == '\n') {
+            http_chunk_size_done(p);
+            p->body_len += p->body_left;
+        } else if (c == ';' || c == ' ' || c == '\t') {
+            p->state = HTTP_PS_CHUNK_EXT;
+        } else if (c != '\r') {
+            http_parser_fail(p, 400);
+        }
+        break;
+    }
+    case HTTP_PS_CHUNK_EXT:
+        // chunk extensions are skipped
+        if (c == '\n') {
+            http_chunk_size_done(p);
+            p->body_len += p->body_left;
+        }
+        break;
+    case HTTP_PS_CHUNK_END:
+        if (c == '\n') {
+            p->state = HTTP_PS_CHUNK_SIZE;
+        } else if (c != '\r') {
+            http_parser_fail(p, 400);
+        }
+        break;
+    case HTTP_PS_TRAILER_START:
+        if (c == '\n') {
+            p->state = HTTP_PS_DONE;
+        } else if (c != '\r') {
+            p->state = HTTP_PS_TRAILER;
+        }
+        break;
+    case HTTP_PS_TRAILER:
+        // trailer fields are skipped
+        if (c == '\n') {
+            p->state = HTTP_PS_TRAILER_START;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Разбирает очередные length байт запроса. Возвращает, сколько из них
+ * взято: разбор останавливается в конце запроса (HTTP_PS_DONE), на ошибке
+ * (HTTP_PS_ERROR, код ответа в error) и после каждой части тела, на
+ * которую тогда указывает body, иначе её длина 0.
+ */
+size_t
+http_parser_feed(struct http_parser *p, const char *data, size_t length, struct str_part *body) {
+    size_t i = 0;
+
+    body->start = NULL;
+    body->length = 0;
+    while (i < length && p->state != HTTP_PS_DONE && p->state != HTTP_PS_ERROR) {
+        if (p->state == HTTP_PS_BODY || p->state == HTTP_PS_CHUNK_DATA) {
+            size_t n = MIN(p->body_left, (uint64_t)(length - i));
+            body->start = (char *)data + i;
+            body->length = n;
+            p->body_left -= n;
+            if (!p->body_left) {
+                p->state = p->state == HTTP_PS_BODY ? HTTP_PS_DONE : HTTP_PS_CHUNK_END;
+            }
+            return i + n;
+        }
+        http_parser_step(p, data[i++]);
+    }
+    return i;
+}
@@ -6,7 +6,6 @@
 #include <kern/icmp.h>
 #include <inc/stdio.h>
 #include <kern/traceopt.h>
-#include <kern/arp.h>
 
 /**
  * Функция-ответчик на ICMP-запрос.
@@ -15,34 +14,30 @@
 int
 icmp_echo_reply(struct ip_pkt *pkt) {
     if (trace_packet_processing) cprintf("Processing ICMP packet\n");
-    
-    struct icmp_pkt icmp_packet;
-    struct ip_pkt result;
 
     int size = JNTOHS(pkt->hdr.ip_total_length) - IP_HEADER_LEN;
-    memcpy((void *)&icmp_packet, (void *)pkt->data, size);
-    
-    struct icmp_hdr *hdr = &icmp_packet.hdr;
+    if (size < ICMP_HEADER_LEN) {
+        return -E_INVAL;
+    }
+
+    // request is parsed and turned into the reply in place
+    struct icmp_pkt *icmp_packet = (struct icmp_pkt *)pkt->data;
+    struct icmp_hdr *hdr = &icmp_packet->hdr;
 
     if (hdr->msg_type != ECHO_REQUEST)
         return -E_UNS_ICMP_TYPE;
     if (hdr->msg_code != 0)
         return -E_INV_ICMP_CODE;
 
+    // only the type changes, payload and id stay: adjust the checksum in O(1)
+    uint16_t old_word;
+    memcpy(&old_word, hdr, sizeof(old_word));
     hdr->msg_type = ECHO_REPLY;
-    hdr->checksum = JHTONS(hdr->checksum);
-
-    result.hdr.ip_protocol = IP_PROTO_ICMP;
-    result.hdr.ip_source_address = JHTONL(MY_IP);
+    hdr->checksum = ip_checksum_adjust(hdr->checksum, &old_word, hdr, sizeof(old_word));
 
-    uint8_t *dmac = get_mac_by_ip(pkt->hdr.ip_source_address);
-
-    if (!dmac) {
-        return arp_request(pkt);
-    } else {
-        result.hdr.ip_destination_address = pkt->hdr.ip_source_address;
-    }
+    pkt->hdr.ip_protocol = IP_PROTO_ICMP;
+    pkt->hdr.ip_destination_address = pkt->hdr.ip_source_address;
+    pkt->hdr.ip_source_address = JHTONL(MY_IP);
 
-    memcpy((void *)result.data, (void *)&icmp_packet, size);
-    return ip_send(&result, size);
-}
\ No newline at end of file
+    return ip_send(pkt, size);
+}
@@ -23,6 +23,8 @@
 #include <kern/e1000.h>
 #include <kern/arp.h>
 #include <kern/tcp.h>
+#include <kern/http.h>
+#include <kern/udp.h>
 
 void
 timers_init(void) {
@@ -159,13 +161,22 @@ i386_init(void) {
     /* User environment initialization functions */
     env_init();
 
+    pbuf_init();
     pci_init();
     initialize_arp_table();
+    ip_init();
+    udp_init();
     tcp_init_vc();
+    http_init();
 
     /* Choose the timer used for scheduling: hpet or pit */
     timers_schedule("hpet0");
 
+#ifdef NET_SELFTEST
+    /* Don't touch -- used by grading script! */
+    net_selftest(NULL);
+#endif
+
 #ifdef CONFIG_KSPACE
     /* Touch all you want */
     ENV_CREATE_KERNEL_TYPE(prog_test1, false);
@@ -179,6 +190,7 @@ i386_init(void) {
 
 #if LAB >= 10
     ENV_CREATE(fs_fs, ENV_TYPE_FS, true);
+    ENV_CREATE(net_ns, ENV_TYPE_NS, true);
 #endif
 
 #if defined(TEST)
@@ -3,11 +3,16 @@
 #include <kern/inet.h>
 #include <inc/error.h>
 #include <kern/eth.h>
+#include <kern/netif.h>
 #include <kern/icmp.h>
 #include <inc/stdio.h>
 #include <kern/udp.h>
 #include <kern/tcp.h>
+#include <kern/slab.h>
+#include <kern/timer.h>
 #include <kern/traceopt.h>
+#include <inc/assert.h>
+#include <inc/checksum.h>
 
 void
 num2ip(int32_t num) {
@@ -15,12 +20,30 @@ num2ip(int32_t num) {
 }
 
 /**
- * Функция проверки check-суммы.
+ * Накапливает сумму для check-суммы, собираемой из нескольких кусков
+ * (например, псевдозаголовок + TCP-сегмент).
+ * Все куски, кроме последнего, должны иметь чётную длину.
+ * Кусок суммируется по 64 бита с отложенным переносом (inc/checksum.h),
+ * в сетевой порядок байт переводится только итог.
  */
-uint16_t
-ip_checksum(void *vdata, size_t length) {
-    char *data = vdata;
-    uint32_t sum = 0xffff;
+uint32_t
+ip_checksum_partial(uint32_t sum, const void *vdata, size_t length) {
+    uint16_t word = csum_fold(csum_accumulate(vdata, length, 0));
+    sum += JNTOHS(word);
+
+    if (sum > 0xffff) {
+        sum -= 0xffff;
+    }
+    return sum;
+}
+
+/**
+ * Прежняя реализация: по одному 16-битному слову за раз.
+ * Оставлена как эталон для проверки и замеров (монитор, csum_bench).
+ */
+uint32_t
+ip_checksum_partial_ref(uint32_t sum, const void *vdata, size_t length) {
+    const char *data = vdata;
     for (size_t i = 0; i + 1 < length; i += 2) {
         uint16_t word;
         memcpy(&word, data + i, 2);
@@ -40,23 +63,174 @@ ip_checksum(void *vdata, size_t length) {
             sum -= 0xffff;
         }
     }
-    // Return the checksum in network byte order.
+    return sum;
+}
+
+/**
+ * Превращает накопленную сумму в check-сумму в сетевом порядке байт.
+ */
+uint16_t
+ip_checksum_finish(uint32_t sum) {
     return JHTONS(~sum);
 }
 
+/**
+ * Пересчёт check-суммы после замены нескольких полей (RFC 1624, формула 3):
+ * HC' = ~(~HC + ~m + m'). old и new - старые и новые значения полей
+ * чётной длины length, check-сумма в сетевом порядке байт.
+ * Работа пропорциональна длине изменённых полей, а не пакета.
+ */
+uint16_t
+ip_checksum_adjust(uint16_t checksum, const void *old, const void *new, size_t length) {
+    const uint8_t *o = old, *n = new;
+    uint32_t sum = (uint16_t)~JNTOHS(checksum);
+
+    for (size_t i = 0; i + 1 < length; i += 2) {
+        uint16_t oword, nword;
+        memcpy(&oword, o + i, 2);
+        memcpy(&nword, n + i, 2);
+        sum += (uint16_t)~JNTOHS(oword) + JNTOHS(nword);
+    }
+    while (sum > 0xffff) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ip_checksum_finish(sum);
+}
+
+/**
+ * Функция проверки check-суммы.
+ */
+uint16_t
+ip_checksum(void *vdata, size_t length) {
+    return ip_checksum_finish(ip_checksum_partial(0xffff, vdata, length));
+}
+
 
 /**
- * Объявляем ethernet-хедер, инициализируем ip-хедер на основании пакета.
- * вычисляем чек-сумму и передаём данные в на уровень Ethernet, чтобы подготовить
- * пакет полностью и отправить на сетевую карту.
+ * Сумма псевдозаголовка TCP/UDP для пакета с заголовком hdr
+ * и length байтами нагрузки (ещё не свёрнутая в check-сумму).
+ */
+uint32_t
+ip_pseudo_sum(const struct ip_hdr *hdr, uint16_t length) {
+    struct ip_pseudo_hdr pseudo_hdr = {};
+
+    pseudo_hdr.source_address = hdr->ip_source_address;
+    pseudo_hdr.destination_address = hdr->ip_destination_address;
+    pseudo_hdr.protocol = hdr->ip_protocol;
+    pseudo_hdr.length = JHTONS(length);
+    return ip_checksum_partial(0, &pseudo_hdr, sizeof(pseudo_hdr));
+}
+
+/**
+ * Отправляет датаграмму больше MTU фрагментами по IP_FRAG_DATA_LEN байт
+ * нагрузки. Каждый фрагмент собирается картой из кусков segs без копий.
+ * Check-сумму TCP/UDP карта посчитала бы по одному кадру, поэтому
+ * при l4_csum_off её считаем сами по всей датаграмме.
+ */
+static int
+ip_fragment(struct ip_hdr *hdr, const struct tx_seg *segs, int nsegs, uint16_t length, uint8_t l4_csum_off) {
+    if (l4_csum_off) {
+        // pseudo header sum is already in the field
+        uint32_t sum = 0;
+        for (int i = 0; i < nsegs; i++) {
+            sum = ip_checksum_partial(sum, segs[i].addr, segs[i].len);
+        }
+        uint16_t checksum = ip_checksum_finish(sum);
+        // zero means "no checksum" for UDP, its ones' complement twin is sent instead
+        if (!checksum && hdr->ip_protocol == IP_PROTO_UDP) checksum = 0xffff;
+        assert(l4_csum_off + sizeof(checksum) <= segs[0].len);
+        memcpy((uint8_t *)segs[0].addr + l4_csum_off, &checksum, sizeof(checksum));
+    }
+
+    struct tx_csum csum = {};
+    csum.ipcso = offsetof(struct ip_hdr, ip_header_checksum);
+    if (netif_csum_caps(JNTOHL(hdr->ip_destination_address)) & E1000_CAP_CSUM_TX_IP) {
+        csum.flags |= E1000_TX_CSUM_IP;
+    }
+
+    int seg = 0;
+    uint16_t seg_off = 0;
+    for (uint16_t off = 0; off < length;) {
+        uint16_t frag_len = MIN(length - off, IP_FRAG_DATA_LEN);
+        struct tx_seg v[E1000_TX_MAX_SEGS];
+        int n = 1;
+
+        // the piece of segs from off up to off + frag_len, the header
+        // and the pieces must leave a descriptor for the Ethernet header
+        for (uint16_t left = frag_len; left;) {
+            if (n == E1000_TX_MAX_SEGS - 1) {
+                return -E_INVAL;
+            }
+            uint16_t len = MIN(left, segs[seg].len - seg_off);
+            v[n].addr = (const uint8_t *)segs[seg].addr + seg_off;
+            v[n].len = len;
+            v[n].pb = segs[seg].pb;
+            n++;
+            left -= len;
+            seg_off += len;
+            if (seg_off == segs[seg].len) {
+                seg++;
+                seg_off = 0;
+            }
+        }
+
+        struct ip_hdr frag = *hdr;
+        frag.ip_total_length = JHTONS(frag_len + IP_HEADER_LEN);
+        frag.ip_flags_offset = JHTONS((off >> 3) | (off + frag_len < length ? IP_MF : 0));
+        if (!csum.flags) {
+            frag.ip_header_checksum = ip_checksum((void *)&frag, IP_HEADER_LEN);
+        }
+        v[0].addr = &frag;
+        v[0].len = IP_HEADER_LEN;
+        v[0].pb = NULL;
+
+        struct eth_hdr e_hdr;
+        e_hdr.eth_type = JHTONS(ETH_TYPE_IP);
+        int rc = eth_sendv(&e_hdr, v, n, csum.flags ? &csum : NULL);
+        if (rc < 0) {
+            return rc;
+        }
+        off += frag_len;
+    }
+    return 0;
+}
+
+/**
+ * Объявляем ethernet-хедер, инициализируем ip-хедер.
+ * вычисляем чек-сумму и передаём заголовок и куски нагрузки на уровень Ethernet,
+ * чтобы карта собрала из них пакет сама, без промежуточных копий.
+ * Если карта умеет, check-сумму заголовка считает она. l4_csum_off - смещение
+ * поля check-суммы TCP/UDP в нагрузке, если её должна досчитать карта
+ * (в поле уже лежит сумма псевдозаголовка), иначе 0.
+ * mss != 0 - пакет TCP больше MTU, карта нарежет его на сегменты (TSO),
+ * повторяя заголовки IP и TCP (l4_hdr_len байт, первый кусок); сумма
+ * псевдозаголовка в поле check-суммы TCP тогда без длины.
+ * Без TSO нагрузка больше MTU уходит фрагментами.
  */
 int
-ip_send(struct ip_pkt *pkt, uint16_t length) {
+ip_sendv_tso(struct ip_hdr *hdr, const struct tx_seg *segs, int nsegs, uint8_t l4_csum_off,
+             uint8_t l4_hdr_len, uint16_t mss) {
     if (trace_packet_processing) cprintf("Sending IP packet\n");
     static uint16_t packet_id = 0;
 
+    if (nsegs + 1 > (mss ? E1000_TSO_MAX_SEGS : E1000_TX_MAX_SEGS) - 1) {
+        return -E_INVAL;
+    }
+
+    struct tx_seg v[E1000_TSO_MAX_SEGS];
+    size_t length = 0;
+    v[0].addr = hdr;
+    v[0].len = IP_HEADER_LEN;
+    v[0].pb = NULL;
+    for (int i = 0; i < nsegs; i++) {
+        v[i + 1] = segs[i];
+        length += segs[i].len;
+    }
+    if (length > IP_MAX_LEN - IP_HEADER_LEN) {
+        return -E_INVAL;
+    }
+
     struct eth_hdr e_hdr;
-    struct ip_hdr *hdr = &pkt->hdr;
     hdr->ip_verlen = IP_VER_LEN;
     hdr->ip_tos = 0;
     hdr->ip_total_length = JHTONS(length + IP_HEADER_LEN);
@@ -64,40 +238,464 @@ ip_send(struct ip_pkt *pkt, uint16_t length) {
     hdr->ip_flags_offset = 0;
     hdr->ip_ttl = IP_TTL;
     hdr->ip_header_checksum = 0;
-    hdr->ip_header_checksum = ip_checksum((void *)pkt, IP_HEADER_LEN);
-    packet_id++;
+    // every segment cut by the NIC takes its own id
+    packet_id += mss ? (length - l4_hdr_len + mss - 1) / mss : 1;
+
+    if (!mss && length > IP_DATA_LEN) {
+        return ip_fragment(hdr, segs, nsegs, length, l4_csum_off);
+    }
+
+    struct tx_csum csum = {};
+    csum.ipcss = 0;
+    csum.ipcso = offsetof(struct ip_hdr, ip_header_checksum);
+    csum.tucss = IP_HEADER_LEN;
+    if (netif_csum_caps(JNTOHL(hdr->ip_destination_address)) & E1000_CAP_CSUM_TX_IP) {
+        csum.flags |= E1000_TX_CSUM_IP;
+    } else {
+        hdr->ip_header_checksum = ip_checksum((void *)hdr, IP_HEADER_LEN);
+    }
+    if (l4_csum_off) {
+        csum.flags |= E1000_TX_CSUM_L4;
+        csum.tucso = IP_HEADER_LEN + l4_csum_off;
+    }
+    if (mss) {
+        csum.flags |= E1000_TX_TSO;
+        csum.hdrlen = IP_HEADER_LEN + l4_hdr_len;
+        csum.mss = mss;
+    }
+
+    // header goes into the headroom of a pool buffer, the packet stays one piece
+    struct tx_seg *pkt = v;
+    if (pbuf_headroom(segs[0].pb, segs[0].addr) >= IP_HEADER_LEN) {
+        uint8_t *room = (uint8_t *)segs[0].addr - IP_HEADER_LEN;
+        memcpy(room, hdr, IP_HEADER_LEN);
+        pkt = &v[1];
+        pkt->addr = room;
+        pkt->len += IP_HEADER_LEN;
+    }
+
     e_hdr.eth_type = JHTONS(ETH_TYPE_IP);
+    return eth_sendv(&e_hdr, pkt, nsegs + 1 - (pkt - v), csum.flags ? &csum : NULL);
+}
+
+int
+ip_sendv(struct ip_hdr *hdr, const struct tx_seg *segs, int nsegs, uint8_t l4_csum_off) {
+    return ip_sendv_tso(hdr, segs, nsegs, l4_csum_off, 0, 0);
+}
+
+/**
+ * Отправка IP-пакета, нагрузка которого лежит сразу за заголовком.
+ */
+int
+ip_send(struct ip_pkt *pkt, uint16_t length) {
+    struct tx_seg seg = {pkt->data, length};
     // length - data length
-    return eth_send(&e_hdr, (void *)pkt, sizeof(struct ip_hdr) + length);
+    return ip_sendv(&pkt->hdr, &seg, 1, 0);
+}
+
+// Payload piece of a datagram being reassembled
+struct ip_frag {
+    struct ip_frag *next;
+    uint16_t offset;
+    uint16_t len;
+    uint8_t data[IP_MTU_DATA_LEN];
+};
+
+// Datagram being reassembled, its fragments are sorted by offset and do not overlap
+struct ip_reasm {
+    bool used;
+    struct ip_hdr hdr;      // addresses, protocol and id are the key
+    bool has_first;         // hdr is taken from the fragment at offset 0
+    uint32_t total;         // payload length, known from the last fragment
+    uint32_t received;      // payload bytes, the datagram is whole once it is total
+    uint64_t deadline;      // ms
+    struct ip_frag *frags;
+};
+
+static struct ip_reasm ip_reasm_table[IP_REASM_MAX];
+static struct slab_cache ip_frag_cache;
+static size_t ip_reasm_mem;
+// Reassembled datagram handed to its protocol. Nobody keeps it: an echo
+// reply built in it in place is copied out by the interface before
+// transmit returns (only pool buffers are sent from where they lie),
+// so the next datagram may be reassembled here at once.
+static uint8_t ip_reasm_buf[IP_MAX_LEN] __attribute__((aligned(8)));
+
+void
+ip_init(void) {
+    slab_init(&ip_frag_cache, "ip_frag", sizeof(struct ip_frag));
+}
+
+static void
+ip_reasm_free(struct ip_reasm *r) {
+    while (r->frags) {
+        struct ip_frag *frag = r->frags;
+        r->frags = frag->next;
+        slab_free(&ip_frag_cache, frag);
+        ip_reasm_mem -= sizeof(*frag);
+    }
+    r->used = false;
+}
+
+/**
+ * Находит сборку датаграммы, которой принадлежит фрагмент, или заводит новую.
+ * Если места нет, вытесняется самая старая.
+ */
+static struct ip_reasm *
+ip_reasm_find(struct ip_hdr *hdr) {
+    struct ip_reasm *free = NULL, *oldest = NULL;
+
+    for (int i = 0; i < IP_REASM_MAX; i++) {
+        struct ip_reasm *r = &ip_reasm_table[i];
+        if (!r->used) {
+            if (!free) free = r;
+            continue;
+        }
+        if (r->hdr.ip_id == hdr->ip_id && r->hdr.ip_protocol == hdr->ip_protocol &&
+            r->hdr.ip_source_address == hdr->ip_source_address &&
+            r->hdr.ip_destination_address == hdr->ip_destination_address) {
+            return r;
+        }
+        if (!oldest || r->deadline < oldest->deadline) oldest = r;
+    }
+
+    if (!free) {
+        if (trace_packet_processing) cprintf("IP reassembly table is full, oldest datagram dropped\n");
+        ip_reasm_free(oldest);
+        free = oldest;
+    }
+    memset(free, 0, sizeof(*free));
+    free->used = true;
+    free->hdr = *hdr;
+    free->deadline = hpet_msec() + IP_REASM_TIMEOUT;
+    return free;
+}
+
+/**
+ * Держит память фрагментов в пределах IP_REASM_MEM_MAX,
+ * освобождая самые старые сборки, кроме keep
+ */
+static bool
+ip_reasm_reserve(struct ip_reasm *keep) {
+    while (ip_reasm_mem + sizeof(struct ip_frag) > IP_REASM_MEM_MAX) {
+        struct ip_reasm *oldest = NULL;
+        for (int i = 0; i < IP_REASM_MAX; i++) {
+            struct ip_reasm *r = &ip_reasm_table[i];
+            if (r->used && r != keep && (!oldest || r->deadline < oldest->deadline)) oldest = r;
+        }
+        if (!oldest) return false;
+        ip_reasm_free(oldest);
+    }
+    return true;
+}
+
+/**
+ * Конец нагрузки в последнем из уже полученных фрагментов
+ */
+static uint32_t
+ip_reasm_end(struct ip_reasm *r) {
+    struct ip_frag *frag = r->frags;
+    while (frag && frag->next) {
+        frag = frag->next;
+    }
+    return frag ? frag->offset + frag->len : 0;
+}
+
+/**
+ * Кладёт кусок нагрузки в сборку. Байты, которые уже есть, отбрасываются,
+ * а фрагменты, полностью перекрытые новым, заменяются им.
+ */
+static int
+ip_reasm_insert(struct ip_reasm *r, uint32_t offset, const uint8_t *data, uint32_t len) {
+    struct ip_frag **link = &r->frags, *prev = NULL;
+    while (*link && (*link)->offset <= offset) {
+        prev = *link;
+        link = &prev->next;
+    }
+
+    if (prev && prev->offset + prev->len > offset) {
+        uint32_t cut = prev->offset + prev->len - offset;
+        if (cut >= len) return 0;
+        offset += cut;
+        data += cut;
+        len -= cut;
+    }
+    while (*link && offset + len >= (uint32_t)(*link)->offset + (*link)->len) {
+        struct ip_frag *next = *link;
+        *link = next->next;
+        r->received -= next->len;
+        slab_free(&ip_frag_cache, next);
+        ip_reasm_mem -= sizeof(*next);
+    }
+    if (*link && offset + len > (*link)->offset) {
+        len = (*link)->offset - offset;
+    }
+
+    if (!ip_reasm_reserve(r)) return -E_NO_MEM;
+    struct ip_frag *frag = slab_alloc(&ip_frag_cache);
+    if (!frag) return -E_NO_MEM;
+    ip_reasm_mem += sizeof(*frag);
+
+    frag->offset = offset;
+    frag->len = len;
+    memcpy(frag->data, data, len);
+    frag->next = *link;
+    *link = frag;
+    r->received += len;
+    return 0;
+}
+
+/**
+ * Сборка фрагментированной датаграммы (RFC 791, RFC 815). Фрагменты
+ * копируются, так что приёмный буфер карты возвращается сразу.
+ * Возвращает собранную датаграмму или NULL, пока не хватает частей.
+ */
+static struct ip_pkt *
+ip_reassemble(struct ip_pkt *pkt) {
+    struct ip_hdr *hdr = &pkt->hdr;
+    uint16_t flags_offset = JNTOHS(hdr->ip_flags_offset);
+    uint32_t offset = (uint32_t)(flags_offset & IP_OFFSET_MASK) << 3;
+    uint32_t len = JNTOHS(hdr->ip_total_length) - IP_HEADER_LEN;
+    bool more = flags_offset & IP_MF;
+
+    // every fragment but the last carries a multiple of 8 bytes
+    if (!len || (more && (len & 7)) || offset + len > IP_MAX_LEN - IP_HEADER_LEN) {
+        return NULL;
+    }
+
+    struct ip_reasm *r = ip_reasm_find(hdr);
+    // fragments must agree on where the datagram ends, otherwise
+    // it never completes: drop it now instead of after the timeout
+    if ((!more && ((r->total && r->total != offset + len) || ip_reasm_end(r) > offset + len)) ||
+        (more && r->total && offset + len >= r->total)) {
+        if (trace_packet_processing) cprintf("Inconsistent IP fragments, datagram dropped\n");
+        ip_reasm_free(r);
+        net_drops.ip++;
+        return NULL;
+    }
+    if (!more) {
+        r->total = offset + len;
+    }
+    if (!offset && !r->has_first) {
+        r->hdr = *hdr;
+        r->has_first = true;
+    }
+    if (ip_reasm_insert(r, offset, pkt->data, len) < 0) {
+        if (trace_packet_processing) cprintf("No memory for IP fragment\n");
+        return NULL;
+    }
+    if (!r->total || r->received != r->total) {
+        return NULL;
+    }
+
+    struct ip_pkt *whole = (struct ip_pkt *)ip_reasm_buf;
+    whole->hdr = r->hdr;
+    whole->hdr.ip_total_length = JHTONS(r->total + IP_HEADER_LEN);
+    whole->hdr.ip_flags_offset = 0;
+    for (struct ip_frag *frag = r->frags; frag; frag = frag->next) {
+        memcpy(ip_reasm_buf + IP_HEADER_LEN + frag->offset, frag->data, frag->len);
+    }
+    ip_reasm_free(r);
+    return whole;
+}
+
+/**
+ * Вызывается на каждый тик таймера: выбрасывает датаграммы,
+ * которые не собрались за IP_REASM_TIMEOUT
+ */
+void
+ip_timer(void) {
+    uint64_t now = hpet_msec();
+
+    for (int i = 0; i < IP_REASM_MAX; i++) {
+        struct ip_reasm *r = &ip_reasm_table[i];
+        if (r->used && r->deadline <= now) {
+            if (trace_packet_processing) cprintf("IP reassembly timed out\n");
+            ip_reasm_free(r);
+        }
+    }
+}
+
+/**
+ * Передаёт нагрузку IP-пакета обработчику её протокола
+ */
+static int
+ip_deliver(struct ip_pkt *pkt, uint8_t csum) {
+    struct ip_hdr *hdr = &pkt->hdr;
+    int res = 0;
+    if (hdr->ip_protocol == IP_PROTO_TCP) {
+        if ((res = tcp_recv(pkt, csum)) < 0) net_drops.tcp++;
+    } else  if (hdr->ip_protocol == IP_PROTO_UDP) {
+        if ((res = udp_recv(pkt, csum)) < 0) net_drops.udp++;
+    } else if (hdr->ip_protocol == IP_PROTO_ICMP) {
+        if ((res = icmp_echo_reply(pkt)) < 0) net_drops.icmp++;
+    } else {
+        if (trace_packet_processing) cprintf("this packet was recieved by unsupported protocol\n");
+    }
+
+    return res;
 }
 
 /**
  * Обрабатываем IP-пакет, предварительно вычислив чексумму.
  * Данный пакет должен содержать TCP/UDP/ICMP нагрузку.
+ * Пакет лежит в приёмном буфере карты, обработчики не должны его сохранять.
+ * len - сколько байт пакета действительно принято.
+ * csum - check-суммы, уже проверенные картой (PBUF_CSUM_*), их не пересчитываем.
  */
 int
-ip_recv(struct ip_pkt *pkt) {
+ip_recv(struct ip_pkt *pkt, size_t len, uint8_t csum) {
     if (trace_packet_processing) cprintf("Processing IP packet\n");
     struct ip_hdr *hdr = &pkt->hdr;
-    if (hdr->ip_verlen != IP_VER_LEN) {
+    if (len < IP_HEADER_LEN || hdr->ip_verlen != IP_VER_LEN) {
+        net_drops.ip++;
         return -E_UNS_VER;
     }
+    // packet is parsed in place, so its length must fit in the frame
+    // and in the bytes actually received, the rest is Ethernet padding
+    if (JNTOHS(hdr->ip_total_length) < IP_HEADER_LEN ||
+        JNTOHS(hdr->ip_total_length) > IP_MTU ||
+        JNTOHS(hdr->ip_total_length) > len) {
+        net_drops.ip++;
+        return -E_INVAL;
+    }
 
-    uint16_t checksum = hdr->ip_header_checksum;
-    hdr->ip_header_checksum = 0;
-    if (checksum != ip_checksum((void *)pkt, IP_HEADER_LEN)) {
-        return -E_INV_CHS;
+    if (!(csum & PBUF_CSUM_IP)) {
+        uint16_t checksum = hdr->ip_header_checksum;
+        hdr->ip_header_checksum = 0;
+        if (checksum != ip_checksum((void *)pkt, IP_HEADER_LEN)) {
+            net_drops.ip++;
+            return -E_INV_CHS;
+        }
     }
 
-    if (hdr->ip_protocol == IP_PROTO_TCP) {
-        return tcp_recv(pkt);
-    } else  if (hdr->ip_protocol == IP_PROTO_UDP) {
-        return udp_recv(pkt);
-    } else if (hdr->ip_protocol == IP_PROTO_ICMP) {
-        return icmp_echo_reply(pkt);
+    if (JNTOHS(hdr->ip_flags_offset) & (IP_MF | IP_OFFSET_MASK)) {
+        // fragment: the datagram goes up once all of it is here,
+        // the NIC could not check a checksum spread over fragments
+        struct ip_pkt *whole = ip_reassemble(pkt);
+        return whole ? ip_deliver(whole, PBUF_CSUM_IP) : 0;
+    }
+
+    return ip_deliver(pkt, csum);
+}
+
+#define IP_TEST_SRC   JHTONL(IP(172, 16, 9, 1))
+#define IP_TEST_PROTO 253   // RFC 3692, for experiments, nobody takes it
+
+static uint8_t
+ip_test_byte(uint32_t n) {
+    return n * 7 + (n >> 8);
+}
+
+/**
+ * Фрагмент датаграммы id с байтами нагрузки ip_test_byte(offset...)
+ */
+static struct ip_pkt *
+ip_test_frag(uint16_t id, uint32_t offset, uint32_t len, bool more) {
+    static struct ip_pkt pkt;
+
+    memset(&pkt.hdr, 0, IP_HEADER_LEN);
+    pkt.hdr.ip_verlen = IP_VER_LEN;
+    pkt.hdr.ip_total_length = JHTONS(len + IP_HEADER_LEN);
+    pkt.hdr.ip_id = JHTONS(id);
+    pkt.hdr.ip_flags_offset = JHTONS((offset >> 3) | (more ? IP_MF : 0));
+    pkt.hdr.ip_ttl = IP_TTL;
+    pkt.hdr.ip_protocol = IP_TEST_PROTO;
+    pkt.hdr.ip_source_address = IP_TEST_SRC;
+    pkt.hdr.ip_destination_address = JHTONL(MY_IP);
+    pkt.hdr.ip_header_checksum = ip_checksum((void *)&pkt.hdr, IP_HEADER_LEN);
+    for (uint32_t i = 0; i < len; i++) {
+        pkt.data[i] = ip_test_byte(offset + i);
+    }
+    return &pkt;
+}
+
+static struct ip_reasm *
+ip_test_find(uint16_t id) {
+    for (int i = 0; i < IP_REASM_MAX; i++) {
+        struct ip_reasm *r = &ip_reasm_table[i];
+        if (r->used && r->hdr.ip_source_address == IP_TEST_SRC && r->hdr.ip_id == JHTONS(id)) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Самопроверка сборки: фрагменты не по порядку и с перекрытием,
+ * противоречивый конец датаграммы, истечение времени, вытеснение
+ * старейшей сборки и приём кадра в полный MTU. Возвращает число ошибок.
+ */
+int
+ip_selftest(void) {
+    size_t mem = ip_reasm_mem;
+    int errors = 0;
+
+    // the last piece first, then pieces overlapping each other
+    struct ip_pkt *whole = ip_reassemble(ip_test_frag(1, 2960, 100, false));
+    whole = whole ? whole : ip_reassemble(ip_test_frag(1, 0, 1480, true));
+    whole = whole ? whole : ip_reassemble(ip_test_frag(1, 1000, 1000, true));
+    if (whole) {
+        cprintf("ip: datagram with a hole reassembled\n");
+        errors++;
+    } else if (!(whole = ip_reassemble(ip_test_frag(1, 1480, 1480, true))) ||
+               JNTOHS(whole->hdr.ip_total_length) != 3060 + IP_HEADER_LEN ||
+               whole->hdr.ip_flags_offset) {
+        cprintf("ip: datagram not reassembled\n");
+        errors++;
     } else {
-        if (trace_packet_processing) cprintf("this packet was recieved by unsupported protocol\n");
+        for (uint32_t i = 0; i < 3060; i++) {
+            if (whole->data[i] != ip_test_byte(i)) {
+                cprintf("ip: reassembled datagram differs at %u\n", i);
+                errors++;
+                break;
+            }
+        }
     }
 
-    return 0;
+    // a fragment past the end set by the last one
+    ip_reassemble(ip_test_frag(2, 800, 80, false));
+    ip_reassemble(ip_test_frag(2, 1600, 80, true));
+    if (ip_test_find(2)) {
+        cprintf("ip: inconsistent fragments kept\n");
+        errors++;
+    }
+
+    ip_reassemble(ip_test_frag(3, 0, 80, true));
+    struct ip_reasm *r = ip_test_find(3);
+    if (r) {
+        r->deadline = hpet_msec();
+        ip_timer();
+    }
+    if (!r || ip_test_find(3)) {
+        cprintf("ip: reassembly does not time out\n");
+        errors++;
+    }
+
+    // a full table gives up the oldest datagram
+    for (int i = 0; i <= IP_REASM_MAX; i++) {
+        ip_reassemble(ip_test_frag(16 + i, 0, 80, true));
+        if (!i && (r = ip_test_find(16))) r->deadline = 0;
+    }
+    if (ip_test_find(16) || !ip_test_find(16 + IP_REASM_MAX)) {
+        cprintf("ip: wrong datagram evicted from a full table\n");
+        errors++;
+    }
+
+    // fragments come in frames of the whole MTU
+    struct ip_pkt *pkt = ip_test_frag(64, 0, IP_MTU_DATA_LEN, true);
+    if (ip_recv(pkt, IP_MTU, 0) < 0 || !ip_test_find(64)) {
+        cprintf("ip: %d byte fragment refused\n", IP_MTU);
+        errors++;
+    }
+
+    for (int i = 0; i < IP_REASM_MAX; i++) {
+        r = &ip_reasm_table[i];
+        if (r->used && r->hdr.ip_source_address == IP_TEST_SRC) ip_reasm_free(r);
+    }
+    if (ip_reasm_mem != mem) {
+        cprintf("ip: %ld bytes of fragments leaked\n", (long)(ip_reasm_mem - mem));
+        errors++;
+    }
+    return errors;
 }
@@ -19,6 +19,17 @@ struct ip_hdr {
 
 #define IP_HEADER_LEN  sizeof(struct ip_hdr)
 #define IP_DATA_LEN (ETH_MAX_PACKET_SIZE - ETH_HEADER_LEN - IP_HEADER_LEN)
+#define IP_MTU 1500 // Largest datagram taken from the wire in one frame
+#define IP_MTU_DATA_LEN (IP_MTU - IP_HEADER_LEN)
+
+// Pseudo header covered by TCP and UDP checksums
+struct ip_pseudo_hdr {
+    uint32_t source_address;
+    uint32_t destination_address;
+    uint8_t zero;
+    uint8_t protocol;
+    uint16_t length;
+} __attribute__((packed));
 
 struct ip_pkt {
     struct ip_hdr hdr;
@@ -28,13 +39,35 @@ struct ip_pkt {
 uint32_t ip2num(int8_t ip[4]);
 void num2ip(int32_t num);
 uint16_t ip_checksum(void* vdata, size_t length);
+uint32_t ip_checksum_partial(uint32_t sum, const void* vdata, size_t length);
+uint32_t ip_checksum_partial_ref(uint32_t sum, const void* vdata, size_t length);
+uint16_t ip_checksum_finish(uint32_t sum);
+uint16_t ip_checksum_adjust(uint16_t checksum, const void* old, const void* new, size_t length);
 int ip_send(struct ip_pkt* pkt, uint16_t length);
-int ip_recv(struct ip_pkt* pkt);
+int ip_sendv(struct ip_hdr* hdr, const struct tx_seg* segs, int nsegs, uint8_t l4_csum_off);
+int ip_sendv_tso(struct ip_hdr* hdr, const struct tx_seg* segs, int nsegs, uint8_t l4_csum_off,
+                 uint8_t l4_hdr_len, uint16_t mss);
+void ip_init(void);
+int ip_recv(struct ip_pkt* pkt, size_t len, uint8_t csum);
+void ip_timer(void);
+int ip_selftest(void);
+uint32_t ip_pseudo_sum(const struct ip_hdr* hdr, uint16_t length);
 
 #define IP_VER 0x4
 #define IP_HLEN    (IP_HEADER_LEN / sizeof(uint32_t))
 #define IP_VER_LEN (IP_VER << 4 | IP_HLEN)
 #define IP_TTL 64
+#define IP_MAX_LEN 65535
+
+// ip_flags_offset, host byte order
+#define IP_DF 0x4000            // Don't fragment
+#define IP_MF 0x2000            // More fragments
+#define IP_OFFSET_MASK 0x1FFF   // Offset in 8 byte units
+
+#define IP_FRAG_DATA_LEN (IP_DATA_LEN & ~7) // Payload of a fragment but the last
+#define IP_REASM_MAX 16                 // Datagrams reassembled at once
+#define IP_REASM_MEM_MAX (256 * 1024)   // Bytes held by their fragments
+#define IP_REASM_TIMEOUT 30000          // ms, then a datagram is dropped
 
 #define IP_PROTO_ICMP 1
 #define IP_PROTO_UDP  17
@@ -45,5 +78,9 @@ int ip_recv(struct ip_pkt* pkt);
 #define MY_IP        IP(172, 16, 0, 2)
 #define HOST_IP      IP(172, 16, 0, 1)
 #define BROADCAST_IP IP(172, 16, 0, 255)
+#define LOOPBACK_IP  IP(127, 0, 0, 1)
+
+// 127.0.0.0/8 never leaves the host
+#define IP_IS_LOOPBACK(ip) (((ip) >> 24) == 127)
 
 #endif
@@ -20,14 +20,19 @@
 #include <kern/sched.h>
 
 #include <kern/ip.h>
+#include <kern/arp.h>
 #include <kern/inet.h>
 #include <inc/error.h>
 #include <kern/eth.h>
+#include <kern/netif.h>
 #include <kern/icmp.h>
 #include <kern/udp.h>
 #include <kern/tcp.h>
+#include <kern/socket.h>
 #include <kern/traceopt.h>
 #include <kern/http.h>
+#include <kern/pktgen.h>
+#include <inc/checksum.h>
 
 #define WHITESPACE "\t\r\n "
 #define MAXARGS    16
@@ -50,6 +55,13 @@ int mon_virt(int argc, char **argv, struct Trapframe *tf);
 int mon_e1000_recv(int argc, char **argv, struct Trapframe *tf);
 int mon_e1000_tran(int argc, char **argv, struct Trapframe *tf);
 int mon_http_test(int argc, char **argv, struct Trapframe *tf);
+int mon_httpstat(int argc, char **argv, struct Trapframe *tf);
+int mon_http_bench(int argc, char **argv, struct Trapframe *tf);
+int mon_pktgen(int argc, char **argv, struct Trapframe *tf);
+int mon_csum_bench(int argc, char **argv, struct Trapframe *tf);
+int mon_tcpstat(int argc, char **argv, struct Trapframe *tf);
+int mon_tcp_cc(int argc, char **argv, struct Trapframe *tf);
+int mon_nettest(int argc, char **argv, struct Trapframe *tf);
 
 struct Command {
     const char *name;
@@ -73,6 +85,13 @@ static struct Command commands[] = {
         {"e1000_recv", "Test e1000 receive", mon_e1000_recv},
         {"e1000_tran", "Test e1000 transmit", mon_e1000_tran},
         {"http_test", "Test http parsing", mon_http_test},
+        {"httpstat", "Display HTTP requests and the file cache", mon_httpstat},
+        {"http_bench", "Check and benchmark HTTP response headers [iterations]", mon_http_bench},
+        {"pktgen", "Benchmark the stack: pktgen arp|icmp|udp|tcp [count] [size] [eth|ip|all] [pps]", mon_pktgen},
+        {"csum_bench", "Check and benchmark IP checksum [MB per size]", mon_csum_bench},
+        {"tcpstat", "Display TCP counters, connections and packet buffers", mon_tcpstat},
+        {"tcp_cc", "Show or set congestion control of new TCP connections [newreno|cubic]", mon_tcp_cc},
+        {"nettest", "Run self-tests of the network stack [lo|arp|ip|tcp|udp|http]", mon_nettest},
         {"exit", "Normal exit from monitor", mon_exit},
 };
 
@@ -230,7 +249,7 @@ mon_dumpcmos(int argc, char **argv, struct Trapframe *tf) {
 int
 mon_e1000_recv(int argc, char **argv, struct Trapframe *tf) {
     char buf[1000];
-    int len = e1000_receive(buf);
+    int len = e1000_receive(buf, sizeof(buf));
     cprintf("received len: %d\n", len);
     cprintf("received packet: ");
     for (int i = 0; i < len; i++) {
@@ -240,49 +259,33 @@ mon_e1000_recv(int argc, char **argv, struct Trapframe *tf) {
     return 0;
 }
 
-static inline bool
-is_time_over(uint64_t *a, uint64_t *b, uint64_t *timeout) {
-    static uint64_t cpu_frequency;
-    if (!cpu_frequency) {
-        cpu_frequency = hpet_cpu_frequency();
-    }
-
-    asm("pause");
-    *b = read_tsc();
-
-    return (*b - *a < *timeout * cpu_frequency) ? false : true;
-}
-
+/* Drains every received frame, looped back ones included, then sleeps until the e1000
+ * raises an RX interrupt. Never returns: the caller is resumed
+ * from its syscall once the NIC wakes it up. */
 int
 mon_eth_recieve(struct Trapframe *tf) {
 
     int len = 0;
-    uint64_t tsc0 = read_tsc(), tsc1 = 0;
-    uint64_t timeout = 45;
-    char buf[1000];
 
+    // Replies to the whole burst go out with a single doorbell
+    e1000_tx_batch_begin();
     do {
-        memset(buf, 0, sizeof(buf));
-
-        while (e1000_timeout_listen(0.01)) {};
-        len = eth_recieve(buf);
+        while (netif_rx_ready()) {
+            len = eth_recieve();
 
-        if (trace_packets && len >= 0) {
-            cprintf("received len: %d\n", len);
-            if (len > 0) {
-                cprintf("received packet: ");
-                for (int i = 0; i < len; i++) {
-                    cprintf("%x ", buf[i] & 0xff);
-                }
-                cprintf("\n");
+            // nothing is printed per frame unless packets are traced
+            if (trace_packets) {
+                cprintf("received status: %s, len %d\n\n", (len >= 0) ? "OK" : "ERROR", len);
             }
-        } else {
-            cprintf("received status: %s%s\n", (len >= 0) ? "OK" : "ERROR", (len == 0) ? " EMPTY" : " ");
         }
-        cprintf("\n");
-
-    } while (!is_time_over(&tsc0, &tsc1, &timeout));
-
+        // one ACK per connection for the whole burst, looped back ones come around again
+        tcp_flush_acks();
+    } while (netif_rx_ready());
+    e1000_tx_batch_end();
+    // clients sleeping on sockets the burst made ready
+    ksock_wakeup();
+
+    e1000_wait_receive();
     sched_yield();
 }
 
@@ -297,24 +300,260 @@ mon_e1000_tran(int argc, char **argv, struct Trapframe *tf) {
 
 int
 mon_http_test(int argc, char **argv, struct Trapframe *tf) {
+    char *bufs[] = {"Hello, HTTP!\r\n\r\n", "GET /hello.world HTTP/2\r\n\r\n",
+                    "POST /hello.world HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello",
+                    "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5;x=y\r\nhello\r\n0\r\n\r\n",
+                    "GET /hello.world HTTP/1.1\r\nHost: jos\r\nConnection:  keep-alive \r\n\r\n"};
+    static struct http_parser parser;
     char reply[1024] = {};
     size_t reply_len = 0;
+    struct str_part body;
+
+    for (size_t i = 0; i < sizeof(bufs) / sizeof(*bufs); i++) {
+        // the whole request at once, then byte by byte as if split by segments
+        for (size_t step = strlen(bufs[i]); step; step = step > 1 ? 1 : 0) {
+            size_t off = 0, len = strlen(bufs[i]);
+            http_parser_init(&parser);
+            while (off < len && parser.state != HTTP_PS_DONE && parser.state != HTTP_PS_ERROR) {
+                off += http_parser_feed(&parser, bufs[i] + off, MIN(step, len - off), &body);
+            }
+            int code = parser.state == HTTP_PS_DONE ? 0 : parser.error ? parser.error : 400;
+            cprintf("%s\n", code ? "FAULT" : "SUCCESS");
+            http_reply(code ? code : 200, NULL, reply, &reply_len);
+            udp_send(reply, reply_len);
+        }
+    }
+    return 0;
+}
+
+int
+mon_httpstat(int argc, char **argv, struct Trapframe *tf) {
+    http_print_stats();
+    return 0;
+}
+
+/* Cycles to render one response header */
+static uint64_t
+http_bench_run(size_t (*fn)(int, int, size_t, char *), int code, size_t length, uint64_t iters) {
+    static char buf[HTTP_HDR_MAX];
+
+    uint64_t tsc0 = read_tsc();
+    for (uint64_t i = 0; i < iters; i++) {
+        fn(code, HTTP_TYPE_HTML, length + (i & 1), buf);
+    }
+    return (read_tsc() - tsc0) / iters;
+}
+
+/* Compares response headers put together from templates against
+ * the snprintf reference and prints cycles per header of both */
+int
+mon_http_bench(int argc, char **argv, struct Trapframe *tf) {
+    static const int codes[] = {200, 404, 431, 999};
+    static const size_t lengths[] = {0, 1460, 4 * 1024 * 1024, (size_t)-2};
+    uint64_t iters = argc > 1 ? strtol(argv[1], NULL, 0) : 100000;
+    char ref[HTTP_HDR_MAX], tmpl[HTTP_HDR_MAX];
+
+    iters = MAX(iters, 1);
+    int errors = 0;
+    cprintf("%5s %20s %8s %8s\n", "code", "length", "ref cyc", "tmpl cyc");
+    for (size_t i = 0; i < sizeof(codes) / sizeof(*codes); i++) {
+        for (size_t j = 0; j < sizeof(lengths) / sizeof(*lengths); j++) {
+            // both take the date of the same second unless it just changed
+            size_t ref_len = http_render_hdr_ref(codes[i], HTTP_TYPE_HTML, lengths[j], ref);
+            size_t tmpl_len = http_render_hdr(codes[i], HTTP_TYPE_HTML, lengths[j], tmpl);
+            if (ref_len != tmpl_len || memcmp(ref, tmpl, ref_len)) {
+                ref_len = http_render_hdr_ref(codes[i], HTTP_TYPE_HTML, lengths[j], ref);
+                if (ref_len != tmpl_len || memcmp(ref, tmpl, ref_len)) {
+                    cprintf("MISMATCH: code %d length %lu\n", codes[i], (unsigned long)lengths[j]);
+                    errors++;
+                }
+            }
+
+            uint64_t ref_cycles = http_bench_run(http_render_hdr_ref, codes[i], lengths[j], iters);
+            uint64_t tmpl_cycles = http_bench_run(http_render_hdr, codes[i], lengths[j], iters);
+            cprintf("%5d %20lu %8lu %8lu\n", codes[i], (unsigned long)lengths[j],
+                    (unsigned long)ref_cycles, (unsigned long)tmpl_cycles);
+        }
+    }
+    cprintf("%s\n", errors ? "FAULT" : "SUCCESS");
+    return 0;
+}
+
+#define CSUM_BENCH_MAX 65536
+static uint8_t csum_bench_buf[CSUM_BENCH_MAX + 8];
+
+/* Throughput of one checksum implementation in MB/s */
+static uint64_t
+csum_bench_run(uint32_t (*fn)(uint32_t, const void *, size_t), const void *buf, size_t size, uint64_t iters) {
+    volatile uint32_t sink = 0;
+
+    uint64_t tsc0 = read_tsc();
+    for (uint64_t i = 0; i < iters; i++) {
+        sink += fn(0xffff, buf, size);
+    }
+    uint64_t cycles = read_tsc() - tsc0;
+    (void)sink;
+
+    return cycles ? size * iters * hpet_cpu_frequency() / cycles / 1000000 : 0;
+}
+
+/* Compares 64-bit checksum engine against the word at a time
+ * reference over sizes and alignments and prints throughput of both */
+int
+mon_csum_bench(int argc, char **argv, struct Trapframe *tf) {
+    static const size_t sizes[] = {20, 64, 256, 576, 1460, 1500, 4096, 16384, CSUM_BENCH_MAX};
+    static const size_t aligns[] = {0, 1, 2, 4};
+    uint64_t budget = (argc > 1 ? strtol(argv[1], NULL, 0) : 4) << 20;
+
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < sizeof(csum_bench_buf); i++) {
+        seed = seed * 1103515245 + 12345;
+        csum_bench_buf[i] = seed >> 16;
+    }
+
+    int errors = 0;
+    cprintf("%8s %5s %10s %10s\n", "size", "align", "ref MB/s", "wide MB/s");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+        for (size_t j = 0; j < sizeof(aligns) / sizeof(*aligns); j++) {
+            const uint8_t *buf = csum_bench_buf + aligns[j];
+
+            // every length up to size catches tail handling bugs
+            for (size_t len = sizes[i] > 64 ? sizes[i] - 8 : 0; len <= sizes[i]; len++) {
+                if (ip_checksum_partial(0xffff, buf, len) != ip_checksum_partial_ref(0xffff, buf, len)) {
+                    cprintf("MISMATCH: len %lu align %lu\n", (unsigned long)len, (unsigned long)aligns[j]);
+                    errors++;
+                }
+            }
+
+            uint64_t iters = MAX(budget / sizes[i], 1);
+            uint64_t ref = csum_bench_run(ip_checksum_partial_ref, buf, sizes[i], iters);
+            uint64_t wide = csum_bench_run(ip_checksum_partial, buf, sizes[i], iters);
+            cprintf("%8lu %5lu %10lu %10lu\n", (unsigned long)sizes[i], (unsigned long)aligns[j],
+                    (unsigned long)ref, (unsigned long)wide);
+        }
+    }
+
+    cprintf("%s\n", errors ? "FAULT" : "SUCCESS");
+    return 0;
+}
+
+static void
+pktgen_print(const char *layer, const struct pktgen_result *res) {
+    uint64_t freq = hpet_cpu_frequency();
+    uint64_t per_pkt = res->sent ? res->cycles / res->sent : 0;
+
+    cprintf("%-4s %8lu packets, %lu cycles/packet (min %lu, max %lu), %lu pps in the stack, %lu pps overall\n",
+            layer, (unsigned long)res->sent, (unsigned long)per_pkt,
+            (unsigned long)res->min_cycles, (unsigned long)res->max_cycles,
+            (unsigned long)(res->cycles ? res->sent * freq / res->cycles : 0),
+            (unsigned long)(res->elapsed ? res->sent * freq / res->elapsed : 0));
+    cprintf("     dropped: eth %lu, arp %lu, ip %lu, icmp %lu, udp %lu, tcp %lu, loopback %lu; %lu replies\n",
+            (unsigned long)res->drops.eth, (unsigned long)res->drops.arp, (unsigned long)res->drops.ip,
+            (unsigned long)res->drops.icmp, (unsigned long)res->drops.udp, (unsigned long)res->drops.tcp,
+            (unsigned long)res->tx_drops, (unsigned long)res->replies);
+}
+
+/* Feeds generated packets straight into the stack at the Ethernet
+ * or IP layer and prints packets per second, cycles per packet and
+ * drops of each layer. With "all" both are run, their difference is
+ * the cost of the Ethernet layer. */
+int
+mon_pktgen(int argc, char **argv, struct Trapframe *tf) {
+    if (argc < 2) {
+        cprintf("Usage: pktgen arp|icmp|udp|tcp [count] [size] [eth|ip|all] [pps]\n");
+        return 0;
+    }
+    uint32_t count = argc > 2 ? strtol(argv[2], NULL, 0) : PKTGEN_COUNT_DEFAULT;
+    uint32_t size = argc > 3 ? strtol(argv[3], NULL, 0) : PKTGEN_SIZE_DEFAULT;
+    const char *layer = argc > 4 ? argv[4] : "all";
+    uint32_t pps = argc > 5 ? strtol(argv[5], NULL, 0) : 0;
+    bool arp = !strcmp(argv[1], "arp");
+    struct pktgen_result ip_res = {}, eth_res = {};
+    int res = 0;
+
+    if (strcmp(layer, "eth") && strcmp(layer, "ip") && strcmp(layer, "all")) {
+        cprintf("Unknown layer %s\n", layer);
+        return 0;
+    }
+    if (trace_packets || trace_packet_processing) {
+        cprintf("Packet tracing is off while pktgen runs\n");
+    }
+    // ARP has no IP layer to enter at
+    if (!arp && strcmp(layer, "eth")) {
+        if ((res = pktgen_run(argv[1], PKTGEN_LAYER_IP, count, size, pps, &ip_res)) == 0) {
+            pktgen_print("ip", &ip_res);
+        }
+    }
+    if (!res && strcmp(layer, "ip")) {
+        if ((res = pktgen_run(argv[1], PKTGEN_LAYER_ETH, count, size, pps, &eth_res)) == 0) {
+            pktgen_print("eth", &eth_res);
+        }
+    }
+    if (res == -E_INVAL) {
+        cprintf("Unknown protocol %s or layer %s for it\n", argv[1], layer);
+    } else if (res < 0) {
+        cprintf("pktgen: %i\n", res);
+    } else if (ip_res.sent && eth_res.sent) {
+        cprintf("Ethernet layer: %ld cycles/packet\n",
+                (long)(eth_res.cycles / eth_res.sent) - (long)(ip_res.cycles / ip_res.sent));
+    }
+    return 0;
+}
 
-    char *buf1 = "Hello, HTTP!";
-    cprintf("%s\n", http_parse(buf1, strlen(buf1), reply, &reply_len) ? "FAULT" : "SUCCESS");
-    udp_send(reply, reply_len);
+int
+mon_tcpstat(int argc, char **argv, struct Trapframe *tf) {
+    tcp_print_stats();
+    pbuf_print_stats();
+    loopback_print_stats();
+    net_print_drops();
+    return 0;
+}
+
+int
+mon_tcp_cc(int argc, char **argv, struct Trapframe *tf) {
+    if (argc > 1 && tcp_set_default_cc(argv[1]) < 0) {
+        cprintf("Unknown congestion control %s\n", argv[1]);
+        return 0;
+    }
+    cprintf("%s\n", tcp_default_cc());
+    return 0;
+}
 
-    char *buf2 = "POST /hello.world HTTP/1.1";
-    cprintf("%s\n", http_parse(buf2, strlen(buf2), reply, &reply_len) ? "FAULT" : "SUCCESS");
-    tcp_send(NULL, (void *)reply, reply_len);
+/* Self-tests of the network stack, each returns the number of errors */
+static const struct {
+    const char *name;
+    int (*run)(void);
+} net_selftests[] = {
+        {"lo", loopback_selftest},
+        {"arp", arp_selftest},
+        {"ip", ip_selftest},
+        {"tcp", tcp_selftest},
+        {"udp", udp_selftest},
+        {"http", http_selftest},
+};
 
-    char *buf3 = "GET /hello.world HTTP/2";
-    cprintf("%s\n", http_parse(buf3, strlen(buf3), reply, &reply_len) ? "FAULT" : "SUCCESS");
-    udp_send(reply, reply_len);
+int
+net_selftest(const char *name) {
+    int failed = 0, found = 0;
+
+    for (size_t i = 0; i < sizeof(net_selftests) / sizeof(*net_selftests); i++) {
+        if (name && strcmp(name, net_selftests[i].name)) continue;
+        found++;
+        int errors = net_selftests[i].run();
+        cprintf("nettest %s: %s\n", net_selftests[i].name, errors ? "FAULT" : "SUCCESS");
+        failed += errors != 0;
+    }
+    if (!found) {
+        cprintf("nettest: no test %s\n", name);
+        return -1;
+    }
+    cprintf("nettest: done, %d failed\n", failed);
+    return failed;
+}
 
-    char *buf4 = "GET /hello.world HTTP/1.1";
-    cprintf("%s\n", http_parse(buf4, strlen(buf4), reply, &reply_len) ? "FAULT" : "SUCCESS");
-    udp_send(reply, reply_len);
+int
+mon_nettest(int argc, char **argv, struct Trapframe *tf) {
+    net_selftest(argc > 1 ? argv[1] : NULL);
     return 0;
 }
 
@@ -12,4 +12,8 @@ struct Trapframe;
 void monitor(struct Trapframe *tf);
 int mon_eth_recieve(struct Trapframe *tf);
 
+/* Runs the network self-test called name, all of them if name is NULL.
+ * Returns the number of failed ones. */
+int net_selftest(const char *name);
+
 #endif /* !JOS_KERN_MONITOR_H */
@@ -0,0 +1,39 @@
+#ifndef JOS_KERN_NETIF_H
+#define JOS_KERN_NETIF_H
+
+#include <inc/types.h>
+#include <kern/e1000.h>
+
+/* Network interface beneath the Ethernet layer. eth_sendv() picks one
+ * by the destination of a frame (netif_route()), eth_recieve() takes
+ * frames from all of them. Checksum capabilities are E1000_CAP_*. */
+struct netif_ops {
+    const char *name;
+    int (*transmit)(const struct tx_seg *segs, int nsegs, const struct tx_csum *csum);
+    int (*receive)(struct pbuf *pb);    // length of the next frame, 0 - none
+    bool (*rx_ready)(void);
+    uint32_t (*csum_caps)(void);
+};
+
+extern const struct netif_ops e1000_netif;
+extern const struct netif_ops loopback_netif;
+
+#define LOOPBACK_QUEUE_MAX 512      // frames sent to ourselves and not taken yet
+
+// Counters for the monitor
+struct loopback_stats {
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t drops;
+};
+
+extern struct loopback_stats loopback_stats;
+
+const struct netif_ops *netif_route(uint32_t ip);
+uint32_t netif_csum_caps(uint32_t ip);
+bool netif_rx_ready(void);
+uint32_t loopback_flush(void);
+void loopback_print_stats(void);
+int loopback_selftest(void);
+
+#endif /* !JOS_KERN_NETIF_H */
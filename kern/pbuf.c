@@ -0,0 +1,76 @@
+#include <inc/assert.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <kern/pbuf.h>
+#include <kern/pmap.h>
+
+struct pbuf_stats pbuf_stats;
+// Free buffers of the pool linked through next
+static struct pbuf *pbuf_free_list;
+
+void
+pbuf_init(void) {
+    pbuf_free_list = NULL;
+    memset(&pbuf_stats, 0, sizeof(pbuf_stats));
+}
+
+/* Carves a new physically contiguous chunk into buffers */
+static int
+pbuf_grow(void) {
+    if (pbuf_stats.nr_total + PBUF_CHUNK_SIZE / PBUF_SIZE > PBUF_POOL_MAX) return -1;
+
+    physaddr_t pa;
+    uint8_t *chunk = kzalloc_dma_region(PBUF_CHUNK_SIZE, &pa);
+    if (!chunk) return -1;
+
+    for (size_t off = PBUF_CHUNK_SIZE; off > 0; off -= PBUF_SIZE) {
+        struct pbuf *pb = (struct pbuf *)(chunk + off - PBUF_SIZE);
+        pb->pa = pa + off - PBUF_SIZE;
+        pb->next = pbuf_free_list;
+        pbuf_free_list = pb;
+    }
+    pbuf_stats.nr_total += PBUF_CHUNK_SIZE / PBUF_SIZE;
+    return 0;
+}
+
+static void
+pbuf_pool_free(struct pbuf *pb) {
+    assert(pbuf_stats.nr_used);
+
+    pb->next = pbuf_free_list;
+    pbuf_free_list = pb;
+    pbuf_stats.nr_used--;
+}
+
+/* Returns a pool buffer with len bytes of data after the headroom and
+ * one reference, or NULL if the pool is exhausted. Data is not cleared. */
+struct pbuf *
+pbuf_alloc(size_t len) {
+    assert(len <= PBUF_DATA_LEN);
+
+    if (!pbuf_free_list && pbuf_grow() < 0) {
+        pbuf_stats.alloc_fails++;
+        return NULL;
+    }
+
+    struct pbuf *pb = pbuf_free_list;
+    pbuf_free_list = pb->next;
+    pbuf_stats.nr_used++;
+    pbuf_stats.allocs++;
+
+    pb->data = (uint8_t *)(pb + 1) + PBUF_HEADROOM;
+    pb->len = len;
+    pb->free = pbuf_pool_free;
+    pb->cookie = 0;
+    pb->csum = 0;
+    pb->ref = 1;
+    pb->next = NULL;
+    return pb;
+}
+
+void
+pbuf_print_stats(void) {
+    cprintf("pbuf pool: %u of %u buffers in use, %lu allocations, %lu failed\n",
+            pbuf_stats.nr_used, pbuf_stats.nr_total,
+            (unsigned long)pbuf_stats.allocs, (unsigned long)pbuf_stats.alloc_fails);
+}
@@ -0,0 +1,96 @@
+#ifndef JOS_KERN_PBUF_H
+#define JOS_KERN_PBUF_H
+
+#include <inc/types.h>
+
+/* Packet buffer - a window onto frame memory owned by someone else
+ * (e.g. an e1000 RX DMA buffer). Each layer parses its header in place
+ * and moves the window forward with pbuf_pull(), so the frame is never
+ * copied on its way up. The memory goes back to its owner only through
+ * pbuf_release().
+ *
+ * Buffers of the pool (pbuf_alloc()) are the frames the stack builds
+ * itself. The struct lies at the start of a physically contiguous
+ * PBUF_SIZE buffer, the data follows after PBUF_HEADROOM bytes left for
+ * the headers of the lower layers, so the NIC takes the whole frame by
+ * DMA from one place. They are reference counted: the NIC holds one
+ * while the frame is in its ring. */
+struct pbuf {
+    uint8_t *data;                  // first byte not consumed by lower layers
+    size_t len;                     // bytes left starting from data
+    void (*free)(struct pbuf *pb);  // gives the memory back to its owner
+    uint32_t cookie;                // owner private, e.g. RX descriptor index
+    uint8_t csum;                   // checksums already verified by the NIC
+    // pool buffers only
+    uint16_t ref;                   // 0 - not counted, freed by the first release
+    physaddr_t pa;                  // physical address of the buffer
+    struct pbuf *next;              // free list of the pool, owner's chain while in use
+};
+
+#define PBUF_CSUM_IP 0x01   // IPv4 header checksum is good
+#define PBUF_CSUM_L4 0x02   // TCP/UDP checksum is good
+
+#define PBUF_SIZE 2048              // pool buffer with its struct pbuf
+#define PBUF_HEADROOM 128           // Ethernet, IP and TCP headers with options
+#define PBUF_DATA_LEN (PBUF_SIZE - sizeof(struct pbuf) - PBUF_HEADROOM)
+#define PBUF_CHUNK_SIZE (64 * 1024) // grow step of the pool
+#define PBUF_POOL_MAX 8192          // buffers, 16 MB
+
+// Counters for the monitor
+struct pbuf_stats {
+    uint64_t allocs;
+    uint64_t alloc_fails;
+    uint32_t nr_total;
+    uint32_t nr_used;
+};
+
+extern struct pbuf_stats pbuf_stats;
+
+void pbuf_init(void);
+struct pbuf *pbuf_alloc(size_t len);
+void pbuf_print_stats(void);
+
+/* Strip n bytes of header, returns pointer to the stripped header
+ * or NULL if the packet is too short */
+static inline void *
+pbuf_pull(struct pbuf *pb, size_t n) {
+    if (pb->len < n) return NULL;
+
+    void *hdr = pb->data;
+    pb->data += n;
+    pb->len -= n;
+    return hdr;
+}
+
+static inline void
+pbuf_ref(struct pbuf *pb) {
+    pb->ref++;
+}
+
+static inline void
+pbuf_release(struct pbuf *pb) {
+    // pool buffers go back with the last reference
+    if (pb->ref && --pb->ref) return;
+
+    if (pb->free) pb->free(pb);
+    pb->free = NULL;
+}
+
+/* Bytes of headroom in front of addr, the start of the data of pool
+ * buffer pb or of the headers already put before it, that a header may
+ * be written to. None in the middle of the data or while a device may
+ * still be reading the buffer: only the owner holds a reference. */
+static inline size_t
+pbuf_headroom(struct pbuf *pb, const void *addr) {
+    if (!pb || pb->ref != 1 || (const uint8_t *)addr > pb->data) return 0;
+
+    return (const uint8_t *)addr - (const uint8_t *)(pb + 1);
+}
+
+/* Physical address of a byte of pool buffer pb */
+static inline physaddr_t
+pbuf_paddr(struct pbuf *pb, const void *addr) {
+    return pb->pa + ((const uint8_t *)addr - (const uint8_t *)pb);
+}
+
+#endif /* !JOS_KERN_PBUF_H */
@@ -0,0 +1,304 @@
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/x86.h>
+#include <kern/pktgen.h>
+#include <kern/arp.h>
+#include <kern/icmp.h>
+#include <kern/inet.h>
+#include <kern/netif.h>
+#include <kern/pbuf.h>
+#include <kern/tcp.h>
+#include <kern/timer.h>
+#include <kern/traceopt.h>
+#include <kern/udp.h>
+
+/* Packet generator: a frame is built once as a template, then for every
+ * packet copied to where the stack parses it in place and handed to
+ * eth_deliver() or ip_recv() directly, with no NIC involved. Only the
+ * call into the stack is timed. Packets come from our own address (ARP
+ * from PKTGEN_PEER_IP), so replies go to the loopback and are thrown
+ * away there: building and sending them is counted, receiving is not.
+ * Checksums are left for the stack to verify, like a NIC without
+ * offload would. Packet tracing is off for the run, otherwise it would
+ * time the console instead of the stack. */
+
+static uint8_t pktgen_tmpl[ETH_HEADER_LEN + IP_HEADER_LEN + IP_DATA_LEN] __attribute__((aligned(8)));
+static uint8_t pktgen_frame[sizeof(pktgen_tmpl)] __attribute__((aligned(8)));
+static size_t pktgen_len;
+
+// Connection over the loopback the TCP run feeds as the client
+static struct tcp_virtual_channel *pktgen_client;
+static struct tcp_virtual_channel *pktgen_server;
+static uint8_t pktgen_sink[TCP_DATA_LEN];
+
+// 02:00:00:00:00:c8, locally administered
+static const uint8_t pktgen_peer_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0xc8};
+
+static struct ip_hdr *
+pktgen_ip_hdr(void) {
+    return (struct ip_hdr *)(pktgen_tmpl + ETH_HEADER_LEN);
+}
+
+static void *
+pktgen_l4(void) {
+    return pktgen_tmpl + ETH_HEADER_LEN + IP_HEADER_LEN;
+}
+
+static void
+pktgen_eth(uint16_t type) {
+    struct eth_hdr *hdr = (struct eth_hdr *)pktgen_tmpl;
+    memcpy(hdr->eth_destination_mac, get_my_mac(), sizeof(hdr->eth_destination_mac));
+    memcpy(hdr->eth_source_mac, pktgen_peer_mac, sizeof(hdr->eth_source_mac));
+    hdr->eth_type = JHTONS(type);
+}
+
+/**
+ * Заголовок IP шаблона для length байт нагрузки протокола proto
+ */
+static void
+pktgen_ip(uint8_t proto, uint16_t length) {
+    struct ip_hdr *hdr = pktgen_ip_hdr();
+
+    pktgen_eth(ETH_TYPE_IP);
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->ip_verlen = IP_VER_LEN;
+    hdr->ip_total_length = JHTONS(IP_HEADER_LEN + length);
+    hdr->ip_ttl = IP_TTL;
+    hdr->ip_protocol = proto;
+    hdr->ip_source_address = JHTONL(MY_IP);
+    hdr->ip_destination_address = JHTONL(MY_IP);
+    hdr->ip_header_checksum = ip_checksum(hdr, IP_HEADER_LEN);
+    pktgen_len = ETH_HEADER_LEN + IP_HEADER_LEN + length;
+}
+
+static void
+pktgen_payload(uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        data[i] = i;
+    }
+}
+
+static void
+pktgen_arp(void) {
+    struct arp_hdr *arp = (struct arp_hdr *)(pktgen_tmpl + ETH_HEADER_LEN);
+
+    pktgen_eth(ETH_TYPE_ARP);
+    arp->hardware_type = JHTONS(ARP_ETHERNET);
+    arp->protocol_type = JHTONS(ARP_IPV4);
+    arp->hardware_address_length = sizeof(arp->source_mac);
+    arp->protocol_address_length = sizeof(arp->source_ip);
+    arp->opcode = JHTONS(ARP_REQUEST);
+    memcpy(arp->source_mac, pktgen_peer_mac, sizeof(arp->source_mac));
+    arp->source_ip = JHTONL(PKTGEN_PEER_IP);
+    memset(arp->target_mac, 0, sizeof(arp->target_mac));
+    arp->target_ip = JHTONL(MY_IP);
+    pktgen_len = ETH_HEADER_LEN + sizeof(*arp);
+}
+
+static void
+pktgen_icmp(uint32_t size) {
+    struct icmp_pkt *icmp = pktgen_l4();
+
+    size = MIN(size, (uint32_t)ICMP_DATA_LEN);
+    pktgen_ip(IP_PROTO_ICMP, ICMP_HEADER_LEN + size);
+    memset(&icmp->hdr, 0, sizeof(icmp->hdr));
+    icmp->hdr.msg_type = ECHO_REQUEST;
+    icmp->hdr.id = JHTONS(1);
+    pktgen_payload(icmp->data, size);
+    icmp->hdr.checksum = ip_checksum(icmp, ICMP_HEADER_LEN + size);
+}
+
+static void
+pktgen_udp(uint32_t size) {
+    struct udp_pkt *udp = pktgen_l4();
+    uint16_t length = UDP_HEADER_LEN + MIN(size, (uint32_t)UDP_DATA_LENGTH);
+
+    pktgen_ip(IP_PROTO_UDP, length);
+    udp->hdr.source_port = JHTONS(UDP_ECHO_PORT);
+    udp->hdr.destination_port = JHTONS(UDP_ECHO_PORT);
+    udp->hdr.length = JHTONS(length);
+    udp->hdr.checksum = 0;
+    pktgen_payload(udp->data, length - UDP_HEADER_LEN);
+    udp->hdr.checksum = ip_checksum_finish(ip_checksum_partial(ip_pseudo_sum(pktgen_ip_hdr(), length), udp, length));
+}
+
+/**
+ * Сегмент TCP с портов src на dst с номерами seq и ack, флагами flags
+ * и size байтами данных
+ */
+static void
+pktgen_tcp(uint16_t src, uint16_t dst, uint32_t seq, uint32_t ack, uint8_t flags, uint32_t size) {
+    struct tcp_pkt *tcp = pktgen_l4();
+    uint16_t length = TCP_HEADER_LEN + size;
+
+    pktgen_ip(IP_PROTO_TCP, length);
+    memset(&tcp->hdr, 0, sizeof(tcp->hdr));
+    tcp->hdr.src_port = JHTONS(src);
+    tcp->hdr.dst_port = JHTONS(dst);
+    tcp->hdr.seq_num = JHTONL(seq);
+    tcp->hdr.ack_num = JHTONL(ack);
+    tcp->hdr.data_offset = TCP_HEADER_LEN >> 2;
+    tcp->hdr.flags = flags;
+    tcp->hdr.win_size = JHTONS(0xFFFF);
+    pktgen_payload(tcp->data, size);
+    tcp->hdr.checksum = ip_checksum_finish(ip_checksum_partial(ip_pseudo_sum(pktgen_ip_hdr(), length), tcp, length));
+}
+
+/**
+ * Отдаёт стеку копию шаблона. Возвращает такты, которые он на неё потратил.
+ */
+static uint64_t
+pktgen_inject(int layer) {
+    memcpy(pktgen_frame, pktgen_tmpl, pktgen_len);
+    struct pbuf pb = {.data = pktgen_frame, .len = pktgen_len};
+
+    uint64_t tsc0 = read_tsc();
+    if (layer == PKTGEN_LAYER_ETH) {
+        eth_deliver(&pb);
+    } else {
+        ip_recv((struct ip_pkt *)(pktgen_frame + ETH_HEADER_LEN), pktgen_len - ETH_HEADER_LEN, 0);
+    }
+    // delayed ACKs of the packet are its cost too
+    tcp_flush_acks();
+    return read_tsc() - tsc0;
+}
+
+static void
+pktgen_tcp_close(void) {
+    // the client never learns of the data sent in its name, both ends are reset
+    if (pktgen_server && pktgen_server->state >= ESTABLISHED) {
+        pktgen_tcp(pktgen_server->guest_side.port, PKTGEN_TCP_PORT,
+                   pktgen_server->ack_seq.ack_num, 0, TH_RST, 0);
+        pktgen_inject(PKTGEN_LAYER_IP);
+    }
+    if (pktgen_client && pktgen_client->state >= ESTABLISHED) {
+        pktgen_tcp(PKTGEN_TCP_PORT, pktgen_client->host_side.port,
+                   pktgen_client->ack_seq.ack_num, 0, TH_RST, 0);
+        pktgen_inject(PKTGEN_LAYER_IP);
+    }
+    if (pktgen_server) tcp_close(pktgen_server);
+    if (pktgen_client) tcp_close(pktgen_client);
+    pktgen_server = pktgen_client = NULL;
+    tcp_unlisten(MY_IP, PKTGEN_TCP_PORT);
+    loopback_flush();
+}
+
+/**
+ * Устанавливает через loopback соединение, в которое пойдут сегменты
+ */
+static int
+pktgen_tcp_open(void) {
+    int res = tcp_listen(MY_IP, PKTGEN_TCP_PORT, 1, TCP_WINDOW_SIZE, true);
+    if (res < 0) return res;
+
+    if (!(pktgen_client = tcp_connect(MY_IP, PKTGEN_TCP_PORT))) {
+        tcp_unlisten(MY_IP, PKTGEN_TCP_PORT);
+        return -E_NO_MEM;
+    }
+    // the handshake goes around the loopback
+    eth_poll();
+    pktgen_server = tcp_accept(MY_IP, PKTGEN_TCP_PORT);
+    if (!pktgen_server || pktgen_server->state != ESTABLISHED || pktgen_client->state != ESTABLISHED) {
+        pktgen_tcp_close();
+        return -E_NO_ENT;
+    }
+    return 0;
+}
+
+static int
+pktgen_go(const char *proto, int layer, uint32_t count, uint32_t size, uint32_t pps,
+          struct pktgen_result *res) {
+    bool tcp = !strcmp(proto, "tcp");
+    bool arp = !strcmp(proto, "arp");
+    uint32_t seq = 0;
+
+    memset(res, 0, sizeof(*res));
+    if (arp) {
+        if (layer != PKTGEN_LAYER_ETH) return -E_INVAL;
+        pktgen_arp();
+    } else if (!strcmp(proto, "icmp")) {
+        pktgen_icmp(size);
+    } else if (!strcmp(proto, "udp")) {
+        pktgen_udp(size);
+    } else if (tcp) {
+        int rc = pktgen_tcp_open();
+        if (rc < 0) return rc;
+        size = MIN(size, (uint32_t)TCP_DATA_LEN);
+        seq = pktgen_server->ack_seq.ack_num;
+        pktgen_tcp(pktgen_client->host_side.port, PKTGEN_TCP_PORT, seq, pktgen_server->snd_end,
+                   TH_ACK | TH_PSH, size);
+    } else {
+        return -E_INVAL;
+    }
+
+    struct net_drop_stats drops = net_drops;
+    uint64_t tx_drops = loopback_stats.drops;
+    uint64_t period = pps ? hpet_cpu_frequency() / pps : 0;
+    uint64_t start = read_tsc(), next = start;
+
+    res->min_cycles = ~0ULL;
+    loopback_flush();
+    for (uint32_t i = 0; i < count; i++) {
+        if (period) {
+            while (read_tsc() < next) {
+                asm volatile("pause");
+            }
+            next += period;
+        }
+
+        uint64_t cycles = pktgen_inject(layer);
+        res->cycles += cycles;
+        res->min_cycles = MIN(res->min_cycles, cycles);
+        res->max_cycles = MAX(res->max_cycles, cycles);
+        res->sent++;
+
+        if (tcp) {
+            // data is taken away, so the window stays open
+            while (tcp_read(pktgen_server, pktgen_sink, sizeof(pktgen_sink)) > 0)
+                ;
+            struct tcp_hdr *th = pktgen_l4();
+            uint32_t old = th->seq_num;
+            seq += size;
+            th->seq_num = JHTONL(seq);
+            th->checksum = ip_checksum_adjust(th->checksum, &old, &th->seq_num, sizeof(old));
+        }
+        res->replies += loopback_flush();
+    }
+    res->elapsed = read_tsc() - start;
+
+    res->drops.eth = net_drops.eth - drops.eth;
+    res->drops.arp = net_drops.arp - drops.arp;
+    res->drops.ip = net_drops.ip - drops.ip;
+    res->drops.icmp = net_drops.icmp - drops.icmp;
+    res->drops.udp = net_drops.udp - drops.udp;
+    res->drops.tcp = net_drops.tcp - drops.tcp;
+    res->tx_drops = loopback_stats.drops - tx_drops;
+    if (!res->sent) res->min_cycles = 0;
+
+    if (tcp) {
+        pktgen_tcp_close();
+    }
+    if (arp) {
+        // the requests taught the cache a peer that does not exist
+        arp_forget(JHTONL(PKTGEN_PEER_IP));
+    }
+    return 0;
+}
+
+/**
+ * Прогоняет через стек count пакетов протокола proto (arp, icmp, udp,
+ * tcp) с size байтами нагрузки, входящих на уровне layer. pps - темп,
+ * 0 - так быстро, как стек их берёт. Трассировка пакетов на время
+ * прогона выключается.
+ */
+int
+pktgen_run(const char *proto, int layer, uint32_t count, uint32_t size, uint32_t pps,
+           struct pktgen_result *res) {
+    bool packets = trace_packets, processing = trace_packet_processing;
+
+    trace_packets = trace_packet_processing = false;
+    int rc = pktgen_go(proto, layer, count, size, pps, res);
+    trace_packets = packets;
+    trace_packet_processing = processing;
+    return rc;
+}
@@ -0,0 +1,32 @@
+#ifndef JOS_KERN_PKTGEN_H
+#define JOS_KERN_PKTGEN_H
+
+#include <inc/types.h>
+#include <kern/eth.h>
+#include <kern/ip.h>
+
+// Layer generated packets enter the stack at
+#define PKTGEN_LAYER_ETH 0      // eth_deliver(), as if the NIC received them
+#define PKTGEN_LAYER_IP  1      // ip_recv()
+
+#define PKTGEN_PEER_IP   IP(172, 16, 0, 200)   // sender of ARP requests
+#define PKTGEN_TCP_PORT  9                     // listener of the TCP run (discard)
+#define PKTGEN_COUNT_DEFAULT 10000
+#define PKTGEN_SIZE_DEFAULT  64                // payload bytes above the protocol header
+
+// Outcome of one run
+struct pktgen_result {
+    uint64_t sent;
+    uint64_t cycles;            // spent in the stack for all packets
+    uint64_t min_cycles;
+    uint64_t max_cycles;
+    uint64_t elapsed;           // TSC ticks of the whole run, pacing included
+    struct net_drop_stats drops;    // refused by each layer
+    uint64_t tx_drops;          // replies the loopback could not take
+    uint64_t replies;           // looped back replies, thrown away unprocessed
+};
+
+int pktgen_run(const char *proto, int layer, uint32_t count, uint32_t size, uint32_t pps,
+               struct pktgen_result *res);
+
+#endif /* !JOS_KERN_PKTGEN_H */
@@ -1789,6 +1789,76 @@ kzalloc_region(size_t size) {
     return (void *)res;
 }
 
+/* Same as kzalloc_region(), but returns NULL instead of panicking
+ * when the kernel heap or physical memory is exhausted,
+ * for caches that can refuse an allocation. */
+void *
+kzalloc_region_try(size_t size) {
+    assert(current_space);
+
+    size = ROUNDUP(size, PAGE_SIZE);
+
+    if (metaheaptop + size > KERN_HEAP_END) return NULL;
+
+    uintptr_t res = metaheaptop;
+    int r = map_region(&kspace, res, NULL, 0, size, PROT_R | PROT_W | ALLOC_ZERO);
+    if (r < 0) {
+        /* Pages mapped before the failure are given back */
+        unmap_region(&kspace, res, size);
+        return NULL;
+    }
+    metaheaptop += size;
+
+#ifdef SANITIZE_SHADOW_BASE
+    if (res + size >= SANITIZE_SHADOW_BASE) {
+        cprintf("kzalloc_region_try: returning shadow memory page! Increase base address?\n");
+        return NULL;
+    }
+    platform_asan_unpoison((void *)res, size);
+#endif
+
+    return (void *)res;
+}
+
+/* Same as kzalloc_region(), but the memory is allocated right away
+ * and is physically contiguous, so devices can reach it by DMA.
+ * Physical address is returned in *pa. Size is limited
+ * by the largest allocation class, NULL if it cannot be satisfied. */
+void *
+kzalloc_dma_region(size_t size, physaddr_t *pa) {
+    assert(current_space);
+
+    size = ROUNDUP(size, PAGE_SIZE);
+
+    int class = 0;
+    while (CLASS_SIZE(class) < size) class++;
+    if (class > MAX_ALLOCATION_CLASS) return NULL;
+
+    /* Mapping a single page requires virtual address aligned on its class */
+    uintptr_t res = ROUNDUP(metaheaptop, CLASS_SIZE(class));
+    if (res + CLASS_SIZE(class) > KERN_HEAP_END) panic("Kernel heap overflow\n");
+
+    struct Page *page = alloc_page(class, 0);
+    if (!page) return NULL;
+
+    int r = map_page(&kspace, res, page, PROT_R | PROT_W);
+    if (r < 0) panic("kzalloc_dma_region: %i\n", r);
+    metaheaptop = res + CLASS_SIZE(class);
+
+#ifdef SANITIZE_SHADOW_BASE
+    if (res + size >= SANITIZE_SHADOW_BASE) {
+        cprintf("kzalloc_dma_region: returning shadow memory page! Increase base address?\n");
+        return NULL;
+    }
+    platform_asan_unpoison((void *)res, CLASS_SIZE(class));
+#endif
+
+    nosan_memset((void *)res, 0, CLASS_SIZE(class));
+    *pa = page2pa(page);
+
+    return (void *)res;
+}
+
 static uintptr_t prev_mmio;
 void *
 mmio_map_region(physaddr_t addr, size_t size) {
@@ -119,6 +119,8 @@ void dump_memory_lists(void);
 void dump_virtual_tree(struct Page *node, int class);
 
 void *kzalloc_region(size_t size);
+void *kzalloc_region_try(size_t size);
+void *kzalloc_dma_region(size_t size, physaddr_t *pa);
 
 void *mmio_map_region(physaddr_t addr, size_t size);
 void *mmio_remap_last_region(physaddr_t addr, void *oldva, size_t oldsz, size_t size);
@@ -57,7 +57,8 @@ sched_halt(void) {
     int i;
     for (i = 0; i < NENV; i++)
         if (envs[i].env_status == ENV_RUNNABLE ||
-            envs[i].env_status == ENV_RUNNING) break;
+            envs[i].env_status == ENV_RUNNING ||
+            envs[i].env_irq_waiting) break;
     if (i == NENV) {
         cprintf("No runnable environments in the system!\n");
         for (;;) monitor(NULL);
@@ -0,0 +1,55 @@
+#include <inc/assert.h>
+#include <inc/memlayout.h>
+#include <kern/pmap.h>
+#include <kern/slab.h>
+
+void
+slab_init(struct slab_cache *cache, const char *name, size_t obj_size) {
+    assert(obj_size);
+
+    cache->name = name;
+    cache->obj_size = ROUNDUP(MAX(obj_size, sizeof(void *)), SLAB_ALIGN);
+    cache->chunk_objs = MAX(SLAB_CHUNK_SIZE / cache->obj_size, 1);
+    cache->free_list = NULL;
+    cache->nr_total = 0;
+    cache->nr_used = 0;
+}
+
+/* Carves a new chunk into objects and puts them on the free list */
+static int
+slab_grow(struct slab_cache *cache) {
+    size_t size = ROUNDUP(cache->chunk_objs * cache->obj_size, PAGE_SIZE);
+    size_t n = size / cache->obj_size;
+
+    uint8_t *chunk = kzalloc_region_try(size);
+    if (!chunk) return -1;
+
+    for (size_t i = n; i > 0; i--) {
+        void **obj = (void **)(chunk + (i - 1) * cache->obj_size);
+        *obj = cache->free_list;
+        cache->free_list = obj;
+    }
+    cache->nr_total += n;
+    return 0;
+}
+
+/* Returns an object of the cache or NULL if the heap is exhausted.
+ * Contents are not cleared. */
+void *
+slab_alloc(struct slab_cache *cache) {
+    if (!cache->free_list && slab_grow(cache) < 0) return NULL;
+
+    void **obj = cache->free_list;
+    cache->free_list = *obj;
+    cache->nr_used++;
+    return obj;
+}
+
+void
+slab_free(struct slab_cache *cache, void *obj) {
+    assert(cache->nr_used);
+
+    *(void **)obj = cache->free_list;
+    cache->free_list = obj;
+    cache->nr_used--;
+}
@@ -0,0 +1,29 @@
+#ifndef JOS_KERN_SLAB_H
+#define JOS_KERN_SLAB_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+/* Cache of equally sized objects. It grows by chunks taken from
+ * the kernel heap with kzalloc_region() when the free list is empty.
+ * Heap memory is never given back, freed objects are kept for reuse,
+ * but the pages of a chunk are only backed once they are touched. */
+struct slab_cache {
+    const char *name;
+    size_t obj_size;    // rounded up to SLAB_ALIGN
+    size_t chunk_objs;  // objects carved from one chunk
+    void *free_list;    // free objects linked through their first word
+    size_t nr_total;    // objects carved so far
+    size_t nr_used;     // objects handed out
+};
+
+#define SLAB_ALIGN      16
+#define SLAB_CHUNK_SIZE (4 * PAGE_SIZE) // grow step for small objects
+
+void slab_init(struct slab_cache *cache, const char *name, size_t obj_size);
+void *slab_alloc(struct slab_cache *cache);
+void slab_free(struct slab_cache *cache, void *obj);
+
+#endif /* !JOS_KERN_SLAB_H */
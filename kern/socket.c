@@ -0,0 +1,399 @@
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
+#include <kern/env.h>
+#include <kern/eth.h>
+#include <kern/http.h>
+#include <kern/inet.h>
+#include <kern/socket.h>
+#include <kern/tcp.h>
+#include <kern/udp.h>
+
+/* Requests never sleep in the kernel, the network server must stay free
+ * for other clients: what is not ready yet returns -E_WOULD_BLOCK. The
+ * client then sleeps in ksock_wait() until ksock_wakeup() finds that the
+ * socket can serve the request, and repeats it. */
+
+static struct ksocket ksockets[KSOCK_NUM];
+// Clients sleeping on all sockets, ksock_wakeup() has nothing to do without them
+static int ksock_sleepers;
+// Next local port of a datagram socket sending without bind
+static uint16_t ksock_ephemeral_port = TCP_EPHEMERAL_MIN;
+
+/**
+ * Выделяет свободный сокет типа type
+ */
+static struct ksocket *
+ksock_alloc(int type) {
+    for (int i = 0; i < KSOCK_NUM; i++) {
+        struct ksocket *sock = &ksockets[i];
+        if (!sock->type) {
+            int id = sock->id + KSOCK_NUM;
+            memset(sock, 0, sizeof(*sock));
+            // generation keeps stale ids of a reused slot from matching
+            sock->id = id > 0 ? id : i;
+            sock->type = type;
+            return sock;
+        }
+    }
+    return NULL;
+}
+
+static struct ksocket *
+ksock_lookup(int id) {
+    if (id < 0) {
+        return NULL;
+    }
+    struct ksocket *sock = &ksockets[id % KSOCK_NUM];
+    return sock->type && sock->id == id ? sock : NULL;
+}
+
+/**
+ * Занимает свободный эфемерный UDP-порт для сокета
+ */
+static int
+ksock_udp_autobind(struct ksocket *sock) {
+    for (int i = 0; i <= 0xFFFF - TCP_EPHEMERAL_MIN; i++) {
+        uint16_t port = ksock_ephemeral_port;
+        ksock_ephemeral_port = port == 0xFFFF ? TCP_EPHEMERAL_MIN : port + 1;
+
+        int res = udp_bind(port, KSOCK_UDP_RCVBUF);
+        if (!res) {
+            sock->local.ip = MY_IP;
+            sock->local.port = port;
+            return 0;
+        }
+        if (res != -E_ADDR_IN_USE) {
+            return res;
+        }
+    }
+    return -E_ADDR_IN_USE;
+}
+
+static int
+ksock_socket(union Nsipc *ipc) {
+    int type = ipc->socket.req_type;
+    if (type != SOCK_STREAM && type != SOCK_DGRAM) {
+        return -E_INVAL;
+    }
+
+    struct ksocket *sock = ksock_alloc(type);
+    return sock ? sock->id : -E_MAX_OPEN;
+}
+
+static int
+ksock_bind(union Nsipc *ipc) {
+    struct Nsreq_bind *req = &ipc->bind;
+    struct ksocket *sock = ksock_lookup(req->req_sockid);
+    if (!sock || sock->local.port || sock->vc || !req->req_addr.sin_port) {
+        return -E_INVAL;
+    }
+    if (req->req_addr.sin_addr && req->req_addr.sin_addr != MY_IP) {
+        return -E_INVAL;
+    }
+
+    if (sock->type == SOCK_DGRAM) {
+        int res = udp_bind(req->req_addr.sin_port, KSOCK_UDP_RCVBUF);
+        if (res < 0) return res;
+    }
+    // a stream port is taken only by listen, so it is checked there
+    sock->local.ip = MY_IP;
+    sock->local.port = req->req_addr.sin_port;
+    return 0;
+}
+
+static int
+ksock_listen(union Nsipc *ipc) {
+    struct Nsreq_listen *req = &ipc->listen;
+    struct ksocket *sock = ksock_lookup(req->req_sockid);
+    if (!sock || sock->type != SOCK_STREAM || !sock->local.port || sock->vc) {
+        return -E_INVAL;
+    }
+    if (sock->listening) {
+        return 0;
+    }
+
+    int backlog = MIN(MAX(req->req_backlog, 1), KSOCK_BACKLOG_MAX);
+    int res = tcp_listen(sock->local.ip, sock->local.port, backlog, TCP_WINDOW_SIZE, true);
+    if (res < 0) return res;
+
+    sock->listening = true;
+    return 0;
+}
+
+static int
+ksock_accept(union Nsipc *ipc) {
+    struct ksocket *sock = ksock_lookup(ipc->accept.req_sockid);
+    if (!sock || !sock->listening) {
+        return -E_INVAL;
+    }
+
+    // the connection is taken only when there is a socket for it
+    struct ksocket *conn = ksock_alloc(SOCK_STREAM);
+    if (!conn) {
+        return -E_MAX_OPEN;
+    }
+    struct tcp_virtual_channel *vc = tcp_accept(sock->local.ip, sock->local.port);
+    if (!vc) {
+        conn->type = 0;
+        return -E_WOULD_BLOCK;
+    }
+
+    conn->vc = vc;
+    conn->local = vc->host_side;
+    conn->peer = vc->guest_side;
+    ipc->acceptRet.ret_addr.sin_addr = conn->peer.ip;
+    ipc->acceptRet.ret_addr.sin_port = conn->peer.port;
+    return conn->id;
+}
+
+static int
+ksock_connect(union Nsipc *ipc) {
+    struct Nsreq_connect *req = &ipc->connect;
+    struct ksocket *sock = ksock_lookup(req->req_sockid);
+    if (!sock || sock->listening || !req->req_addr.sin_port) {
+        return -E_INVAL;
+    }
+
+    if (sock->type == SOCK_DGRAM) {
+        sock->peer.ip = req->req_addr.sin_addr;
+        sock->peer.port = req->req_addr.sin_port;
+        return 0;
+    }
+
+    if (!sock->vc) {
+        if (!(sock->vc = tcp_connect(req->req_addr.sin_addr, req->req_addr.sin_port))) {
+            return -E_NO_MEM;
+        }
+        sock->local = sock->vc->host_side;
+        sock->peer = sock->vc->guest_side;
+    }
+
+    switch (sock->vc->state) {
+    case SYN_SENT:
+        return -E_WOULD_BLOCK;
+    case CLOSED:
+        // refused or timed out, connect may be tried again
+        tcp_close(sock->vc);
+        sock->vc = NULL;
+        return -E_NO_ENT;
+    default:
+        return 0;
+    }
+}
+
+static int
+ksock_recv(union Nsipc *ipc) {
+    struct Nsreq_recv *req = &ipc->recv;
+    struct ksocket *sock = ksock_lookup(req->req_sockid);
+    if (!sock) {
+        return -E_INVAL;
+    }
+    size_t n = MIN(req->req_n, (size_t)NSBUFSIZE);
+    struct Nsret_recv *ret = &ipc->recvRet;
+
+    if (sock->type == SOCK_DGRAM) {
+        if (!sock->local.port) return -E_INVAL;
+        return udp_recvfrom(sock->local.port, ret->ret_buf, n,
+                            &ret->ret_addr.sin_addr, &ret->ret_addr.sin_port);
+    }
+
+    if (!sock->vc || sock->vc->state == SYN_SENT) {
+        return -E_INVAL;
+    }
+    ret->ret_addr.sin_addr = sock->peer.ip;
+    ret->ret_addr.sin_port = sock->peer.port;
+    return tcp_read(sock->vc, ret->ret_buf, n);
+}
+
+static int
+ksock_send(union Nsipc *ipc) {
+    struct Nsreq_send *req = &ipc->send;
+    struct ksocket *sock = ksock_lookup(req->req_sockid);
+    if (!sock) {
+        return -E_INVAL;
+    }
+    size_t n = MIN(req->req_n, (size_t)NSBUFSIZE);
+
+    if (sock->type == SOCK_DGRAM) {
+        struct tcp_endpoint dst = sock->peer;
+        if (req->req_addr.sin_port) {
+            dst.ip = req->req_addr.sin_addr;
+            dst.port = req->req_addr.sin_port;
+        }
+        if (!dst.port) {
+            return -E_INVAL;
+        }
+        if (!sock->local.port) {
+            int res = ksock_udp_autobind(sock);
+            if (res < 0) return res;
+        }
+        int res = udp_sendto(sock->local.port, dst.ip, dst.port, req->req_buf, n);
+        return res < 0 ? res : (int)n;
+    }
+
+    struct tcp_virtual_channel *vc = sock->vc;
+    if (!vc) {
+        return -E_INVAL;
+    }
+    if (vc->state != ESTABLISHED && vc->state != CLOSE_WAIT) {
+        return vc->state == SYN_SENT ? -E_WOULD_BLOCK : -E_EOF;
+    }
+    // only what fits the send buffer, the client sends the rest later
+    n = MIN(n, (size_t)tcp_sndbuf_space(vc));
+    if (!n) {
+        return -E_WOULD_BLOCK;
+    }
+    int res = tcp_write(vc, req->req_buf, n, TH_PSH);
+    return res < 0 ? res : (int)n;
+}
+
+/**
+ * Вернёт ли запрос op к сокету что-нибудь, кроме -E_WOULD_BLOCK
+ */
+static bool
+ksock_ready(struct ksocket *sock, int op) {
+    struct tcp_virtual_channel *vc = sock->vc;
+
+    switch (op) {
+    case NSREQ_ACCEPT:
+        return !sock->listening || tcp_accept_ready(sock->local.ip, sock->local.port);
+    case NSREQ_CONNECT:
+        return !vc || vc->state != SYN_SENT;
+    case NSREQ_RECV:
+        if (sock->type == SOCK_DGRAM) {
+            return !sock->local.port || udp_rx_ready(sock->local.port);
+        }
+        return !vc || vc->state == SYN_SENT || vc->state == CLOSED || vc->data_len || vc->rcv_fin;
+    case NSREQ_SEND:
+        if (sock->type == SOCK_DGRAM || !vc) {
+            return true;
+        }
+        if (vc->state != ESTABLISHED && vc->state != CLOSE_WAIT) {
+            return vc->state != SYN_SENT;
+        }
+        return tcp_sndbuf_space(vc) > 0;
+    default:
+        return true;
+    }
+}
+
+/**
+ * Будит клиента, спящего на сокете, и освобождает его место
+ */
+static void
+ksock_wake(struct ksock_waiter *waiter) {
+    struct Env *env;
+    if (!envid2env(waiter->env, &env, 0) && env->env_status == ENV_NOT_RUNNABLE) {
+        env->env_status = ENV_RUNNABLE;
+    }
+    waiter->env = 0;
+    ksock_sleepers--;
+}
+
+/**
+ * Усыпляет клиента, которому запрос op к сокету id вернул -E_WOULD_BLOCK,
+ * пока сокет не сможет его выполнить. Проснувшись, клиент повторяет запрос.
+ * Если сокет уже готов, клиент не засыпает. -E_WOULD_BLOCK - на сокете
+ * спит слишком много клиентов, этот пусть повторит запрос сам.
+ */
+int
+ksock_wait(int id, int op) {
+    struct ksocket *sock = ksock_lookup(id);
+    if (!sock) {
+        return -E_INVAL;
+    }
+    if (ksock_ready(sock, op)) {
+        return 0;
+    }
+
+    for (int i = 0; i < KSOCK_WAITERS; i++) {
+        struct ksock_waiter *waiter = &sock->waiters[i];
+        if (!waiter->env) {
+            waiter->env = curenv->env_id;
+            waiter->op = op;
+            ksock_sleepers++;
+            curenv->env_status = ENV_NOT_RUNNABLE;
+            return 0;
+        }
+    }
+    return -E_WOULD_BLOCK;
+}
+
+/**
+ * Будит клиентов, чьи сокеты готовы: пришли данные или соединение,
+ * установилось соединение, освободилось место в очереди отправки.
+ * Вызывается после того, как стек обработал принятые кадры и таймеры.
+ */
+void
+ksock_wakeup(void) {
+    for (int i = 0; i < KSOCK_NUM && ksock_sleepers; i++) {
+        struct ksocket *sock = &ksockets[i];
+        if (!sock->type) {
+            continue;
+        }
+        for (int j = 0; j < KSOCK_WAITERS; j++) {
+            struct ksock_waiter *waiter = &sock->waiters[j];
+            if (waiter->env && ksock_ready(sock, waiter->op)) {
+                ksock_wake(waiter);
+            }
+        }
+    }
+}
+
+static int
+ksock_close(union Nsipc *ipc) {
+    struct ksocket *sock = ksock_lookup(ipc->close.req_sockid);
+    if (!sock) {
+        return -E_INVAL;
+    }
+    // clients sleeping on the socket find out that it is gone
+    for (int i = 0; i < KSOCK_WAITERS; i++) {
+        if (sock->waiters[i].env) {
+            ksock_wake(&sock->waiters[i]);
+        }
+    }
+
+    if (sock->vc) {
+        tcp_close(sock->vc);
+    }
+    if (sock->listening) {
+        tcp_unlisten(sock->local.ip, sock->local.port);
+    }
+    if (sock->type == SOCK_DGRAM && sock->local.port) {
+        udp_unbind(sock->local.port);
+    }
+    sock->type = 0;
+    return 0;
+}
+
+typedef int (*nshandler)(union Nsipc *ipc);
+
+static nshandler handlers[] = {
+        [NSREQ_SOCKET] = ksock_socket,
+        [NSREQ_BIND] = ksock_bind,
+        [NSREQ_LISTEN] = ksock_listen,
+        [NSREQ_ACCEPT] = ksock_accept,
+        [NSREQ_CONNECT] = ksock_connect,
+        [NSREQ_RECV] = ksock_recv,
+        [NSREQ_SEND] = ksock_send,
+        [NSREQ_CLOSE] = ksock_close,
+        [NSREQ_HTTP_MISS] = http_miss,
+        [NSREQ_HTTP_FILL] = http_fill};
+#define NHANDLERS (sizeof(handlers) / sizeof(handlers[0]))
+
+/**
+ * Выполняет запрос op сетевого сервера. Аргументы и результаты
+ * передаются на странице ipc, как в запросах к файловому серверу.
+ */
+int
+net_call(int op, union Nsipc *ipc) {
+    if (op < 0 || op >= (int)NHANDLERS || !handlers[op]) {
+        return -E_INVAL;
+    }
+    int res = handlers[op](ipc);
+    // frames the request sent to this host are taken before the client runs again
+    eth_poll();
+    ksock_wakeup();
+    return res;
+}
@@ -0,0 +1,39 @@
+#ifndef JOS_KERN_SOCKET_H
+#define JOS_KERN_SOCKET_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+#include <inc/ns.h>
+#include <kern/tcp.h>
+
+#define KSOCK_WAITERS 4
+
+// Client sleeping in ksock_wait() until the socket can serve request op
+struct ksock_waiter {
+    envid_t env;                // 0 - free
+    int op;
+};
+
+/* Socket of the network server. Stream sockets hold a TCP channel or
+ * a listening port, datagram ones a bound UDP port. */
+struct ksocket {
+    int id;                     // index plus generation, like file ids of the FS
+    int type;                   // SOCK_STREAM or SOCK_DGRAM, 0 - free
+    struct tcp_endpoint local;  // port 0 - not bound
+    struct tcp_endpoint peer;   // connected peer, port 0 - none
+    bool listening;
+    struct tcp_virtual_channel *vc;
+    struct ksock_waiter waiters[KSOCK_WAITERS];
+};
+
+#define KSOCK_NUM 128
+#define KSOCK_BACKLOG_MAX 64
+#define KSOCK_UDP_RCVBUF 16384
+
+int net_call(int op, union Nsipc *ipc);
+int ksock_wait(int id, int op);
+void ksock_wakeup(void);
+
+#endif /* !JOS_KERN_SOCKET_H */
@@ -14,6 +14,7 @@
 #include <kern/trap.h>
 #include <kern/traceopt.h>
 #include <kern/monitor.h>
+#include <kern/socket.h>
 
 /* Print a string to the system console.
  * The string is exactly 'len' characters long.
@@ -478,6 +479,33 @@ sys_ethernet_loop(void) {
     switch_address_space(old);
 }
 
+/* Execute socket request op of the network server with arguments
+ * and results on the page at va. Only the network server and the
+ * helpers it forks may call it. */
+static int
+sys_net_call(int op, uintptr_t va) {
+    struct Env *parent;
+    if (curenv->env_type != ENV_TYPE_NS &&
+        (envid2env(curenv->env_parent_id, &parent, 0) || parent->env_type != ENV_TYPE_NS)) {
+        return -E_BAD_ENV;
+    }
+    if (va & (PAGE_SIZE - 1)) return -E_INVAL;
+    user_mem_assert(curenv, (void *)va, PAGE_SIZE, PROT_R | PROT_W);
+
+    struct AddressSpace *old = switch_address_space(&curenv->address_space);
+    int res = net_call(op, (union Nsipc *)va);
+    switch_address_space(old);
+    return res;
+}
+
+/* Sleep until request op of the network server on socket sockid can
+ * be served, the request returned -E_WOULD_BLOCK. Returns at once if
+ * it can be served already. Any client of the network server may call it. */
+static int
+sys_net_wait(int sockid, int op) {
+    return ksock_wait(sockid, op);
+}
+
 /*
  * This function return the difference between maximal
  * number of references of regions [addr, addr + size] and [addr2,addr2+size2]
@@ -572,6 +600,12 @@ syscall(uintptr_t syscallno, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t
         case SYS_ethernet_loop:
             sys_ethernet_loop(); return 0;
 
+        case SYS_net_call:
+            return (uintptr_t) sys_net_call((int) a1, a2);
+
+        case SYS_net_wait:
+            return (uintptr_t) sys_net_wait((int) a1, (int) a2);
+
         default:
             return -E_NO_SYS;
     }
@@ -4,125 +4,1205 @@
 #include <inc/error.h>
 #include <inc/stdio.h>
 #include <kern/tcp.h>
+#include <kern/tcp_cc.h>
 #include <kern/http.h>
+#include <kern/netif.h>
+#include <kern/pbuf.h>
+#include <kern/slab.h>
+#include <kern/timer.h>
 #include <kern/traceopt.h>
 
-struct tcp_virtual_channel tcp_vc[TCP_VC_NUM];
+// Control blocks and receive buffers of live connections
+static struct slab_cache tcp_vc_cache;
+#define TCP_RCVBUF_CLASSES 6 // TCP_RCVBUF_MIN << i up to TCP_RCVBUF_MAX
+static struct slab_cache tcp_rcvbuf_cache[TCP_RCVBUF_CLASSES];
+// Segments of send queues
+static struct slab_cache tcp_seg_cache;
+
+struct tcp_stats tcp_stats;
+// Congestion control of new connections
+static const struct tcp_cc_ops *tcp_cc_default = &tcp_cc_cubic;
+
+// TCP header with room for the options we send
+struct tcp_hdr_opt {
+    struct tcp_hdr hdr;
+    uint8_t opt[TCP_OPT_MSS_LEN];
+} __attribute__((packed));
+// Established and half-open channels by 4-tuple
+static struct tcp_virtual_channel *tcp_vc_hash[TCP_VC_HASH_SIZE];
+
+static struct tcp_listener tcp_listeners[TCP_LISTEN_NUM];
+static struct tcp_listener *tcp_listen_hash[TCP_LISTEN_HASH_SIZE];
+static int tcp_listen_num;
+// Next local port of an active open
+static uint16_t tcp_ephemeral_port = TCP_EPHEMERAL_MIN;
+// Channels that may owe a delayed ACK
+static struct tcp_virtual_channel *tcp_delack_list;
 
 /**
- * Функция нахождения соотвествия порта входящего tcp-пакета и
- * виртуального канала
+ * Номер корзины для соединения (multiplicative hashing, Кнут)
+ */
+static uint32_t
+tcp_vc_hash_fn(uint32_t host_ip, uint16_t host_port, uint32_t guest_ip, uint16_t guest_port) {
+    uint32_t key = host_ip ^ (guest_ip * 31) ^ ((uint32_t)host_port << 16 | guest_port);
+    return (key * 2654435761u) >> 24 & (TCP_VC_HASH_SIZE - 1);
+}
+
+static struct tcp_virtual_channel **
+tcp_vc_bucket(struct tcp_virtual_channel *vc) {
+    return &tcp_vc_hash[tcp_vc_hash_fn(vc->host_side.ip, vc->host_side.port,
+                                       vc->guest_side.ip, vc->guest_side.port)];
+}
+
+/**
+ * Функция нахождения виртуального канала по четвёрке
+ * (адрес и порт отправителя, адрес и порт получателя) входящего tcp-пакета
  */
 struct tcp_virtual_channel *
-match_tcp_vc(struct tcp_pkt *pkt) {
-    for (int i = 0; i < TCP_VC_NUM; i++) {
-        if (tcp_vc[i].host_side.port == JNTOHS(pkt->hdr.dst_port)) {
-            return &tcp_vc[i];
+match_tcp_vc(struct tcp_pkt *pkt, uint32_t src_ip, uint32_t dst_ip) {
+    uint16_t src_port = JNTOHS(pkt->hdr.src_port);
+    uint16_t dst_port = JNTOHS(pkt->hdr.dst_port);
+
+    struct tcp_virtual_channel *vc = tcp_vc_hash[tcp_vc_hash_fn(dst_ip, dst_port, src_ip, src_port)];
+    for (; vc; vc = vc->hash_next) {
+        if (vc->host_side.port == dst_port && vc->guest_side.port == src_port &&
+            vc->host_side.ip == dst_ip && vc->guest_side.ip == src_ip) {
+            return vc;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Функция нахождения слушающего порта для входящего SYN
+ */
+static struct tcp_listener *
+match_tcp_listener(uint32_t dst_ip, uint16_t dst_port) {
+    struct tcp_listener *listener = tcp_listen_hash[dst_port & (TCP_LISTEN_HASH_SIZE - 1)];
+    for (; listener; listener = listener->hash_next) {
+        if (listener->host_side.port == dst_port && listener->host_side.ip == dst_ip) {
+            return listener;
         }
     }
     return NULL;
 }
 
 /**
- * Функция нахождения соответствия IP-адреса и виртуального канала
+ * Функция нахождения соответствия IP-адреса и слушающего порта
  */
 int
-match_listen_ip(struct tcp_virtual_channel *vc, uint32_t src_ip) {
+match_listen_ip(struct tcp_listener *listener, uint32_t src_ip) {
     // ACCEPT FROM ALL IP
     return 1;
 }
 
 /**
- * Функция инициализации всех виртуальных каналов
+ * Открывает порт на приём соединений. Не более backlog соединений
+ * могут ждать приёма (tcp_accept), включая полуоткрытые; SYN сверх
+ * этого отбрасывается, и клиент повторит его позже.
+ * Каждое соединение получает приёмный буфер rcv_buf_size байт.
+ * user - соединения принимает сокет пользователя, а не HTTP-сервер ядра.
+ */
+int
+tcp_listen(uint32_t ip, uint16_t port, uint16_t backlog, uint32_t rcv_buf_size, bool user) {
+    if (!port || !backlog || rcv_buf_size < TCP_RCVBUF_MIN || rcv_buf_size > TCP_RCVBUF_MAX) {
+        return -E_INVAL;
+    }
+    if (match_tcp_listener(ip, port)) {
+        return -E_ADDR_IN_USE;
+    }
+    if (tcp_listen_num == TCP_LISTEN_NUM) {
+        return -E_NO_MEM;
+    }
+
+    // free slots have port 0
+    struct tcp_listener *listener = tcp_listeners;
+    while (listener->host_side.port) {
+        listener++;
+    }
+    tcp_listen_num++;
+    memset(listener, 0, sizeof(*listener));
+    listener->host_side.ip = ip;
+    listener->host_side.port = port;
+    listener->backlog = backlog;
+    listener->rcv_buf_size = rcv_buf_size;
+    listener->user = user;
+
+    struct tcp_listener **bucket = &tcp_listen_hash[port & (TCP_LISTEN_HASH_SIZE - 1)];
+    listener->hash_next = *bucket;
+    *bucket = listener;
+    return 0;
+}
+
+static void tcp_vc_free(struct tcp_virtual_channel *vc);
+
+/**
+ * Закрывает слушающий порт. Соединения, которые никто не принял,
+ * обрываются; принятые продолжают жить.
+ */
+int
+tcp_unlisten(uint32_t ip, uint16_t port) {
+    struct tcp_listener **link = &tcp_listen_hash[port & (TCP_LISTEN_HASH_SIZE - 1)];
+    for (; *link; link = &(*link)->hash_next) {
+        if ((*link)->host_side.port == port && (*link)->host_side.ip == ip) {
+            break;
+        }
+    }
+    struct tcp_listener *listener = *link;
+    if (!listener) {
+        return -E_INVAL;
+    }
+    *link = listener->hash_next;
+
+    // half-open ones are not on the accept queue, look through the table
+    for (int i = 0; i < TCP_VC_HASH_SIZE; i++) {
+        struct tcp_virtual_channel *vc = tcp_vc_hash[i], *next;
+        for (; vc; vc = next) {
+            next = vc->hash_next;
+            if (vc->listener == listener) {
+                tcp_vc_free(vc);
+            }
+        }
+    }
+
+    listener->host_side.port = 0;
+    tcp_listen_num--;
+    return 0;
+}
+
+/**
+ * Кэш, из которого берутся приёмные буферы размера size
+ */
+static struct slab_cache *
+tcp_rcvbuf_class(uint32_t size) {
+    int class = 0;
+    while ((TCP_RCVBUF_MIN << class) < size) class++;
+    return &tcp_rcvbuf_cache[class];
+}
+
+/**
+ * Выделяет канал соединения host - guest с приёмным буфером
+ * rcv_buf_size байт и вносит его в таблицу
+ */
+static struct tcp_virtual_channel *
+tcp_vc_new(struct tcp_endpoint host, struct tcp_endpoint guest, uint32_t rcv_buf_size) {
+    struct tcp_virtual_channel *vc = slab_alloc(&tcp_vc_cache);
+    if (!vc) {
+        return NULL;
+    }
+    memset(vc, 0, sizeof(*vc));
+
+    struct slab_cache *rcvbuf = tcp_rcvbuf_class(rcv_buf_size);
+    if (!(vc->buffer = slab_alloc(rcvbuf))) {
+        slab_free(&tcp_vc_cache, vc);
+        return NULL;
+    }
+    vc->buffer_size = rcvbuf->obj_size;
+
+    vc->host_side = host;
+    vc->guest_side = guest;
+    vc->rto = TCP_RTO_INIT;
+    vc->snd_mss = TCP_MSS_DEFAULT;
+    vc->cc = tcp_cc_default;
+    tcp_stats.conn_opened++;
+
+    struct tcp_virtual_channel **bucket = tcp_vc_bucket(vc);
+    vc->hash_next = *bucket;
+    *bucket = vc;
+    return vc;
+}
+
+/**
+ * Выделяет канал для нового соединения слушающего порта.
+ * Соединение занимает место в очереди слушающего порта, пока его не передадут
+ * владельцу: сокету при tcp_accept(), HTTP-серверу ядра по завершении рукопожатия.
+ */
+static struct tcp_virtual_channel *
+tcp_vc_alloc(struct tcp_listener *listener, uint32_t src_ip, uint16_t src_port) {
+    if (listener->pending >= listener->backlog) {
+        return NULL;
+    }
+
+    struct tcp_endpoint guest = {src_ip, src_port};
+    struct tcp_virtual_channel *vc = tcp_vc_new(listener->host_side, guest, listener->rcv_buf_size);
+    if (!vc) {
+        return NULL;
+    }
+
+    vc->state = LISTEN;
+    vc->listener = listener;
+    vc->user = listener->user;
+    listener->pending++;
+    return vc;
+}
+
+/**
+ * Ставит установленное соединение в очередь приёма слушающего порта
+ */
+static void
+tcp_vc_enqueue(struct tcp_virtual_channel *vc) {
+    struct tcp_listener *listener = vc->listener;
+
+    vc->accept_next = NULL;
+    if (listener->accept_tail) {
+        listener->accept_tail->accept_next = vc;
+    } else {
+        listener->accept_head = vc;
+    }
+    listener->accept_tail = vc;
+}
+
+/**
+ * Снимает соединение с очереди слушающего порта, освобождая в ней место
+ */
+static void
+tcp_vc_dequeue(struct tcp_virtual_channel *vc) {
+    struct tcp_listener *listener = vc->listener;
+    if (!listener) {
+        return;
+    }
+
+    struct tcp_virtual_channel *prev = NULL;
+    for (struct tcp_virtual_channel *it = listener->accept_head; it; prev = it, it = it->accept_next) {
+        if (it == vc) {
+            if (prev) {
+                prev->accept_next = vc->accept_next;
+            } else {
+                listener->accept_head = vc->accept_next;
+            }
+            if (listener->accept_tail == vc) {
+                listener->accept_tail = prev;
+            }
+            break;
+        }
+    }
+
+    listener->pending--;
+    vc->listener = NULL;
+    vc->accept_next = NULL;
+}
+
+/**
+ * Принимает первое установленное соединение слушающего порта,
+ * NULL если таких нет
+ */
+struct tcp_virtual_channel *
+tcp_accept(uint32_t ip, uint16_t port) {
+    struct tcp_listener *listener = match_tcp_listener(ip, port);
+    if (!listener || !listener->accept_head) {
+        return NULL;
+    }
+
+    struct tcp_virtual_channel *vc = listener->accept_head;
+    tcp_vc_dequeue(vc);
+    vc->sock_ref = vc->user;
+    return vc;
+}
+
+/**
+ * Есть ли у слушающего порта соединение, которое tcp_accept() отдаст сразу
+ */
+bool
+tcp_accept_ready(uint32_t ip, uint16_t port) {
+    struct tcp_listener *listener = match_tcp_listener(ip, port);
+    return !listener || listener->accept_head;
+}
+
+/**
+ * Убирает канал закрытого соединения из таблицы и освобождает его память.
+ * Канал, который держит сокет, остаётся в состоянии CLOSED с непрочитанными
+ * данными до tcp_close().
+ */
+static void
+tcp_vc_free(struct tcp_virtual_channel *vc) {
+    if (vc->state != CLOSED) {
+        struct tcp_virtual_channel **link = tcp_vc_bucket(vc);
+        while (*link != vc) {
+            link = &(*link)->hash_next;
+        }
+        *link = vc->hash_next;
+
+        if (vc->delack_queued) {
+            for (link = &tcp_delack_list; *link != vc; link = &(*link)->delack_next)
+                ;
+            *link = vc->delack_next;
+            vc->delack_queued = false;
+        }
+
+        tcp_vc_dequeue(vc);
+        if (!vc->user) {
+            http_release(vc);
+        }
+        tcp_stats.conn_closed++;
+        while (vc->snd_head) {
+            struct tcp_snd_seg *seg = vc->snd_head;
+            vc->snd_head = seg->next;
+            pbuf_release(seg->pb);
+            slab_free(&tcp_seg_cache, seg);
+        }
+        vc->snd_tail = vc->snd_next = NULL;
+        vc->rtx_deadline = 0;
+        vc->state = CLOSED;
+    }
+    if (vc->sock_ref && !vc->user_closed) {
+        return;
+    }
+    slab_free(tcp_rcvbuf_class(vc->buffer_size), vc->buffer);
+    slab_free(&tcp_vc_cache, vc);
+}
+
+/**
+ * Функция инициализации таблиц соединений и слушающих портов
+ */
+void
+tcp_init_vc() {
+    slab_init(&tcp_vc_cache, "tcp_vc", sizeof(struct tcp_virtual_channel));
+    for (int i = 0; i < TCP_RCVBUF_CLASSES; i++) {
+        slab_init(&tcp_rcvbuf_cache[i], "tcp_rcvbuf", TCP_RCVBUF_MIN << i);
+    }
+    slab_init(&tcp_seg_cache, "tcp_seg", sizeof(struct tcp_snd_seg));
+    memset(tcp_vc_hash, 0, sizeof(tcp_vc_hash));
+    tcp_delack_list = NULL;
+
+    memset(tcp_listen_hash, 0, sizeof(tcp_listen_hash));
+    memset(tcp_listeners, 0, sizeof(tcp_listeners));
+    tcp_listen_num = 0;
+    tcp_listen(MY_IP, 80, TCP_BACKLOG_DEFAULT, TCP_WINDOW_SIZE, false);
+    for (int i = 1; i < TCP_KERN_PORTS; i++) {
+        tcp_listen(MY_IP, 7999 + i, TCP_BACKLOG_DEFAULT, TCP_WINDOW_SIZE, false);
+    }
+}
+
+/**
+ * Выбор алгоритма управления перегрузкой для новых соединений
+ */
+int
+tcp_set_default_cc(const char *name) {
+    const struct tcp_cc_ops *cc = tcp_cc_find(name);
+    if (!cc) {
+        return -E_INVAL;
+    }
+
+    tcp_cc_default = cc;
+    return 0;
+}
+
+const char *
+tcp_default_cc(void) {
+    return tcp_cc_default->name;
+}
+
+/**
+ * Печать счётчиков TCP и состояния живых соединений
+ */
+void
+tcp_print_stats(void) {
+    cprintf("segments in %lu, out %lu (TSO frames %lu), data bytes out %lu\n",
+            (unsigned long)tcp_stats.segs_in, (unsigned long)tcp_stats.segs_out,
+            (unsigned long)tcp_stats.tso_frames, (unsigned long)tcp_stats.bytes_out);
+    cprintf("retransmits %lu (fast %lu), timeouts %lu, duplicate ACKs %lu\n",
+            (unsigned long)tcp_stats.retransmits, (unsigned long)tcp_stats.fast_retransmits,
+            (unsigned long)tcp_stats.timeouts, (unsigned long)tcp_stats.dupacks);
+    cprintf("pure ACKs %lu (delayed %lu), ACKs on data %lu\n",
+            (unsigned long)tcp_stats.acks_out, (unsigned long)tcp_stats.acks_delayed,
+            (unsigned long)tcp_stats.acks_piggybacked);
+    cprintf("connections opened %lu, closed %lu, timed out %lu, reset %lu, SYN dropped %lu\n",
+            (unsigned long)tcp_stats.conn_opened, (unsigned long)tcp_stats.conn_closed,
+            (unsigned long)tcp_stats.conn_timed_out, (unsigned long)tcp_stats.conn_reset,
+            (unsigned long)tcp_stats.syn_dropped);
+    cprintf("congestion control of new connections: %s\n", tcp_cc_default->name);
+
+    for (int i = 0; i < TCP_VC_HASH_SIZE; i++) {
+        for (struct tcp_virtual_channel *vc = tcp_vc_hash[i]; vc; vc = vc->hash_next) {
+            cprintf("%u <- ", vc->host_side.port);
+            num2ip(vc->guest_side.ip);
+            cprintf(":%u state %d %s cwnd %u ssthresh %u flight %u wnd %u srtt %u rto %u%s\n",
+                    vc->guest_side.port, vc->state, vc->cc->name, vc->cwnd, vc->ssthresh,
+                    tcp_flight(vc), vc->snd_wnd, vc->srtt >> 3, vc->rto,
+                    vc->in_recovery ? " recovery" : "");
+        }
+    }
+}
+
+/**
+ * Заполняет поля заголовков TCP и IP, которые берутся из виртуального канала
+ */
+static void
+tcp_fill_hdr(struct tcp_virtual_channel *channel, struct tcp_hdr *tcp_hdr, struct ip_hdr *hdr) {
+    // any segment acknowledges everything received, a delayed ACK is not owed anymore
+    channel->delack_segs = 0;
+
+    tcp_hdr->seq_num = JHTONL(channel->ack_seq.seq_num);
+    tcp_hdr->ack_num = JHTONL(channel->ack_seq.ack_num);
+    tcp_hdr->src_port = JHTONS(channel->host_side.port);
+    tcp_hdr->dst_port = JHTONS(channel->guest_side.port);
+    // window is the free part of the receive buffer
+    tcp_hdr->win_size = JHTONS(MIN(channel->buffer_size - channel->data_len, 0xFFFF));
+
+    hdr->ip_protocol = IP_PROTO_TCP;
+    hdr->ip_source_address = JHTONL(channel->host_side.ip);
+    hdr->ip_destination_address = JHTONL(channel->guest_side.ip);
+}
+
+/**
+ * Отправляет сегмент канала с заданным последовательным номером: заголовок
+ * th и куски данных data. SYN несёт опцию MSS - сколько данных мы примем
+ * в одном сегменте. mss != 0 - данных больше MTU, их режет карта (TSO).
+ */
+static int
+tcp_xmit(struct tcp_virtual_channel *channel, struct tcp_hdr_opt *th, uint32_t seq,
+         const struct tx_seg *data, int ndata, uint16_t mss) {
+    if (trace_packet_processing) cprintf("Sending TCP packet\n");
+
+    size_t hdr_len = TCP_HEADER_LEN;
+    if (th->hdr.flags & TH_SYN) {
+        th->opt[0] = TCP_OPT_MSS;
+        th->opt[1] = TCP_OPT_MSS_LEN;
+        th->opt[2] = TCP_DATA_LEN >> 8;
+        th->opt[3] = TCP_DATA_LEN & 0xFF;
+        hdr_len += TCP_OPT_MSS_LEN;
+    }
+
+    struct ip_hdr ip_header = {};
+    struct ip_hdr *hdr = &ip_header;
+
+    th->hdr.data_offset = ((uint8_t)(hdr_len >> 2) & 0xF);
+    th->hdr.checksum = 0;
+    tcp_fill_hdr(channel, &th->hdr, hdr);
+    th->hdr.seq_num = JHTONL(seq);
+
+    struct tx_seg v[E1000_TSO_MAX_SEGS];
+    size_t data_length = hdr_len;
+    v[0].addr = th;
+    v[0].len = hdr_len;
+    v[0].pb = NULL;
+    for (int i = 0; i < ndata; i++) {
+        v[i + 1] = data[i];
+        data_length += data[i].len;
+    }
+
+    if (channel->delack_segs && data_length > hdr_len) {
+        tcp_stats.acks_piggybacked++;
+    }
+    tcp_stats.segs_out++;
+    tcp_stats.bytes_out += data_length - hdr_len;
+
+    uint8_t csum_off = 0;
+    if (mss) {
+        tcp_stats.tso_frames++;
+        // every segment cut by the NIC gets its own length added
+        th->hdr.checksum = JHTONS(ip_pseudo_sum(hdr, 0));
+        csum_off = offsetof(struct tcp_hdr, checksum);
+    } else {
+        // checksum covers pseudo header and the segment, summed where they lie
+        uint32_t sum = ip_pseudo_sum(hdr, data_length);
+
+        if (netif_csum_caps(channel->guest_side.ip) & E1000_CAP_CSUM_TX_L4) {
+            // NIC adds the segment to the pseudo header sum left in the field
+            th->hdr.checksum = JHTONS(sum);
+            csum_off = offsetof(struct tcp_hdr, checksum);
+        } else {
+            // header is of even length, so the data is summed on its own
+            for (int i = 0; i <= ndata; i++) {
+                sum = ip_checksum_partial(sum, v[i].addr, v[i].len);
+            }
+            th->hdr.checksum = ip_checksum_finish(sum);
+        }
+    }
+
+    // header goes into the headroom of the data, the segment stays one piece
+    struct tx_seg *frame = v;
+    if (ndata && pbuf_headroom(data[0].pb, data[0].addr) >= hdr_len) {
+        uint8_t *room = (uint8_t *)data[0].addr - hdr_len;
+        memcpy(room, th, hdr_len);
+        frame = &v[1];
+        frame->addr = room;
+        frame->len += hdr_len;
+    }
+    int nframe = ndata + 1 - (frame - v);
+
+    if (mss) {
+        return ip_sendv_tso(hdr, frame, nframe, csum_off, hdr_len, mss);
+    }
+    return ip_sendv(hdr, frame, nframe, csum_off);
+}
+
+/**
+ * Отправляет сегмент очереди отправки как есть
+ */
+static int
+tcp_xmit_seg(struct tcp_virtual_channel *vc, struct tcp_snd_seg *seg) {
+    struct tcp_hdr_opt th = {};
+    // an empty piece still lends its headroom to the header
+    struct tx_seg data = {seg->pb->data, seg->data_len, seg->pb};
+    int ndata = seg->data_len || pbuf_headroom(seg->pb, seg->pb->data) ? 1 : 0;
+
+    th.hdr.flags = seg->flags;
+    return tcp_xmit(vc, &th, seg->seq, &data, ndata, 0);
+}
+
+/**
+ * Отправляет подряд идущие сегменты от first до last включительно
+ * одним кадром TSO. Все сегменты, кроме последнего, ровно по MSS.
+ */
+static int
+tcp_xmit_tso(struct tcp_virtual_channel *vc, struct tcp_snd_seg *first, struct tcp_snd_seg *last) {
+    struct tcp_hdr_opt th = {};
+    struct tx_seg data[E1000_TSO_MAX_SEGS];
+    int ndata = 0;
+
+    for (struct tcp_snd_seg *seg = first;; seg = seg->next) {
+        data[ndata].addr = seg->pb->data;
+        data[ndata].len = seg->data_len;
+        data[ndata].pb = seg->pb;
+        ndata++;
+        if (seg == last) break;
+    }
+    // NIC puts PSH and FIN only into the last segment
+    th.hdr.flags = last->flags;
+    return tcp_xmit(vc, &th, first->seq, data, ndata, vc->snd_mss);
+}
+
+/**
+ * Ставит данные в очередь отправки, нарезая их на сегменты по MSS собеседника.
+ * SYN занимает первый сегмент, PSH и FIN ставятся на последний.
+ * Не отправленный ещё последний сегмент без флагов сперва дополняется
+ * до MSS, так что данные, записанные по частям, уходят полными сегментами.
+ * Всё или ничего: если памяти на новые сегменты нет, очередь не меняется.
+ */
+int
+tcp_queue(struct tcp_virtual_channel *vc, const void *buf, size_t length, uint8_t flags) {
+    const uint8_t *data = buf;
+    struct tcp_snd_seg *tail = vc->snd_tail;
+
+    size_t fill = 0;
+    if (tail && vc->snd_next && !(tail->flags & (TH_SYN | TH_PSH | TH_FIN)) &&
+        tail->data_len < vc->snd_mss && length) {
+        fill = MIN(length, (size_t)vc->snd_mss - tail->data_len);
+    }
+
+    // new segments are taken before anything is queued, so a failure
+    // loses neither data nor the FIN already accepted from the caller
+    size_t rest = length - fill;
+    size_t nsegs = rest ? (rest + vc->snd_mss - 1) / vc->snd_mss : !fill;
+    struct tcp_snd_seg *head = NULL, **link = &head;
+    for (size_t i = 0; i < nsegs; i++) {
+        struct tcp_snd_seg *seg = slab_alloc(&tcp_seg_cache);
+        // room up to the MSS for the data of the next write
+        if (seg && !(seg->pb = pbuf_alloc(vc->snd_mss))) {
+            slab_free(&tcp_seg_cache, seg);
+            seg = NULL;
+        }
+        if (!seg) {
+            cprintf("No memory for TCP send queue\n");
+            while (head) {
+                seg = head;
+                head = seg->next;
+                pbuf_release(seg->pb);
+                slab_free(&tcp_seg_cache, seg);
+            }
+            return -E_NO_MEM;
+        }
+        seg->next = NULL;
+        *link = seg;
+        link = &seg->next;
+    }
+
+    if (fill) {
+        memcpy(tail->pb->data + tail->data_len, data, fill);
+        tail->data_len += fill;
+        tail->seq_len += fill;
+        tail->pb->len += fill;
+        vc->snd_end += fill;
+        data += fill;
+        if (!rest) {
+            tail->flags |= flags & (TH_PSH | TH_FIN);
+            tail->seq_len += !!(flags & TH_FIN);
+            vc->snd_end += !!(flags & TH_FIN);
+            return 0;
+        }
+    }
+
+    while (head) {
+        struct tcp_snd_seg *seg = head;
+        head = seg->next;
+
+        size_t n = MIN(rest, (size_t)vc->snd_mss);
+        seg->next = NULL;
+        seg->seq = vc->snd_end;
+        seg->flags = TH_ACK | (flags & TH_SYN);
+        if (n == rest) {
+            seg->flags |= flags & (TH_PSH | TH_FIN);
+        }
+        seg->seq_len = n + !!(seg->flags & TH_SYN) + !!(seg->flags & TH_FIN);
+        seg->sent_ms = 0;
+        seg->retransmitted = false;
+        seg->data_len = n;
+        seg->pb->len = n;
+        memcpy(seg->pb->data, data, n);
+
+        if (vc->snd_tail) {
+            vc->snd_tail->next = seg;
+        } else {
+            vc->snd_head = seg;
+        }
+        vc->snd_tail = seg;
+        if (!vc->snd_next) {
+            vc->snd_next = seg;
+        }
+        vc->snd_end += seg->seq_len;
+
+        data += n;
+        rest -= n;
+        flags &= ~TH_SYN;
+    }
+
+    return 0;
+}
+
+/**
+ * Может ли сегмент seg уйти в сеть, не выходя ни за окно собеседника,
+ * ни за окно перегрузки
+ */
+static bool
+tcp_in_window(struct tcp_virtual_channel *vc, struct tcp_snd_seg *seg) {
+    uint32_t snd_una = vc->snd_head->seq;
+    return SEQ_LEQ(seg->seq + seg->data_len, snd_una + MIN(vc->snd_wnd, vc->cwnd));
+}
+
+/**
+ * Последний сегмент, который можно отправить вместе с first одним кадром TSO
+ */
+static struct tcp_snd_seg *
+tcp_tso_run(struct tcp_virtual_channel *vc, struct tcp_snd_seg *first) {
+    int max_segs = e1000_tso_max_segs() - 3; // Ethernet, IP and TCP headers take a piece each
+    size_t room = E1000_TSO_MAX_LEN - ETH_HEADER_LEN - IP_HEADER_LEN - TCP_HEADER_LEN;
+    struct tcp_snd_seg *last = first;
+
+    if (first->flags & TH_SYN) {
+        return first;
+    }
+    room -= first->data_len;
+    for (int n = 1; n < max_segs && last->data_len == vc->snd_mss; n++) {
+        struct tcp_snd_seg *seg = last->next;
+        if (!seg || !seg->data_len || seg->data_len > room || !tcp_in_window(vc, seg)) {
+            break;
+        }
+        room -= seg->data_len;
+        last = seg;
+    }
+    return last;
+}
+
+/**
+ * Отправляет из очереди всё, что помещается в окно собеседника.
+ * force - отправить первый сегмент даже при закрытом окне (проба окна).
+ */
+static void
+tcp_output(struct tcp_virtual_channel *vc, bool force) {
+    struct tcp_snd_seg *seg;
+
+    while ((seg = vc->snd_next)) {
+        if (!tcp_in_window(vc, seg) && !force) {
+            break;
+        }
+        force = false;
+
+        struct tcp_snd_seg *last = seg;
+        int rc = -1;
+        if (netif_csum_caps(vc->guest_side.ip) & E1000_CAP_TSO) {
+            last = tcp_tso_run(vc, seg);
+        }
+        if (last != seg) {
+            rc = tcp_xmit_tso(vc, seg, last);
+        }
+        if (rc < 0) {
+            // TSO frame did not fit the NIC ring, one segment goes to its queue
+            last = seg;
+            rc = tcp_xmit_seg(vc, seg);
+        }
+        if (rc < 0) {
+            break;
+        }
+
+        uint64_t now = hpet_msec();
+        for (;; seg = seg->next) {
+            seg->sent_ms = now;
+            if (seg == last) break;
+        }
+        vc->ack_seq.seq_num = last->seq + last->seq_len;
+        vc->snd_next = last->next;
+        if (!vc->rtx_deadline) {
+            vc->rtx_deadline = now + vc->rto;
+        }
+    }
+}
+
+/**
+ * Записывает данные в поток соединения. Они уходят сегментами по MSS
+ * собеседника по мере того, как он открывает окно.
+ * flags - TH_PSH и TH_FIN для последнего сегмента.
+ */
+int
+tcp_write(struct tcp_virtual_channel *vc, const void *data, size_t length, uint8_t flags) {
+    int rc = tcp_queue(vc, data, length, flags);
+    tcp_output(vc, false);
+    return rc;
+}
+
+/**
+ * Отправляет то, что поставлено в очередь tcp_queue(), насколько пускают окна
+ */
+void
+tcp_push(struct tcp_virtual_channel *vc) {
+    tcp_output(vc, false);
+}
+
+/**
+ * Функция отправки пакета заданного размера по данному виртуальному каналу.
+ * Данные, SYN и FIN ждут подтверждения в очереди отправки.
+ */
+int
+tcp_send(struct tcp_virtual_channel *channel, struct tcp_pkt *pkt, size_t length) {
+    if (channel == NULL) {
+        if (pkt == NULL || (channel = match_tcp_vc(pkt, HOST_IP, MY_IP)) == NULL) {
+            return -E_BAD_ETH_TYPE;
+        }
+    }
+
+    return tcp_write(channel, pkt->data, length, pkt->hdr.flags);
+}
+
+/**
+ * Повторно отправляет самый старый неподтверждённый сегмент
+ */
+static int
+tcp_retransmit(struct tcp_virtual_channel *vc) {
+    struct tcp_snd_seg *seg = vc->snd_head;
+    if (!seg || seg == vc->snd_next) {
+        return 0;
+    }
+
+    seg->retransmitted = true;
+    tcp_stats.retransmits++;
+    if (trace_packet_processing) cprintf("Retransmitting TCP segment seq=%u\n", seg->seq);
+    return tcp_xmit_seg(vc, seg);
+}
+
+/**
+ * Пересчёт SRTT, RTTVAR и RTO по новому замеру rtt (RFC 6298, 2.2-2.4)
+ */
+static void
+tcp_rtt_update(struct tcp_virtual_channel *vc, uint32_t rtt) {
+    if (!vc->rtt_valid) {
+        vc->srtt = rtt << 3;
+        vc->rttvar = rtt << 1;
+        vc->rtt_valid = true;
+    } else {
+        int32_t delta = (int32_t)rtt - (int32_t)(vc->srtt >> 3);
+        if (delta < 0) delta = -delta;
+        // rttvar = 3/4 rttvar + 1/4 |srtt - rtt|, srtt = 7/8 srtt + 1/8 rtt
+        vc->rttvar += delta - (vc->rttvar >> 2);
+        vc->srtt += rtt - (vc->srtt >> 3);
+    }
+
+    uint32_t rto = (vc->srtt >> 3) + MAX((uint32_t)TCP_RTO_GRANULARITY, vc->rttvar);
+    vc->rto = MIN(MAX(rto, (uint32_t)TCP_RTO_MIN), (uint32_t)TCP_RTO_MAX);
+}
+
+/**
+ * Убирает из очереди отправки сегменты, подтверждённые ack
+ */
+static void
+tcp_rtx_ack(struct tcp_virtual_channel *vc, uint32_t ack) {
+    uint64_t now = hpet_msec();
+    bool acked = false;
+
+    struct tcp_snd_seg *seg;
+    while ((seg = vc->snd_head) && seg != vc->snd_next && SEQ_LEQ(seg->seq + seg->seq_len, ack)) {
+        if (!seg->retransmitted) {
+            tcp_rtt_update(vc, now - seg->sent_ms);
+        }
+        vc->snd_head = seg->next;
+        pbuf_release(seg->pb);
+        slab_free(&tcp_seg_cache, seg);
+        acked = true;
+    }
+    if (!vc->snd_head) {
+        vc->snd_tail = NULL;
+    }
+
+    // new data is acknowledged, restart the timer (RFC 6298, 5.2-5.3)
+    if (acked) {
+        vc->rtx_count = 0;
+        vc->rtx_deadline = vc->snd_head != vc->snd_next ? now + vc->rto : 0;
+    }
+}
+
+/**
+ * Истёк таймер повторной передачи: сегмент отправляется снова с удвоенным RTO,
+ * после TCP_RTX_MAX попыток подряд соединение сбрасывается
+ */
+static void
+tcp_rtx_timeout(struct tcp_virtual_channel *vc, uint64_t now) {
+    tcp_stats.timeouts++;
+    if (++vc->rtx_count > TCP_RTX_MAX) {
+        cprintf("TCP connection timed out\n");
+        tcp_stats.conn_timed_out++;
+        tcp_vc_free(vc);
+        return;
+    }
+
+    // the whole window is in doubt, fast recovery is over
+    vc->cc->on_timeout(vc);
+    vc->in_recovery = false;
+    vc->dupacks = 0;
+    vc->recover = vc->ack_seq.seq_num;
+
+    vc->rto = MIN(vc->rto * 2, (uint32_t)TCP_RTO_MAX);
+    tcp_retransmit(vc);
+    vc->rtx_deadline = now + vc->rto;
+}
+
+/**
+ * Соединение HTTP-сервера ядра простаивает: без запросов оно закрывается,
+ * а собеседник, не ответивший на наш FIN, забывается.
+ */
+static void
+tcp_http_idle(struct tcp_virtual_channel *vc) {
+    if (vc->state == ESTABLISHED && !vc->http_wait) {
+        tcp_close(vc);
+    } else if (vc->state == FIN_WAIT_2) {
+        tcp_vc_free(vc);
+    }
+}
+
+/**
+ * Вызывается на каждый тик HPET и обслуживает таймеры повторной передачи
+ * и отложенных ACK. Неотправленные данные при закрытом окне уходят
+ * по одному сегменту как проба. Закрытое нами соединение, собеседник
+ * которого так и не прислал FIN, забывается через TCP_FIN_WAIT_2_MS,
+ * запрос к HTTP-серверу, файл которого не пришёл, получает отказ через
+ * TCP_HTTP_WAIT_MS.
+ */
+void
+tcp_timer(void) {
+    uint64_t now = hpet_msec();
+
+    for (int i = 0; i < TCP_VC_HASH_SIZE; i++) {
+        struct tcp_virtual_channel *vc = tcp_vc_hash[i], *next;
+        for (; vc; vc = next) {
+            next = vc->hash_next;
+            if (vc->rtx_deadline && vc->rtx_deadline <= now) {
+                tcp_rtx_timeout(vc, now);
+            } else if (vc->snd_next && vc->snd_next == vc->snd_head) {
+                // nothing in flight: the NIC was busy or the window is closed
+                tcp_output(vc, true);
+            } else if (vc->http_wait && now - vc->http_wait_ms >= TCP_HTTP_WAIT_MS) {
+                // the helper of the network server may be gone
+                http_timeout(vc);
+            } else if (!vc->user && !vc->snd_head && now - vc->last_rcv_ms >= TCP_HTTP_IDLE_MS) {
+                tcp_http_idle(vc);
+            } else if (vc->state == FIN_WAIT_2 && now - vc->fin_wait_ms >= TCP_FIN_WAIT_2_MS) {
+                // nobody reads a closed connection, a peer that never sends
+                // its FIN must not hold the channel forever
+                tcp_stats.conn_timed_out++;
+                tcp_vc_free(vc);
+            }
+        }
+    }
+    tcp_flush_acks();
+}
+
+/**
+ * Отправка ACK без данных, check-сумма которого получается из check-суммы
+ * предыдущего ACK этого канала заменой seq, ack, флагов и окна (RFC 1624).
+ * Возвращает 1, если предыдущего ACK для тех же концов соединения нет.
+ */
+static int
+tcp_send_ack_fast(struct tcp_virtual_channel *vc, struct tcp_hdr *ack_hdr) {
+    struct ip_hdr ip_header = {};
+    struct tcp_hdr *prev = &vc->ack_hdr;
+
+    tcp_fill_hdr(vc, ack_hdr, &ip_header);
+    if (!vc->ack_hdr_valid || vc->ack_hdr_ip != vc->guest_side.ip ||
+        prev->src_port != ack_hdr->src_port || prev->dst_port != ack_hdr->dst_port) {
+        return 1;
+    }
+
+    // seq_num, ack_num, data_offset + flags and win_size lie one after another
+    size_t changed = offsetof(struct tcp_hdr, checksum) - offsetof(struct tcp_hdr, seq_num);
+    ack_hdr->checksum = ip_checksum_adjust(prev->checksum, &prev->seq_num, &ack_hdr->seq_num, changed);
+    *prev = *ack_hdr;
+
+    if (trace_packet_processing) cprintf("Sending TCP packet\n");
+    tcp_stats.segs_out++;
+    struct tx_seg seg = {ack_hdr, TCP_HEADER_LEN};
+    return ip_sendv(&ip_header, &seg, 1, 0);
+}
+
+/**
+ * Функция отправки ACK-пакета. Данный пакет может содержкать дополнительные флаги,
+ * SYN и FIN уходят через очередь отправки
+ */
+int
+tcp_send_ack(struct tcp_virtual_channel *vc, uint8_t flags) {
+    if (flags & (TH_SYN | TH_FIN)) {
+        return tcp_write(vc, NULL, 0, flags);
+    }
+
+    struct tcp_hdr_opt ack = {};
+    ack.hdr.data_offset = ((uint8_t)(TCP_HEADER_LEN >> 2) & 0xF);
+    ack.hdr.flags = (uint32_t)flags | TH_ACK;
+
+    int rc = 1;
+    // with checksum offload the NIC does the work anyway
+    if (!flags && !(netif_csum_caps(vc->guest_side.ip) & E1000_CAP_CSUM_TX_L4)) {
+        rc = tcp_send_ack_fast(vc, &ack.hdr);
+    }
+    tcp_stats.acks_out++;
+    if (rc == 1) {
+        rc = tcp_xmit(vc, &ack, vc->ack_seq.seq_num, NULL, 0, 0);
+        // next pure ACK of the connection starts from this one
+        vc->ack_hdr = ack.hdr;
+        vc->ack_hdr_ip = vc->guest_side.ip;
+        vc->ack_hdr_valid = !(netif_csum_caps(vc->guest_side.ip) & E1000_CAP_CSUM_TX_L4);
+    }
+    if (rc < 0) {
+        cprintf("tcp_send error\n");
+    }
+    return rc;
+}
+
+/**
+ * Откладывает ACK на принятые данные: он уйдёт вместе с ответом, а если ответа
+ * нет - на каждый второй сегмент или через TCP_DELACK_MS (RFC 1122, 4.2.3.2).
+ * now - подтвердить в конце текущей пачки принятых кадров, так несколько
+ * сегментов одной пачки получают один ACK.
+ */
+static void
+tcp_delack(struct tcp_virtual_channel *vc, bool now) {
+    if (!vc->delack_segs) {
+        vc->delack_deadline = hpet_msec() + TCP_DELACK_MS;
+    }
+    vc->delack_segs++;
+    if (now) {
+        vc->delack_segs = MAX(vc->delack_segs, (uint8_t)TCP_DELACK_SEGS);
+    }
+
+    if (!vc->delack_queued) {
+        vc->delack_queued = true;
+        vc->delack_next = tcp_delack_list;
+        tcp_delack_list = vc;
+    }
+}
+
+/**
+ * Отправляет отложенные ACK, которые больше нельзя задерживать.
+ * Вызывается после каждой пачки принятых кадров и на тик таймера.
+ */
+void
+tcp_flush_acks(void) {
+    uint64_t now = hpet_msec();
+    struct tcp_virtual_channel **link = &tcp_delack_list, *vc;
+
+    while ((vc = *link)) {
+        if (vc->delack_segs && vc->delack_segs < TCP_DELACK_SEGS && vc->delack_deadline > now) {
+            link = &vc->delack_next;
+            continue;
+        }
+
+        *link = vc->delack_next;
+        vc->delack_queued = false;
+        // the ACK may already have gone out with data
+        if (vc->delack_segs) {
+            if (vc->delack_segs < TCP_DELACK_SEGS) tcp_stats.acks_delayed++;
+            tcp_send_ack(vc, 0);
+        }
+    }
+}
+
+/**
+ * Функция проверка последовательного номера ACK-последовательности.
+ * Значения должны быть когерентны как для виртуального канала, так и для последовательности
+ */
+int
+check_ack_seq(struct tcp_virtual_channel * vc, struct tcp_hdr ack_seq) {
+    //cprintf("Ack=%u Seq=%u <== Ack=%u Seq=%u\n", vc->ack_seq.ack_num, vc->ack_seq.seq_num, (uint32_t)JNTOHL(ack_seq.ack_num), (uint32_t)JNTOHL(ack_seq.seq_num));
+
+    return JNTOHL(ack_seq.seq_num) == vc->ack_seq.ack_num &&
+           JNTOHL(ack_seq.ack_num) == vc->ack_seq.seq_num;
+}
+
+/**
+ * Обработка ACK собеседника: очистка очереди отправки, окно перегрузки,
+ * быстрая повторная передача по трём дубликатам и быстрое восстановление
+ * NewReno (RFC 5681, RFC 6582). Потом уходит то, что пустило окно.
  */
-void
-tcp_init_vc() {
-    tcp_vc[0].state = LISTEN;
-    tcp_vc[0].host_side.ip = MY_IP;
-    tcp_vc[0].host_side.port = 80;
+static void
+tcp_ack(struct tcp_virtual_channel *vc, struct tcp_pkt *pkt, uint16_t tcp_data_len) {
+    uint32_t ack = JNTOHL(pkt->hdr.ack_num);
+    uint32_t wnd = JNTOHS(pkt->hdr.win_size);
+    uint32_t snd_una = vc->snd_head ? vc->snd_head->seq : vc->ack_seq.seq_num;
 
-    tcp_vc[0].guest_side.ip = HOST_IP;
-    tcp_vc[0].guest_side.port = 8080;
-    for (int i = 1; i < TCP_VC_NUM; i++) {
-        tcp_vc[i].state = LISTEN;
-        tcp_vc[i].host_side.ip = MY_IP;
-        tcp_vc[i].host_side.port = 7999 + i;
+    if (SEQ_LT(snd_una, ack)) {
+        uint32_t acked = ack - snd_una;
+        tcp_rtx_ack(vc, ack);
+        vc->dupacks = 0;
 
-        tcp_vc[i].guest_side.ip = HOST_IP;
-        tcp_vc[i].guest_side.port = i;
+        if (!vc->in_recovery) {
+            vc->cc->on_ack(vc, acked);
+        } else if (SEQ_LT(ack, vc->recover)) {
+            // partial ACK: the next segment is lost too, deflate by what left
+            tcp_retransmit(vc);
+            vc->cwnd = (vc->cwnd > acked ? vc->cwnd - acked : 0) + vc->snd_mss;
+        } else {
+            vc->cwnd = MIN(vc->ssthresh, tcp_flight(vc) + vc->snd_mss);
+            vc->in_recovery = false;
+        }
+    } else if (ack == snd_una && !tcp_data_len && wnd == vc->snd_wnd &&
+               !((uint32_t)pkt->hdr.flags & (TH_SYN | TH_FIN)) && vc->snd_head != vc->snd_next) {
+        tcp_stats.dupacks++;
+        if (vc->in_recovery) {
+            // every duplicate means a segment has left the network
+            vc->cwnd += vc->snd_mss;
+        } else if (++vc->dupacks == TCP_DUPACK_THRESH && SEQ_LEQ(vc->recover, ack)) {
+            vc->cc->on_loss(vc);
+            vc->recover = vc->ack_seq.seq_num;
+            vc->cwnd = vc->ssthresh + TCP_DUPACK_THRESH * vc->snd_mss;
+            vc->in_recovery = true;
+            tcp_stats.fast_retransmits++;
+            tcp_retransmit(vc);
+        }
     }
+
+    vc->snd_wnd = wnd;
+    // acknowledged data and a wider window let more segments go
+    tcp_output(vc, false);
 }
 
 /**
- * Функция отправки пакета заданного размера по данному виртуальному каналу
+ * MSS из опций SYN собеседника
  */
-int
-tcp_send(struct tcp_virtual_channel *channel, struct tcp_pkt *pkt, size_t length) {
-    if (trace_packet_processing) cprintf("Sending TCP packet\n");
+static uint16_t
+tcp_parse_mss(struct tcp_pkt *pkt) {
+    uint8_t *opt = (uint8_t *)pkt + TCP_HEADER_LEN;
+    uint8_t *end = (uint8_t *)pkt + pkt->hdr.data_offset * 4;
 
-    if (channel == NULL) {
-        if (pkt == NULL || (channel = match_tcp_vc(pkt)) == NULL) {
-            return -E_BAD_ETH_TYPE;
+    while (opt < end && *opt != TCP_OPT_END) {
+        if (*opt == TCP_OPT_NOP) {
+            opt++;
+            continue;
+        }
+        if (opt + 2 > end || opt[1] < 2 || opt + opt[1] > end) {
+            break;
         }
+        if (opt[0] == TCP_OPT_MSS && opt[1] == TCP_OPT_MSS_LEN) {
+            uint16_t mss = opt[2] << 8 | opt[3];
+            return mss ? mss : TCP_MSS_DEFAULT;
+        }
+        opt += opt[1];
     }
-
-    size_t data_length = TCP_HEADER_LEN + length;
-    struct ip_pkt result = {};
-    struct ip_hdr *hdr = &result.hdr;
-    uint8_t buf[IP_DATA_LEN + 12] = {};
-    uint32_t network_data_length = JHTONS(data_length);
-
-    pkt->hdr.checksum = 0;
-    pkt->hdr.seq_num = JHTONL(channel->ack_seq.seq_num);
-    pkt->hdr.ack_num = JHTONL(channel->ack_seq.ack_num);
-    pkt->hdr.src_port = JHTONS(channel->host_side.port);
-    pkt->hdr.dst_port = JHTONS(channel->guest_side.port);
-    pkt->hdr.win_size = JHTONS(sizeof(channel->buffer));
-
-    hdr->ip_protocol = IP_PROTO_TCP;
-    hdr->ip_source_address = JHTONL(channel->host_side.ip);
-    hdr->ip_destination_address = JHTONL(channel->guest_side.ip);
-
-    memcpy((void *)buf, (void *)&hdr->ip_source_address, sizeof(hdr->ip_source_address));
-    memcpy((void *)buf + 4, (void  *)&hdr->ip_destination_address, sizeof(hdr->ip_destination_address));
-    memcpy((void *)buf + 12, (void *)pkt, data_length);
-
-    buf[8] = 0;
-    buf[8 + 1] = IP_PROTO_TCP;
-
-    memcpy((void *)buf + 10, (void *)&network_data_length, sizeof(network_data_length));
-    pkt->hdr.checksum = JHTONS(JNTOHS(ip_checksum(buf, data_length + 12)) - channel->host_side.port);
-    memcpy((void *)result.data, (void *)pkt, data_length);
-
-    return ip_send(&result, data_length);
+    return TCP_MSS_DEFAULT;
 }
 
 /**
- * Функция отправки ACK-пакета. Данный пакет может содержкать дополнительные флаги
+ * Параметры собеседника из его SYN: начальный номер, окно и MSS
  */
-int
-tcp_send_ack(struct tcp_virtual_channel *vc, uint8_t flags) {
-    struct tcp_pkt ack_pkt = {};
-    ack_pkt.hdr.data_offset = ((uint8_t)(TCP_HEADER_LEN >> 2) & 0xF);
-    ack_pkt.hdr.flags = (uint32_t)flags | TH_ACK;
-
-    int rc = tcp_send(vc, &ack_pkt, 0);
-    if (rc < 0) {
-        cprintf("tcp_send error\n");
-    }
-    return rc;
+static void
+tcp_peer_syn(struct tcp_virtual_channel *vc, struct tcp_pkt *pkt) {
+    vc->ack_seq.ack_num = JNTOHL(pkt->hdr.seq_num) + 1;
+    vc->snd_wnd = JNTOHS(pkt->hdr.win_size);
+    vc->snd_mss = MIN(tcp_parse_mss(pkt), (uint16_t)TCP_DATA_LEN);
+    vc->cwnd = TCP_INIT_CWND(vc->snd_mss);
+    vc->ssthresh = TCP_SSTHRESH_INIT;
+    vc->cc->init(vc);
 }
 
 /**
- * Функция проверка последовательного номера ACK-последовательности.
- * Значения должны быть когерентны как для виртуального канала, так и для последовательности
+ * Сегмент установленного соединения: данные копятся в приёмном буфере
+ * до tcp_read() сокета или до HTTP-сервера ядра, FIN закрывает поток на чтение.
+ * TIME_WAIT не держится: канал освобождается сразу после обмена FIN.
  */
-int
-check_ack_seq(struct tcp_virtual_channel * vc, struct tcp_hdr ack_seq) {
-    //cprintf("Ack=%u Seq=%u <== Ack=%u Seq=%u\n", vc->ack_seq.ack_num, vc->ack_seq.seq_num, (uint32_t)JNTOHL(ack_seq.ack_num), (uint32_t)JNTOHL(ack_seq.seq_num));
+static int
+tcp_input(struct tcp_virtual_channel *vc, struct tcp_pkt *pkt, uint8_t *payload, uint16_t len) {
+    uint32_t flags = pkt->hdr.flags;
+    uint32_t seq = JNTOHL(pkt->hdr.seq_num);
 
-    return JNTOHL(ack_seq.seq_num) == vc->ack_seq.ack_num &&
-           JNTOHL(ack_seq.ack_num) == vc->ack_seq.seq_num;
+    vc->last_rcv_ms = hpet_msec();
+
+    if (flags & TH_RST) {
+        // only an exact match is trusted (RFC 5961, 3.2)
+        if (seq == vc->ack_seq.ack_num) {
+            tcp_vc_free(vc);
+        }
+        return 0;
+    }
+    if (!(flags & TH_ACK)) {
+        return -1;
+    }
+
+    // everything up to our FIN is acknowledged
+    if (!vc->snd_head) {
+        if (vc->state == FIN_WAIT_1) {
+            vc->state = FIN_WAIT_2;
+            vc->fin_wait_ms = vc->last_rcv_ms;
+        } else if (vc->state == CLOSING || vc->state == LAST_ACK) {
+            tcp_vc_free(vc);
+            return 0;
+        }
+    }
+
+    if (seq != vc->ack_seq.ack_num) {
+        // repeated or out of order segment, the peer learns what we expect
+        if (len || (flags & TH_FIN)) {
+            tcp_send_ack(vc, 0);
+        }
+        return 0;
+    }
+    if (len) {
+        if (vc->user_closed) {
+            // nobody reads anymore, the data is dropped
+            vc->ack_seq.ack_num += len;
+        } else if (len > vc->buffer_size - vc->data_len) {
+            // beyond the window, the peer sends it again
+            tcp_send_ack(vc, 0);
+            return 0;
+        } else {
+            memcpy(vc->buffer + vc->data_len, payload, len);
+            vc->data_len += len;
+            vc->ack_seq.ack_num += len;
+        }
+    }
+
+    if (flags & TH_FIN) {
+        vc->ack_seq.ack_num++;
+        vc->rcv_fin = true;
+        tcp_send_ack(vc, 0);
+        switch (vc->state) {
+        case ESTABLISHED:
+            vc->state = CLOSE_WAIT;
+            break;
+        case FIN_WAIT_1:
+            vc->state = CLOSING;
+            break;
+        case FIN_WAIT_2:
+            tcp_vc_free(vc);
+            return 0;
+        default:
+            break;
+        }
+    } else if (len) {
+        // a reply of the HTTP server carries the ACK
+        tcp_delack(vc, flags & TH_PSH);
+    }
+
+    if (!vc->user) {
+        // requests are served in order, the connection stays open between them;
+        // acknowledged data makes room for the rest of a reply
+        return http_serve(vc);
+    }
+    return 0;
 }
 
 /**
@@ -130,69 +1210,80 @@ check_ack_seq(struct tcp_virtual_channel * vc, struct tcp_hdr ack_seq) {
  * http-запрос будет обрабатываться только после трёх-стороннего рукопожатия
  */
 int
-tcp_process(struct tcp_pkt *pkt, uint32_t src_ip, uint16_t tcp_data_len) {
+tcp_process(struct tcp_pkt *pkt, uint32_t src_ip, uint32_t dst_ip, uint16_t tcp_data_len) {
     if (trace_packet_processing) cprintf("Processing TCP packet\n");
-    struct tcp_virtual_channel *vc = match_tcp_vc(pkt);
+    tcp_stats.segs_in++;
+    struct tcp_virtual_channel *vc = match_tcp_vc(pkt, src_ip, dst_ip);
     if (vc == NULL) {
-        cprintf("Unable to find virtual channel for this packet !!!\n");
-        goto error;
+        // new connection: SYN to a listening port gets a channel of its own
+        struct tcp_listener *listener = match_tcp_listener(dst_ip, JNTOHS(pkt->hdr.dst_port));
+        if (listener == NULL || !((uint32_t)pkt->hdr.flags & TH_SYN)) {
+            cprintf("Unable to find virtual channel for this packet !!!\n");
+            goto error;
+        }
+        if (!match_listen_ip(listener, src_ip)) {
+            cprintf("Source IP: "); num2ip(src_ip); cprintf(" didn't match listen IP: "); num2ip(listener->host_side.ip);
+            cprintf("\n");
+            goto error;
+        }
+        if ((vc = tcp_vc_alloc(listener, src_ip, JNTOHS(pkt->hdr.src_port))) == NULL) {
+            // backlog is full, client retransmits the SYN later
+            if (trace_packet_processing) cprintf("Listen queue overflow, SYN dropped\n");
+            tcp_stats.syn_dropped++;
+            return 0;
+        }
     }
 
     // client sends SYN
     // server answers SYN+ACK
     // client sends ACK
-    // server answers ACK
+
+    uint8_t *payload = (uint8_t *)pkt + pkt->hdr.data_offset * 4;
+
+    if (vc->state >= SYN_RECEIVED && ((uint32_t)pkt->hdr.flags & TH_ACK) &&
+        SEQ_LEQ(JNTOHL(pkt->hdr.ack_num), vc->ack_seq.seq_num)) {
+        tcp_ack(vc, pkt, tcp_data_len);
+    }
+    if (vc->state >= ESTABLISHED) {
+        return tcp_input(vc, pkt, payload, tcp_data_len);
+    }
 
     switch(vc->state) {
         case CLOSED:
-            tcp_init_vc();
             break;
         case LISTEN:
-            if ((uint32_t)pkt->hdr.flags & TH_SYN)
-            {
-                if (match_listen_ip(vc, src_ip)) {
-                    // trivial seq num
-                    vc->ack_seq.seq_num = JNTOHL(pkt->hdr.seq_num);
-                    vc->guest_side.ip = src_ip;
-                    vc->guest_side.port = JNTOHS(pkt->hdr.src_port);
-                    vc->ack_seq.ack_num = JNTOHL(pkt->hdr.seq_num) + 1;
-                    // inside flags |= TH_ACK
-                    tcp_send_ack(vc, TH_SYN);
-
-                    vc->ack_seq.seq_num++;
-                    vc->state = SYN_RECEIVED;
-                } else {
-                    cprintf("Source IP: "); num2ip(src_ip); cprintf(" didn't match listen IP: "); num2ip(vc->guest_side.ip);
-                    cprintf("\n");
-                    goto error;
-                }
-            } else {
-                cprintf("SYN flag is not provided\n");
-                goto error;
-            }
+            // channel was just taken for this SYN
+            // trivial seq num
+            vc->ack_seq.seq_num = JNTOHL(pkt->hdr.seq_num);
+            vc->snd_end = vc->ack_seq.seq_num;
+            vc->recover = vc->ack_seq.seq_num;
+            tcp_peer_syn(vc, pkt);
+            // inside flags |= TH_ACK, SYN takes one sequence number
+            tcp_send_ack(vc, TH_SYN);
+
+            vc->state = SYN_RECEIVED;
             break;
         case SYN_SENT:
-            break;
-        case SYN_RECEIVED:
-            if ((uint32_t)pkt->hdr.flags & TH_ACK)
-            {
-                if (src_ip != vc->guest_side.ip) {
-                    cprintf("Wrong IP: "); num2ip(src_ip); cprintf(" is not: "); num2ip(vc->guest_side.ip);
-                    cprintf("\n");
-                    goto error;
-                }
-                if (!check_ack_seq(vc, pkt->hdr)) {
-                    cprintf("Wrond ack seq\n");
-                    goto error;
-                }
-                tcp_send_ack(vc, 0);
+            // SYN+ACK must acknowledge our SYN, RST to it means nobody listens
+            if (!((uint32_t)pkt->hdr.flags & TH_ACK) || JNTOHL(pkt->hdr.ack_num) != vc->ack_seq.seq_num) {
+                break;
+            }
+            if ((uint32_t)pkt->hdr.flags & TH_RST) {
+                tcp_vc_free(vc);
+                break;
+            }
+            if ((uint32_t)pkt->hdr.flags & TH_SYN) {
+                tcp_peer_syn(vc, pkt);
+                tcp_ack(vc, pkt, 0);
                 vc->state = ESTABLISHED;
-            } else {
-                goto error;
+                tcp_send_ack(vc, 0);
             }
             break;
-        case ESTABLISHED:
-            if ((uint32_t)pkt->hdr.flags & TH_ACK)
+        case SYN_RECEIVED:
+            if (((uint32_t)pkt->hdr.flags & (TH_SYN | TH_ACK)) == TH_SYN) {
+                // our SYN+ACK was lost, the client repeats its SYN
+                tcp_retransmit(vc);
+            } else if ((uint32_t)pkt->hdr.flags & TH_ACK)
             {
                 if (src_ip != vc->guest_side.ip) {
                     cprintf("Wrong IP: "); num2ip(src_ip); cprintf(" is not: "); num2ip(vc->guest_side.ip);
@@ -203,76 +1294,24 @@ tcp_process(struct tcp_pkt *pkt, uint32_t src_ip, uint16_t tcp_data_len) {
                     cprintf("Wrond ack seq\n");
                     goto error;
                 }
-                if (vc->data_len + tcp_data_len >= TCP_WINDOW_SIZE) {
-                    cprintf("Buffer overflow\n");
-                    goto error;
-                }
-                memcpy((void *)vc->buffer + vc->data_len, (void *)pkt->data, tcp_data_len);
-                vc->data_len += tcp_data_len;
-                vc->ack_seq.ack_num += tcp_data_len;
-
-                if ((uint32_t)pkt->hdr.flags & TH_PSH) {
-                    size_t reply_len = 0;
-                    struct tcp_pkt data_pkt = {};
-
-                    data_pkt.hdr.data_offset = ((uint8_t)(TCP_HEADER_LEN >> 2) & 0xF);
-                    data_pkt.hdr.flags = TH_ACK | TH_PSH | TH_FIN;
-
-                    http_parse((char *)vc->buffer, vc->data_len, (char *)&data_pkt.data, &reply_len);
-                    // answer by html-page "Hello from JOS"
-                    int rc = tcp_send(vc, &data_pkt, reply_len);
-                    if (rc == -1) {
-                        cprintf("tcp send error\n");
-                        goto error;
-                    }
-
-                    vc->ack_seq.seq_num += reply_len + 1; // +1 - because FIN
-                    vc->data_len = 0;                     // because PSH
-                    vc->state = CLOSE_WAIT;
-                } else if (tcp_data_len) {
-                    tcp_send_ack(vc, 0);
+                // ACK needs no answer, the first one goes with the reply data
+                vc->state = ESTABLISHED;
+                vc->last_rcv_ms = hpet_msec();
+                if (vc->user) {
+                    tcp_vc_enqueue(vc);
+                } else {
+                    // HTTP server of the kernel takes the connection at once,
+                    // a client that never sends a request is dropped as idle
+                    tcp_vc_dequeue(vc);
                 }
-            } else {
-                cprintf("ACK flag is not provided\n");
-                goto error;
-            }
-            break;
-        case FIN_WAIT_1:
-            cprintf("Unimplemented state - %d\n", vc->state);
-            break;
-        case CLOSING:
-            cprintf("Unimplemented state - %d\n", vc->state);
-            break;
-        case FIN_WAIT_2:
-            cprintf("Unimplemented state - %d\n", vc->state);
-            break;
-        case TIME_WAIT:
-            cprintf("Unimplemented state - %d\n", vc->state);
-            break;
-        case CLOSE_WAIT:
-            if ((uint32_t)pkt->hdr.flags & TH_ACK) {
-                if ((uint32_t)pkt->hdr.flags & TH_FIN) {
-                    if (src_ip != vc->guest_side.ip) {
-                        cprintf("Wrong IP: "); num2ip(src_ip); cprintf(" is not: "); num2ip(vc->guest_side.ip);
-                        cprintf("\n");
-                        goto error;
-                    }
-                    if (!check_ack_seq(vc, pkt->hdr)) {
-                        cprintf("Wrond ack seq\n");
-                        goto error;
-                    }
-                    vc->ack_seq.ack_num += 1; // new ACK answer of zero lenght
-                    tcp_send_ack(vc, 0);
-                    vc->state = LISTEN;
+                if (tcp_data_len) {
+                    // the request came along with the ACK
+                    return tcp_input(vc, pkt, payload, tcp_data_len);
                 }
             } else {
-                cprintf("ACK flag is not provided\n");
                 goto error;
             }
             break;
-        case LAST_ACK:
-            tcp_send_ack(vc, TH_FIN);
-            break;
         default:
             cprintf("Impossible state - %d\n", vc->state);
             break;
@@ -287,15 +1326,496 @@ error:
 }
 
 /**
- * Функция получения пакета и его обработки
+ * Активное открытие соединения с ip:port с локального эфемерного порта.
+ * SYN уходит сразу, соединение установлено, когда канал перейдёт
+ * в ESTABLISHED; NULL - нет памяти.
+ */
+struct tcp_virtual_channel *
+tcp_connect(uint32_t ip, uint16_t port) {
+    // listeners are bound to MY_IP, 127.0.0.0/8 is the same host
+    if (IP_IS_LOOPBACK(ip)) {
+        ip = MY_IP;
+    }
+    struct tcp_endpoint host = {MY_IP, 0};
+    struct tcp_endpoint guest = {ip, port};
+
+    // skip ports that are taken for the same peer
+    for (int i = 0; i <= 0xFFFF - TCP_EPHEMERAL_MIN && !host.port; i++) {
+        host.port = tcp_ephemeral_port;
+        tcp_ephemeral_port = tcp_ephemeral_port == 0xFFFF ? TCP_EPHEMERAL_MIN : tcp_ephemeral_port + 1;
+
+        struct tcp_virtual_channel *vc = tcp_vc_hash[tcp_vc_hash_fn(host.ip, host.port, ip, port)];
+        for (; vc; vc = vc->hash_next) {
+            if (vc->host_side.port == host.port && vc->guest_side.port == port &&
+                vc->host_side.ip == host.ip && vc->guest_side.ip == ip) {
+                host.port = 0;
+                break;
+            }
+        }
+    }
+    if (!host.port) {
+        return NULL;
+    }
+
+    struct tcp_virtual_channel *vc = tcp_vc_new(host, guest, TCP_WINDOW_SIZE);
+    if (!vc) {
+        return NULL;
+    }
+    vc->user = vc->sock_ref = true;
+
+    // ISN follows a clock of about 4 us (RFC 793, 3.3)
+    uint32_t isn = (uint32_t)hpet_msec() * 250;
+    vc->ack_seq.seq_num = isn;
+    vc->snd_end = isn;
+    vc->recover = isn;
+    vc->state = SYN_SENT;
+    if (tcp_write(vc, NULL, 0, TH_SYN) < 0) {
+        vc->user_closed = true;
+        tcp_vc_free(vc);
+        return NULL;
+    }
+    return vc;
+}
+
+/**
+ * Чтение принятых данных сокетом. 0 - собеседник закрыл поток,
+ * -E_WOULD_BLOCK - данных пока нет, -E_EOF - соединение оборвано.
+ */
+int
+tcp_read(struct tcp_virtual_channel *vc, void *buf, size_t n) {
+    if (!vc->data_len) {
+        if (vc->rcv_fin) return 0;
+        return vc->state == CLOSED ? -E_EOF : -E_WOULD_BLOCK;
+    }
+
+    bool wnd_closed = vc->buffer_size - vc->data_len < vc->snd_mss;
+    n = MIN(n, (size_t)vc->data_len);
+    memcpy(buf, vc->buffer, n);
+    memmove(vc->buffer, vc->buffer + n, vc->data_len - n);
+    vc->data_len -= n;
+
+    // the peer may be waiting for the window to open
+    if (wnd_closed && vc->state != CLOSED && !vc->rcv_fin) {
+        tcp_send_ack(vc, 0);
+    }
+    return n;
+}
+
+/**
+ * Сколько ещё данных сокет может поставить в очередь отправки
+ */
+uint32_t
+tcp_sndbuf_space(struct tcp_virtual_channel *vc) {
+    uint32_t queued = vc->snd_head ? vc->snd_end - vc->snd_head->seq : 0;
+    return queued < TCP_SNDBUF_MAX ? TCP_SNDBUF_MAX - queued : 0;
+}
+
+/**
+ * Закрытие соединения сокетом: FIN уходит после всех данных очереди.
+ * Канал освобождается, когда собеседник закроет свою сторону,
+ * но не позже TCP_FIN_WAIT_2_MS после подтверждения нашего FIN.
+ */
+int
+tcp_close(struct tcp_virtual_channel *vc) {
+    vc->user_closed = true;
+
+    switch (vc->state) {
+    case ESTABLISHED:
+        vc->state = FIN_WAIT_1;
+        return tcp_write(vc, NULL, 0, TH_FIN);
+    case CLOSE_WAIT:
+        vc->state = LAST_ACK;
+        return tcp_write(vc, NULL, 0, TH_FIN);
+    case CLOSED:
+    case SYN_SENT:
+        tcp_vc_free(vc);
+        return 0;
+    default:
+        // FIN is already sent
+        return 0;
+    }
+}
+
+/**
+ * Обрывает соединение: собеседнику уходит RST, канал освобождается.
+ * Так поток, который не удалось дописать, не примут за целый.
+ */
+void
+tcp_abort(struct tcp_virtual_channel *vc) {
+    if (vc->state >= SYN_RECEIVED) {
+        // the peer expects the first byte it has not acknowledged
+        if (vc->snd_head) {
+            vc->ack_seq.seq_num = vc->snd_head->seq;
+        }
+        tcp_send_ack(vc, TH_RST);
+    }
+    tcp_stats.conn_reset++;
+    tcp_vc_free(vc);
+}
+
+/**
+ * Функция получения пакета и его обработки.
+ * Check-сумма считается программно, если её не проверила карта (csum).
  */
 int
-tcp_recv(struct ip_pkt* pkt) {
-    if (JNTOHS(pkt->hdr.ip_total_length) - IP_HEADER_LEN < TCP_HEADER_LEN) {
+tcp_recv(struct ip_pkt* pkt, uint8_t csum) {
+    uint16_t length = JNTOHS(pkt->hdr.ip_total_length) - IP_HEADER_LEN;
+    if (length < TCP_HEADER_LEN) {
         cprintf("IP packet too short for TCP header\n");
         return -1;
     }
-    struct tcp_pkt tcp_pkt;
-    memcpy((void *)&tcp_pkt, (void *)pkt->data, JNTOHS(pkt->hdr.ip_total_length) - IP_HEADER_LEN);
-    return tcp_process(&tcp_pkt, JNTOHL(pkt->hdr.ip_source_address), JNTOHS(pkt->hdr.ip_total_length) - IP_HEADER_LEN - TCP_HEADER_LEN);
+    if (!(csum & PBUF_CSUM_L4) &&
+        ip_checksum_partial(ip_pseudo_sum(&pkt->hdr, length), pkt->data, length) != 0xffff) {
+        cprintf("Bad TCP checksum\n");
+        return -E_INV_CHS;
+    }
+    // segment is parsed in place, data follows the options
+    struct tcp_pkt *tcp_pkt = (struct tcp_pkt *)pkt->data;
+    uint16_t hdr_len = tcp_pkt->hdr.data_offset * 4;
+    if (hdr_len < TCP_HEADER_LEN || hdr_len > length) {
+        cprintf("Bad TCP data offset\n");
+        return -1;
+    }
+    return tcp_process(tcp_pkt, JNTOHL(pkt->hdr.ip_source_address), JNTOHL(pkt->hdr.ip_destination_address),
+                       length - hdr_len);
+}
+
+#define TCP_TEST_IP   IP(127, 0, 0, 9)  // frames go to the loopback and find no channel
+#define TCP_TEST_PORT 9                 // discard
+#define TCP_TEST_ISN  1000
+#define TCP_TEST_MSS  1000
+
+/**
+ * Установленное соединение для самопроверки TCP и протоколов над ним,
+ * без рукопожатия. Управляет перегрузкой cc.
+ */
+struct tcp_virtual_channel *
+tcp_test_vc(const struct tcp_cc_ops *cc) {
+    struct tcp_endpoint host = {MY_IP, TCP_TEST_PORT}, guest = {TCP_TEST_IP, TCP_TEST_PORT};
+    struct tcp_virtual_channel *vc = tcp_vc_new(host, guest, TCP_RCVBUF_MIN);
+    if (!vc) {
+        cprintf("tcp: no memory for a test connection\n");
+        return NULL;
+    }
+
+    vc->state = ESTABLISHED;
+    vc->user = true;
+    vc->ack_seq.seq_num = vc->snd_end = vc->recover = TCP_TEST_ISN;
+    vc->snd_wnd = 0xFFFF;
+    vc->snd_mss = TCP_TEST_MSS;
+    vc->cwnd = TCP_INIT_CWND(vc->snd_mss);
+    vc->ssthresh = TCP_SSTHRESH_INIT;
+    vc->cc = cc;
+    vc->cc->init(vc);
+    return vc;
+}
+
+/**
+ * Чистый ACK собеседника с подтверждением ack
+ */
+static void
+tcp_test_ack(struct tcp_virtual_channel *vc, uint32_t ack) {
+    static struct tcp_pkt pkt;
+
+    memset(&pkt.hdr, 0, TCP_HEADER_LEN);
+    pkt.hdr.ack_num = JHTONL(ack);
+    pkt.hdr.win_size = JHTONS(vc->snd_wnd);
+    pkt.hdr.flags = TH_ACK;
+    pkt.hdr.data_offset = TCP_HEADER_LEN / 4;
+    tcp_ack(vc, &pkt, 0);
+}
+
+/**
+ * Оценка RTT, таймер повторной передачи и быстрый повтор с NewReno
+ */
+static int
+tcp_test_rtx(void) {
+    static uint8_t data[5 * TCP_TEST_MSS];
+    int errors = 0;
+
+    struct tcp_virtual_channel *vc = tcp_test_vc(&tcp_cc_newreno);
+    if (!vc) return 1;
+
+    // 0 ms, as on the loopback, is a sample too
+    tcp_rtt_update(vc, 0);
+    tcp_rtt_update(vc, 80);
+    if (!vc->rtt_valid || vc->srtt >> 3 != 10 || vc->rto != TCP_RTO_MIN) {
+        cprintf("tcp: srtt %u ms rto %u ms after samples of 0 and 80 ms\n", vc->srtt >> 3, vc->rto);
+        errors++;
+    }
+
+    // the timer sends the oldest segment again and backs off
+    tcp_write(vc, data, 3 * TCP_TEST_MSS, 0);
+    uint64_t retransmits = tcp_stats.retransmits;
+    if (vc->snd_next || !vc->rtx_deadline) {
+        cprintf("tcp: data not sent or timer not armed\n");
+        errors++;
+    }
+    tcp_rtx_timeout(vc, hpet_msec());
+    if (tcp_stats.retransmits != retransmits + 1 || !vc->snd_head->retransmitted ||
+        vc->rto != 2 * TCP_RTO_MIN || vc->cwnd != TCP_TEST_MSS) {
+        cprintf("tcp: timeout: rto %u cwnd %u\n", vc->rto, vc->cwnd);
+        errors++;
+    }
+    tcp_test_ack(vc, TCP_TEST_ISN + 3 * TCP_TEST_MSS);
+    if (vc->snd_head || vc->rtx_deadline || vc->rtx_count) {
+        cprintf("tcp: acknowledged data kept or timer running\n");
+        errors++;
+    }
+
+    // three duplicates: fast retransmit, partial and full ACK of the recovery
+    uint32_t una = TCP_TEST_ISN + 3 * TCP_TEST_MSS;
+    vc->cwnd = vc->ssthresh = 10 * TCP_TEST_MSS;
+    tcp_write(vc, data, 5 * TCP_TEST_MSS, 0);
+    retransmits = tcp_stats.retransmits;
+    for (int i = 0; i < TCP_DUPACK_THRESH; i++) {
+        tcp_test_ack(vc, una);
+    }
+    if (!vc->in_recovery || tcp_stats.retransmits != retransmits + 1 ||
+        vc->ssthresh != 5 * TCP_TEST_MSS / 2 || vc->cwnd != vc->ssthresh + TCP_DUPACK_THRESH * TCP_TEST_MSS) {
+        cprintf("tcp: fast retransmit: ssthresh %u cwnd %u\n", vc->ssthresh, vc->cwnd);
+        errors++;
+    }
+    tcp_test_ack(vc, una + TCP_TEST_MSS);
+    if (!vc->in_recovery || tcp_stats.retransmits != retransmits + 2) {
+        cprintf("tcp: partial ACK does not retransmit\n");
+        errors++;
+    }
+    tcp_test_ack(vc, una + 5 * TCP_TEST_MSS);
+    if (vc->in_recovery || vc->cwnd != TCP_TEST_MSS || vc->snd_head) {
+        cprintf("tcp: recovery not left: cwnd %u\n", vc->cwnd);
+        errors++;
+    }
+    tcp_vc_free(vc);
+
+    // a peer that never answers is given up
+    if (!(vc = tcp_test_vc(&tcp_cc_newreno))) return errors + 1;
+    uint64_t timed_out = tcp_stats.conn_timed_out;
+    tcp_write(vc, data, TCP_TEST_MSS, 0);
+    for (int i = 0; i <= TCP_RTX_MAX; i++) {
+        tcp_rtx_timeout(vc, hpet_msec());
+    }
+    if (tcp_stats.conn_timed_out != timed_out + 1) {
+        cprintf("tcp: connection kept after %d timeouts\n", TCP_RTX_MAX);
+        errors++;
+        tcp_vc_free(vc);
+    }
+    return errors;
+}
+
+/**
+ * Нарезка записей на сегменты по MSS, дописывание последнего сегмента,
+ * флаги последнего и MSS из опций SYN
+ */
+static int
+tcp_test_queue(void) {
+    static uint8_t data[3200];
+    int errors = 0;
+
+    struct tcp_virtual_channel *vc = tcp_test_vc(&tcp_cc_newreno);
+    if (!vc) return 1;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = i * 13 + (i >> 8);
+    }
+
+    // the second write tops up the last segment of the first one
+    tcp_queue(vc, data, 2500, 0);
+    tcp_queue(vc, data + 2500, 700, TH_PSH | TH_FIN);
+    static const uint16_t lens[] = {1000, 1000, 1000, 200};
+    uint32_t seq = TCP_TEST_ISN, off = 0;
+    struct tcp_snd_seg *seg = vc->snd_head;
+    for (size_t i = 0; i < sizeof(lens) / sizeof(*lens); i++, seg = seg->next) {
+        uint8_t flags = i == 3 ? TH_ACK | TH_PSH | TH_FIN : TH_ACK;
+        if (!seg || seg->seq != seq || seg->data_len != lens[i] || seg->flags != flags ||
+            memcmp(seg->pb->data, data + off, lens[i])) {
+            cprintf("tcp: segment %d of the send queue is wrong\n", (int)i);
+            errors++;
+            break;
+        }
+        seq += seg->seq_len;
+        off += seg->data_len;
+    }
+    if (!errors && (seg || vc->snd_end != TCP_TEST_ISN + 3201 || vc->snd_next != vc->snd_head)) {
+        cprintf("tcp: send queue ends at %u\n", vc->snd_end - TCP_TEST_ISN);
+        errors++;
+    }
+    tcp_vc_free(vc);
+
+    static struct {
+        struct tcp_hdr hdr;
+        uint8_t opt[8];
+    } syn = {.opt = {TCP_OPT_NOP, TCP_OPT_NOP, TCP_OPT_MSS, TCP_OPT_MSS_LEN, 0x05, 0xb4}};
+    syn.hdr.data_offset = sizeof(syn) / 4;
+    uint16_t mss = tcp_parse_mss((struct tcp_pkt *)&syn);
+    syn.hdr.data_offset = TCP_HEADER_LEN / 4;
+    if (mss != 1460 || tcp_parse_mss((struct tcp_pkt *)&syn) != TCP_MSS_DEFAULT) {
+        cprintf("tcp: MSS option is not parsed\n");
+        errors++;
+    }
+    return errors;
+}
+
+/**
+ * Алгоритмы управления перегрузкой: выбор по имени, алгоритм соединения
+ * при смене выбранного по умолчанию, медленный старт, реакция на потерю
+ * и таймаут, рост CUBIC после потери не выше W_max
+ */
+static int
+tcp_test_cc(void) {
+    const struct tcp_cc_ops *saved = tcp_cc_default;
+    int errors = 0;
+
+    if (tcp_cc_find("newreno") != &tcp_cc_newreno || tcp_cc_find("cubic") != &tcp_cc_cubic ||
+        tcp_cc_find("reno")) {
+        cprintf("tcp: congestion control is not found by name\n");
+        errors++;
+    }
+
+    // a connection keeps the algorithm it was created with
+    tcp_cc_default = &tcp_cc_newreno;
+    struct tcp_virtual_channel *vc = tcp_vc_new((struct tcp_endpoint){MY_IP, TCP_TEST_PORT},
+                                                (struct tcp_endpoint){TCP_TEST_IP, TCP_TEST_PORT}, TCP_RCVBUF_MIN);
+    tcp_set_default_cc("cubic");
+    if (vc && vc->cc != &tcp_cc_newreno) {
+        cprintf("tcp: connection follows the default congestion control\n");
+        errors++;
+    }
+    if (vc) {
+        // a table entry like any other channel
+        vc->state = ESTABLISHED;
+        vc->user = true;
+        tcp_vc_free(vc);
+    }
+    tcp_cc_default = saved;
+
+    const struct tcp_cc_ops *algs[] = {&tcp_cc_newreno, &tcp_cc_cubic};
+    for (size_t i = 0; i < sizeof(algs) / sizeof(*algs); i++) {
+        if (!(vc = tcp_test_vc(algs[i]))) return errors + 1;
+        uint32_t mss = vc->snd_mss, cwnd = vc->cwnd;
+
+        // nothing in flight, an ACK of a whole window: one MSS more
+        vc->cc->on_ack(vc, cwnd);
+        if (vc->cwnd != cwnd + mss) {
+            cprintf("tcp: %s: slow start gives cwnd %u\n", vc->cc->name, vc->cwnd);
+            errors++;
+        }
+
+        cwnd = vc->cwnd = 10 * mss;
+        vc->cc->on_loss(vc);
+        uint32_t ssthresh = algs[i] == &tcp_cc_cubic ? cwnd * 717 / 1024 : 2 * mss;
+        if (vc->ssthresh != ssthresh) {
+            cprintf("tcp: %s: ssthresh %u after a loss\n", vc->cc->name, vc->ssthresh);
+            errors++;
+        }
+
+        // congestion avoidance: CUBIC comes back towards W_max, not past it
+        vc->cwnd = vc->ssthresh;
+        vc->cc->on_ack(vc, vc->cwnd);
+        if (vc->cwnd <= vc->ssthresh || vc->cwnd >= cwnd) {
+            cprintf("tcp: %s: cwnd %u after a loss at %u\n", vc->cc->name, vc->cwnd, cwnd);
+            errors++;
+        }
+
+        vc->cc->on_timeout(vc);
+        if (vc->cwnd != mss) {
+            cprintf("tcp: %s: cwnd %u after a timeout\n", vc->cc->name, vc->cwnd);
+            errors++;
+        }
+        tcp_vc_free(vc);
+    }
+    return errors;
+}
+
+/**
+ * Сегмент собеседника с порта port на TCP_TEST_PORT без данных
+ */
+static struct tcp_pkt *
+tcp_test_seg(uint16_t port, uint32_t seq, uint32_t ack, uint8_t flags) {
+    static struct tcp_pkt pkt;
+
+    memset(&pkt.hdr, 0, TCP_HEADER_LEN);
+    pkt.hdr.src_port = JHTONS(port);
+    pkt.hdr.dst_port = JHTONS(TCP_TEST_PORT);
+    pkt.hdr.seq_num = JHTONL(seq);
+    pkt.hdr.ack_num = JHTONL(ack);
+    pkt.hdr.flags = flags;
+    pkt.hdr.win_size = JHTONS(0xFFFF);
+    pkt.hdr.data_offset = TCP_HEADER_LEN / 4;
+    return &pkt;
+}
+
+/**
+ * Рукопожатие с порта port, NULL - SYN отброшен или соединение не установлено
+ */
+static struct tcp_virtual_channel *
+tcp_test_handshake(uint16_t port) {
+    struct tcp_pkt *pkt = tcp_test_seg(port, TCP_TEST_ISN, 0, TH_SYN);
+    tcp_process(pkt, TCP_TEST_IP, MY_IP, 0);
+    struct tcp_virtual_channel *vc = match_tcp_vc(pkt, TCP_TEST_IP, MY_IP);
+    if (!vc) return NULL;
+
+    tcp_process(tcp_test_seg(port, vc->ack_seq.ack_num, vc->ack_seq.seq_num, TH_ACK), TCP_TEST_IP, MY_IP, 0);
+    return vc->state == ESTABLISHED ? vc : NULL;
+}
+
+/**
+ * Очередь слушающего порта: SYN сверх backlog отбрасывается, место
+ * освобождается, когда соединение получает владелец - HTTP-сервер ядра
+ * по завершении рукопожатия, сокет при tcp_accept()
+ */
+static int
+tcp_test_backlog(void) {
+    int errors = 0;
+
+    for (int user = 0; user <= 1; user++) {
+        if (tcp_listen(MY_IP, TCP_TEST_PORT, 1, TCP_RCVBUF_MIN, user) < 0) {
+            cprintf("tcp: cannot listen on port %d\n", TCP_TEST_PORT);
+            return errors + 1;
+        }
+        struct tcp_listener *listener = match_tcp_listener(MY_IP, TCP_TEST_PORT);
+        uint64_t dropped = tcp_stats.syn_dropped;
+
+        struct tcp_virtual_channel *vc = tcp_test_handshake(1000), *next = NULL;
+        if (!vc) {
+            cprintf("tcp: handshake failed\n");
+            errors++;
+        } else if (user) {
+            // a socket takes it by accept
+            if (tcp_test_handshake(1001) || tcp_stats.syn_dropped != dropped + 1) {
+                cprintf("tcp: SYN over the backlog taken\n");
+                errors++;
+            }
+            if (tcp_accept(MY_IP, TCP_TEST_PORT) != vc || listener->pending) {
+                cprintf("tcp: accept does not free the backlog\n");
+                errors++;
+            }
+            vc->user_closed = true;
+        } else if (vc->listener || listener->pending) {
+            cprintf("tcp: HTTP connection holds the backlog\n");
+            errors++;
+        }
+
+        if (vc && !(next = tcp_test_handshake(1001))) {
+            cprintf("tcp: SYN refused with a free backlog\n");
+            errors++;
+        }
+        if (vc) tcp_vc_free(vc);
+        // the HTTP server owns its connections, the port only those not accepted
+        if (next && !user) tcp_vc_free(next);
+        tcp_unlisten(MY_IP, TCP_TEST_PORT);
+    }
+    return errors;
+}
+
+/**
+ * Самопроверка TCP на соединении с адресом петли, которого никто не слушает:
+ * сегменты уходят в очередь петли, подтверждения подставляются вручную.
+ * Возвращает число ошибок.
+ */
+int
+tcp_selftest(void) {
+    int errors = tcp_test_rtx() + tcp_test_queue() + tcp_test_cc() + tcp_test_backlog();
+    // nobody is there to take what was sent to the test peer
+    loopback_flush();
+    return errors;
 }
@@ -30,7 +30,7 @@ struct tcp_hdr {
 
 #define TCP_HEADER_LEN sizeof(struct tcp_hdr)
 #define TCP_DATA_LEN (IP_DATA_LEN - TCP_HEADER_LEN)
-#define TCP_WINDOW_SIZE TCP_DATA_LEN * 10
+#define TCP_WINDOW_SIZE TCP_DATA_LEN * 10 // default receive buffer of a connection
 
 struct tcp_pkt {
     struct tcp_hdr hdr;
@@ -61,19 +61,191 @@ struct tcp_ack_seq {
     uint32_t ack_num;
 };
 
+// Modular comparison of sequence numbers
+#define SEQ_LT(a, b)  ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+
+// TCP options
+#define TCP_OPT_END 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_MSS 2
+#define TCP_OPT_MSS_LEN 4
+#define TCP_MSS_DEFAULT 536     // RFC 1122, peer sent no MSS option
+
+struct pbuf;
+
+// Segment of the send queue, kept until the peer acknowledges it.
+// Written data is cut into segments of the peer's MSS, each one lies
+// in a pool buffer with room for the headers in front of it.
+struct tcp_snd_seg {
+    struct tcp_snd_seg *next;
+    uint32_t seq;
+    uint32_t seq_len;     // data plus SYN and FIN
+    uint64_t sent_ms;     // first transmission, RTT sample is taken from it
+    bool retransmitted;   // Karn: no RTT sample from ambiguous ACK
+    uint8_t flags;
+    uint16_t data_len;
+    struct pbuf *pb;
+};
+
+// CUBIC state of a connection, see kern/tcp_cc.c
+struct tcp_cubic {
+    uint32_t w_max;     // cwnd before the last loss, bytes
+    uint32_t origin;    // plateau of the cubic curve, bytes
+    uint64_t k;         // ms from epoch to the plateau
+    uint64_t epoch;     // ms, start of congestion avoidance, 0 - not started
+    uint64_t w_est;     // window of Reno with the same losses, bytes * 1024
+};
+
+struct tcp_listener;
+struct tcp_cc_ops;
+struct http_object;
+struct http_parser;
+
+// Connection control block, allocated from a slab for every accepted SYN
 struct tcp_virtual_channel {
     enum tcp_state state;
     struct tcp_endpoint host_side;
     struct tcp_endpoint guest_side;
     struct tcp_ack_seq ack_seq;
-    uint8_t buffer[TCP_WINDOW_SIZE];
+    uint8_t *buffer;           // receive buffer, size is taken from the listener
+    uint32_t buffer_size;
     uint32_t data_len;
+    // last pure ACK, the next one only adjusts its checksum
+    struct tcp_hdr ack_hdr;
+    uint32_t ack_hdr_ip;
+    bool ack_hdr_valid;
+    // delayed ACK (RFC 1122, 4.2.3.2): data segments not acknowledged yet
+    uint8_t delack_segs;
+    uint64_t delack_deadline;   // ms, ACK goes out by then at the latest
+    bool delack_queued;
+    struct tcp_virtual_channel *delack_next;
+    // send queue: unacknowledged segments, then the ones not sent yet
+    struct tcp_snd_seg *snd_head;
+    struct tcp_snd_seg *snd_tail;
+    struct tcp_snd_seg *snd_next;   // first segment not sent
+    uint32_t snd_end;       // sequence number after the queue
+    uint32_t snd_wnd;       // window advertised by the peer
+    uint16_t snd_mss;       // MSS from the peer's SYN
+    uint64_t rtx_deadline;  // ms, 0 if nothing is in flight
+    uint32_t rtx_count;     // timeouts of the oldest segment in a row
+    // RFC 6298 estimator, ms scaled by 8 and 4 like in BSD
+    uint32_t srtt;
+    uint32_t rttvar;
+    bool rtt_valid;         // srtt and rttvar hold a measurement, 0 ms is one too
+    uint32_t rto;           // ms
+    // congestion control, bytes
+    const struct tcp_cc_ops *cc; // tcp_cc_default when the channel is created
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    struct tcp_cubic cubic;
+    // fast retransmit and NewReno fast recovery (RFC 5681, RFC 6582)
+    uint32_t dupacks;
+    uint32_t recover;       // snd_nxt when recovery started
+    bool in_recovery;
+    // connection of a user socket (kern/socket.c) instead of the HTTP server
+    bool user;
+    bool sock_ref;          // socket holds the channel until tcp_close()
+    bool user_closed;       // tcp_close() was called
+    bool rcv_fin;           // peer will send no more data
+    uint64_t last_rcv_ms;   // ms, last segment of the established connection
+    uint64_t fin_wait_ms;   // ms, our FIN was acknowledged (FIN_WAIT_2 entered)
+    // file the HTTP server of the kernel waits for to reply
+    struct http_object *http_wait;
+    uint64_t http_wait_ms;  // ms, since when it is waited for
+    struct tcp_virtual_channel *http_next;
+    uint8_t http_conn;      // what the reply does to the connection, HTTP_CONN_*
+    bool http_head;         // HEAD request, the reply goes without the body
+    struct pbuf *http_body; // rest of the reply body, a reference is held on each piece
+    struct http_parser *http;   // request being received, allocated with the first
+    // listener while the connection is not accepted yet
+    struct tcp_listener *listener;
+    struct tcp_virtual_channel *accept_next;
+    // next channel in the same hash bucket
+    struct tcp_virtual_channel *hash_next;
+};
+
+// Passive open endpoint, every SYN to it gets its own channel
+struct tcp_listener {
+    struct tcp_endpoint host_side;
+    uint32_t rcv_buf_size;  // receive buffer of its connections
+    uint16_t backlog;       // connections not handed to their owner yet, half-open included
+    uint16_t pending;
+    bool user;              // connections go to a user socket
+    // established connections in the order of arrival
+    struct tcp_virtual_channel *accept_head;
+    struct tcp_virtual_channel *accept_tail;
+    struct tcp_listener *hash_next;
+};
+
+#define TCP_VC_HASH_SIZE 256    // Buckets of (src ip, src port, dst ip, dst port), power of 2
+#define TCP_LISTEN_NUM 128      // Listening ports
+#define TCP_KERN_PORTS 64       // of them taken by the HTTP server of the kernel
+#define TCP_LISTEN_HASH_SIZE 64 // Buckets of listening ports, power of 2
+#define TCP_BACKLOG_DEFAULT 16
+#define TCP_RCVBUF_MIN 2048     // Receive buffers come in powers of 2 between these
+#define TCP_RCVBUF_MAX 65536
+#define TCP_RTO_INIT 1000       // ms, RFC 6298
+#define TCP_RTO_MIN 1000
+#define TCP_RTO_MAX 60000
+#define TCP_RTO_GRANULARITY 500 // ms, HPET tick driving tcp_timer()
+#define TCP_RTX_MAX 8           // timeouts before the connection is dropped
+#define TCP_DUPACK_THRESH 3
+#define TCP_SSTHRESH_INIT 0x7FFFFFFF // no limit until the first loss
+#define TCP_CWND_MAX 0x7FFFFFFF // cwnd never grows past it, so it cannot wrap
+#define TCP_DELACK_SEGS 2       // every second segment is acknowledged at once
+#define TCP_DELACK_MS 40        // the others wait for data to ride on
+#define TCP_SNDBUF_MAX 65536    // unacknowledged and unsent data of a user socket
+#define TCP_EPHEMERAL_MIN 49152 // local ports of active opens, RFC 6335
+#define TCP_HTTP_IDLE_MS 15000  // keep-alive connection of the HTTP server without requests
+#define TCP_HTTP_WAIT_MS 30000  // request of the HTTP server waiting for its file
+#define TCP_FIN_WAIT_2_MS 60000 // closed connection waiting for the FIN of the peer
+// Initial window (RFC 6928)
+#define TCP_INIT_CWND(mss) MIN(10 * (uint32_t)(mss), MAX(2 * (uint32_t)(mss), 14600U))
+
+// Counters for the monitor
+struct tcp_stats {
+    uint64_t segs_in;
+    uint64_t segs_out;
+    uint64_t tso_frames;
+    uint64_t bytes_out;
+    uint64_t retransmits;
+    uint64_t fast_retransmits;
+    uint64_t timeouts;
+    uint64_t dupacks;
+    uint64_t acks_out;        // pure ACKs
+    uint64_t acks_delayed;    // of them sent by the delayed ACK timer
+    uint64_t acks_piggybacked;
+    uint64_t conn_opened;
+    uint64_t conn_closed;
+    uint64_t conn_timed_out;
+    uint64_t conn_reset;      // aborted by us
+    uint64_t syn_dropped;
 };
 
-#define TCP_VC_NUM 64
+extern struct tcp_stats tcp_stats;
 
 void tcp_init_vc();
+int tcp_listen(uint32_t ip, uint16_t port, uint16_t backlog, uint32_t rcv_buf_size, bool user);
+int tcp_unlisten(uint32_t ip, uint16_t port);
+struct tcp_virtual_channel *tcp_accept(uint32_t ip, uint16_t port);
+bool tcp_accept_ready(uint32_t ip, uint16_t port);
+struct tcp_virtual_channel *tcp_connect(uint32_t ip, uint16_t port);
+int tcp_read(struct tcp_virtual_channel *vc, void *buf, size_t n);
+uint32_t tcp_sndbuf_space(struct tcp_virtual_channel *vc);
+int tcp_close(struct tcp_virtual_channel *vc);
+void tcp_abort(struct tcp_virtual_channel *vc);
 int tcp_send(struct tcp_virtual_channel* channel, struct tcp_pkt* pkt, size_t length);
-int tcp_recv(struct ip_pkt* pkt);
+int tcp_queue(struct tcp_virtual_channel *vc, const void *data, size_t length, uint8_t flags);
+int tcp_write(struct tcp_virtual_channel *vc, const void *data, size_t length, uint8_t flags);
+int tcp_selftest(void);
+struct tcp_virtual_channel *tcp_test_vc(const struct tcp_cc_ops *cc);
+void tcp_push(struct tcp_virtual_channel *vc);
+int tcp_recv(struct ip_pkt* pkt, uint8_t csum);
+void tcp_timer(void);
+void tcp_flush_acks(void);
+int tcp_set_default_cc(const char *name);
+const char *tcp_default_cc(void);
+void tcp_print_stats(void);
 
 #endif
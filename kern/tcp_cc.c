@@ -0,0 +1,187 @@
+#include <inc/string.h>
+#include <kern/tcp.h>
+#include <kern/tcp_cc.h>
+#include <kern/timer.h>
+
+/**
+ * Окно растёт, только пока отправитель в него упирается (RFC 7661):
+ * до этого ACK в пути было почти cwnd байт. Если данных не хватало
+ * приложению или окну получателя, рост ничего не говорит о сети.
+ */
+static bool
+tcp_cwnd_limited(struct tcp_virtual_channel *vc, uint32_t acked) {
+    return (uint64_t)tcp_flight(vc) + acked + vc->snd_mss > vc->cwnd;
+}
+
+static void
+tcp_cwnd_grow(struct tcp_virtual_channel *vc, uint32_t inc) {
+    vc->cwnd = MIN((uint64_t)vc->cwnd + inc, (uint64_t)TCP_CWND_MAX);
+}
+
+/**
+ * Медленный старт (RFC 5681, 3.1): не больше одного MSS на каждый ACK
+ */
+static void
+tcp_slow_start(struct tcp_virtual_channel *vc, uint32_t acked) {
+    tcp_cwnd_grow(vc, MIN(acked, (uint32_t)vc->snd_mss));
+}
+
+/**
+ * Половина данных в пути, но не меньше двух сегментов (RFC 5681, 3.1)
+ */
+static uint32_t
+tcp_halve_flight(struct tcp_virtual_channel *vc) {
+    return MAX(tcp_flight(vc) / 2, 2 * (uint32_t)vc->snd_mss);
+}
+
+static void
+newreno_init(struct tcp_virtual_channel *vc) {
+}
+
+static void
+newreno_on_ack(struct tcp_virtual_channel *vc, uint32_t acked) {
+    if (!tcp_cwnd_limited(vc, acked)) return;
+
+    if (vc->cwnd < vc->ssthresh) {
+        tcp_slow_start(vc, acked);
+        return;
+    }
+    // congestion avoidance: about one MSS per RTT
+    tcp_cwnd_grow(vc, MAX((uint32_t)vc->snd_mss * vc->snd_mss / vc->cwnd, 1U));
+}
+
+static void
+newreno_on_loss(struct tcp_virtual_channel *vc) {
+    vc->ssthresh = tcp_halve_flight(vc);
+}
+
+static void
+newreno_on_timeout(struct tcp_virtual_channel *vc) {
+    vc->ssthresh = tcp_halve_flight(vc);
+    vc->cwnd = vc->snd_mss;
+}
+
+const struct tcp_cc_ops tcp_cc_newreno = {
+        .name = "newreno",
+        .init = newreno_init,
+        .on_ack = newreno_on_ack,
+        .on_loss = newreno_on_loss,
+        .on_timeout = newreno_on_timeout,
+};
+
+/* CUBIC (RFC 8312): W(t) = C * (t - K)^3 + W_max, C = 0.4, beta = 0.7.
+ * No floating point in the kernel: time is in ms, window in segments
+ * where it is cubed, beta and alpha are scaled by 1024 like in Linux.
+ * Where Reno would be faster (short RTT, small window) cwnd follows
+ * W_est, Reno with alpha = 3 * (1 - beta) / (1 + beta) (RFC 8312, 4.2). */
+#define CUBIC_BETA 717          // 0.7 * 1024
+#define CUBIC_ALPHA 542         // 3 * 0.3 / 1.7 * 1024
+#define CUBIC_MAX_DELTA (1 << 20) // ms, keeps (t - K)^3 in 64 bits
+
+/**
+ * Целый кубический корень (метод Ньютона)
+ */
+static uint64_t
+cubic_root(uint64_t a) {
+    if (!a) return 0;
+
+    // start from a power of 2 not below the root, Newton then goes down
+    uint64_t x = 1ULL << ((64 - __builtin_clzll(a) + 2) / 3);
+    for (;;) {
+        uint64_t y = (2 * x + a / (x * x)) / 3;
+        if (y >= x) break;
+        x = y;
+    }
+    return x;
+}
+
+static void
+cubic_init(struct tcp_virtual_channel *vc) {
+    memset(&vc->cubic, 0, sizeof(vc->cubic));
+}
+
+static void
+cubic_on_ack(struct tcp_virtual_channel *vc, uint32_t acked) {
+    struct tcp_cubic *c = &vc->cubic;
+    uint32_t mss = vc->snd_mss;
+
+    if (!tcp_cwnd_limited(vc, acked)) return;
+
+    if (vc->cwnd < vc->ssthresh) {
+        tcp_slow_start(vc, acked);
+        return;
+    }
+
+    uint64_t now = hpet_msec();
+    if (!c->epoch) {
+        // first ACK of congestion avoidance after a loss
+        c->epoch = now;
+        if (vc->cwnd < c->w_max) {
+            // K = cbrt((W_max - cwnd) / C) seconds, here in ms
+            c->k = cubic_root((uint64_t)((c->w_max - vc->cwnd) / mss) * 2500000000ULL);
+            c->origin = c->w_max;
+        } else {
+            c->k = 0;
+            c->origin = vc->cwnd;
+        }
+        c->w_est = (uint64_t)vc->cwnd * 1024;
+    }
+
+    // Reno-friendly estimate: alpha segments per RTT
+    c->w_est += (uint64_t)CUBIC_ALPHA * mss * acked / vc->cwnd;
+
+    // window one RTT ahead
+    int64_t delta = (int64_t)(now - c->epoch + (vc->srtt >> 3)) - c->k;
+    delta = MIN(MAX(delta, (int64_t)-CUBIC_MAX_DELTA), (int64_t)CUBIC_MAX_DELTA);
+    int64_t offset = delta * delta * delta / 1000000 * 4 * mss / 10000;
+    int64_t target = MAX((int64_t)c->origin + offset, (int64_t)mss);
+    target = MAX(target, (int64_t)(c->w_est / 1024));
+    target = MIN(target, (int64_t)TCP_CWND_MAX);
+
+    if (target > vc->cwnd) {
+        tcp_cwnd_grow(vc, MAX((uint32_t)((target - vc->cwnd) * acked / vc->cwnd), 1U));
+    } else {
+        // plateau around W_max: grow very slowly
+        tcp_cwnd_grow(vc, MAX((uint32_t)((uint64_t)mss * acked / (100ULL * vc->cwnd)), 1U));
+    }
+}
+
+static void
+cubic_on_loss(struct tcp_virtual_channel *vc) {
+    struct tcp_cubic *c = &vc->cubic;
+
+    c->epoch = 0;
+    // fast convergence: a flow that lost before reaching W_max yields
+    if (vc->cwnd < c->w_max) {
+        c->w_max = (uint64_t)vc->cwnd * (1024 + CUBIC_BETA) / 2048;
+    } else {
+        c->w_max = vc->cwnd;
+    }
+    vc->ssthresh = MAX((uint32_t)((uint64_t)vc->cwnd * CUBIC_BETA / 1024), 2 * (uint32_t)vc->snd_mss);
+}
+
+static void
+cubic_on_timeout(struct tcp_virtual_channel *vc) {
+    cubic_on_loss(vc);
+    vc->cwnd = vc->snd_mss;
+}
+
+const struct tcp_cc_ops tcp_cc_cubic = {
+        .name = "cubic",
+        .init = cubic_init,
+        .on_ack = cubic_on_ack,
+        .on_loss = cubic_on_loss,
+        .on_timeout = cubic_on_timeout,
+};
+
+static const struct tcp_cc_ops *tcp_cc_list[] = {&tcp_cc_newreno, &tcp_cc_cubic};
+
+const struct tcp_cc_ops *
+tcp_cc_find(const char *name) {
+    for (size_t i = 0; i < sizeof(tcp_cc_list) / sizeof(*tcp_cc_list); i++) {
+        if (!strcmp(tcp_cc_list[i]->name, name)) {
+            return tcp_cc_list[i];
+        }
+    }
+    return NULL;
+}
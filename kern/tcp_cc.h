@@ -0,0 +1,31 @@
+#ifndef JOS_KERN_TCP_CC_H
+#define JOS_KERN_TCP_CC_H
+
+#include <kern/tcp.h>
+
+/* Congestion control algorithm of a connection. It owns cwnd and
+ * ssthresh of the channel; loss detection and NewReno fast recovery
+ * (duplicate ACKs, partial ACKs) are done by tcp.c for all of them. */
+struct tcp_cc_ops {
+    const char *name;
+    void (*init)(struct tcp_virtual_channel *vc);
+    // acked bytes of new data are acknowledged outside of fast recovery
+    void (*on_ack)(struct tcp_virtual_channel *vc, uint32_t acked);
+    // third duplicate ACK: set ssthresh, fast recovery starts from it
+    void (*on_loss)(struct tcp_virtual_channel *vc);
+    // retransmission timer expired: set ssthresh and cwnd
+    void (*on_timeout)(struct tcp_virtual_channel *vc);
+};
+
+extern const struct tcp_cc_ops tcp_cc_newreno;
+extern const struct tcp_cc_ops tcp_cc_cubic;
+
+const struct tcp_cc_ops *tcp_cc_find(const char *name);
+
+// Bytes sent and not acknowledged yet
+static inline uint32_t
+tcp_flight(struct tcp_virtual_channel *vc) {
+    return vc->snd_head ? vc->ack_seq.seq_num - vc->snd_head->seq : 0;
+}
+
+#endif /* !JOS_KERN_TCP_CC_H */
@@ -387,6 +387,12 @@ hpet_get_main_cnt(void) {
     return hpetReg->MAIN_CNT;
 }
 
+/* Milliseconds counted by HPET main counter. */
+uint64_t
+hpet_msec(void) {
+    return hpetReg ? hpet_get_main_cnt() / (hpetFreq / 1000) : 0;
+}
+
 /* - Configure HPET timer 0 to trigger every 0.5 seconds on IRQ_TIMER line
  * - Configure HPET timer 1 to trigger every 1.5 seconds on IRQ_CLOCK line
  *
@@ -1,6 +1,8 @@
 #ifndef JOS_INC_TRACEOPT_H
 #define JOS_INC_TRACEOPT_H
 
+#include <inc/types.h>
+
 #if LAB == 8
 #define trace_traps 1
 #elif !defined(trace_traps)
@@ -50,8 +52,10 @@
 #define trace_init 1
 #endif
 
-#ifndef trace_packets
-#define trace_packets 1
-#endif
+// Packet tracing, off by default and switched at run time (kern/e1000.c)
+extern bool net_trace_packets;
+extern bool net_trace_processing;
+#define trace_packets net_trace_packets
+#define trace_packet_processing net_trace_processing
 
 #endif
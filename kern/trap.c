@@ -15,6 +15,11 @@
 #include <kern/picirq.h>
 #include <kern/timer.h>
 #include <kern/vsyscall.h>
+#include <kern/e1000.h>
+#include <kern/eth.h>
+#include <kern/tcp.h>
+#include <kern/arp.h>
+#include <kern/socket.h>
 #include <kern/traceopt.h>
 
 #include <stdatomic.h>
@@ -53,6 +58,10 @@
     extern void kbd_thdlr(void);
     extern void serial_thdlr(void);
 
+    extern void pci_a_thdlr(void);
+    extern void pci_b_thdlr(void);
+    extern void pci_c_thdlr(void);
+
 #endif
 
 static struct Taskstate ts;
@@ -181,6 +190,10 @@ trap_init(void) {
     idt[IRQ_OFFSET + IRQ_KBD] = GATE(0, GD_KT, kbd_thdlr, 0);
     idt[IRQ_OFFSET + IRQ_SERIAL] = GATE(0, GD_KT, serial_thdlr, 0);
 
+    idt[IRQ_OFFSET + IRQ_PCI_A] = GATE(0, GD_KT, pci_a_thdlr, 0);
+    idt[IRQ_OFFSET + IRQ_PCI_B] = GATE(0, GD_KT, pci_b_thdlr, 0);
+    idt[IRQ_OFFSET + IRQ_PCI_C] = GATE(0, GD_KT, pci_c_thdlr, 0);
+
     /* Per-CPU setup */
     trap_init_percpu();
 }
@@ -338,6 +351,11 @@ trap_dispatch(struct Trapframe *tf) {
         // LAB 12: Your code here
         assert(timer_for_schedule);
         timer_for_schedule->handle_interrupts();
+        tcp_timer();
+        arp_timer();
+        ip_timer();
+        eth_poll();
+        ksock_wakeup();
         // вот здесь по часам определяется время (прерывания от часов)
         atomic_store_explicit(&vsys[VSYS_gettime], gettime(), memory_order_relaxed);        
         sched_yield();
@@ -351,6 +369,13 @@ trap_dispatch(struct Trapframe *tf) {
     case IRQ_OFFSET + IRQ_SERIAL:
         serial_intr();
         return;
+    case IRQ_OFFSET + IRQ_PCI_A:
+    case IRQ_OFFSET + IRQ_PCI_B:
+    case IRQ_OFFSET + IRQ_PCI_C:
+        /* PCI INTx lines may be shared, the NIC checks its own ICR */
+        e1000_intr();
+        pic_send_eoi(tf->tf_trapno - IRQ_OFFSET);
+        return;
     default:
         print_trapframe(tf);
         if (!(tf->tf_cs & 3))
@@ -1,52 +1,421 @@
 #include <kern/udp.h>
 #include <kern/inet.h>
+#include <kern/netif.h>
+#include <kern/pbuf.h>
 #include <inc/string.h>
 #include <inc/stdio.h>
+#include <inc/error.h>
+#include <kern/slab.h>
 #include <kern/traceopt.h>
 
+// Bound ports and their receive rings
+static struct udp_socket udp_sockets[UDP_SOCK_NUM];
+static struct udp_socket *udp_sock_hash[UDP_SOCK_HASH_SIZE];
+#define UDP_RCVBUF_CLASSES 7 // UDP_RCVBUF_MIN << i up to UDP_RCVBUF_MAX
+static struct slab_cache udp_rcvbuf_cache[UDP_RCVBUF_CLASSES];
+
+void
+udp_init(void) {
+    for (int i = 0; i < UDP_RCVBUF_CLASSES; i++) {
+        slab_init(&udp_rcvbuf_cache[i], "udp_rcvbuf", UDP_RCVBUF_MIN << i);
+    }
+    memset(udp_sockets, 0, sizeof(udp_sockets));
+    memset(udp_sock_hash, 0, sizeof(udp_sock_hash));
+}
+
+/**
+ * Наименьший класс кольца не меньше size
+ */
+static struct slab_cache *
+udp_rcvbuf_class(uint32_t size) {
+    int i = 0;
+    while (i < UDP_RCVBUF_CLASSES - 1 && (UDP_RCVBUF_MIN << i) < size) {
+        i++;
+    }
+    return &udp_rcvbuf_cache[i];
+}
+
+static struct udp_socket **
+udp_sock_bucket(uint16_t port) {
+    return &udp_sock_hash[(port * 2654435761u) >> 24 & (UDP_SOCK_HASH_SIZE - 1)];
+}
+
+static struct udp_socket *
+udp_sock_find(uint16_t port) {
+    struct udp_socket *sock = *udp_sock_bucket(port);
+    while (sock && sock->port != port) {
+        sock = sock->hash_next;
+    }
+    return sock;
+}
+
 /**
- * Создаёт udp пакет и отправляет его
+ * Занимает порт: датаграммы на него складываются в кольцо не меньше
+ * rcv_buf_size байт, пока их не заберёт udp_recvfrom(). Не поместившиеся
+ * в кольцо датаграммы отбрасываются.
  */
 int
-udp_send(void* data, int length) {
+udp_bind(uint16_t port, uint32_t rcv_buf_size) {
+    if (!port) {
+        return -E_INVAL;
+    }
+    if (udp_sock_find(port)) {
+        return -E_ADDR_IN_USE;
+    }
+
+    struct udp_socket *sock = NULL;
+    for (int i = 0; i < UDP_SOCK_NUM && !sock; i++) {
+        if (!udp_sockets[i].port) sock = &udp_sockets[i];
+    }
+    if (!sock) {
+        return -E_NO_MEM;
+    }
+
+    struct slab_cache *rcvbuf = udp_rcvbuf_class(rcv_buf_size);
+    if (!(sock->ring = slab_alloc(rcvbuf))) {
+        return -E_NO_MEM;
+    }
+    sock->ring_size = rcvbuf->obj_size;
+    sock->head = sock->tail = 0;
+    sock->drops = 0;
+    sock->port = port;
+
+    struct udp_socket **bucket = udp_sock_bucket(port);
+    sock->hash_next = *bucket;
+    *bucket = sock;
+    return 0;
+}
+
+/**
+ * Освобождает порт, непрочитанные датаграммы пропадают
+ */
+int
+udp_unbind(uint16_t port) {
+    struct udp_socket **link = udp_sock_bucket(port);
+    while (*link && (*link)->port != port) {
+        link = &(*link)->hash_next;
+    }
+    struct udp_socket *sock = *link;
+    if (!sock) {
+        return -E_NO_ENT;
+    }
+
+    *link = sock->hash_next;
+    slab_free(udp_rcvbuf_class(sock->ring_size), sock->ring);
+    sock->ring = NULL;
+    sock->port = 0;
+    return 0;
+}
+
+// Copy to and from the ring, pos wraps around its end
+static void
+udp_ring_put(struct udp_socket *sock, uint32_t pos, const void *data, uint32_t len) {
+    uint32_t off = pos & (sock->ring_size - 1);
+    uint32_t n = MIN(len, sock->ring_size - off);
+    memcpy(sock->ring + off, data, n);
+    memcpy(sock->ring, (const uint8_t *)data + n, len - n);
+}
+
+static void
+udp_ring_get(struct udp_socket *sock, uint32_t pos, void *data, uint32_t len) {
+    uint32_t off = pos & (sock->ring_size - 1);
+    uint32_t n = MIN(len, sock->ring_size - off);
+    memcpy(data, sock->ring + off, n);
+    memcpy((uint8_t *)data + n, sock->ring, len - n);
+}
+
+/**
+ * Забирает из кольца порта самую старую датаграмму. Не поместившийся
+ * в buf хвост отбрасывается. Возвращает число скопированных байт
+ * или -E_WOULD_BLOCK, если кольцо пусто.
+ */
+int
+udp_recvfrom(uint16_t port, void *buf, size_t size, uint32_t *src_ip, uint16_t *src_port) {
+    struct udp_socket *sock = udp_sock_find(port);
+    if (!sock) {
+        return -E_NO_ENT;
+    }
+
+    uint32_t head = sock->head;
+    // datagram is written before tail moves past it
+    if (head == __atomic_load_n(&sock->tail, __ATOMIC_ACQUIRE)) {
+        return -E_WOULD_BLOCK;
+    }
+
+    struct udp_rx_rec rec;
+    udp_ring_get(sock, head, &rec, sizeof(rec));
+    uint32_t len = MIN(rec.len, (uint32_t)size);
+    udp_ring_get(sock, head + sizeof(rec), buf, len);
+    if (src_ip) *src_ip = rec.src_ip;
+    if (src_port) *src_port = rec.src_port;
+
+    __atomic_store_n(&sock->head, head + sizeof(rec) + rec.len, __ATOMIC_RELEASE);
+    return len;
+}
+
+/**
+ * Вернёт ли udp_recvfrom() что-нибудь, кроме -E_WOULD_BLOCK
+ */
+bool
+udp_rx_ready(uint16_t port) {
+    struct udp_socket *sock = udp_sock_find(port);
+    return !sock || sock->head != __atomic_load_n(&sock->tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Отправляет датаграмму: заголовок hdr и данные data длины length.
+ * Данные вызывающего не живут до отправки кадра, поэтому датаграмма
+ * один раз копируется в буфер пула: карта заберёт её оттуда по DMA,
+ * а заголовки IP и Ethernet лягут в его headroom. Без буфера пула
+ * (датаграмма больше него или пул пуст) куски скопирует интерфейс.
+ */
+static int
+udp_xmit(struct ip_hdr *ip_header, const struct udp_hdr *hdr, const void *data, int length, uint8_t csum_off) {
+    size_t len = sizeof(*hdr) + length;
+    struct pbuf *pb = len <= PBUF_DATA_LEN ? pbuf_alloc(len) : NULL;
+    if (!pb) {
+        struct tx_seg segs[] = {
+                {hdr, sizeof(*hdr)},
+                {data, length},
+        };
+        return ip_sendv(ip_header, segs, 2, csum_off);
+    }
+
+    memcpy(pb->data, hdr, sizeof(*hdr));
+    memcpy(pb->data + sizeof(*hdr), data, length);
+    struct tx_seg seg = {pb->data, len, pb};
+    int res = ip_sendv(ip_header, &seg, 1, csum_off);
+    // the NIC keeps its own reference until the frame is sent
+    pbuf_release(pb);
+    return res;
+}
+
+/**
+ * Создаёт udp пакет и отправляет его.
+ * checksum - уже посчитанная check-сумма датаграммы или 0,
+ * тогда её досчитает карта или мы сами.
+ * Порты и адрес получателя в порядке байт хоста.
+ */
+static int
+udp_output(uint16_t src_port, uint32_t dst_ip, uint16_t dst_port,
+           const void* data, int length, uint16_t checksum) {
     if (trace_packet_processing) cprintf("Sending UDP packet\n");
-    struct udp_pkt pkt;
-    struct udp_hdr* hdr = &pkt.hdr;
-    struct ip_pkt result;
+    if (length < 0 || length > UDP_MAX_DATA_LENGTH) {
+        return -E_INVAL;
+    }
+
+    struct udp_hdr hdr;
+    struct ip_hdr ip_header = {};
+
+    hdr.source_port = JHTONS(src_port);
+    hdr.destination_port = JHTONS(dst_port);
+    hdr.length = JHTONS(length + sizeof(struct udp_hdr));
+    hdr.checksum = 0;
+
+    ip_header.ip_protocol = IP_PROTO_UDP;
+    ip_header.ip_source_address = JHTONL(MY_IP);
+    ip_header.ip_destination_address = JHTONL(dst_ip);
+
+    if (checksum) {
+        hdr.checksum = checksum;
+        return udp_xmit(&ip_header, &hdr, data, length, 0);
+    }
+
+    uint32_t sum = ip_pseudo_sum(&ip_header, length + sizeof(struct udp_hdr));
+    if (netif_csum_caps(dst_ip) & E1000_CAP_CSUM_TX_L4) {
+        // NIC adds the datagram to the pseudo header sum left in the field
+        hdr.checksum = JHTONS(sum);
+        return udp_xmit(&ip_header, &hdr, data, length, offsetof(struct udp_hdr, checksum));
+    }
+
+    sum = ip_checksum_partial(sum, &hdr, sizeof(struct udp_hdr));
+    sum = ip_checksum_partial(sum, data, length);
+    hdr.checksum = ip_checksum_finish(sum);
+    // zero means "no checksum", its ones' complement twin is sent instead
+    if (!hdr.checksum) hdr.checksum = 0xffff;
+    return udp_xmit(&ip_header, &hdr, data, length, 0);
+}
+
+/**
+ * Отправляет датаграмму с порта src_port на dst_ip:dst_port
+ * (порядок байт хоста)
+ */
+int
+udp_sendto(uint16_t src_port, uint32_t dst_ip, uint16_t dst_port, const void* data, int length) {
+    return udp_output(src_port, dst_ip, dst_port, data, length, 0);
+}
+
+int
+udp_send(void* data, int length) {
+    return udp_sendto(UDP_SRC_PORT, HOST_IP, UDP_DST_PORT, data, length);
+}
+
+// Fields an echo reply changes, as they lie in the datagram checksum
+struct udp_echo_fields {
+    uint32_t source_address;
+    uint32_t destination_address;
+    uint16_t source_port;
+    uint16_t destination_port;
+} __attribute__((packed));
 
-    hdr->source_port = JHTONS(8081);
-    hdr->destination_port = JHTONS(1234);
-    hdr->length = JHTONS(length + sizeof(struct udp_hdr));
-    hdr->checksum = 0;
-    memcpy((void*)pkt.data, data, length);
+/**
+ * Check-сумма ответа с теми же данными, полученная из check-суммы запроса
+ * заменой адресов и портов (RFC 1624), без прохода по данным.
+ * 0, если посчитать так нельзя.
+ */
+static uint16_t
+udp_echo_checksum(struct ip_pkt* pkt, struct udp_hdr* hdr) {
+    // nothing to adjust, or the NIC fills the checksum anyway
+    if (!hdr->checksum || (netif_csum_caps(JNTOHL(pkt->hdr.ip_source_address)) & E1000_CAP_CSUM_TX_L4)) {
+        return 0;
+    }
 
-    result.hdr.ip_protocol = IP_PROTO_UDP;
-    result.hdr.ip_source_address = JHTONL(MY_IP);
-    result.hdr.ip_destination_address = JHTONL(HOST_IP);
-    memcpy((void*)result.data, (void*)&pkt, length + sizeof(struct udp_hdr));
+    struct udp_echo_fields old = {pkt->hdr.ip_source_address, pkt->hdr.ip_destination_address,
+                                  hdr->source_port, hdr->destination_port};
+    struct udp_echo_fields new = {JHTONL(MY_IP), pkt->hdr.ip_source_address,
+                                  JHTONS(UDP_ECHO_PORT), hdr->source_port};
 
-    return ip_send(&result, length + sizeof(struct udp_hdr));
+    uint16_t checksum = ip_checksum_adjust(hdr->checksum, &old, &new, sizeof(old));
+    // zero means "no checksum", its ones' complement twin is sent instead
+    return checksum ? checksum : 0xffff;
 }
 
 /**
- * Обрабатывает входящий UDP-пакет и отправляет ответ. 
+ * Обрабатывает входящий UDP-пакет: датаграмма копируется в кольцо
+ * занявшего порт сокета. На незанятый UDP_ECHO_PORT отвечаем ею же.
+ * Check-сумма считается программно, если её не проверила карта (csum)
+ * и отправитель её заполнил.
  */
 int
-udp_recv(struct ip_pkt* pkt) {
+udp_recv(struct ip_pkt* pkt, uint8_t csum) {
     if (trace_packet_processing) cprintf("Processing UDP packet\n");
-    struct udp_pkt upkt;
     int size = JNTOHS(pkt->hdr.ip_total_length) - IP_HEADER_LEN;
+    if (size < UDP_HEADER_LEN) {
+        cprintf("IP packet too short for UDP header\n");
+        return -1;
+    }
 
-    memcpy((void*)&upkt, (void*)pkt->data, size);
+    // datagram is parsed in place
+    struct udp_pkt* upkt = (struct udp_pkt*)pkt->data;
+    struct udp_hdr* hdr = &upkt->hdr;
+    if (JNTOHS(hdr->length) < UDP_HEADER_LEN || JNTOHS(hdr->length) > size) {
+        cprintf("Bad UDP length\n");
+        return -1;
+    }
+    if (!(csum & PBUF_CSUM_L4) && hdr->checksum &&
+        ip_checksum_partial(ip_pseudo_sum(&pkt->hdr, JNTOHS(hdr->length)), upkt, JNTOHS(hdr->length)) != 0xffff) {
+        cprintf("Bad UDP checksum\n");
+        return -E_INV_CHS;
+    }
 
-    struct udp_hdr* hdr = &upkt.hdr;
+    uint16_t port = JNTOHS(hdr->destination_port);
+    uint32_t len = JNTOHS(hdr->length) - UDP_HEADER_LEN;
+    struct udp_socket *sock = udp_sock_find(port);
+    if (!sock) {
+        if (port == UDP_ECHO_PORT) {
+            return udp_output(UDP_ECHO_PORT, JNTOHL(pkt->hdr.ip_source_address), JNTOHS(hdr->source_port),
+                              upkt->data, len, udp_echo_checksum(pkt, hdr));
+        }
+        if (trace_packet_processing) cprintf("No socket on UDP port %u\n", port);
+        return 0;
+    }
 
-    cprintf("port: %d\n", JNTOHS(hdr->destination_port));
-    for (size_t i = 0; i < JNTOHS(hdr->length) - UDP_HEADER_LEN; i++) {
-        cprintf("%02x", upkt.data[i]);
+    struct udp_rx_rec rec = {len, JNTOHL(pkt->hdr.ip_source_address), JNTOHS(hdr->source_port)};
+    uint32_t tail = sock->tail;
+    uint32_t used = tail - __atomic_load_n(&sock->head, __ATOMIC_ACQUIRE);
+    if (sock->ring_size - used < sizeof(rec) + len) {
+        sock->drops++;
+        return 0;
     }
-    cprintf("\n");
-    udp_send(upkt.data, JNTOHS(hdr->length) - UDP_HEADER_LEN);
 
+    udp_ring_put(sock, tail, &rec, sizeof(rec));
+    udp_ring_put(sock, tail + sizeof(rec), upkt->data, len);
+    // the consumer sees the datagram only once it is all in the ring
+    __atomic_store_n(&sock->tail, tail + sizeof(rec) + len, __ATOMIC_RELEASE);
     return 0;
 }
+
+#define UDP_TEST_PORT 9     // discard
+
+/**
+ * Датаграмма длины len с UDP_TEST_PORT на него же, без check-суммы
+ */
+static struct ip_pkt *
+udp_test_pkt(uint32_t len, uint8_t fill) {
+    static struct ip_pkt pkt;
+    struct udp_pkt *upkt = (struct udp_pkt *)pkt.data;
+
+    memset(&pkt.hdr, 0, IP_HEADER_LEN);
+    pkt.hdr.ip_verlen = IP_VER_LEN;
+    pkt.hdr.ip_total_length = JHTONS(IP_HEADER_LEN + UDP_HEADER_LEN + len);
+    pkt.hdr.ip_protocol = IP_PROTO_UDP;
+    pkt.hdr.ip_source_address = JHTONL(LOOPBACK_IP);
+    pkt.hdr.ip_destination_address = JHTONL(MY_IP);
+    upkt->hdr.source_port = JHTONS(UDP_TEST_PORT);
+    upkt->hdr.destination_port = JHTONS(UDP_TEST_PORT);
+    upkt->hdr.length = JHTONS(UDP_HEADER_LEN + len);
+    upkt->hdr.checksum = 0;
+    memset(upkt->data, fill, len);
+    return &pkt;
+}
+
+/**
+ * Самопроверка кольца порта: порядок датаграмм и адрес отправителя,
+ * отбрасывание не поместившейся, переход через конец кольца, усечение
+ * под буфер получателя и пустое кольцо. Возвращает число ошибок.
+ */
+int
+udp_selftest(void) {
+    static uint8_t buf[UDP_DATA_LENGTH];
+    const uint32_t len = 1400;
+    uint32_t src_ip;
+    uint16_t src_port;
+    int errors = 0;
+
+    if (udp_bind(UDP_TEST_PORT, UDP_RCVBUF_MIN) < 0) {
+        cprintf("udp: cannot bind port %d\n", UDP_TEST_PORT);
+        return 1;
+    }
+    struct udp_socket *sock = udp_sock_find(UDP_TEST_PORT);
+
+    // two fit in the smallest ring, the third is dropped
+    for (int i = 0; i < 3; i++) {
+        udp_recv(udp_test_pkt(len, 'a' + i), 0);
+    }
+    if (sock->drops != 1) {
+        cprintf("udp: %lu datagrams dropped instead of 1\n", (unsigned long)sock->drops);
+        errors++;
+    }
+
+    // the ring wraps around its end, datagrams still come in order
+    for (int i = 0; i < 4; i++) {
+        int n = udp_recvfrom(UDP_TEST_PORT, buf, sizeof(buf), &src_ip, &src_port);
+        if (n != (int)len || buf[0] != 'a' + i || buf[len - 1] != 'a' + i ||
+            src_ip != LOOPBACK_IP || src_port != UDP_TEST_PORT) {
+            cprintf("udp: datagram %d is wrong\n", i);
+            errors++;
+            break;
+        }
+        udp_recv(udp_test_pkt(len, 'a' + i + 2), 0);
+    }
+
+    // a short buffer takes the head of a datagram, the rest is dropped
+    int n = udp_recvfrom(UDP_TEST_PORT, buf, 10, NULL, NULL);
+    n = n == 10 ? udp_recvfrom(UDP_TEST_PORT, buf, sizeof(buf), NULL, NULL) : -1;
+    if (n != (int)len || buf[0] != 'a' + 5) {
+        cprintf("udp: datagram cut for a short buffer is wrong\n");
+        errors++;
+    }
+
+    if (udp_rx_ready(UDP_TEST_PORT) || udp_recvfrom(UDP_TEST_PORT, buf, sizeof(buf), NULL, NULL) != -E_WOULD_BLOCK) {
+        cprintf("udp: empty ring is not empty\n");
+        errors++;
+    }
+
+    udp_unbind(UDP_TEST_PORT);
+    if (udp_recvfrom(UDP_TEST_PORT, buf, sizeof(buf), NULL, NULL) != -E_NO_ENT) {
+        cprintf("udp: port is still bound\n");
+        errors++;
+    }
+    return errors;
+}
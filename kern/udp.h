@@ -6,6 +6,7 @@
 
 #define UDP_HEADER_LEN sizeof(struct udp_hdr)
 #define UDP_DATA_LENGTH (IP_DATA_LEN - UDP_HEADER_LEN)
+#define UDP_MAX_DATA_LENGTH (IP_MAX_LEN - IP_HEADER_LEN - UDP_HEADER_LEN) // sent in fragments
 
 struct udp_hdr {
     uint16_t source_port;
@@ -20,7 +21,42 @@ struct udp_pkt {
     uint8_t data[UDP_DATA_LENGTH];
 } __attribute__((packed));
 
+// Datagram in the receive ring of a socket, its data follows
+struct udp_rx_rec {
+    uint32_t len;
+    uint32_t src_ip;
+    uint16_t src_port;
+} __attribute__((packed));
+
+// Bound port. The receive ring has one producer (the receive path)
+// and one consumer, so positions are only published, never locked.
+struct udp_socket {
+    uint16_t port;          // 0 - free slot
+    uint8_t *ring;
+    uint32_t ring_size;     // power of 2
+    uint32_t head;          // free running, consumer side
+    uint32_t tail;          // free running, producer side
+    uint64_t drops;         // datagrams that did not fit
+    struct udp_socket *hash_next;
+};
+
+#define UDP_SOCK_NUM 64         // Bound ports
+#define UDP_SOCK_HASH_SIZE 64   // Buckets of bound ports, power of 2
+#define UDP_RCVBUF_MIN 4096     // Receive rings come in powers of 2 between these
+#define UDP_RCVBUF_MAX 262144
+#define UDP_ECHO_PORT 7         // In-kernel echo (RFC 862) unless bound
+
+#define UDP_SRC_PORT 8081       // Ports of udp_send()
+#define UDP_DST_PORT 1234
+
+void udp_init(void);
+int udp_bind(uint16_t port, uint32_t rcv_buf_size);
+int udp_unbind(uint16_t port);
+int udp_recvfrom(uint16_t port, void* buf, size_t size, uint32_t* src_ip, uint16_t* src_port);
+bool udp_rx_ready(uint16_t port);
+int udp_sendto(uint16_t src_port, uint32_t dst_ip, uint16_t dst_port, const void* data, int length);
 int udp_send(void* data, int length);
-int udp_recv(struct ip_pkt* pkt);
+int udp_recv(struct ip_pkt* pkt, uint8_t csum);
+int udp_selftest(void);
 
 #endif
@@ -2,6 +2,7 @@
 #include <inc/stdio.h>
 #include <inc/memlayout.h>
 #include <inc/uefi.h>
+#include <inc/string.h>
 
 extern void _efi_call_in_32bit_mode_asm(uint32_t func, efi_registers *efi_reg, void *stack_contents, size_t stack_contents_size);
 
@@ -28,3 +29,32 @@ efi_call_in_32bit_mode(uint32_t func, efi_registers *efi_reg, void *stack_conten
 
     return 0;
 }
+
+/* Numeric boot argument "name=value" from the loader command line
+ * (\EFI\BOOT\bootargs on the ESP). Value is parsed by strtol with
+ * base 0, so hex works too. Returns def if the argument is absent
+ * or malformed. */
+long
+uefi_boot_arg(const char *name, long def) {
+    if (!uefi_lp) return def;
+
+    size_t namelen = strlen(name);
+    const char *arg = uefi_lp->CommandLine;
+    const char *end = arg + strnlen(arg, LOADER_CMDLINE_SIZE);
+
+    while (arg < end) {
+        while (arg < end && strchr(" \t\r\n", *arg)) arg++;
+
+        if ((size_t)(end - arg) > namelen && !strncmp(arg, name, namelen) && arg[namelen] == '=') {
+            char *endp;
+            long val = strtol(arg + namelen + 1, &endp, 0);
+            if (endp != arg + namelen + 1 && (*endp == '\0' || strchr(" \t\r\n", *endp))) return val;
+            cprintf("Malformed boot argument %s\n", name);
+            return def;
+        }
+
+        while (arg < end && !strchr(" \t\r\n", *arg)) arg++;
+    }
+
+    return def;
+}
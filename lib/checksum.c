@@ -0,0 +1,71 @@
+/* Internet checksum engine, see inc/checksum.h */
+
+#include <inc/checksum.h>
+
+/* Unaligned loads, the compiler turns them into single moves */
+static inline uint64_t
+csum_load64(const uint8_t *p) {
+    uint64_t v;
+    __builtin_memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t
+csum_load32(const uint8_t *p) {
+    uint32_t v;
+    __builtin_memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint16_t
+csum_load16(const uint8_t *p) {
+    uint16_t v;
+    __builtin_memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Each 64-bit word is added as two 32-bit halves, so the accumulator
+ * cannot overflow before 2^32 words and carries are folded only once
+ * by csum_fold(). */
+uint64_t
+csum_accumulate(const void *data, size_t len, uint64_t acc) {
+    const uint8_t *p = data;
+
+    while (len >= 32) {
+        uint64_t a = csum_load64(p);
+        uint64_t b = csum_load64(p + 8);
+        uint64_t c = csum_load64(p + 16);
+        uint64_t d = csum_load64(p + 24);
+
+        acc += (a & 0xFFFFFFFF) + (a >> 32);
+        acc += (b & 0xFFFFFFFF) + (b >> 32);
+        acc += (c & 0xFFFFFFFF) + (c >> 32);
+        acc += (d & 0xFFFFFFFF) + (d >> 32);
+        p += 32;
+        len -= 32;
+    }
+    while (len >= 8) {
+        uint64_t a = csum_load64(p);
+        acc += (a & 0xFFFFFFFF) + (a >> 32);
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        acc += csum_load32(p);
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        acc += csum_load16(p);
+        p += 2;
+        len -= 2;
+    }
+    // Odd byte is the first byte of a zero padded word
+    if (len) {
+        uint16_t word = 0;
+        *(uint8_t *)&word = *p;
+        acc += word;
+    }
+
+    return acc;
+}
@@ -111,6 +111,7 @@ static struct Dev *devtab[] = {
         &devfile,
         &devpipe,
         &devcons,
+        &devsock,
         NULL};
 
 int
@@ -0,0 +1,201 @@
+#include <inc/ns.h>
+#include <inc/string.h>
+#include <inc/lib.h>
+
+union Nsipc nsipcbuf __attribute__((aligned(PAGE_SIZE)));
+
+/* Send a request to the network server and wait for a reply.
+ * The request body should be in nsipcbuf, and parts of the
+ * response may be written back to nsipcbuf.
+ * Requests that cannot be served yet (nothing to accept or read,
+ * connection not established, send buffer full) sleep in the kernel
+ * until the socket is ready and are repeated then, so the calls
+ * block like their Unix namesakes.
+ * Returns result from the network server. */
+static int
+nsipc(unsigned type) {
+    static envid_t nsenv;
+
+    if (!nsenv) nsenv = ipc_find_env(ENV_TYPE_NS);
+
+    static_assert(sizeof(nsipcbuf) == PAGE_SIZE, "Invalid nsipcbuf size");
+
+    if (debug) {
+        cprintf("[%08x] nsipc %d %08x\n",
+                thisenv->env_id, type, *(uint32_t *)&nsipcbuf);
+    }
+
+    /* The request page may be rewritten by the reply, keep a copy to repeat */
+    static union Nsipc req;
+    memcpy(&req, &nsipcbuf, sizeof(req));
+
+    for (;;) {
+        ipc_send(nsenv, type, &nsipcbuf, PAGE_SIZE, PROT_RW);
+        size_t maxsz = PAGE_SIZE;
+        int res = ipc_recv(NULL, NULL, &maxsz, NULL);
+        if (res != -E_WOULD_BLOCK) return res;
+
+        /* Requests that may block start with the socket id. If too many
+         * clients sleep on the socket, just give the CPU away. */
+        if (sys_net_wait(req.accept.req_sockid, type) < 0) sys_yield();
+        memcpy(&nsipcbuf, &req, sizeof(req));
+    }
+}
+
+static ssize_t devsock_read(struct Fd *fd, void *buf, size_t n);
+static ssize_t devsock_write(struct Fd *fd, const void *buf, size_t n);
+static int devsock_close(struct Fd *fd);
+static int devsock_stat(struct Fd *fd, struct Stat *stat);
+
+struct Dev devsock = {
+        .dev_id = 's',
+        .dev_name = "sock",
+        .dev_read = devsock_read,
+        .dev_write = devsock_write,
+        .dev_close = devsock_close,
+        .dev_stat = devsock_stat,
+};
+
+/* Socket descriptor number of fdnum, or < 0 if it is not a socket */
+static int
+fd2sockid(int fdnum) {
+    struct Fd *fd;
+    int res = fd_lookup(fdnum, &fd);
+    if (res < 0) return res;
+
+    if (fd->fd_dev_id != devsock.dev_id) return -E_NOT_SUPP;
+    return fd->fd_sock.sockid;
+}
+
+/* Put socket sockid of type type of the network server behind a new file
+ * descriptor. The socket is closed if there is no descriptor for it. */
+static int
+alloc_sockfd(int sockid, int type) {
+    struct Fd *fd;
+    int res;
+
+    if ((res = fd_alloc(&fd)) < 0 ||
+        (res = sys_alloc_region(0, fd, PAGE_SIZE, PROT_RW | PROT_SHARE)) < 0) {
+        nsipcbuf.close.req_sockid = sockid;
+        USED(nsipc(NSREQ_CLOSE));
+        return res;
+    }
+
+    fd->fd_dev_id = devsock.dev_id;
+    fd->fd_omode = O_RDWR;
+    fd->fd_sock.sockid = sockid;
+    fd->fd_sock.type = type;
+    return fd2num(fd);
+}
+
+/* Create a socket of type SOCK_STREAM (TCP) or SOCK_DGRAM (UDP).
+ * Returns the file descriptor index on success, < 0 on failure. */
+int
+socket(int type) {
+    nsipcbuf.socket.req_type = type;
+    int res = nsipc(NSREQ_SOCKET);
+    if (res < 0) return res;
+
+    return alloc_sockfd(res, type);
+}
+
+int
+bind(int s, const struct sockaddr_in *addr) {
+    int res = fd2sockid(s);
+    if (res < 0) return res;
+
+    nsipcbuf.bind.req_sockid = res;
+    nsipcbuf.bind.req_addr = *addr;
+    return nsipc(NSREQ_BIND);
+}
+
+int
+listen(int s, int backlog) {
+    int res = fd2sockid(s);
+    if (res < 0) return res;
+
+    nsipcbuf.listen.req_sockid = res;
+    nsipcbuf.listen.req_backlog = backlog;
+    return nsipc(NSREQ_LISTEN);
+}
+
+/* Wait for a connection to listening socket s.
+ * Returns a new file descriptor of the connection and stores the
+ * address of the peer in *addr if addr is not NULL. */
+int
+accept(int s, struct sockaddr_in *addr) {
+    int res = fd2sockid(s);
+    if (res < 0) return res;
+
+    nsipcbuf.accept.req_sockid = res;
+    if ((res = nsipc(NSREQ_ACCEPT)) < 0) return res;
+
+    if (addr) *addr = nsipcbuf.acceptRet.ret_addr;
+    return alloc_sockfd(res, SOCK_STREAM);
+}
+
+/* Connect a stream socket, waiting until the connection is established,
+ * or set the default destination of a datagram socket. */
+int
+connect(int s, const struct sockaddr_in *addr) {
+    int res = fd2sockid(s);
+    if (res < 0) return res;
+
+    nsipcbuf.connect.req_sockid = res;
+    nsipcbuf.connect.req_addr = *addr;
+    return nsipc(NSREQ_CONNECT);
+}
+
+/* Read what the socket has received, at most one datagram or what
+ * fits in nsipcbuf.  Returns 0 when the peer has closed the stream. */
+static ssize_t
+devsock_read(struct Fd *fd, void *buf, size_t n) {
+    nsipcbuf.recv.req_sockid = fd->fd_sock.sockid;
+    nsipcbuf.recv.req_n = n;
+
+    int res = nsipc(NSREQ_RECV);
+    if (res > 0) memcpy(buf, nsipcbuf.recvRet.ret_buf, res);
+    return res;
+}
+
+/* A stream is sent in parts of what fits in nsipcbuf, a datagram
+ * goes out whole or not at all. */
+static ssize_t
+devsock_write(struct Fd *fd, const void *buf, size_t n) {
+    size_t done = 0;
+
+    if (fd->fd_sock.type == SOCK_DGRAM && n > sizeof(nsipcbuf.send.req_buf)) return -E_INVAL;
+
+    do {
+        size_t next = MIN(n - done, sizeof(nsipcbuf.send.req_buf));
+
+        memset(&nsipcbuf.send.req_addr, 0, sizeof(nsipcbuf.send.req_addr));
+        memcpy(nsipcbuf.send.req_buf, buf + done, next);
+        nsipcbuf.send.req_sockid = fd->fd_sock.sockid;
+        nsipcbuf.send.req_n = next;
+
+        int res = nsipc(NSREQ_SEND);
+        if (res < 0) return done ? (ssize_t)done : res;
+        done += res;
+    } while (done < n);
+
+    return done;
+}
+
+/* The socket is closed with the last descriptor that refers to it */
+static int
+devsock_close(struct Fd *fd) {
+    if (sys_region_refs(fd, PAGE_SIZE) != 1) return 0;
+
+    nsipcbuf.close.req_sockid = fd->fd_sock.sockid;
+    return nsipc(NSREQ_CLOSE);
+}
+
+static int
+devsock_stat(struct Fd *fd, struct Stat *stat) {
+    strcpy(stat->st_name, "<sock>");
+    stat->st_size = 0;
+    stat->st_isdir = 0;
+    stat->st_dev = &devsock;
+    return 0;
+}
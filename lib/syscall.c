@@ -164,4 +164,14 @@ sys_monitor(void) {
 void
 sys_ethernet_loop(void) {
     syscall(SYS_ethernet_loop, 0, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_net_call(int op, void *ipc) {
+    return syscall(SYS_net_call, 0, op, (uintptr_t)ipc, 0, 0, 0, 0);
+}
+
+int
+sys_net_wait(int sockid, int op) {
+    return syscall(SYS_net_wait, 0, sockid, op, 0, 0, 0, 0);
 }
\ No newline at end of file
@@ -0,0 +1,131 @@
+/*
+ * Network server main loop -
+ * serves socket requests from other environments.
+ */
+
+#include <inc/lib.h>
+#include <inc/ns.h>
+
+/* The TCP/UDP stack lives in the kernel next to the NIC driver, sockets
+ * are kept there too (kern/socket.c). The server receives requests
+ * like the file server does and passes each one to the kernel with
+ * sys_net_call(), which reads the arguments from the request page and
+ * writes the results back to it. The client's 'struct Fd' page only
+ * holds the socket id.
+ *
+ * The HTTP server of the kernel serves files of the file server. A
+ * forked helper asks the kernel which files it misses, reads them with
+ * the usual file calls and hands them back in parts. */
+
+/* Virtual address at which to receive page mappings containing client requests. */
+union Nsipc *nsreq = (union Nsipc *)0x0FFFF000;
+
+void
+serve(void) {
+    uint32_t req, whom;
+    int perm, res;
+
+    while (1) {
+        perm = 0;
+        size_t sz = PAGE_SIZE;
+        req = ipc_recv((int32_t *)&whom, nsreq, &sz, &perm);
+        if (debug) {
+            cprintf("ns req %d from %08x [page %08lx]\n",
+                    req, whom, (unsigned long)get_uvpt_entry(nsreq));
+        }
+
+        /* All requests must contain an argument page */
+        if (!(perm & PROT_R)) {
+            cprintf("Invalid request from %08x: no argument page\n", whom);
+            continue; /* Just leave it hanging... */
+        }
+
+        /* Requests of the helper are not taken from clients */
+        res = req <= NSREQ_CLOSE ? sys_net_call(req, nsreq) : -E_INVAL;
+        if (res == -E_INVAL && debug) {
+            cprintf("Invalid request %d from %08x\n", req, whom);
+        }
+        ipc_send(whom, res, NULL, PAGE_SIZE, 0);
+        sys_unmap_region(0, nsreq, PAGE_SIZE);
+    }
+}
+
+union Nsipc httpbuf __attribute__((aligned(PAGE_SIZE)));
+
+/* Read the file the kernel asked for in httpbuf and pass it back */
+static void
+http_read_file(void) {
+    struct Nsreq_http_fill *fill = &httpbuf.httpFill;
+    char path[NS_PATH_MAX];
+    struct Stat st;
+
+    strcpy(path, httpbuf.httpMiss.ret_path);
+    int fd = open(path, O_RDONLY);
+    int res = fd;
+    if (fd >= 0 && (res = fstat(fd, &st)) >= 0 && st.st_isdir) res = -E_NOT_FOUND;
+
+    /* Errors go to the kernel too, it answers the waiting clients */
+    size_t offset = 0;
+    do {
+        ssize_t n = 0;
+        if (res >= 0) {
+            n = readn(fd, fill->req_buf, MIN(sizeof(fill->req_buf), st.st_size - offset));
+            if (n < 0) res = n;
+            if (!n && offset < (size_t)st.st_size) res = -E_INVAL;
+        }
+        strcpy(fill->req_path, path);
+        fill->req_status = MIN(res, 0);
+        fill->req_size = res < 0 ? 0 : st.st_size;
+        fill->req_offset = offset;
+        fill->req_n = res < 0 ? 0 : n;
+
+        if (sys_net_call(NSREQ_HTTP_FILL, fill) < 0) break;
+        offset += fill->req_n;
+    } while (res >= 0 && offset < (size_t)st.st_size);
+
+    if (fd >= 0) close(fd);
+}
+
+#define HTTP_HELPER_MAX_ERRORS 6
+
+/* Helper loop: take the next file the HTTP server of the kernel misses.
+ * The kernel puts the helper to sleep while there is nothing to read,
+ * it wakes up with -E_WOULD_BLOCK once a file is missed. */
+static void
+http_helper(void) {
+    binaryname = "ns_http";
+    int errors = 0;
+
+    while (1) {
+        int res = sys_net_call(NSREQ_HTTP_MISS, &httpbuf);
+        if (res == -E_WOULD_BLOCK) continue;
+        if (res < 0) {
+            /* Back off 2, 4, ... seconds, the kernel may keep refusing */
+            cprintf("ns_http: %i\n", res);
+            if (++errors == HTTP_HELPER_MAX_ERRORS) {
+                cprintf("ns_http: giving up\n");
+                exit();
+            }
+            for (int until = vsys_gettime() + (1 << errors); vsys_gettime() < until;) {
+                sys_yield();
+            }
+            continue;
+        }
+        errors = 0;
+        if (debug) cprintf("ns_http: reading %s\n", httpbuf.httpMiss.ret_path);
+        http_read_file();
+    }
+}
+
+void
+umain(int argc, char **argv) {
+    static_assert(sizeof(union Nsipc) == PAGE_SIZE, "Unsupported request size");
+    binaryname = "ns";
+    cprintf("NS is running\n");
+
+    int res = fork();
+    if (res < 0) panic("fork: %i", res);
+    if (!res) http_helper();
+
+    serve();
+}
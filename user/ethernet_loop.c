@@ -2,5 +2,6 @@
 
 void
 umain(int argc, char **argv) {
-    sys_ethernet_loop();
+    /* Each call returns after the NIC interrupt woke us up */
+    for (;;) sys_ethernet_loop();
 }
@@ -0,0 +1,87 @@
+/* Echo server and client over the sockets of the network server.
+ * The child serves one connection, sending back everything it reads;
+ * the parent connects to it through the loopback and checks the echo. */
+
+#include <inc/lib.h>
+
+/* Address of this machine, MY_IP of the kernel */
+#define ECHO_IP   ((172 << 24) | (16 << 16) | 2)
+#define ECHO_PORT 7
+
+const char *msg = "Now is the time for all good men to come to the aid of their party.";
+
+static void
+echo_server(void) {
+    struct sockaddr_in addr = {0, ECHO_PORT};
+    char buf[64];
+    int s, c, n;
+
+    binaryname = "echosrv";
+    if ((s = socket(SOCK_STREAM)) < 0) panic("socket: %i", s);
+    if ((n = bind(s, &addr)) < 0) panic("bind: %i", n);
+    if ((n = listen(s, 1)) < 0) panic("listen: %i", n);
+    cprintf("echosrv: listening on port %d\n", ECHO_PORT);
+
+    /* Sleeps in the kernel until the client connects */
+    if ((c = accept(s, &addr)) < 0) panic("accept: %i", c);
+    cprintf("echosrv: accepted a connection\n");
+    close(s);
+
+    while ((n = read(c, buf, sizeof(buf))) > 0) {
+        if (write(c, buf, n) != n) panic("echosrv: write failed");
+    }
+    if (n < 0) panic("echosrv: read: %i", n);
+    close(c);
+    exit();
+}
+
+static void
+echo_client(void) {
+    struct sockaddr_in addr = {ECHO_IP, ECHO_PORT};
+    char buf[128];
+    int s, r;
+    size_t len = strlen(msg), got = 0;
+
+    if ((s = socket(SOCK_STREAM)) < 0) panic("socket: %i", s);
+    /* The server may not listen yet, a refused connect is tried again */
+    while ((r = connect(s, &addr)) == -E_NO_ENT) sys_yield();
+    if (r < 0) panic("connect: %i", r);
+    cprintf("echocli: connected\n");
+
+    if ((r = write(s, msg, len)) != (int)len) panic("echocli: write: %i", r);
+    while (got < len && (r = read(s, buf + got, sizeof(buf) - 1 - got)) > 0) got += r;
+    if (r < 0) panic("echocli: read: %i", r);
+    buf[got] = 0;
+    close(s);
+
+    if (strcmp(buf, msg)) panic("echocli: got %d bytes: %s", (int)got, buf);
+    cprintf("echocli: echo ok\n");
+}
+
+/* A datagram does not fit in a request of the network server */
+static void
+dgram_too_long(void) {
+    static char big[NSBUFSIZE + 1];
+    struct sockaddr_in addr = {ECHO_IP, ECHO_PORT};
+    int s, r;
+
+    if ((s = socket(SOCK_DGRAM)) < 0) panic("socket: %i", s);
+    if ((r = connect(s, &addr)) < 0) panic("connect: %i", r);
+    if ((r = write(s, big, sizeof(big))) != -E_INVAL) panic("long datagram write: %i", r);
+    close(s);
+    cprintf("long datagram refused\n");
+}
+
+void
+umain(int argc, char **argv) {
+    int pid;
+
+    binaryname = "echocli";
+    if ((pid = fork()) < 0) panic("fork: %i", pid);
+    if (!pid) echo_server();
+
+    echo_client();
+    wait(pid);
+    dgram_too_long();
+    cprintf("socket tests passed\n");
+}